@@ -0,0 +1,190 @@
+#include "CScreenComposer.h"
+
+#include <QPainter>
+#include <QPen>
+#include <QColor>
+#include <QFont>
+#include <QPoint>
+
+#include <algorithm>
+
+
+namespace {
+    const int MAX_PLACE_TRIES = 50;  // per pattern, to find a free spot
+
+    QColor randomColor(std::mt19937& rRng)
+    {
+        std::uniform_int_distribution<int> channel(0, 255);
+        return QColor(channel(rRng), channel(rRng), channel(rRng));
+    }
+}
+
+
+CScreenComposer::CScreenComposer(const params_t& rParams, unsigned seed) :
+    mParams(rParams),
+    mRng(seed)
+{
+    mParams.minScale = std::max(0.1f, mParams.minScale);
+    mParams.maxScale = std::max(mParams.minScale, mParams.maxScale);
+    mParams.occlusion = std::min(std::max(0.f, mParams.occlusion), 1.f);
+}
+
+
+void CScreenComposer::addPattern(const QString& rKey, const QImage& rPattern)
+{
+    if (!rKey.isEmpty() && !rPattern.isNull())
+        mPatterns.append(entry_t{ rKey, rPattern.convertToFormat(QImage::Format_RGB32) });
+}
+
+
+QImage CScreenComposer::makeBackground()
+{
+    const int w = mParams.frameSize.width();
+    const int h = mParams.frameSize.height();
+    QImage frame(mParams.frameSize, QImage::Format_RGB32);
+    frame.fill(QColor(235, 235, 235));
+
+    std::uniform_int_distribution<int> xDist(0, w - 1), yDist(0, h - 1);
+    QPainter painter(&frame);
+    for (int i = 0, n = w * h / 60000; i < n; i++)
+    {// Windows with a title bar
+        QRect wnd(xDist(mRng), yDist(mRng), 80 + xDist(mRng) / 3, 60 + yDist(mRng) / 3);
+        painter.fillRect(wnd, randomColor(mRng).lighter(130));
+        painter.fillRect(QRect(wnd.topLeft(), QSize(wnd.width(), 22)), randomColor(mRng));
+        painter.setPen(randomColor(mRng));
+        painter.drawRect(wnd);
+    }
+    QFont font = painter.font();
+    for (int i = 0, n = w * h / 8000; i < n; i++)
+    {// Labels
+        font.setPixelSize(9 + (xDist(mRng) % 10));
+        painter.setFont(font);
+        painter.setPen(randomColor(mRng).darker(200));
+        painter.drawText(QPoint(xDist(mRng), yDist(mRng)), QString("Item %1").arg(yDist(mRng)));
+    }
+    painter.setRenderHint(QPainter::Antialiasing);
+    for (int i = 0, n = w * h / 30000; i < n; i++)
+    {// Icons
+        int r = 4 + (xDist(mRng) % 12);
+        painter.setBrush(randomColor(mRng));
+        painter.setPen(Qt::NoPen);
+        painter.drawEllipse(QPoint(xDist(mRng), yDist(mRng)), r, r);
+    }
+    return frame;
+}
+
+
+void CScreenComposer::addNoise(QImage* pFrame)
+{
+    std::normal_distribution<float> noise(0.f, mParams.noise);
+    for (int y = 0; y < pFrame->height(); y++)
+    {
+        QRgb* pLine = reinterpret_cast<QRgb*>(pFrame->scanLine(y));
+        for (int x = 0; x < pFrame->width(); x++)
+        {
+            auto add = [&](int c) { return std::min(255, std::max(0, c + static_cast<int>(noise(mRng)))); };
+            pLine[x] = qRgb(add(qRed(pLine[x])), add(qGreen(pLine[x])), add(qBlue(pLine[x])));
+        }
+    }
+}
+
+
+QImage CScreenComposer::compose(std::vector<placement_t>* pOutTruth)
+{
+    if (pOutTruth)
+        pOutTruth->clear();
+    if (mParams.frameSize.isEmpty())
+        return QImage();
+
+    QImage frame = makeBackground();
+    std::vector<int> order(mPatterns.size());
+    for (int i = 0; i < mPatterns.size(); i++)
+        order[i] = i;
+    std::shuffle(order.begin(), order.end(), mRng);
+    order.resize(std::min<size_t>(order.size(), std::max(0, mParams.placedPerFrame)));
+
+    std::uniform_real_distribution<float> scaleDist(mParams.minScale, mParams.maxScale);
+    std::uniform_real_distribution<float> coverDist(0.f, mParams.occlusion);
+    std::vector<QRect> used;
+    QPainter painter(&frame);
+    for (int idx : order)
+    {
+        const entry_t& rEntry = mPatterns[idx];
+        float scale = scaleDist(mRng);
+        QSize size = rEntry.img.size() * scale;
+        if (size.isEmpty()
+            || (size.width() > frame.width())
+            || (size.height() > frame.height()))
+        {
+            continue;
+        }
+        std::uniform_int_distribution<int> xDist(0, frame.width() - size.width());
+        std::uniform_int_distribution<int> yDist(0, frame.height() - size.height());
+        QRect rect;
+        for (int i = 0; i < MAX_PLACE_TRIES && rect.isNull(); i++)
+        {// Patterns do not overlap each other, the truth stays unambiguous
+            QRect candidate(QPoint(xDist(mRng), yDist(mRng)), size);
+            bool free = std::none_of(used.cbegin(), used.cend(),
+                [&candidate](const QRect& r) { return r.intersects(candidate); });
+            if (free)
+                rect = candidate;
+        }
+        if (rect.isNull())
+            continue;
+
+        painter.drawImage(rect, rEntry.img);  // smooth scaling is not set, like a window scaled by the OS
+        float occluded = 0.f;
+        if (mParams.occlusion > 0.f)
+        {// Bottom part covered, like by a tooltip or another window
+            occluded = coverDist(mRng);
+            int coverRows = qRound(rect.height() * occluded);
+            painter.fillRect(QRect(rect.left(), rect.bottom() - coverRows + 1, rect.width(), coverRows),
+                randomColor(mRng));
+        }
+        used.push_back(rect);
+        if (pOutTruth)
+            pOutTruth->push_back(placement_t{ rEntry.key, rect, scale, occluded });
+    }
+    painter.end();
+
+    if (mParams.noise > 0.f)
+        addNoise(&frame);
+    return frame;
+}
+
+
+QImage CScreenComposer::makePattern(int idx, const QSize& rSize)
+{
+    std::mt19937 rng(static_cast<unsigned>(idx) * 7919u + 1u);
+    QImage pattern(rSize, QImage::Format_RGB32);
+    pattern.fill(randomColor(rng));
+
+    QPainter painter(&pattern);
+    painter.setRenderHint(QPainter::Antialiasing);
+    painter.setPen(QPen(randomColor(rng), 2));
+    painter.setBrush(randomColor(rng));
+    if (idx & 1)
+    {// Button with a caption
+        painter.drawRoundedRect(pattern.rect().adjusted(1, 1, -2, -2), 4, 4);
+        QFont font = painter.font();
+        font.setPixelSize(std::max(8, rSize.height() / 2));
+        painter.setFont(font);
+        painter.setPen(randomColor(rng).darker(200));
+        painter.drawText(pattern.rect(), Qt::AlignCenter, QString("B%1").arg(idx));
+    } else {
+        // Icon: shapes in a grid
+        int cell = std::max(4, std::min(rSize.width(), rSize.height()) / 3);
+        for (int y = 0; y + cell <= rSize.height(); y += cell)
+        {
+            for (int x = 0; x + cell <= rSize.width(); x += cell)
+            {
+                painter.setBrush(randomColor(rng));
+                if ((x + y + idx) % 3)
+                    painter.drawEllipse(QRect(x, y, cell, cell).adjusted(1, 1, -1, -1));
+                else
+                    painter.drawRect(QRect(x, y, cell, cell).adjusted(1, 1, -1, -1));
+            }
+        }
+    }
+    return pattern;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <QImage>
+#include <QRect>
+#include <QSize>
+#include <QString>
+#include <QVector>
+
+#include <random>
+#include <vector>
+
+
+// Generates screen frames with registered patterns composited at known places.
+// Backgrounds imitate a desktop (panels, bars, labels, icons), each placement
+// can be scaled, noisy and partly covered. Same seed, same frame sequence.
+class CScreenComposer
+{
+public:
+    struct params_t {
+        QSize frameSize;
+        float minScale;     // of the pattern, 1 = as registered
+        float maxScale;
+        float noise;        // std deviation of pixel noise (0-255)
+        float occlusion;    // max covered part of a pattern (0-1)
+        int placedPerFrame; // patterns drawn into a frame, the others are absent
+    };
+
+    struct placement_t {
+        QString key;
+        QRect rect;         // where the scaled pattern was drawn
+        float scale;
+        float occluded;     // covered part of the pattern
+    };
+
+private:
+    struct entry_t {
+        QString key;
+        QImage img;
+    };
+
+    params_t mParams;
+    std::mt19937 mRng;
+    QVector<entry_t> mPatterns;
+
+    QImage makeBackground();
+    void addNoise(QImage* pFrame);
+
+public:
+    CScreenComposer(const params_t& rParams, unsigned seed);
+
+    void addPattern(const QString& rKey, const QImage& rPattern);
+    void reset(unsigned seed) { mRng.seed(seed); }
+
+    // RGB32 frame, the truth lists the placed patterns only
+    QImage compose(std::vector<placement_t>* pOutTruth);
+
+    // A button or icon like pattern for runs without recorded patterns
+    static QImage makePattern(int idx, const QSize& rSize);
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <algorithm>
+#include <iterator>
+#include <vector>
+
+#include "../Source/CScreenMacroTools.h"
+#include "../Source/Util/imgproc.h"  // DEFAULT_CASCADE
+
+
+// Engines of frameHasPattern and latency statistics, shared by the detection
+// harness and the batch CLI so that their figures compare.
+namespace DetectionEngines {
+    struct engine_t {
+        const char* pName;
+        CScreenMacroTools::scaling_t scaling;
+        bool cascade;   // prefilter of the template engines
+    };
+    const engine_t ENGINES[] = {
+        { "pattern", CScreenMacroTools::SCL_OFF, false },
+        { "cascade", CScreenMacroTools::SCL_OFF, true },
+        { "window", CScreenMacroTools::SCL_WINDOW, false },
+        { "features", CScreenMacroTools::SCL_ZOOM, false }
+    };
+
+    // Null if the name is unknown
+    inline const engine_t* find(const QString& rName)
+    {
+        const engine_t* pEngine = std::find_if(std::begin(ENGINES), std::end(ENGINES),
+            [&](const engine_t& rEngine) { return rName == rEngine.pName; });
+        return (pEngine != std::end(ENGINES)) ? pEngine : nullptr;
+    }
+
+    // Before the frames of the engine are searched
+    inline void select(CScreenMacroTools& rTools, const engine_t& rEngine)
+    {
+        rTools.setCascade(rEngine.cascade ? &ImProcU8::DEFAULT_CASCADE : nullptr);
+    }
+
+    // perc 0-1, 0 without values
+    inline double percentile(std::vector<double> values, double perc)
+    {
+        if (values.empty())
+            return 0.;
+        std::sort(values.begin(), values.end());
+        size_t idx = std::min(values.size() - 1, static_cast<size_t>(perc * values.size()));
+        return values[idx];
+    }
+}
@@ -0,0 +1,257 @@
+// End-to-end detection run on synthetic screens with known pattern positions.
+// Patterns are registered in CScreenMacroTools like from the UI, every frame is
+// searched for all of them through frameHasPattern, the same matching the
+// monitors use. Reports frames/s, latency percentiles and accuracy per engine.
+// A saved monitor history replaces the synthetic screens with --replay, there
+// is no truth then and only the found patterns are counted.
+#include "CScreenComposer.h"
+#include "DetectionEngines.h"
+#include "../Source/CScreenMacroTools.h"
+#include "../Source/CFrameHistory.h"
+#include "../Source/Util/metrics.h"
+
+#include <QApplication>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QPixmap>
+#include <QTextStream>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+
+namespace {
+    const unsigned SEED = 20181101u;  // every engine sees the same frames
+
+    struct tally_t {
+        int hits;       // found at the true position
+        int displaced;  // found somewhere else
+        int misses;     // present but not found
+        int falseHits;  // absent but found
+        int rejects;    // absent and not found
+        int found;
+    };
+
+    using DetectionEngines::percentile;
+
+    QJsonObject latencyOf(const std::vector<double>& rMs)
+    {
+        QJsonObject obj;
+        obj["p50_ms"] = percentile(rMs, 0.50);
+        obj["p90_ms"] = percentile(rMs, 0.90);
+        obj["p99_ms"] = percentile(rMs, 0.99);
+        obj["max_ms"] = rMs.empty() ? 0. : *std::max_element(rMs.cbegin(), rMs.cend());
+        return obj;
+    }
+}
+
+
+int main(int argc, char* argv[])
+{
+    QApplication app(argc, argv);  // pixmaps, run with -platform offscreen on a headless machine
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Detection throughput and accuracy on synthetic screens");
+    parser.addHelpOption();
+    QCommandLineOption patternsOpt("patterns", "Directory with *.png patterns, generated ones if not set.", "dir");
+    QCommandLineOption framesOpt("frames", "Frames per engine (default 50).", "n", "50");
+    QCommandLineOption sizeOpt("size", "Frame size (default 1920x1080).", "WxH", "1920x1080");
+    QCommandLineOption scaleOpt("scale", "Pattern scale range (default 1:1).", "min:max", "1:1");
+    QCommandLineOption noiseOpt("noise", "Pixel noise std deviation (default 0).", "sigma", "0");
+    QCommandLineOption occlusionOpt("occlusion", "Max covered part of a pattern (default 0).", "0-1", "0");
+    QCommandLineOption placedOpt("placed", "Patterns placed per frame, the others are absent (default 4).", "n", "4");
+    QCommandLineOption engineOpt("engine", "pattern, cascade, window or features, all if not set.", "name");
+    QCommandLineOption replayOpt("replay", "Frame history saved by a monitor instead of synthetic screens.", "file");
+    QCommandLineOption outOpt("out", "JSON result file, stdout if not set.", "file");
+    parser.addOptions({ patternsOpt, framesOpt, sizeOpt, scaleOpt, noiseOpt, occlusionOpt, placedOpt, engineOpt, replayOpt, outOpt });
+    parser.process(app);
+
+    CScreenComposer::params_t params;
+    QStringList size = parser.value(sizeOpt).split('x');
+    QStringList scale = parser.value(scaleOpt).split(':');
+    params.frameSize = QSize(size.value(0).toInt(), size.value(1).toInt());
+    params.minScale = scale.value(0).toFloat();
+    params.maxScale = scale.value(1, scale.value(0)).toFloat();
+    params.noise = parser.value(noiseOpt).toFloat();
+    params.occlusion = parser.value(occlusionOpt).toFloat();
+    params.placedPerFrame = parser.value(placedOpt).toInt();
+    int frameCount = parser.value(framesOpt).toInt();
+    const bool replay = parser.isSet(replayOpt);
+    CFrameHistoryReader recording;
+    if (replay)
+    {
+        if (!recording.open(parser.value(replayOpt)) || !recording.count())
+        {
+            QTextStream(stderr) << "Cannot replay " << parser.value(replayOpt) << "\n";
+            return 2;
+        }
+        params.frameSize = recording.info(0).size;  // patterns are registered against it
+        frameCount = parser.isSet(framesOpt) ? std::min(frameCount, recording.count()) : recording.count();
+    }
+    if (params.frameSize.isEmpty() || (frameCount < 1))
+    {
+        QTextStream(stderr) << "Invalid frame size or count\n";
+        return 2;
+    }
+
+    CScreenMacroTools tools;
+    CScreenComposer composer(params, SEED);
+    QStringList keys;
+    auto addPattern = [&](const QString& rKey, const QImage& rImg) {
+        // Registered at scale 1 on a frame of this size, like a capture from the UI
+        tools.setPattern(rKey, QPixmap::fromImage(rImg), static_cast<float>(rImg.width()) / params.frameSize.width());
+        composer.addPattern(rKey, rImg);
+        keys.append(rKey);
+    };
+    if (parser.isSet(patternsOpt))
+    {
+        QDir dir(parser.value(patternsOpt));
+        for (const QFileInfo& rFile : dir.entryInfoList(QStringList("*.png"), QDir::Files, QDir::Name))
+        {
+            QImage img(rFile.filePath());
+            if (!img.isNull())
+                addPattern(rFile.completeBaseName(), img);
+        }
+    } else {
+        const QSize sizes[] = { QSize(24, 24), QSize(32, 32), QSize(48, 48), QSize(96, 32) };
+        for (int i = 0; i < 8; i++)
+            addPattern(QString("synthetic%1").arg(i), CScreenComposer::makePattern(i, sizes[i % 4]));
+    }
+    if (keys.isEmpty())
+    {
+        QTextStream(stderr) << "No patterns\n";
+        return 2;
+    }
+
+    QJsonArray results;
+    for (const DetectionEngines::engine_t& rEngine : DetectionEngines::ENGINES)
+    {
+        if (parser.isSet(engineOpt) && (parser.value(engineOpt) != rEngine.pName))
+            continue;
+
+        DetectionEngines::select(tools, rEngine);
+        composer.reset(SEED);
+        recording.rewind();
+        std::vector<double> frameMs, searchMs;
+        std::vector<double> scaleErrors;  // relative, of the hits
+        tally_t tally = {};
+        double busyMs = 0.;
+        int frames = 0;
+        const CMatchCache::stats_t cacheBefore = tools.getCacheStats();
+        const Metrics::snapshot_t metricsBefore = Metrics::collect();
+        for (; frames < frameCount; frames++)
+        {
+            std::vector<CScreenComposer::placement_t> truth;
+            QImage frame;  // not timed
+            if (!replay)
+                frame = composer.compose(&truth);
+            else if (!recording.next(&frame))
+                break;
+
+            QElapsedTimer frameTimer;
+            frameTimer.start();
+            for (const QString& rKey : keys)
+            {
+                QElapsedTimer timer;
+                timer.start();
+                match_t result = tools.frameHasPattern(frame, rKey, rEngine.scaling);
+                searchMs.push_back(timer.nsecsElapsed() * 1e-6);
+                tally.found += result.found ? 1 : 0;
+                if (replay)
+                    continue;
+
+                auto placed = std::find_if(truth.cbegin(), truth.cend(),
+                    [&rKey](const CScreenComposer::placement_t& rPlaced) { return rPlaced.key == rKey; });
+                if (placed == truth.cend())
+                {
+                    if (result.found)
+                        tally.falseHits++;
+                    else
+                        tally.rejects++;
+                } else if (!result.found) {
+                    tally.misses++;
+                } else {
+                    // A quarter of the pattern off still clicks on it
+                    QPoint offset = result.pos - placed->rect.center();
+                    int tolerance = std::max(2, std::min(placed->rect.width(), placed->rect.height()) / 4);
+                    if (std::max(std::abs(offset.x()), std::abs(offset.y())) <= tolerance)
+                    {
+                        tally.hits++;
+                        scaleErrors.push_back(std::abs(result.scale - placed->scale) / placed->scale);
+                    } else
+                        tally.displaced++;
+                }
+            }
+            frameMs.push_back(frameTimer.nsecsElapsed() * 1e-6);
+            busyMs += frameMs.back();
+        }
+
+        int present = tally.hits + tally.displaced + tally.misses;
+        int reported = tally.hits + tally.displaced + tally.falseHits;
+        QJsonObject result;
+        result["engine"] = rEngine.pName;
+        result["frames"] = frames;
+        result["patterns"] = keys.size();
+        result["frames_per_s"] = busyMs > 0. ? 1000. * frames / busyMs : 0.;
+        result["frame_latency"] = latencyOf(frameMs);
+        result["search_latency"] = latencyOf(searchMs);
+        result["found"] = tally.found;
+        const CMatchCache::stats_t cacheAfter = tools.getCacheStats();
+        result["cache_hits"] = static_cast<double>(cacheAfter.hits - cacheBefore.hits);
+        result["cache_misses"] = static_cast<double>(cacheAfter.misses - cacheBefore.misses);
+        // Share of the pattern positions each prefilter stage rejected
+        const Metrics::snapshot_t metricsAfter = Metrics::collect();
+        auto delta = [&](Metrics::counter_t counter) {
+            return static_cast<double>(metricsAfter.counters[counter] - metricsBefore.counters[counter]);
+        };
+        const double windows = delta(Metrics::C_CASCADE_WINDOWS);
+        result["rejected_stats"] = windows > 0. ? delta(Metrics::C_REJECTED_STATS) / windows : 0.;
+        result["rejected_signature"] = windows > 0. ? delta(Metrics::C_REJECTED_SIGNATURE) / windows : 0.;
+        if (!replay)
+        {
+            result["hits"] = tally.hits;
+            result["displaced"] = tally.displaced;
+            result["misses"] = tally.misses;
+            result["false_hits"] = tally.falseHits;
+            result["rejects"] = tally.rejects;
+            result["recall"] = present ? static_cast<double>(tally.hits) / present : 0.;
+            result["precision"] = reported ? static_cast<double>(tally.hits) / reported : 0.;
+            result["scale_error"] = percentile(scaleErrors, 0.5);  // median
+        }
+        results.append(result);
+    }
+
+    QJsonObject setup;
+    setup["width"] = params.frameSize.width();
+    setup["height"] = params.frameSize.height();
+    setup["min_scale"] = params.minScale;
+    setup["max_scale"] = params.maxScale;
+    setup["noise"] = params.noise;
+    setup["occlusion"] = params.occlusion;
+    setup["placed"] = params.placedPerFrame;
+    if (replay)
+        setup["replay"] = parser.value(replayOpt);
+    QJsonObject root;
+    root["setup"] = setup;
+    root["results"] = results;
+    QByteArray json = QJsonDocument(root).toJson();
+
+    if (parser.isSet(outOpt))
+    {
+        QFile out(parser.value(outOpt));
+        if (!out.open(QIODevice::WriteOnly) || (out.write(json) != json.size()))
+        {
+            QTextStream(stderr) << "Cannot write " << parser.value(outOpt) << "\n";
+            return 1;
+        }
+    } else {
+        QTextStream(stdout) << json;
+    }
+    return 0;
+}
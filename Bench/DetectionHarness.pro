@@ -0,0 +1,43 @@
+# End-to-end detection run on synthetic screens, builds on Windows and Linux
+TEMPLATE = app
+
+# Sources
+HEADERS = CScreenComposer.h \
+  DetectionEngines.h \
+  ../Source/CCaptureEngine.h
+SOURCES = DetectionHarness.cpp \
+  CScreenComposer.cpp \
+  ../Source/CScreenMacroTools.cpp \
+  ../Source/CCaptureEngine.cpp \
+  ../Source/CDetectionPool.cpp \
+  ../Source/CPatternRegistry.cpp \
+  ../Source/CPatternLibrary.cpp \
+  ../Source/CRuleEngine.cpp \
+  ../Source/CActionDispatcher.cpp \
+  ../Source/CFrameHistory.cpp \
+  ../Source/CFrameRing.cpp \
+  ../Source/CMatchTracker.cpp \
+  ../Source/CMatchCache.cpp \
+  ../Source/CPatternIndex.cpp \
+  ../Source/Util/imgproc.cpp \
+  ../Source/Util/metrics.cpp \
+  ../Source/Util/trace.cpp \
+  ../Source/Util/winapi.cpp
+INCLUDEPATH += $$(OCV_DIR)/include \
+  ../Source
+
+# qmake configuration
+CONFIG *= console release c++14
+CONFIG -= app_bundle
+QT += widgets concurrent
+DEFINES += NDEBUG
+
+# Dependencies
+win32:contains(QMAKE_TARGET.arch, x86_64) {
+  LIBS += -L$$(OCV_DIR)/x64/vc15/lib -lopencv_world342 -luser32
+  DESTDIR = ../Build/vc15_x64
+  OBJECTS_DIR += ../Assembly/Harness_x64
+} else {
+  LIBS += -lopencv_core -lopencv_imgproc -lopencv_features2d -lopencv_calib3d -lrt  # shm_open
+}
+TARGET = DetectionHarness
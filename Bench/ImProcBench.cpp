@@ -0,0 +1,414 @@
+// Microbenchmark of the ImProcU8 matching engines.
+// Runs a matrix of frame resolution, pattern size, engine (channel count),
+// location hint and OpenCV thread count on synthetic and recorded screen content.
+// Results are written as JSON, one object per case. The integer correlation of the
+// fixed engine is checked against matchTemplate, a score difference above
+// SCORE_TOLERANCE is reported and fails the run.
+//
+// Usage: ImProcBench [--out file.json] [--frames dir] [--quick] [--min-time ms]
+#include "../Source/Util/imgproc.h"
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+
+// Float rounding of matchTemplate, the integer sums are exact
+static const double SCORE_TOLERANCE = 2e-3;
+
+
+#pragma region Allocation counting
+// Heap allocations while a case runs: operator new catches std containers,
+// the Mat allocator catches OpenCV image buffers.
+static std::atomic<long long> gAllocs(0);
+static std::atomic<long long> gAllocBytes(0);
+
+static void countAlloc(size_t bytes)
+{
+    gAllocs.fetch_add(1, std::memory_order_relaxed);
+    gAllocBytes.fetch_add(static_cast<long long>(bytes), std::memory_order_relaxed);
+}
+
+void* operator new(size_t bytes)
+{
+    countAlloc(bytes);
+    if (void* p = std::malloc(bytes ? bytes : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+#if CV_VERSION_MAJOR >= 4
+using accessFlag_t = cv::AccessFlag;
+#else
+using accessFlag_t = int;
+#endif
+
+class CCountingAllocator : public cv::MatAllocator
+{
+    const cv::MatAllocator* mpBase;
+
+public:
+    explicit CCountingAllocator(const cv::MatAllocator* pBase) : mpBase(pBase) {}
+
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data,
+        size_t* step, accessFlag_t flags, cv::UMatUsageFlags usageFlags) const override
+    {
+        if (!data)
+        {
+            size_t bytes = CV_ELEM_SIZE(type);
+            for (int i = 0; i < dims; i++)
+                bytes *= static_cast<size_t>(sizes[i]);
+            countAlloc(bytes);
+        }
+        return mpBase->allocate(dims, sizes, type, data, step, flags, usageFlags);
+    }
+    bool allocate(cv::UMatData* data, accessFlag_t accessflags, cv::UMatUsageFlags usageFlags) const override
+    {
+        return mpBase->allocate(data, accessflags, usageFlags);
+    }
+    void deallocate(cv::UMatData* data) const override
+    {
+        mpBase->deallocate(data);
+    }
+};
+#pragma endregion
+
+
+#pragma region Content
+struct source_t {
+    std::string name;
+    cv::Mat img;    // BGRA, any size, resized per resolution
+};
+
+// Desktop like content: flat panels, bars, text and icons. Deterministic per seed.
+static cv::Mat makeScreen(int width, int height, unsigned seed)
+{
+    cv::RNG rng(seed);
+    cv::Mat frame(height, width, CV_8UC4, cv::Scalar(235, 235, 235, 255));
+    auto color = [&rng]() {
+        return cv::Scalar(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256), 255);
+    };
+    for (int i = 0, n = width * height / 40000; i < n; i++)
+    {// Windows and panels
+        cv::Point tl(rng.uniform(0, width), rng.uniform(0, height));
+        cv::Point br = tl + cv::Point(rng.uniform(40, width / 3 + 41), rng.uniform(20, height / 3 + 21));
+        cv::rectangle(frame, tl, br, color(), cv::FILLED);
+        cv::rectangle(frame, tl, br, color(), 1);
+    }
+    for (int i = 0, n = width * height / 4000; i < n; i++)
+    {// Labels
+        char text[16];
+        std::snprintf(text, sizeof(text), "Item %d", rng.uniform(0, 100000));
+        cv::putText(frame, text, cv::Point(rng.uniform(0, width), rng.uniform(0, height)),
+            cv::FONT_HERSHEY_SIMPLEX, rng.uniform(0.3, 0.8), color(), 1, cv::LINE_AA);
+    }
+    for (int i = 0, n = width * height / 20000; i < n; i++)
+    {// Icons
+        cv::Point c(rng.uniform(0, width), rng.uniform(0, height));
+        int r = rng.uniform(4, 16);
+        cv::circle(frame, c, r, color(), cv::FILLED, cv::LINE_AA);
+        cv::line(frame, c - cv::Point(r, r), c + cv::Point(r, r), color(), 2, cv::LINE_AA);
+    }
+    return frame;
+}
+
+// Most textured of some random candidate spots, a flat pattern would measure nothing.
+static cv::Point pickPatternPos(const cv::Mat& rGray, int size, unsigned seed)
+{
+    cv::RNG rng(seed);
+    cv::Point best(0, 0);
+    double bestDev = -1;
+    for (int i = 0; i < 24; i++)
+    {
+        cv::Point pos(rng.uniform(0, rGray.cols - size + 1), rng.uniform(0, rGray.rows - size + 1));
+        cv::Scalar mean, dev;
+        cv::meanStdDev(rGray(cv::Rect(pos, cv::Size(size, size))), mean, dev);
+        if (dev[0] > bestDev)
+        {
+            bestDev = dev[0];
+            best = pos;
+        }
+    }
+    return best;
+}
+
+static void loadRecorded(const std::string& rDir, std::vector<source_t>& rOutSources)
+{
+    std::vector<cv::String> files;
+    cv::glob(rDir + "/*.png", files, false);
+    for (const cv::String& rFile : files)
+    {
+        cv::Mat img = cv::imread(rFile, cv::IMREAD_COLOR);
+        if (img.empty())
+            continue;
+        cv::cvtColor(img, img, cv::COLOR_BGR2BGRA);
+        std::string name = rFile.substr(rFile.find_last_of("/\\") + 1);
+        rOutSources.push_back(source_t{ name, img });
+    }
+}
+#pragma endregion
+
+
+#pragma region Measurement
+struct case_t {
+    std::string source;
+    std::string engine;
+    int width, height;
+    int patSize;
+    int channels;
+    bool hint;
+    int threads;
+};
+
+struct result_t {
+    long long iterations;
+    double nsMedian;
+    double nsMin;
+    double allocsPerOp;
+    double allocBytesPerOp;
+    double pixelsPerSec;    // of the whole frame
+    double rejectedStats;   // share of the windows per cascade stage
+    double rejectedSignature;
+    bool found;
+    int errPx;              // distance of the reported to the true center
+    double scoreDiff;       // of the row extrema of correlateRows to matchTemplate, fixed engine only
+};
+
+using benchClock_t = std::chrono::steady_clock;
+
+// Largest difference of the row extrema of correlateRows to those of the matchTemplate map,
+// on 3x3 pattern sizes around the pattern, which has the best and worst scores in it.
+static double fixedScoreDiff(const cv::Mat& rFrame, const cv::Mat& rPat, const cv::Point& rPos)
+{
+    const cv::Rect area = cv::Rect(rPos - cv::Point(rPat.cols, rPat.rows), cv::Size(3 * rPat.cols, 3 * rPat.rows))
+        & cv::Rect(0, 0, rFrame.cols, rFrame.rows);
+    const cv::Mat src = rFrame(area);
+    ImProcU8::imgArr2I_t srcSz = { src.cols, src.rows };
+    ImProcU8::imgArr2I_t patSz = { rPat.cols, rPat.rows };
+    const ImProcU8::Image srcImg{ src.data, static_cast<int>(src.step), src.channels(), srcSz };
+    const ImProcU8::Image patImg{ rPat.data, static_cast<int>(rPat.step), rPat.channels(), patSz };
+    ImProcU8::RowExtrema rows;
+    cv::Mat result;
+    if (!ImProcU8::correlateRows(srcImg, patImg, rows, nullptr))
+        return 1.;
+    cv::matchTemplate(src, rPat, result, cv::TM_CCOEFF_NORMED);
+    if (static_cast<int>(rows.maxVal.size()) != result.rows)
+        return 1.;
+    double diff = 0.;
+    for (int y = 0; y < result.rows; y++)
+    {
+        double minVal, maxVal;
+        cv::minMaxLoc(result.row(y), &minVal, &maxVal);
+        diff = std::max(diff, std::max(std::abs(maxVal - rows.maxVal[y]), std::abs(minVal - rows.minVal[y])));
+    }
+    return diff;
+}
+
+// Warm up once, then repeat till minTime has passed (at least 3, at most 1000 runs).
+template<class Fn>
+static result_t measure(Fn run, double minTimeMs, long long framePixels)
+{
+    result_t res{};
+    run();  // first call builds the OpenCV internals
+
+    std::vector<double> times;
+    times.reserve(1000);  // not counted as allocation of the case
+    long long allocs0 = gAllocs.load(), bytes0 = gAllocBytes.load();
+    auto start = benchClock_t::now();
+    double total = 0;
+    while ((times.size() < 3) || ((total < minTimeMs * 1e6) && (times.size() < 1000)))
+    {
+        auto t0 = benchClock_t::now();
+        run();
+        double ns = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(benchClock_t::now() - t0).count());
+        times.push_back(ns);
+        total = static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(benchClock_t::now() - start).count());
+    }
+    res.iterations = static_cast<long long>(times.size());
+    res.allocsPerOp = static_cast<double>(gAllocs.load() - allocs0) / res.iterations;
+    res.allocBytesPerOp = static_cast<double>(gAllocBytes.load() - bytes0) / res.iterations;
+    std::sort(times.begin(), times.end());
+    res.nsMin = times.front();
+    res.nsMedian = times[times.size() / 2];
+    res.pixelsPerSec = framePixels / (res.nsMedian * 1e-9);
+    return res;
+}
+
+static void writeResult(FILE* pOut, const case_t& rCase, const result_t& rRes, bool first)
+{
+    std::fprintf(pOut,
+        "%s\n  {\"source\": \"%s\", \"engine\": \"%s\", \"width\": %d, \"height\": %d, "
+        "\"pattern\": %d, \"channels\": %d, \"hint\": %s, \"threads\": %d, "
+        "\"iterations\": %lld, \"ns_per_op\": %.0f, \"ns_min\": %.0f, "
+        "\"allocs_per_op\": %.1f, \"alloc_bytes_per_op\": %.0f, \"pixels_per_s\": %.0f, "
+        "\"rejected_stats\": %.4f, \"rejected_signature\": %.4f, \"found\": %s, \"error_px\": %d, \"score_diff\": %.6f}",
+        first ? "" : ",",
+        rCase.source.c_str(), rCase.engine.c_str(), rCase.width, rCase.height,
+        rCase.patSize, rCase.channels, rCase.hint ? "true" : "false", rCase.threads,
+        rRes.iterations, rRes.nsMedian, rRes.nsMin,
+        rRes.allocsPerOp, rRes.allocBytesPerOp, rRes.pixelsPerSec,
+        rRes.rejectedStats, rRes.rejectedSignature, rRes.found ? "true" : "false", rRes.errPx, rRes.scoreDiff);
+    std::fflush(pOut);
+}
+#pragma endregion
+
+
+int main(int argc, char* argv[])
+{
+    const char* pOutPath = nullptr;
+    std::string framesDir;
+    bool quick = false;
+    double minTimeMs = 300;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!std::strcmp(argv[i], "--out") && (i + 1 < argc))
+            pOutPath = argv[++i];
+        else if (!std::strcmp(argv[i], "--frames") && (i + 1 < argc))
+            framesDir = argv[++i];
+        else if (!std::strcmp(argv[i], "--min-time") && (i + 1 < argc))
+            minTimeMs = std::atof(argv[++i]);
+        else if (!std::strcmp(argv[i], "--quick"))
+            quick = true;
+        else
+        {
+            std::fprintf(stderr, "Usage: %s [--out file.json] [--frames dir] [--quick] [--min-time ms]\n", argv[0]);
+            return 2;
+        }
+    }
+    FILE* pOut = pOutPath ? std::fopen(pOutPath, "w") : stdout;
+    if (!pOut)
+    {
+        std::fprintf(stderr, "Cannot write %s\n", pOutPath);
+        return 1;
+    }
+
+    CCountingAllocator allocator(cv::Mat::getStdAllocator());
+    cv::Mat::setDefaultAllocator(&allocator);
+
+    const std::vector<cv::Size> resolutions = quick ?
+        std::vector<cv::Size>{ {1920, 1080} } :
+        std::vector<cv::Size>{ {1280, 720}, {1920, 1080}, {2560, 1440}, {3840, 2160} };
+    const std::vector<int> patSizes = quick ?
+        std::vector<int>{ 32, 64 } :
+        std::vector<int>{ 16, 32, 64, 128 };
+    std::vector<int> threadCounts{ 1 };
+    if (cv::getNumberOfCPUs() > 1)
+        threadCounts.push_back(cv::getNumberOfCPUs());
+
+    std::vector<source_t> sources;
+    sources.push_back(source_t{ "synthetic", cv::Mat() });  // generated per resolution
+    if (!framesDir.empty())
+        loadRecorded(framesDir, sources);
+
+    std::fprintf(pOut, "{\"opencv\": \"%s\", \"cpus\": %d, \"results\": [", CV_VERSION, cv::getNumberOfCPUs());
+    bool first = true;
+    int mismatches = 0;
+    for (const source_t& rSource : sources)
+    {
+        for (const cv::Size& rRes : resolutions)
+        {
+            cv::Mat frame;
+            if (rSource.img.empty())
+                frame = makeScreen(rRes.width, rRes.height, 1);
+            else
+                cv::resize(rSource.img, frame, rRes, 0, 0, cv::INTER_AREA);
+            cv::Mat gray;
+            cv::cvtColor(frame, gray, cv::COLOR_BGRA2GRAY);
+            ImProcU8::imgArr2I_t frmSz = { frame.cols, frame.rows };
+            const ImProcU8::Image frame4{ frame.data, static_cast<int>(frame.step), 4, frmSz };
+            const ImProcU8::Image frame1{ gray.data, static_cast<int>(gray.step), 1, frmSz };
+
+            for (int patSize : patSizes)
+            {
+                const cv::Point pos = pickPatternPos(gray, patSize, static_cast<unsigned>(patSize));
+                const cv::Point center = pos + cv::Point(patSize >> 1, patSize >> 1);
+                const cv::Rect roi(pos, cv::Size(patSize, patSize));
+                cv::Mat pat4 = frame(roi).clone();
+                cv::Mat pat1 = gray(roi).clone();
+                ImProcU8::imgArr2I_t patSz = { patSize, patSize };
+                const ImProcU8::Image target4{ pat4.data, static_cast<int>(pat4.step), 4, patSz };
+                const ImProcU8::Image target1{ pat1.data, static_cast<int>(pat1.step), 1, patSz };
+
+                std::vector<float> pts;
+                std::vector<ImProcU8::imgPxl_t> descr;
+                ImProcU8::Features feat{};
+                bool described = ImProcU8::describePattern(target1, pts, descr, feat);
+
+                const double scoreDiff = std::max(fixedScoreDiff(frame, pat4, pos), fixedScoreDiff(gray, pat1, pos));
+                if (scoreDiff > SCORE_TOLERANCE)
+                {
+                    mismatches++;
+                    std::fprintf(stderr, "Score mismatch %s %dx%d pattern %d: %.6f\n",
+                        rSource.name.c_str(), rRes.width, rRes.height, patSize, scoreDiff);
+                }
+
+                for (int threads : threadCounts)
+                {
+                    cv::setNumThreads(threads);
+                    for (const char* pEngine : { "pattern", "cascade", "fixed", "features" })
+                    {
+                        const int channels = std::strcmp(pEngine, "features") ? 4 : 1;
+                        const ImProcU8::Cascade* pCascade = std::strcmp(pEngine, "cascade") ? nullptr : &ImProcU8::DEFAULT_CASCADE;
+                        const bool fixed = !std::strcmp(pEngine, "fixed");
+                        if ((channels == 1) && !described)
+                            continue;  // too few features in this pattern
+                        for (bool hint : { false, true })
+                        {
+                            if (fixed && !hint)
+                                continue;  // direct correlation is meant for hint sized areas
+                            case_t bench{ rSource.name, pEngine,
+                                rRes.width, rRes.height, patSize, channels, hint, threads };
+                            ImProcU8::imgArr2I_t location = { 0, 0 };
+                            ImProcU8::CascadeStats stats = {};
+                            bool found = false;
+                            auto run = [&]() {
+                                // A hint slightly off, like the previous position of a moving element
+                                location[ImProcU8::COOR_LEFT] = hint ? center.x + 3 : 0;
+                                location[ImProcU8::COOR_TOP] = hint ? center.y + 2 : 0;
+                                if (fixed)
+                                    found = ImProcU8::locatePatternFixed(frame4, target4, location);
+                                else if (channels == 4)
+                                    found = ImProcU8::locatePatternIn(frame4, target4, location, 0.55f, nullptr, pCascade, &stats);
+                                else
+                                    found = ImProcU8::locateFeaturesIn(frame1, feat, location);
+                            };
+                            result_t res = measure(run, minTimeMs, static_cast<long long>(frame.total()));
+                            res.found = found;
+                            res.scoreDiff = fixed ? scoreDiff : 0.;
+                            if (stats.windows > 0)
+                            {
+                                res.rejectedStats = static_cast<double>(stats.rejectedStats) / stats.windows;
+                                res.rejectedSignature = static_cast<double>(stats.rejectedSignature) / stats.windows;
+                            }
+                            res.errPx = found ?
+                                static_cast<int>(cv::norm(cv::Point(location[ImProcU8::COOR_LEFT], location[ImProcU8::COOR_TOP]) - center)) : -1;
+                            writeResult(pOut, bench, res, first);
+                            first = false;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    std::fprintf(pOut, "\n]}\n");
+    cv::Mat::setDefaultAllocator(nullptr);
+    if (pOut != stdout)
+        std::fclose(pOut);
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,23 @@
+# Microbenchmark of the matching engines, no Qt needed
+TEMPLATE = app
+
+# Sources
+SOURCES = ImProcBench.cpp \
+  ../Source/Util/imgproc.cpp \
+  ../Source/Util/trace.cpp
+INCLUDEPATH += $$(OCV_DIR)/include
+
+# qmake configuration
+CONFIG *= console release c++11
+CONFIG -= qt app_bundle
+DEFINES += NDEBUG  # no debug printouts in the measured code
+
+# Dependencies
+win32:contains(QMAKE_TARGET.arch, x86_64) {
+  LIBS += -L$$(OCV_DIR)/x64/vc15/lib -lopencv_world342
+  DESTDIR = ../Build/vc15_x64
+  OBJECTS_DIR += ../Assembly/Bench_x64
+} else {
+  LIBS += -lopencv_core -lopencv_imgproc -lopencv_imgcodecs -lopencv_features2d -lopencv_calib3d
+}
+TARGET = ImProcBench
@@ -0,0 +1,266 @@
+// Headless batch detection: searches a pattern set in captured frames without
+// a window to capture from. Patterns come from a library saved by the
+// application or a directory of *.png, frames from a directory of screenshots
+// or a frame history saved by a monitor. Frames are loaded and searched in parallel,
+// one per core, through frameHasPattern like the application does. Writes one row
+// per frame and pattern with location and search time as CSV or JSON.
+#include "../Bench/DetectionEngines.h"
+#include "../Source/CScreenMacroTools.h"
+#include "../Source/CFrameHistory.h"
+
+#include <QCommandLineParser>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QGuiApplication>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QPixmap>
+#include <QTextStream>
+#include <QThreadPool>
+#include <QtConcurrent>
+
+#include <algorithm>
+#include <vector>
+
+
+namespace {
+    // Frames in memory at once, the sources are read in batches of it
+    const int BATCH_FRAMES = 64;
+    const char* const IMAGE_FILTERS[] = { "*.png", "*.bmp", "*.jpg", "*.jpeg" };
+
+    struct frameJob_t {
+        int index;
+        QString source;   // file, or history time stamp
+        QImage frame;     // loaded by the worker
+        bool loaded;
+        std::vector<match_t> results;  // per pattern key
+        std::vector<double> searchMs;
+        double frameMs;
+    };
+
+    QString csvField(QString text)
+    {
+        return '"' + text.replace('"', "\"\"") + '"';
+    }
+}
+
+
+int main(int argc, char* argv[])
+{
+    // Pixmaps need a platform plugin, a server has no display
+    if (!qEnvironmentVariableIsSet("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    QGuiApplication app(argc, argv);
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Searches a pattern set in captured frames");
+    parser.addHelpOption();
+    QCommandLineOption libraryOpt("library", "Pattern library saved by the application.", "file");
+    QCommandLineOption patternsOpt("patterns", "Directory with *.png patterns, captured at the frame size.", "dir");
+    QCommandLineOption framesOpt("frames", "Directory with screenshots (png, bmp, jpg).", "dir");
+    QCommandLineOption historyOpt("history", "Frame history saved by a monitor.", "file");
+    QCommandLineOption engineOpt("engine", "pattern, cascade, window or features (default pattern).", "name", "pattern");
+    QCommandLineOption threadsOpt("threads", "Frames searched at once (default one per core).", "n");
+    QCommandLineOption formatOpt("format", "csv or json (default csv).", "name", "csv");
+    QCommandLineOption outOpt("out", "Result file, stdout if not set.", "file");
+    parser.addOptions({ libraryOpt, patternsOpt, framesOpt, historyOpt, engineOpt, threadsOpt, formatOpt, outOpt });
+    parser.process(app);
+
+    QTextStream err(stderr);
+    const DetectionEngines::engine_t* pEngine = DetectionEngines::find(parser.value(engineOpt));
+    const bool json = (parser.value(formatOpt) == "json");
+    if (!pEngine || (!json && (parser.value(formatOpt) != "csv")))
+    {
+        err << "Unknown engine or format\n";
+        return 2;
+    }
+    if ((parser.isSet(libraryOpt) == parser.isSet(patternsOpt)) || (parser.isSet(framesOpt) == parser.isSet(historyOpt)))
+    {
+        err << "Set one of --library and --patterns and one of --frames and --history\n";
+        return 2;
+    }
+
+    // Frame sources, the workers load and decode the frames
+    QFileInfoList files;
+    CFrameHistoryReader history;
+    int frameCount = 0;
+    QSize frameSize;
+    if (parser.isSet(framesOpt))
+    {
+        QStringList filters;
+        for (const char* pFilter : IMAGE_FILTERS)
+            filters.append(pFilter);
+        files = QDir(parser.value(framesOpt)).entryInfoList(filters, QDir::Files, QDir::Name);
+        frameCount = files.size();
+        if (frameCount)
+            frameSize = QImage(files.front().filePath()).size();
+    } else if (history.open(parser.value(historyOpt))) {
+        frameCount = history.count();
+        if (frameCount)
+            frameSize = history.info(0).size;
+    }
+    if (!frameCount || frameSize.isEmpty())
+    {
+        err << "No frames\n";
+        return 2;
+    }
+
+    CScreenMacroTools tools;
+    QStringList keys;
+    if (parser.isSet(libraryOpt))
+    {
+        if (!tools.loadLibrary(parser.value(libraryOpt)))
+        {
+            err << "Cannot load " << parser.value(libraryOpt) << "\n";
+            return 2;
+        }
+        // A fresh registry interns the library keys in order from 0
+        for (patternId_t id = 0; !tools.getPatternKey(id).isEmpty(); id++)
+            keys.append(tools.getPatternKey(id));
+    } else {
+        QDir dir(parser.value(patternsOpt));
+        for (const QFileInfo& rFile : dir.entryInfoList(QStringList("*.png"), QDir::Files, QDir::Name))
+        {
+            QImage img(rFile.filePath());
+            if (img.isNull())
+                continue;
+            // Cut from a frame of this size, like a capture from the UI
+            tools.setPattern(rFile.completeBaseName(), QPixmap::fromImage(img), static_cast<float>(img.width()) / frameSize.width());
+            keys.append(rFile.completeBaseName());
+        }
+    }
+    if (keys.isEmpty())
+    {
+        err << "No patterns\n";
+        return 2;
+    }
+    DetectionEngines::select(tools, *pEngine);
+
+    if (parser.isSet(threadsOpt))
+        QThreadPool::globalInstance()->setMaxThreadCount(std::max(1, parser.value(threadsOpt).toInt()));
+
+    QFile outFile;
+    if (parser.isSet(outOpt))
+    {
+        outFile.setFileName(parser.value(outOpt));
+        if (!outFile.open(QIODevice::WriteOnly | QIODevice::Text))
+        {
+            err << "Cannot write " << parser.value(outOpt) << "\n";
+            return 1;
+        }
+    } else {
+        outFile.open(stdout, QIODevice::WriteOnly | QIODevice::Text);
+    }
+    QTextStream out(&outFile);
+    if (!json)
+        out << "frame,source,pattern,found,x,y,scale,search_ms,frame_ms\n";
+
+    auto search = [&](frameJob_t& rJob) {
+        rJob.loaded = files.isEmpty() ? history.read(rJob.index, &rJob.frame) : rJob.frame.load(rJob.source);
+        if (!rJob.loaded)
+            return;
+        QElapsedTimer frameTimer;
+        frameTimer.start();
+        // One frame per core, the others must not push its block hashes out of the cache
+        tools.holdFrame(rJob.frame);
+        for (const QString& rKey : keys)
+        {
+            QElapsedTimer timer;
+            timer.start();
+            rJob.results.push_back(tools.frameHasPattern(rJob.frame, rKey, pEngine->scaling));
+            rJob.searchMs.push_back(timer.nsecsElapsed() * 1e-6);
+        }
+        tools.releaseFrame(rJob.frame);
+        rJob.frameMs = frameTimer.nsecsElapsed() * 1e-6;
+        rJob.frame = QImage();  // the batch only keeps results
+    };
+
+    QJsonArray frames;
+    std::vector<double> frameMs;
+    int found = 0;
+    int unreadable = 0;
+    QElapsedTimer wallTimer;
+    wallTimer.start();
+    for (int first = 0; first < frameCount; first += BATCH_FRAMES)
+    {
+        std::vector<frameJob_t> batch;
+        for (int idx = first, upper = std::min(frameCount, first + BATCH_FRAMES); idx < upper; idx++)
+        {
+            frameJob_t job = { idx, QString(), QImage(), false, {}, {}, 0. };
+            job.source = files.isEmpty() ? QString::number(history.info(idx).timeMs) : files[idx].filePath();
+            batch.push_back(std::move(job));
+        }
+        QtConcurrent::blockingMap(batch, search);
+
+        for (const frameJob_t& rJob : batch)
+        {
+            if (!rJob.loaded)
+            {
+                unreadable++;
+                err << "Cannot read frame " << rJob.index << " " << rJob.source << "\n";
+                continue;
+            }
+            frameMs.push_back(rJob.frameMs);
+            QJsonArray patterns;
+            for (int i = 0; i < keys.size(); i++)
+            {
+                const match_t& rResult = rJob.results[i];
+                found += rResult.found ? 1 : 0;
+                if (json)
+                {
+                    QJsonObject pattern;
+                    pattern["pattern"] = keys[i];
+                    pattern["found"] = rResult.found;
+                    if (rResult.found)
+                    {
+                        pattern["x"] = rResult.pos.x();
+                        pattern["y"] = rResult.pos.y();
+                        pattern["scale"] = rResult.scale;
+                    }
+                    pattern["search_ms"] = rJob.searchMs[i];
+                    patterns.append(pattern);
+                } else {
+                    out << rJob.index << ',' << csvField(rJob.source) << ',' << csvField(keys[i]) << ','
+                        << (rResult.found ? 1 : 0) << ',' << rResult.pos.x() << ',' << rResult.pos.y() << ','
+                        << rResult.scale << ',' << rJob.searchMs[i] << ',' << rJob.frameMs << '\n';
+                }
+            }
+            if (json)
+            {
+                QJsonObject frame;
+                frame["frame"] = rJob.index;
+                frame["source"] = rJob.source;
+                frame["frame_ms"] = rJob.frameMs;
+                frame["patterns"] = patterns;
+                frames.append(frame);
+            }
+        }
+        out.flush();
+    }
+    const double wallMs = wallTimer.nsecsElapsed() * 1e-6;
+
+    // Throughput counts all cores, latency is of one frame on one of them
+    QJsonObject summary;
+    summary["engine"] = pEngine->pName;
+    summary["frames"] = static_cast<int>(frameMs.size());
+    summary["unreadable"] = unreadable;
+    summary["patterns"] = keys.size();
+    summary["threads"] = QThreadPool::globalInstance()->maxThreadCount();
+    summary["found"] = found;
+    summary["frames_per_s"] = wallMs > 0. ? 1000. * frameMs.size() / wallMs : 0.;
+    summary["p50_frame_ms"] = DetectionEngines::percentile(frameMs, 0.50);
+    summary["p99_frame_ms"] = DetectionEngines::percentile(frameMs, 0.99);
+    if (json)
+    {
+        QJsonObject root;
+        root["summary"] = summary;
+        root["frames"] = frames;
+        out << QJsonDocument(root).toJson();
+    } else {
+        err << QJsonDocument(summary).toJson();
+    }
+    out.flush();
+    return unreadable ? 1 : 0;
+}
@@ -0,0 +1,304 @@
+#include "CActionDispatcher.h"
+
+#include <QThread>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
+
+#include "Util/winapi.h"
+#include "Util/util.h"
+#include "Util/metrics.h"
+#include "Util/trace.h"
+
+
+#pragma region Backends
+bool CWinInputBackend::toDesktop(const void* hWnd, QPoint* pInOutPos)
+{
+    int x, y;
+    if (!pInOutPos || !WinOS::getWindowOrigin(hWnd, &x, &y))
+        return false;
+    *pInOutPos += QPoint(x, y);
+    // can click on a desktop spread over max 34 FullHD monitors...
+    return (pInOutPos->x() | pInOutPos->y()) <= 0xFFFF;
+}
+
+
+QPoint CWinInputBackend::cursorPos()
+{
+    int x, y;
+    WinOS::getCursorPos(&x, &y);
+    return QPoint(x, y);
+}
+
+
+void CWinInputBackend::send(const std::vector<inputEvent_t>& rEvents)
+{
+    std::vector<WinOS::mouseInput_t> inputs;
+    inputs.reserve(rEvents.size());
+    for (const inputEvent_t& rEvent : rEvents)
+    {
+        switch (rEvent.kind)
+        {
+        case inputEvent_t::MOVE:
+            inputs.push_back({ WinOS::mouseInput_t::MSE_MOVE, rEvent.pos.x(), rEvent.pos.y() });
+            break;
+        case inputEvent_t::LEFT_DOWN:
+            inputs.push_back({ WinOS::mouseInput_t::MSE_LEFT_DOWN, 0, 0 });
+            break;
+        case inputEvent_t::LEFT_UP:
+            inputs.push_back({ WinOS::mouseInput_t::MSE_LEFT_UP, 0, 0 });
+            break;
+        }
+    }
+    WinOS::sendMouseInputs(inputs.data(), static_cast<unsigned>(inputs.size()));
+}
+
+
+unsigned long CWinInputBackend::defaultHoldMs()
+{
+    // Longer than a double click, two clicks in a row stay two clicks
+    return WinOS::getDoubleClickTime() + 5;
+}
+
+
+CRecordingInputBackend::CRecordingInputBackend(unsigned long holdMs) :
+    mpLock(nullptr),
+    mHoldMs(holdMs),
+    mBatches(0)
+{
+    mpLock = new QMutex();
+}
+
+
+CRecordingInputBackend::~CRecordingInputBackend()
+{
+    DEL_PTR_(mpLock);
+}
+
+
+bool CRecordingInputBackend::toDesktop(const void* hWnd, QPoint* pInOutPos)
+{
+    return hWnd && pInOutPos;  // every window sits at the desktop origin
+}
+
+
+QPoint CRecordingInputBackend::cursorPos()
+{
+    QMutexLocker guard(mpLock);
+    return mCursor;
+}
+
+
+void CRecordingInputBackend::send(const std::vector<inputEvent_t>& rEvents)
+{
+    auto now = std::chrono::steady_clock::now();
+    QMutexLocker guard(mpLock);
+    for (const inputEvent_t& rEvent : rEvents)
+    {
+        mRecords.push_back(record_t{ rEvent, now, mBatches });
+        if (rEvent.kind == inputEvent_t::MOVE)
+            mCursor = rEvent.pos;
+    }
+    mBatches++;
+}
+
+
+std::vector<CRecordingInputBackend::record_t> CRecordingInputBackend::takeRecords()
+{
+    QMutexLocker guard(mpLock);
+    std::vector<record_t> records;
+    records.swap(mRecords);
+    return records;
+}
+#pragma endregion
+
+
+CActionDispatcher::CActionDispatcher(CInputBackend* pBackend) :
+    mpBackend(pBackend),
+    mpWorker(nullptr),
+    mpLock(nullptr),
+    mpWake(nullptr),
+    mStats(),
+    mNextGroup(0),
+    mSkipGroup(-1),
+    mStop(false)
+{
+    mpLock = new QMutex();
+    mpWake = new QWaitCondition();
+    mpWorker = QThread::create([this]() { work(); });
+    mpWorker->start();
+}
+
+
+CActionDispatcher::~CActionDispatcher()
+{
+    {
+        QMutexLocker guard(mpLock);
+        mStop = true;  // queued events go out at once, no button stays pressed
+        mpWake->wakeAll();
+    }
+    mpWorker->wait();
+    delete mpWorker;
+    DEL_PTR_(mpWake);
+    DEL_PTR_(mpLock);
+    DEL_PTR_(mpBackend);
+}
+
+
+void CActionDispatcher::click(const void* hWnd, const QPoint& rInWndPos, bool returnAfter, unsigned long holdMs)
+{
+    using namespace std::chrono;
+    const milliseconds hold(holdMs ? holdMs : mpBackend->defaultHoldMs());
+    const milliseconds none(0);
+
+    steady_clock::time_point now = steady_clock::now();
+    QMutexLocker guard(mpLock);
+    int group = mNextGroup++;
+    mQueue.push_back(action_t{ action_t::MOVE, hWnd, rInWndPos, returnAfter, group, none, now });
+    mQueue.push_back(action_t{ action_t::LEFT_DOWN, hWnd, QPoint(), false, group, none, now });
+    mQueue.push_back(action_t{ action_t::LEFT_UP, hWnd, QPoint(), false, group, hold, now });
+    if (returnAfter)
+        mQueue.push_back(action_t{ action_t::RESTORE, hWnd, QPoint(), false, group, none, now });
+    mpWake->wakeOne();
+}
+
+
+void CActionDispatcher::move(const void* hWnd, const QPoint& rInWndPos)
+{
+    auto now = std::chrono::steady_clock::now();
+    QMutexLocker guard(mpLock);
+    if (!mQueue.empty()
+        && (mQueue.back().kind == action_t::MOVE)
+        && (mQueue.back().group < 0))
+    {// Not sent yet, the newer target wins
+        mQueue.back().hWnd = hWnd;
+        mQueue.back().pos = rInWndPos;
+        mStats.coalescedMoves++;
+        Metrics::add(Metrics::C_COALESCED_MOVES);
+        return;
+    }
+    mQueue.push_back(action_t{ action_t::MOVE, hWnd, rInWndPos, false, -1, std::chrono::milliseconds(0), now });
+    mpWake->wakeOne();
+}
+
+
+CActionDispatcher::stats_t CActionDispatcher::getStats()
+{
+    QMutexLocker guard(mpLock);
+    return mStats;
+}
+
+
+void CActionDispatcher::work()
+{
+    std::vector<action_t> batch;
+    QMutexLocker guard(mpLock);
+    while (!mStop || !mQueue.empty())
+    {
+        if (mQueue.empty())
+        {
+            mpWake->wait(mpLock);
+            continue;
+        }
+        auto now = std::chrono::steady_clock::now();
+        auto due = mLastSent + mQueue.front().after;
+        if (!mStop && (due > now))
+        {// Sleep till the release is due, a new event may wake earlier
+            auto waitMs = std::chrono::duration_cast<std::chrono::milliseconds>(due - now).count() + 1;
+            mpWake->wait(mpLock, static_cast<unsigned long>(waitMs));
+            continue;
+        }
+        // Everything due goes out together, order is kept.
+        // An event with a gap to its predecessor starts the next batch.
+        do {
+            batch.push_back(mQueue.front());
+            mQueue.pop_front();
+        } while (!mQueue.empty() && (mStop || (mQueue.front().after.count() == 0)));
+        guard.unlock();
+        dispatch(batch);
+        batch.clear();
+        guard.relock();
+        mLastSent = std::chrono::steady_clock::now();
+    }
+}
+
+
+void CActionDispatcher::dispatch(std::vector<action_t>& rBatch)
+{// Dispatcher thread, lock not held
+    std::vector<inputEvent_t> events;
+    bool movePending = false;
+    inputEvent_t pendingMove{ inputEvent_t::MOVE, QPoint(), std::chrono::steady_clock::time_point() };
+    unsigned long long coalesced = 0, dropped = 0;
+
+    for (const action_t& rAction : rBatch)
+    {
+        if ((rAction.group >= 0) && (rAction.group == mSkipGroup))
+            continue;
+
+        QPoint target;
+        switch (rAction.kind)
+        {
+        case action_t::MOVE:
+            target = rAction.pos;
+            if (!mpBackend->toDesktop(rAction.hWnd, &target))
+            {
+                if (rAction.group >= 0)
+                {// Drop the whole click
+                    mSkipGroup = rAction.group;
+                    dropped++;
+                }
+                continue;
+            }
+            if (rAction.saveCursor)  // a pending move is where the cursor will be
+                mSavedCursor = movePending ? pendingMove.pos : mpBackend->cursorPos();
+            break;
+        case action_t::RESTORE:
+            target = mSavedCursor;
+            break;
+        case action_t::LEFT_DOWN:
+        case action_t::LEFT_UP:
+            if (movePending)
+            {
+                events.push_back(pendingMove);
+                movePending = false;
+            }
+            events.push_back(inputEvent_t{
+                (rAction.kind == action_t::LEFT_DOWN) ? inputEvent_t::LEFT_DOWN : inputEvent_t::LEFT_UP,
+                QPoint(),
+                rAction.queuedAt
+            });
+            continue;
+        }
+        // Moves are only sent before a button or at the end of the batch
+        if (movePending)
+            coalesced++;
+        pendingMove = inputEvent_t{ inputEvent_t::MOVE, target, rAction.queuedAt };
+        movePending = true;
+    }
+    if (movePending)
+        events.push_back(pendingMove);
+
+    if (!events.empty())
+    {
+        {
+            TRACE_("sendInput");
+            mpBackend->send(events);
+        }
+        auto sentAt = std::chrono::steady_clock::now();
+        for (const inputEvent_t& rEvent : events)
+        {
+            if (rEvent.kind == inputEvent_t::LEFT_DOWN)
+            {
+                Metrics::observe(Metrics::H_INPUT_DELAY, sentAt - rEvent.queuedAt);
+                Trace::record("inputQueued", rEvent.queuedAt, sentAt);
+            }
+        }
+    }
+    Metrics::add(Metrics::C_COALESCED_MOVES, coalesced);
+
+    QMutexLocker guard(mpLock);
+    mStats.events += events.size();
+    mStats.batches += events.empty() ? 0 : 1;
+    mStats.coalescedMoves += coalesced;
+    mStats.droppedClicks += dropped;
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+class QThread;
+class QMutex;
+class QWaitCondition;
+
+
+#include <QPoint>
+
+#include <chrono>
+#include <deque>
+#include <vector>
+
+
+struct inputEvent_t {
+    enum kind_t { MOVE, LEFT_DOWN, LEFT_UP } kind;
+    QPoint pos;  // virtual desktop pixel, MOVE only
+    std::chrono::steady_clock::time_point queuedAt;
+};
+
+
+// Injects input on behalf of the dispatcher, called from its thread only
+class CInputBackend
+{
+public:
+    virtual ~CInputBackend() {}
+
+    // Window to virtual desktop coordinates, false if the window is gone
+    virtual bool toDesktop(const void* hWnd, QPoint* pInOutPos) = 0;
+    virtual QPoint cursorPos() = 0;
+    // One batch, injected without other input in between
+    virtual void send(const std::vector<inputEvent_t>& rEvents) = 0;
+    virtual unsigned long defaultHoldMs() = 0;
+};
+
+
+// SendInput of the WinOS module
+class CWinInputBackend : public CInputBackend
+{
+public:
+    bool toDesktop(const void* hWnd, QPoint* pInOutPos) override;
+    QPoint cursorPos() override;
+    void send(const std::vector<inputEvent_t>& rEvents) override;
+    unsigned long defaultHoldMs() override;
+};
+
+
+// Records instead of injecting, measures dispatch latency without a desktop
+class CRecordingInputBackend : public CInputBackend
+{
+public:
+    struct record_t {
+        inputEvent_t event;
+        std::chrono::steady_clock::time_point sentAt;
+        int batch;
+    };
+
+private:
+    QMutex* mpLock;
+    std::vector<record_t> mRecords;
+    QPoint mCursor;
+    unsigned long mHoldMs;
+    int mBatches;
+
+public:
+    explicit CRecordingInputBackend(unsigned long holdMs=0);
+    ~CRecordingInputBackend();
+
+    bool toDesktop(const void* hWnd, QPoint* pInOutPos) override;
+    QPoint cursorPos() override;
+    void send(const std::vector<inputEvent_t>& rEvents) override;
+    unsigned long defaultHoldMs() override { return mHoldMs; }
+
+    std::vector<record_t> takeRecords();
+};
+
+
+// Single ordered queue for all synthetic input.
+// One thread sends the events when they are due, everything due at once
+// goes out as one batch. A button release waits its hold time after the
+// press was sent without a thread sleeping per click. A move superseded by
+// a later one in the same batch is dropped.
+class CActionDispatcher
+{
+public:
+    struct stats_t {
+        unsigned long long events;
+        unsigned long long batches;
+        unsigned long long coalescedMoves;
+        unsigned long long droppedClicks;  // window gone
+    };
+
+private:
+    struct action_t {
+        enum kind_t { MOVE, RESTORE, LEFT_DOWN, LEFT_UP } kind;
+        const void* hWnd;
+        QPoint pos;          // window coordinates, MOVE only
+        bool saveCursor;     // remember the cursor for the RESTORE of the group
+        int group;           // events of one click
+        std::chrono::milliseconds after;  // min gap to the event before, e.g. button hold time
+        std::chrono::steady_clock::time_point queuedAt;
+    };
+
+    CInputBackend* mpBackend;
+    QThread* mpWorker;
+    QMutex* mpLock;
+    QWaitCondition* mpWake;
+    std::deque<action_t> mQueue;
+    stats_t mStats;
+    int mNextGroup;
+    int mSkipGroup;        // click whose window is gone, dispatcher thread only
+    QPoint mSavedCursor;   // of the click being sent, dispatcher thread only
+    std::chrono::steady_clock::time_point mLastSent;
+    bool mStop;
+
+    void work();
+    void dispatch(std::vector<action_t>& rBatch);
+
+public:
+    // Takes ownership of the backend
+    explicit CActionDispatcher(CInputBackend* pBackend);
+    ~CActionDispatcher();
+
+    // holdMs 0 takes the backend default, the cursor returns if returnAfter
+    void click(const void* hWnd, const QPoint& rInWndPos, bool returnAfter=true, unsigned long holdMs=0);
+    // Replaces a queued move not yet sent
+    void move(const void* hWnd, const QPoint& rInWndPos);
+    stats_t getStats();
+};
@@ -1,123 +1,178 @@
-#include "CCaptureEngine.h"
-
-#include <QTimer>
-#include <QApplication>
-#include <QScreen>
-#include <QPixmap>
-#include <QMutex>
-#include <QMutexLocker>
-
-#include "Util/util.h"
-
-
-CCaptureEngine::CCaptureEngine(int tDelayMs, QObject* parent) :
-    QObject(parent),
-    mTDelayMs(tDelayMs),
-    mpTrigger(nullptr),
-    mpCapture(nullptr),
-    mpScrnPtr(nullptr),
-    mpWnd(nullptr),
-    mpLock(nullptr)
-{
-    mpCapture = new QPixmap();
-    mpLock = new QMutex();
-}
-
-
-CCaptureEngine::~CCaptureEngine()
-{
-    stopCapture();
-    DEL_PTR_(mpTrigger);
-    DEL_PTR_(mpCapture);
-    DEL_PTR_(mpLock);
-}
-
-
-bool CCaptureEngine::startCapture()
-{
-    if (!mpTrigger)
-    {   // Must created in the thread that starts it.
-        mpTrigger = new QTimer();
-        connect(mpTrigger,
-            &QTimer::timeout,
-            [this](void) {this->captureWindow(mpWnd); }
-        );
-    }
-    if (mpTrigger)
-    {  // can start without valid window handle
-        if (mpTrigger->isActive())
-            mpTrigger->setInterval(mTDelayMs);
-        else
-            mpTrigger->start(mTDelayMs);
-        return true;
-    }
-    return false;
-}
-
-
-void CCaptureEngine::stopCapture()
-{
-    if (!mpTrigger)
-    {
-        mpTrigger->stop();
-    }
-}
-
-
-bool CCaptureEngine::captureWindow(const void* hwnd)
-{
-    if (!hwnd)
-        return false;
-
-    if (!mpScrnPtr)
-        mpScrnPtr = QGuiApplication::primaryScreen();
-
-    try
-    {
-        if (mpLock->tryLock(mpTrigger->interval()>>1))
-        {
-            BENCHMARK_(2, mpScrnPtr->grabWindow(WId(hwnd)).swap(*mpCapture));
-            mpLock->unlock();
-            return true;
-        }
-    } catch (const std::exception& e) {
-        qWarning() << "Frame dropped:" << e.what();
-        mpScrnPtr = nullptr;
-    }
-
-    return false;
-}
-
-
-bool  CCaptureEngine::tryGetImage(QImage* pOutImg)
-{
-    if (pOutImg)
-    {
-        QMutexLocker guard(mpLock);
-        if (mpCapture && !mpCapture->isNull())
-        {
-            // This is a deep copy moved to rOutImg
-            mpCapture->toImage().swap(*pOutImg);
-            return !pOutImg->isNull();
-        }
-    }
-    return false;
-}
-
-
-bool CCaptureEngine::getIsRunning()
-{
-    if (mpTrigger)
-        return mpTrigger->isActive();
-    else
-        return false;
-}
-
-
-const QPixmap* CCaptureEngine::getCapture()
-{
-    // gives no guard for pointer access after call,
-    // only assures the ptr is not written during cpy
-    QMutexLocker guard(mpLock);
-    return mpCapture;
+#include "CCaptureEngine.h"
+
+#include <QTimer>
+#include <QApplication>
+#include <QScreen>
+#include <QPixmap>
+#include <QImage>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QDateTime>
+#include <QString>
+
+#include "CFrameRing.h"
+#include "Util/util.h"
+#include "Util/metrics.h"
+#include "Util/trace.h"
+
+
+CCaptureEngine::CCaptureEngine(int tDelayMs, QObject* parent) :
+    QObject(parent),
+    mTDelayMs(tDelayMs),
+    mpTrigger(nullptr),
+    mpCapture(nullptr),
+    mpFrame(nullptr),
+    mpScrnPtr(nullptr),
+    mpWnd(nullptr),
+    mpLock(nullptr),
+    mpRing(nullptr)
+{
+    mpCapture = new QPixmap();
+    mpFrame = new QImage();
+    mpLock = new QMutex();
+}
+
+
+CCaptureEngine::~CCaptureEngine()
+{
+    stopCapture();
+    DEL_PTR_(mpTrigger);
+    DEL_PTR_(mpCapture);
+    DEL_PTR_(mpFrame);
+    DEL_PTR_(mpLock);
+    DEL_PTR_(mpRing);
+}
+
+
+bool CCaptureEngine::startCapture()
+{
+    if (!mpTrigger)
+    {   // Must created in the thread that starts it.
+        Trace::setThreadName("capture");
+        mpTrigger = new QTimer();
+        connect(mpTrigger,
+            &QTimer::timeout,
+            [this](void) {this->captureWindow(mpWnd); }
+        );
+    }
+    if (mpTrigger)
+    {  // can start without valid window handle
+        if (mpTrigger->isActive())
+            mpTrigger->setInterval(mTDelayMs);
+        else
+            mpTrigger->start(mTDelayMs);
+        return true;
+    }
+    return false;
+}
+
+
+void CCaptureEngine::stopCapture()
+{
+    if (mpTrigger)
+    {
+        mpTrigger->stop();
+    }
+}
+
+
+bool CCaptureEngine::publishFrames(const QString& rName, int slots)
+{
+    DEL_PTR_(mpRing);
+    mpRing = nullptr;
+    if (rName.isEmpty())
+        return true;
+
+    QScreen* pScreen = QGuiApplication::primaryScreen();
+    if (!pScreen)
+        return false;
+    const QSize desktop = pScreen->virtualSize() * pScreen->devicePixelRatio();
+    mpRing = new CFrameRing();
+    if (!mpRing->create(rName, slots, static_cast<qint64>(desktop.width()) * desktop.height() * 4))  // RGB32
+    {
+        qWarning() << "Cannot publish frames as" << rName;
+        delete mpRing;
+        mpRing = nullptr;
+        return false;
+    }
+    return true;
+}
+
+
+bool CCaptureEngine::captureWindow(const void* hwnd)
+{
+    if (!hwnd)
+        return false;
+
+    if (!mpScrnPtr)
+        mpScrnPtr = QGuiApplication::primaryScreen();
+
+    try
+    {
+        if (mpLock->tryLock(mpTrigger->interval()>>1))
+        {
+            {
+                Metrics::ScopeTimer timer(Metrics::H_CAPTURE);
+                TRACE_("grab");
+                BENCHMARK_(2, mpScrnPtr->grabWindow(WId(hwnd)).swap(*mpCapture));
+                *mpFrame = QImage();  // converted again on request
+            }
+            mpLock->unlock();
+            Metrics::add(Metrics::C_FRAMES);
+            QImage frame;
+            if (mpRing && tryGetImage(&frame))
+            {// The same conversion the searches get
+                TRACE_("publish");
+                if (mpRing->publish(frame, QDateTime::currentMSecsSinceEpoch()))
+                    Metrics::add(Metrics::C_PUBLISHED);
+            }
+            emit captured();
+            return true;
+        }
+        Metrics::add(Metrics::C_DROPPED);  // readers hold the frame too long
+    } catch (const std::exception& e) {
+        qWarning() << "Frame dropped:" << e.what();
+        mpScrnPtr = nullptr;
+    }
+
+    return false;
+}
+
+
+bool  CCaptureEngine::tryGetImage(QImage* pOutImg)
+{
+    if (pOutImg)
+    {
+        QMutexLocker guard(mpLock);
+        if (mpCapture && !mpCapture->isNull())
+        {
+            if (mpFrame->isNull())
+            {// One deep copy per capture, shared by all requests and the frame ring
+                Metrics::ScopeTimer timer(Metrics::H_CONVERT);
+                TRACE_("toImage");
+                mpCapture->toImage().swap(*mpFrame);
+            }
+            *pOutImg = *mpFrame;  // detaches on write
+            return !pOutImg->isNull();
+        }
+    }
+    return false;
+}
+
+
+bool CCaptureEngine::getIsRunning()
+{
+    if (mpTrigger)
+        return mpTrigger->isActive();
+    else
+        return false;
+}
+
+
+const QPixmap* CCaptureEngine::getCapture()
+{
+    // gives no guard for pointer access after call,
+    // only assures the ptr is not written during cpy
+    QMutexLocker guard(mpLock);
+    return mpCapture;
 }
\ No newline at end of file
@@ -1,39 +1,52 @@
-#pragma once
-
-class QTimer;
-class QScreen;
-class QPixmap;
-class QMutex;
-
-
-#include <QObject>
-
-
-class CCaptureEngine : public QObject
-{
-    Q_OBJECT
-
-    QTimer* mpTrigger;
-    QPixmap* mpCapture;
-    QScreen* mpScrnPtr;
-    QMutex* mpLock;
-    const void* mpWnd;
-    const int mTDelayMs;
-
-    bool captureWindow(const void* hwnd);
-
-public:
-    CCaptureEngine(int tDelayMs, QObject* parent = 0);
-    ~CCaptureEngine();
-
-    bool tryGetImage(QImage* pOutImg);
-    const QPixmap* getCapture();
-    bool getIsRunning();
-
-    bool startCapture();
-    void stopCapture();
-
-public slots:
-    // this is only thread save with queued signal connection
-    void onSetWindow(const void* wndPtr) { mpWnd = wndPtr; }
+#pragma once
+
+class QTimer;
+class QScreen;
+class QPixmap;
+class QImage;
+class QMutex;
+class QString;
+class CFrameRing;
+
+
+#include <QObject>
+
+
+class CCaptureEngine : public QObject
+{
+    Q_OBJECT
+
+    QTimer* mpTrigger;
+    QPixmap* mpCapture;
+    QImage* mpFrame;     // mpCapture converted, once per capture on first request
+    QScreen* mpScrnPtr;
+    QMutex* mpLock;
+    CFrameRing* mpRing;  // null unless frames are published
+    const void* mpWnd;
+    const int mTDelayMs;
+
+    bool captureWindow(const void* hwnd);
+
+public:
+    CCaptureEngine(int tDelayMs, QObject* parent = 0);
+    ~CCaptureEngine();
+
+    bool tryGetImage(QImage* pOutImg);
+    const QPixmap* getCapture();
+    bool getIsRunning();
+
+    bool startCapture();
+    void stopCapture();
+    // Every frame also goes to a shared memory CFrameRing of this name, for
+    // readers in other processes. Slots fit the virtual desktop. Empty stops.
+    // Call it in the thread of the engine, where the frames are captured.
+    bool publishFrames(const QString& rName, int slots);
+
+signals:
+    // Emitted from the capture thread after each new frame
+    void captured();
+
+public slots:
+    // this is only thread save with queued signal connection
+    void onSetWindow(const void* wndPtr) { mpWnd = wndPtr; }
 };
\ No newline at end of file
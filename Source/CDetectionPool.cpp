@@ -0,0 +1,166 @@
+#include "CDetectionPool.h"
+
+#include <QThread>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QWaitCondition>
+
+#include "Util/util.h"
+#include "Util/trace.h"
+
+
+CDetectionPool::CDetectionPool(int threads) :
+    mpLock(nullptr),
+    mpWake(nullptr),
+    mpLaneDone(nullptr),
+    mNextLane(0),
+    mStop(false)
+{
+    mpLock = new QMutex();
+    mpWake = new QWaitCondition();
+    mpLaneDone = new QWaitCondition();
+
+    if (threads < 1)
+        threads = qMax(1, QThread::idealThreadCount());
+    mReady.resize(threads);
+    for (int i = 0; i < threads; i++)
+    {
+        mWorkers.push_back(QThread::create([this, i]() { work(i); }));
+        mWorkers.back()->start();
+    }
+}
+
+
+CDetectionPool::~CDetectionPool()
+{
+    {
+        QMutexLocker guard(mpLock);
+        mStop = true;
+        mpWake->wakeAll();
+    }
+    for (QThread* pThread : mWorkers)
+    {
+        pThread->wait();  // finishes the running job, pending ones are dropped
+        delete pThread;
+    }
+    DEL_PTR_(mpLaneDone);
+    DEL_PTR_(mpWake);
+    DEL_PTR_(mpLock);
+}
+
+
+int CDetectionPool::addLane()
+{
+    QMutexLocker guard(mpLock);
+    int id = mNextLane++;
+    mLanes.emplace(id, lane_t{ job_t(), id % threadCount(), false, false, false });
+    return id;
+}
+
+
+void CDetectionPool::removeLane(int lane)
+{
+    QMutexLocker guard(mpLock);
+    auto it = mLanes.find(lane);
+    if (it == mLanes.end())
+        return;
+
+    it->second.removed = true;
+    it->second.pending = nullptr;
+    if (it->second.queued)
+    {
+        for (auto& rQueue : mReady)
+        {
+            for (auto qIt = rQueue.begin(); qIt != rQueue.end(); qIt++)
+            {
+                if (*qIt == lane)
+                {
+                    rQueue.erase(qIt);
+                    break;
+                }
+            }
+        }
+    }
+    while (mLanes.count(lane) && mLanes.at(lane).running)
+        mpLaneDone->wait(mpLock);
+    mLanes.erase(lane);
+}
+
+
+bool CDetectionPool::submit(int lane, job_t job)
+{
+    QMutexLocker guard(mpLock);
+    auto it = mLanes.find(lane);
+    if (it == mLanes.end() || it->second.removed || !job)
+        return false;
+
+    lane_t& rLane = it->second;
+    bool superseded = static_cast<bool>(rLane.pending);
+    rLane.pending = std::move(job);
+    if (!rLane.queued && !rLane.running)
+    {// A running lane is requeued when its job returns
+        mReady[rLane.home].push_back(lane);
+        rLane.queued = true;
+        mpWake->wakeOne();
+    }
+    return !superseded;
+}
+
+
+int CDetectionPool::takeLane(int workerIdx)
+{// Caller holds the lock
+    if (!mReady[workerIdx].empty())
+    {
+        int lane = mReady[workerIdx].front();
+        mReady[workerIdx].pop_front();
+        return lane;
+    }
+    for (int i = 1, n = threadCount(); i < n; i++)
+    {// Steal the most recently queued lane of a neighbour
+        auto& rVictim = mReady[(workerIdx + i) % n];
+        if (!rVictim.empty())
+        {
+            int lane = rVictim.back();
+            rVictim.pop_back();
+            return lane;
+        }
+    }
+    return -1;
+}
+
+
+void CDetectionPool::work(int workerIdx)
+{
+    Trace::setThreadName("detection");
+    QMutexLocker guard(mpLock);
+    while (!mStop)
+    {
+        int lane = takeLane(workerIdx);
+        if (lane < 0)
+        {
+            mpWake->wait(mpLock);
+            continue;
+        }
+        lane_t& rLane = mLanes.at(lane);  // map nodes are stable
+        job_t job;
+        job.swap(rLane.pending);
+        rLane.queued = false;
+        rLane.running = true;
+
+        guard.unlock();
+        if (job)
+            job();
+        guard.relock();
+
+        rLane.running = false;
+        if (rLane.removed)
+        {
+            mpLaneDone->wakeAll();
+        } else if (rLane.pending) {
+            // Back of the queue, the other lanes of this worker go first
+            mReady[rLane.home].push_back(lane);
+            rLane.queued = true;
+            mpWake->wakeOne();
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+class QThread;
+class QMutex;
+class QWaitCondition;
+
+
+#include <functional>
+#include <deque>
+#include <map>
+#include <vector>
+
+
+// Worker pool shared by all monitored windows.
+// Each window submits into its own lane. A lane holds at most one pending job,
+// a newer frame replaces the one not yet started. A lane never runs on two
+// workers at once, so a busy window cannot occupy more than one core.
+// Ready lanes are queued at their home worker in FIFO order (round robin),
+// idle workers steal from the back of the other queues.
+class CDetectionPool
+{
+public:
+    using job_t = std::function<void()>;
+
+private:
+    struct lane_t {
+        job_t pending;
+        int home;       // worker index
+        bool queued;    // in a ready queue
+        bool running;
+        bool removed;
+    };
+
+    std::vector<QThread*> mWorkers;
+    std::vector<std::deque<int>> mReady;  // lane ids per worker
+    std::map<int, lane_t> mLanes;
+    QMutex* mpLock;             // jobs are coarse, one lock is not the bottleneck
+    QWaitCondition* mpWake;     // ready lane or shutdown
+    QWaitCondition* mpLaneDone; // a running job finished
+    int mNextLane;
+    bool mStop;
+
+    void work(int workerIdx);
+    int takeLane(int workerIdx);
+
+public:
+    // threads < 1 sizes the pool to the number of cores
+    explicit CDetectionPool(int threads=0);
+    ~CDetectionPool();
+
+    int addLane();
+    // Drops the pending job and blocks till a running job has finished
+    void removeLane(int lane);
+    // Returns false if the lane is unknown or the job superseded a pending one
+    bool submit(int lane, job_t job);
+    int threadCount() const { return static_cast<int>(mWorkers.size()); }
+};
@@ -0,0 +1,507 @@
+#include "CFrameHistory.h"
+
+#include <QByteArray>
+#include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QRect>
+#include <QSaveFile>
+#include <QString>
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+
+#include "Util/util.h"
+#include "Util/trace.h"
+
+
+namespace {
+    const char MAGIC[8] = { 'S', 'M', 'F', 'H', 'I', 'S', 'T', '\0' };
+    const quint32 VERSION = 1;
+    const int ALIGN = 64;            // of the tile data
+    const int COMPRESSION = 1;       // zlib level, screens compress well already at the fastest
+    const int PIXEL_BYTES = 4;       // RGB32
+    const quint32 MAX_SIDE = 1 << 15;  // of frames and tiles in a file, keeps tile counts in int
+
+    struct header_t {
+        char magic[8];
+        quint32 version;
+        quint32 tileSize;
+        quint32 frameCount;
+        quint32 tileCount;
+        quint64 frames;     // offset of the frame table
+        quint64 tiles;      // offset of the tile table
+        quint64 refs;       // offset of the tile indices of all frames
+        quint64 fileBytes;
+        quint32 refCount;
+        char reserved[4];
+    };
+
+    struct frameEntry_t {
+        quint64 seq;
+        qint64 timeMs;
+        quint32 width;
+        quint32 height;
+        quint32 firstRef;   // its tile indices follow in row major order
+        quint32 keyframe;
+    };
+
+    struct tileEntry_t {
+        quint64 offset;     // from file start
+        quint32 bytes;      // compressed
+        quint32 reserved;
+    };
+
+    static_assert(sizeof(header_t) == ALIGN, "History layout changed");
+    static_assert(sizeof(frameEntry_t) == 32, "History layout changed");
+    static_assert(sizeof(tileEntry_t) == 16, "History layout changed");
+
+    qint64 alignUp(qint64 val, qint64 align) {
+        return (val + align - 1) & ~(align - 1);
+    }
+
+    int tileCols(const QSize& rSize, int tileSize) {
+        return (rSize.width() + tileSize - 1) / tileSize;
+    }
+
+    int tileCount(const QSize& rSize, int tileSize) {
+        return tileCols(rSize, tileSize) * ((rSize.height() + tileSize - 1) / tileSize);
+    }
+
+    QRect tileRect(const QSize& rSize, int tileSize, int idx)
+    {
+        int cols = tileCols(rSize, tileSize);
+        int x = (idx % cols) * tileSize;
+        int y = (idx / cols) * tileSize;
+        return QRect(x, y, std::min(tileSize, rSize.width() - x), std::min(tileSize, rSize.height() - y));
+    }
+
+    bool tileEqual(const QImage& rA, const QImage& rB, const QRect& rRect)
+    {
+        const int offset = rRect.x() * PIXEL_BYTES;
+        const int rowBytes = rRect.width() * PIXEL_BYTES;
+        for (int y = rRect.top(); y <= rRect.bottom(); y++)
+        {
+            if (std::memcmp(rA.constScanLine(y) + offset, rB.constScanLine(y) + offset, rowBytes))
+                return false;
+        }
+        return true;
+    }
+
+    QByteArray encodeTile(const QImage& rFrame, const QRect& rRect)
+    {
+        const int offset = rRect.x() * PIXEL_BYTES;
+        const int rowBytes = rRect.width() * PIXEL_BYTES;
+        QByteArray raw(rowBytes * rRect.height(), Qt::Uninitialized);
+        for (int y = 0; y < rRect.height(); y++)
+            std::memcpy(raw.data() + y * rowBytes, rFrame.constScanLine(rRect.y() + y) + offset, rowBytes);
+        return qCompress(raw, COMPRESSION);
+    }
+
+    bool decodeTile(const uchar* pData, int bytes, const QRect& rRect, QImage* pOutFrame)
+    {
+        const int rowBytes = rRect.width() * PIXEL_BYTES;
+        QByteArray raw = qUncompress(pData, bytes);
+        if (raw.size() != rowBytes * rRect.height())
+            return false;  // corrupt
+        for (int y = 0; y < rRect.height(); y++)
+            std::memcpy(pOutFrame->scanLine(rRect.y() + y) + rRect.x() * PIXEL_BYTES, raw.constData() + y * rowBytes, rowBytes);
+        return true;
+    }
+}
+
+
+#pragma region History
+CFrameHistory::tile_t::tile_t(const QByteArray& rData, std::atomic<qint64>* pUsedBytes) :
+    data(rData),
+    pUsed(pUsedBytes)
+{
+    *pUsed += sizeof(tile_t) + data.size();
+}
+
+
+CFrameHistory::tile_t::~tile_t()
+{
+    *pUsed -= sizeof(tile_t) + data.size();
+}
+
+
+CFrameHistory::CFrameHistory(qint64 maxBytes, int tileSize) :
+    mpLock(nullptr),
+    mUsed(0),
+    mMaxBytes(maxBytes),
+    mTileSize(std::max(tileSize, 8)),
+    mNextSeq(1)
+{
+    mpLock = new QMutex();
+}
+
+
+CFrameHistory::~CFrameHistory()
+{
+    mFrames.clear();  // tiles release into mUsed
+    DEL_PTR_(mpLock);
+}
+
+
+qint64 CFrameHistory::frameBytes(const frame_t& rFrame)
+{
+    return sizeof(frame_t) + rFrame.tiles.capacity() * sizeof(tilePtr_t);
+}
+
+
+void CFrameHistory::evict()
+{// Lock held, the newest frame stays unless nothing is kept at all
+    const qint64 maxBytes = mMaxBytes.load();
+    while (!mFrames.empty()
+        && (mUsed.load() > maxBytes)
+        && ((mFrames.size() > 1) || (maxBytes <= 0)))
+    {
+        mUsed -= frameBytes(mFrames.front());
+        mFrames.pop_front();  // its own tiles go with it
+    }
+}
+
+
+quint64 CFrameHistory::append(const QImage& rFrame, qint64 timeMs)
+{
+    if (rFrame.isNull() || (mMaxBytes.load() <= 0))
+        return 0;
+
+    TRACE_("history");
+    QImage frame = (rFrame.format() == QImage::Format_RGB32) ? rFrame : rFrame.convertToFormat(QImage::Format_RGB32);
+    std::vector<tilePtr_t> prevTiles;
+    {
+        QMutexLocker guard(mpLock);
+        if (!mFrames.empty() && (mFrames.back().info.size == frame.size()))
+            prevTiles = mFrames.back().tiles;  // mLastFrame holds its pixels
+    }
+
+    // Compared and compressed without the lock, readers are not blocked
+    frame_t entry;
+    const int count = tileCount(frame.size(), mTileSize);
+    const bool comparable = (static_cast<int>(prevTiles.size()) == count);
+    bool shared = false;
+    entry.tiles.reserve(count);
+    for (int i = 0; i < count; i++)
+    {
+        QRect rect = tileRect(frame.size(), mTileSize, i);
+        if (comparable && tileEqual(frame, mLastFrame, rect))
+        {
+            entry.tiles.push_back(prevTiles[i]);
+            shared = true;
+        } else {
+            entry.tiles.push_back(std::make_shared<const tile_t>(encodeTile(frame, rect), &mUsed));
+        }
+    }
+    entry.info.size = frame.size();
+    entry.info.keyframe = !shared;
+    mLastFrame = frame;  // shallow, detaches if the caller draws on it
+
+    QMutexLocker guard(mpLock);
+    entry.info.seq = mNextSeq++;
+    entry.info.timeMs = mFrames.empty() ? timeMs : std::max(timeMs, mFrames.back().info.timeMs);
+    mUsed += frameBytes(entry);
+    mFrames.push_back(std::move(entry));
+    evict();
+    return mFrames.back().info.seq;
+}
+
+
+void CFrameHistory::setMaxBytes(qint64 maxBytes)
+{
+    QMutexLocker guard(mpLock);
+    mMaxBytes = maxBytes;
+    evict();
+}
+
+
+void CFrameHistory::clear()
+{
+    QMutexLocker guard(mpLock);
+    for (const frame_t& rFrame : mFrames)
+        mUsed -= frameBytes(rFrame);
+    mFrames.clear();
+}
+
+
+bool CFrameHistory::decode(const frame_t& rFrame, QImage* pOutFrame) const
+{
+    if (!pOutFrame)
+        return true;
+
+    QImage img(rFrame.info.size, QImage::Format_RGB32);
+    for (int i = 0; i < static_cast<int>(rFrame.tiles.size()); i++)
+    {
+        const QByteArray& rData = rFrame.tiles[i]->data;
+        if (!decodeTile(reinterpret_cast<const uchar*>(rData.constData()), rData.size(),
+            tileRect(rFrame.info.size, mTileSize, i), &img))
+        {
+            return false;
+        }
+    }
+    pOutFrame->swap(img);
+    return true;
+}
+
+
+bool CFrameHistory::frameBySeq(quint64 seq, QImage* pOutFrame, frameInfo_t* pOutInfo)
+{
+    frame_t frame;
+    {// Copy shares the tiles, decoded without the lock
+        QMutexLocker guard(mpLock);
+        if (mFrames.empty() || (seq < mFrames.front().info.seq) || (seq > mFrames.back().info.seq))
+            return false;
+        frame = mFrames[seq - mFrames.front().info.seq];  // sequence numbers have no gaps
+    }
+    if (pOutInfo)
+        *pOutInfo = frame.info;
+    return decode(frame, pOutFrame);
+}
+
+
+bool CFrameHistory::frameAt(qint64 timeMs, QImage* pOutFrame, frameInfo_t* pOutInfo)
+{
+    frame_t frame;
+    {
+        QMutexLocker guard(mpLock);
+        auto after = std::upper_bound(mFrames.cbegin(), mFrames.cend(), timeMs,
+            [](qint64 t, const frame_t& rFrame) { return t < rFrame.info.timeMs; });
+        if (after == mFrames.cbegin())
+            return false;
+        frame = *(after - 1);
+    }
+    if (pOutInfo)
+        *pOutInfo = frame.info;
+    return decode(frame, pOutFrame);
+}
+
+
+QVector<CFrameHistory::frameInfo_t> CFrameHistory::index()
+{
+    QMutexLocker guard(mpLock);
+    QVector<frameInfo_t> infos;
+    infos.reserve(static_cast<int>(mFrames.size()));
+    for (const frame_t& rFrame : mFrames)
+        infos.append(rFrame.info);
+    return infos;
+}
+
+
+bool CFrameHistory::save(const QString& rPath)
+{
+    std::deque<frame_t> frames;
+    {// Shares the tiles, capture goes on while writing
+        QMutexLocker guard(mpLock);
+        frames = mFrames;
+    }
+
+    std::vector<frameEntry_t> frameTable;
+    std::vector<tileEntry_t> tileTable;
+    std::vector<const tile_t*> tiles;
+    std::vector<quint32> refs;
+    std::unordered_map<const tile_t*, quint32> tileIds;
+    frameTable.reserve(frames.size());
+    for (const frame_t& rFrame : frames)
+    {
+        frameEntry_t entry = {};
+        entry.seq = rFrame.info.seq;
+        entry.timeMs = rFrame.info.timeMs;
+        entry.width = rFrame.info.size.width();
+        entry.height = rFrame.info.size.height();
+        entry.firstRef = static_cast<quint32>(refs.size());
+        entry.keyframe = rFrame.info.keyframe;
+        frameTable.push_back(entry);
+        for (const tilePtr_t& rTile : rFrame.tiles)
+        {
+            auto found = tileIds.emplace(rTile.get(), static_cast<quint32>(tiles.size()));
+            if (found.second)
+                tiles.push_back(rTile.get());  // written once
+            refs.push_back(found.first->second);
+        }
+    }
+
+    header_t header = {};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.tileSize = mTileSize;
+    header.frameCount = static_cast<quint32>(frameTable.size());
+    header.tileCount = static_cast<quint32>(tiles.size());
+    header.frames = sizeof(header_t);
+    header.tiles = header.frames + frameTable.size() * sizeof(frameEntry_t);
+    header.refs = header.tiles + tiles.size() * sizeof(tileEntry_t);
+    header.refCount = static_cast<quint32>(refs.size());
+    qint64 offset = alignUp(header.refs + refs.size() * sizeof(quint32), ALIGN);
+    const qint64 padding = offset - (header.refs + refs.size() * sizeof(quint32));
+    for (const tile_t* pTile : tiles)
+    {
+        tileTable.push_back(tileEntry_t{ static_cast<quint64>(offset), static_cast<quint32>(pTile->data.size()), 0 });
+        offset += pTile->data.size();
+    }
+    header.fileBytes = offset;
+
+    QSaveFile out(rPath);  // replaced on commit, a reader never sees half a history
+    if (!out.open(QIODevice::WriteOnly))
+        return false;
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(frameTable.data()), frameTable.size() * sizeof(frameEntry_t));
+    out.write(reinterpret_cast<const char*>(tileTable.data()), tileTable.size() * sizeof(tileEntry_t));
+    out.write(reinterpret_cast<const char*>(refs.data()), refs.size() * sizeof(quint32));
+    out.write(QByteArray(padding, '\0'));
+    for (const tile_t* pTile : tiles)
+        out.write(pTile->data);
+    if (!out.commit())
+    {
+        qWarning("Frame history could not be written.");
+        return false;
+    }
+    return true;
+}
+#pragma endregion
+
+
+#pragma region Reader
+CFrameHistoryReader::CFrameHistoryReader() :
+    mpFile(nullptr),
+    mpData(nullptr),
+    mBytes(0),
+    mTileSize(CFrameHistory::TILE_SIZE),
+    mpRefs(nullptr),
+    mRefCount(0),
+    mpTiles(nullptr),
+    mTileCount(0),
+    mNext(0)
+{
+}
+
+
+CFrameHistoryReader::~CFrameHistoryReader()
+{
+    close();
+}
+
+
+void CFrameHistoryReader::close()
+{
+    if (mpFile && mpData)
+        mpFile->unmap(const_cast<uchar*>(mpData));
+    DEL_PTR_(mpFile);
+    mpFile = nullptr;
+    mpData = nullptr;
+    mBytes = 0;
+    mInfos.clear();
+    mFirstRef.clear();
+    mpRefs = nullptr;
+    mRefCount = 0;
+    mpTiles = nullptr;
+    mTileCount = 0;
+    mNext = 0;
+}
+
+
+bool CFrameHistoryReader::open(const QString& rPath)
+{
+    close();
+    mpFile = new QFile(rPath);
+    if (!mpFile->open(QIODevice::ReadOnly))
+        return false;
+    mBytes = mpFile->size();
+    if (mBytes < static_cast<qint64>(sizeof(header_t)))
+        return false;
+    mpData = mpFile->map(0, mBytes);
+    if (!mpData)
+        return false;
+
+    header_t header;
+    std::memcpy(&header, mpData, sizeof(header));
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC))
+        || (header.version != VERSION)
+        || (header.fileBytes != static_cast<quint64>(mBytes))
+        || (header.tileSize < 8) || (header.tileSize > MAX_SIDE)
+        // Tables follow the header in this order, compared without overflow
+        || (header.frames < sizeof(header_t))
+        || (header.frames > header.tiles) || (header.tiles > header.refs) || (header.refs > header.fileBytes)
+        || (static_cast<quint64>(header.frameCount) * sizeof(frameEntry_t) > header.tiles - header.frames)
+        || (static_cast<quint64>(header.tileCount) * sizeof(tileEntry_t) > header.refs - header.tiles)
+        || (static_cast<quint64>(header.refCount) * sizeof(quint32) > header.fileBytes - header.refs)
+        || (header.refs % sizeof(quint32)))
+    {
+        qWarning("Invalid frame history.");
+        close();
+        return false;
+    }
+    mTileSize = header.tileSize;
+    mpTiles = mpData + header.tiles;
+    mTileCount = header.tileCount;
+    mpRefs = reinterpret_cast<const quint32*>(mpData + header.refs);
+    mRefCount = header.refCount;
+
+    for (quint32 i = 0; i < header.frameCount; i++)
+    {
+        frameEntry_t entry;
+        std::memcpy(&entry, mpData + header.frames + i * sizeof(frameEntry_t), sizeof(entry));
+        QSize size(entry.width, entry.height);
+        if ((entry.width > MAX_SIDE) || (entry.height > MAX_SIDE) || size.isEmpty() || (static_cast<quint64>(entry.firstRef) + tileCount(size, mTileSize) > mRefCount))
+        {
+            qWarning("Corrupt frame history entry skipped.");
+            continue;
+        }
+        mInfos.append(CFrameHistory::frameInfo_t{ entry.seq, entry.timeMs, size, entry.keyframe != 0 });
+        mFirstRef.append(entry.firstRef);
+    }
+    return true;
+}
+
+
+int CFrameHistoryReader::indexAt(qint64 timeMs) const
+{
+    auto after = std::upper_bound(mInfos.cbegin(), mInfos.cend(), timeMs,
+        [](qint64 t, const CFrameHistory::frameInfo_t& rInfo) { return t < rInfo.timeMs; });
+    return static_cast<int>(after - mInfos.cbegin()) - 1;
+}
+
+
+bool CFrameHistoryReader::read(int idx, QImage* pOutFrame)
+{
+    if (!mpData || (idx < 0) || (idx >= mInfos.count()) || !pOutFrame)
+        return false;
+
+    const QSize size = mInfos[idx].size;
+    QImage img(size, QImage::Format_RGB32);
+    const int count = tileCount(size, mTileSize);
+    for (int i = 0; i < count; i++)
+    {
+        quint32 ref = mpRefs[mFirstRef[idx] + i];
+        if (ref >= mTileCount)
+            return false;
+        tileEntry_t tile;
+        std::memcpy(&tile, mpTiles + ref * sizeof(tileEntry_t), sizeof(tile));
+        if ((tile.offset > static_cast<quint64>(mBytes))
+            || (tile.bytes > static_cast<quint64>(mBytes) - tile.offset)
+            || !decodeTile(mpData + tile.offset, tile.bytes, tileRect(size, mTileSize, i), &img))
+        {
+            return false;
+        }
+    }
+    pOutFrame->swap(img);
+    return true;
+}
+
+
+bool CFrameHistoryReader::next(QImage* pOutFrame, CFrameHistory::frameInfo_t* pOutInfo)
+{
+    while (mNext < mInfos.count())
+    {
+        int idx = mNext++;
+        if (read(idx, pOutFrame))
+        {
+            if (pOutInfo)
+                *pOutInfo = mInfos[idx];
+            return true;
+        }
+        qWarning("Corrupt frame in history skipped.");
+    }
+    return false;
+}
+#pragma endregion
@@ -0,0 +1,116 @@
+#pragma once
+
+class QMutex;
+class QFile;
+class QString;
+
+
+#include <QImage>
+#include <QSize>
+#include <QVector>
+#include <QtGlobal>
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <vector>
+
+
+// Recent frames of a capture for replay and post-mortem analysis.
+// Frames are split into tiles compressed one by one. A tile equal to the one
+// at the same place in the previous frame is shared by reference, so a mostly
+// static screen costs its changed tiles only. A keyframe is a frame sharing
+// no tile, e.g. the first one or after a resize. The oldest frames are
+// dropped once the memory cap is reached, a shared tile lives as long as
+// the newest frame using it.
+class CFrameHistory
+{
+public:
+    static const int TILE_SIZE = 64;
+
+    struct frameInfo_t {
+        quint64 seq;      // increases by one per appended frame
+        qint64 timeMs;    // ms since epoch, not decreasing
+        QSize size;
+        bool keyframe;
+    };
+
+private:
+    struct tile_t {
+        QByteArray data;              // qCompress of the RGB32 rows
+        std::atomic<qint64>* pUsed;   // of the history, released with the tile
+        tile_t(const QByteArray& rData, std::atomic<qint64>* pUsedBytes);
+        ~tile_t();
+    };
+    using tilePtr_t = std::shared_ptr<const tile_t>;
+
+    struct frame_t {
+        frameInfo_t info;
+        std::vector<tilePtr_t> tiles;  // row major
+    };
+
+    QMutex* mpLock;
+    std::deque<frame_t> mFrames;
+    std::atomic<qint64> mUsed;     // tiles and frame tables
+    std::atomic<qint64> mMaxBytes;
+    const int mTileSize;
+    quint64 mNextSeq;
+    QImage mLastFrame;             // pixels of the newest frame, append() only, not capped
+
+    static qint64 frameBytes(const frame_t& rFrame);
+    void evict();
+    bool decode(const frame_t& rFrame, QImage* pOutFrame) const;
+
+public:
+    // maxBytes 0 keeps nothing
+    explicit CFrameHistory(qint64 maxBytes, int tileSize=TILE_SIZE);
+    ~CFrameHistory();
+
+    // From one thread at a time, a low priority worker of the monitor. Returns the sequence number.
+    quint64 append(const QImage& rFrame, qint64 timeMs);
+    void setMaxBytes(qint64 maxBytes);
+    void clear();
+
+    bool frameBySeq(quint64 seq, QImage* pOutFrame, frameInfo_t* pOutInfo=nullptr);
+    // Latest frame at or before timeMs
+    bool frameAt(qint64 timeMs, QImage* pOutFrame, frameInfo_t* pOutInfo=nullptr);
+    QVector<frameInfo_t> index();
+    qint64 bytesUsed() const { return mUsed.load(); }
+
+    // Shared tiles are written once, CFrameHistoryReader replays the file
+    bool save(const QString& rPath);
+};
+
+
+// Replay source of a saved history, the file is memory mapped read-only
+class CFrameHistoryReader
+{
+    QFile* mpFile;
+    const uchar* mpData;
+    qint64 mBytes;
+    int mTileSize;
+    QVector<CFrameHistory::frameInfo_t> mInfos;
+    const quint32* mpRefs;       // tile indices of all frames
+    quint32 mRefCount;
+    QVector<quint32> mFirstRef;  // per frame
+    const uchar* mpTiles;        // tile table
+    quint32 mTileCount;
+    int mNext;
+
+public:
+    CFrameHistoryReader();
+    ~CFrameHistoryReader();
+
+    bool open(const QString& rPath);
+    void close();
+
+    int count() const { return mInfos.count(); }
+    CFrameHistory::frameInfo_t info(int idx) const { return mInfos.value(idx); }
+    // Index of the latest frame at or before timeMs, -1 if none
+    int indexAt(qint64 timeMs) const;
+    // From several threads at once, unlike next
+    bool read(int idx, QImage* pOutFrame);
+    // Frames in recorded order, false after the last one
+    bool next(QImage* pOutFrame, CFrameHistory::frameInfo_t* pOutInfo=nullptr);
+    void rewind() { mNext = 0; }
+};
@@ -0,0 +1,256 @@
+#include "CFrameRing.h"
+
+#include <QImage>
+#include <QString>
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <new>
+
+#include "Util/util.h"
+#include "Util/winapi.h"
+
+
+namespace {
+    const char MAGIC[8] = { 'S', 'M', 'F', 'R', 'I', 'N', 'G', '\0' };
+    const quint32 VERSION = 1;
+    const int ALIGN = 64;             // headers and pixel rows start on a cache line
+    const int MAX_READ_RETRIES = 4;   // the writer lapped the reader, the next frame is on its way anyway
+
+    // The atomics are lock free, so they work across processes
+    struct header_t {
+        char magic[8];                // written last, a reader sees a complete header
+        quint32 version;
+        quint32 slotCount;
+        quint64 slotBytes;            // slot header and pixels
+        quint64 maxFrameBytes;
+        std::atomic<quint64> latest;  // seq of the newest complete frame, 0 none
+        char reserved[24];
+    };
+
+    struct slot_t {
+        std::atomic<quint32> lock;    // odd while written
+        quint32 format;
+        quint64 seq;
+        qint64 timeMs;
+        quint32 width;
+        quint32 height;
+        quint32 stride;
+        quint32 bytes;
+        char reserved[24];            // pixels follow
+    };
+
+    static_assert(sizeof(header_t) == ALIGN, "Frame ring layout changed");
+    static_assert(sizeof(slot_t) == ALIGN, "Frame ring layout changed");
+
+    quint64 alignUp(quint64 val, quint64 align) {
+        return (val + align - 1) & ~(align - 1);
+    }
+}
+
+
+CFrameRing::CFrameRing() :
+    mpMem(nullptr),
+    mWriter(false),
+    mNextSeq(1),
+    mSlotCount(0),
+    mSlotBytes(0),
+    mMaxFrameBytes(0)
+{
+    mpMem = new WinOS::sharedMemory_t{ nullptr, 0, nullptr };
+}
+
+
+CFrameRing::~CFrameRing()
+{
+    close();
+    DEL_PTR_(mpMem);
+}
+
+
+bool CFrameRing::create(const QString& rName, int slots, qint64 maxFrameBytes)
+{
+    close();
+    if ((slots < 1) || (maxFrameBytes <= 0) || (static_cast<quint64>(maxFrameBytes) > (~0ull >> 1) / static_cast<quint64>(slots)))
+        return false;
+    const quint64 slotBytes = alignUp(sizeof(slot_t) + static_cast<quint64>(maxFrameBytes), ALIGN);
+    mName = rName.toUtf8();
+    // Pages of unused slot space are never touched and cost no memory
+    if (!WinOS::openSharedMemory(mName.constData(), sizeof(header_t) + slots * slotBytes, true, mpMem))
+        return false;
+    mWriter = true;
+    mNextSeq = 1;
+    mSlotCount = static_cast<quint32>(slots);
+    mSlotBytes = slotBytes;
+    mMaxFrameBytes = static_cast<quint64>(maxFrameBytes);
+
+    header_t* pHeader = static_cast<header_t*>(mpMem->pView);
+    pHeader->version = VERSION;
+    pHeader->slotCount = static_cast<quint32>(slots);
+    pHeader->slotBytes = slotBytes;
+    pHeader->maxFrameBytes = static_cast<quint64>(maxFrameBytes);
+    pHeader->latest.store(0, std::memory_order_relaxed);
+    for (int i = 0; i < slots; i++)
+        new (slotAt(i)) slot_t();  // counters at 0
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(pHeader->magic, MAGIC, sizeof(MAGIC));
+    return true;
+}
+
+
+bool CFrameRing::open(const QString& rName)
+{
+    close();
+    mName = rName.toUtf8();
+    if (!WinOS::openSharedMemory(mName.constData(), 0, false, mpMem))
+        return false;
+
+    const header_t* pHeader = static_cast<const header_t*>(mpMem->pView);
+    bool valid = (mpMem->bytes >= sizeof(header_t))
+        && !std::memcmp(pHeader->magic, MAGIC, sizeof(MAGIC));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (valid)
+    {// Copied once, slots fit the mapping and a frame fits its slot. Compared without overflow.
+        mSlotCount = pHeader->slotCount;
+        mSlotBytes = pHeader->slotBytes;
+        mMaxFrameBytes = pHeader->maxFrameBytes;
+        valid = (pHeader->version == VERSION)
+            && (mSlotCount > 0)
+            && (mSlotBytes >= sizeof(slot_t))
+            && (mMaxFrameBytes <= mSlotBytes - sizeof(slot_t))
+            && ((mpMem->bytes - sizeof(header_t)) / mSlotBytes >= mSlotCount);
+    }
+    if (!valid)
+    {// Not created yet, by another version or corrupt
+        close();
+        return false;
+    }
+    return true;
+}
+
+
+void CFrameRing::close()
+{
+    if (mpMem && mpMem->pView)
+        WinOS::closeSharedMemory(mpMem, mWriter ? mName.constData() : nullptr);
+    mWriter = false;
+    mSlotCount = 0;
+    mSlotBytes = 0;
+    mMaxFrameBytes = 0;
+}
+
+
+bool CFrameRing::isOpen() const
+{
+    return mpMem && mpMem->pView;
+}
+
+
+uchar* CFrameRing::slotAt(int idx) const
+{
+    return static_cast<uchar*>(mpMem->pView) + sizeof(header_t) + idx * mSlotBytes;
+}
+
+
+bool CFrameRing::publish(const QImage& rFrame, qint64 timeMs)
+{
+    if (!mWriter || rFrame.isNull())
+        return false;
+    header_t* pHeader = static_cast<header_t*>(mpMem->pView);
+    const quint64 bytes = static_cast<quint64>(rFrame.bytesPerLine()) * rFrame.height();
+    if (bytes > mMaxFrameBytes)
+        return false;
+
+    const quint64 seq = mNextSeq++;
+    slot_t* pSlot = reinterpret_cast<slot_t*>(slotAt(static_cast<int>(seq % mSlotCount)));
+    // Only this thread writes the counter, readers just compare it
+    const quint32 lock = pSlot->lock.load(std::memory_order_relaxed);
+    pSlot->lock.store(lock + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);  // odd before any data
+
+    pSlot->format = static_cast<quint32>(rFrame.format());
+    pSlot->seq = seq;
+    pSlot->timeMs = timeMs;
+    pSlot->width = static_cast<quint32>(rFrame.width());
+    pSlot->height = static_cast<quint32>(rFrame.height());
+    pSlot->stride = static_cast<quint32>(rFrame.bytesPerLine());
+    pSlot->bytes = static_cast<quint32>(bytes);
+    std::memcpy(reinterpret_cast<uchar*>(pSlot) + sizeof(slot_t), rFrame.constBits(), bytes);
+
+    pSlot->lock.store(lock + 2, std::memory_order_release);
+    pHeader->latest.store(seq, std::memory_order_release);
+    return true;
+}
+
+
+bool CFrameRing::latest(view_t* pOutView) const
+{
+    if (!isOpen() || !pOutView)
+        return false;
+    const header_t* pHeader = static_cast<const header_t*>(mpMem->pView);
+    for (int attempt = 0; attempt < MAX_READ_RETRIES; attempt++)
+    {
+        const quint64 seq = pHeader->latest.load(std::memory_order_acquire);
+        if (!seq)
+            return false;
+        const int idx = static_cast<int>(seq % mSlotCount);
+        const slot_t* pSlot = reinterpret_cast<const slot_t*>(slotAt(idx));
+        const quint32 lock = pSlot->lock.load(std::memory_order_acquire);
+        if (lock & 1)
+            continue;  // lapped, the slot is being rewritten
+        if ((pSlot->stride > (~0u >> 1)) || (static_cast<quint64>(pSlot->stride) * pSlot->height > mMaxFrameBytes))
+            continue;  // torn or corrupt, the pixels would not fit the slot
+
+        view_t view = {
+            reinterpret_cast<const uchar*>(pSlot) + sizeof(slot_t),
+            frameInfo_t{ pSlot->seq, pSlot->timeMs, QSize(pSlot->width, pSlot->height),
+                static_cast<int>(pSlot->stride), static_cast<int>(pSlot->format) },
+            idx,
+            lock
+        };
+        if (isValid(view) && (view.info.seq == seq))
+        {
+            *pOutView = view;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+bool CFrameRing::isValid(const view_t& rView) const
+{
+    if (!isOpen())
+        return false;
+    // Reads of the view complete before the counter is compared
+    std::atomic_thread_fence(std::memory_order_acquire);
+    const slot_t* pSlot = reinterpret_cast<const slot_t*>(slotAt(rView.slot));
+    return pSlot->lock.load(std::memory_order_relaxed) == rView.lock;
+}
+
+
+bool CFrameRing::copyLatest(QImage* pOutFrame, frameInfo_t* pOutInfo) const
+{
+    if (!pOutFrame)
+        return false;
+    for (int attempt = 0; attempt < MAX_READ_RETRIES; attempt++)
+    {
+        view_t view;
+        if (!latest(&view))
+            return false;
+        QImage frame(view.info.size, static_cast<QImage::Format>(view.info.format));
+        if (frame.isNull())
+            return false;
+        const int rowBytes = std::min(frame.bytesPerLine(), view.info.stride);
+        for (int y = 0; y < frame.height(); y++)
+            std::memcpy(frame.scanLine(y), view.pPixels + y * view.info.stride, rowBytes);
+        if (!isValid(view))
+            continue;  // torn, the newer frame is taken instead
+        frame.swap(*pOutFrame);
+        if (pOutInfo)
+            *pOutInfo = view.info;
+        return true;
+    }
+    return false;
+}
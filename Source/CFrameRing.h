@@ -0,0 +1,73 @@
+#pragma once
+
+class QImage;
+class QString;
+namespace WinOS { struct sharedMemory_t; }
+
+
+#include <QByteArray>
+#include <QSize>
+#include <QtGlobal>
+
+
+// Latest frames of a capture in named shared memory, for analyzers in other
+// processes (OCR, recorder) that shall not grab the screen again.
+// A fixed number of slots is written round robin. Every slot is guarded by a
+// seqlock: the writer makes its counter odd, writes, then makes it even again.
+// Readers never lock, they read the pixels in place and retry or drop the
+// frame if the counter changed meanwhile. The capture thread never waits.
+// One writer per name, any number of readers.
+class CFrameRing
+{
+public:
+    static const int DEFAULT_SLOTS = 3;  // a slow reader still finds its frame while the next one is written
+
+    struct frameInfo_t {
+        quint64 seq;      // increases by one per published frame, from 1
+        qint64 timeMs;    // ms since epoch
+        QSize size;
+        int stride;       // bytes per line
+        int format;       // QImage::Format
+    };
+
+    // A frame read in place, see isValid
+    struct view_t {
+        const uchar* pPixels;
+        frameInfo_t info;
+        int slot;
+        quint32 lock;     // counter of the slot when the view was taken
+    };
+
+private:
+    WinOS::sharedMemory_t* mpMem;
+    QByteArray mName;
+    bool mWriter;
+    quint64 mNextSeq;
+    // Layout checked once when mapped, the shared header is not trusted afterwards
+    quint32 mSlotCount;
+    quint64 mSlotBytes;
+    quint64 mMaxFrameBytes;
+
+    uchar* slotAt(int idx) const;
+
+public:
+    CFrameRing();
+    ~CFrameRing();
+
+    // Writer: creates the ring, replacing a stale one of that name
+    bool create(const QString& rName, int slots, qint64 maxFrameBytes);
+    // Frames bigger than maxFrameBytes are skipped
+    bool publish(const QImage& rFrame, qint64 timeMs);
+
+    // Reader
+    bool open(const QString& rName);
+    // Newest complete frame without copy, false if none yet
+    bool latest(view_t* pOutView) const;
+    // Call after using the pixels of a view, false if the writer reused the slot meanwhile
+    bool isValid(const view_t& rView) const;
+    // Newest frame as a deep copy, for readers slower than the capture period
+    bool copyLatest(QImage* pOutFrame, frameInfo_t* pOutInfo=nullptr) const;
+
+    void close();
+    bool isOpen() const;
+};
@@ -0,0 +1,258 @@
+#include "CMatchCache.h"
+
+#include <QImage>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QRect>
+
+#include <algorithm>
+#include <cstring>
+
+#include "Util/util.h"
+#include "Util/metrics.h"
+#include "Util/trace.h"
+
+
+namespace {
+    const int BLOCK = 32;           // pixels per block side
+    const int FRAME_GRIDS = 4;      // block hashes kept of the latest frames, held frames not counted
+    const quint64 SEED = 0xCBF29CE484222325ull;
+    const quint64 PRIME = 0x100000001B3ull;
+    // Two RGB32 pixels, alpha and the lowest 2 bits of each channel are ignored
+    const quint64 NOISE_MASK = 0x00FCFCFC00FCFCFCull;
+    // List and index node overhead of an entry, roughly
+    const qint64 NODE_BYTES = 6 * sizeof(void*);
+
+    inline quint64 fmix(quint64 h)
+    {// Murmur3 finalizer
+        h ^= h >> 33;
+        h *= 0xFF51AFD7ED558CCDull;
+        h ^= h >> 33;
+        h *= 0xC4CEB9FE1A85EC53ull;
+        return h ^ (h >> 33);
+    }
+}
+
+
+size_t CMatchCache::keyHash_t::operator()(const key_t& rKey) const
+{
+    return static_cast<size_t>(fmix(rKey.region ^ fmix(static_cast<quint64>(rKey.patternKey) + rKey.variant)));
+}
+
+
+CMatchCache::CMatchCache(qint64 maxBytes) :
+    mpLock(nullptr),
+    mStats(),
+    mMaxBytes(maxBytes)
+{
+    mpLock = new QMutex();
+}
+
+
+CMatchCache::~CMatchCache()
+{
+    DEL_PTR_(mpLock);
+}
+
+
+CMatchCache::grid_t CMatchCache::hashBlocks(const QImage& rFrame)
+{
+    grid_t grid;
+    grid.frameKey = rFrame.cacheKey();
+    grid.size = rFrame.size();
+    grid.cols = 0;
+    grid.holds = 0;
+    if (rFrame.isNull() || (rFrame.depth() != 32))
+        return grid;
+
+    TRACE_("blockHash");
+    const int w = rFrame.width();
+    const int h = rFrame.height();
+    grid.cols = (w + BLOCK - 1) / BLOCK;
+    grid.blocks.assign(grid.cols * ((h + BLOCK - 1) / BLOCK), SEED);
+    for (int y = 0; y < h; y++)
+    {// Row by row, the block hashes continue over the rows of their block
+        const uchar* pRow = rFrame.constScanLine(y);
+        quint64* pBlocks = grid.blocks.data() + (y / BLOCK) * grid.cols;
+        for (int bx = 0; bx < grid.cols; bx++)
+        {
+            const int end = std::min(w, (bx + 1) * BLOCK);
+            // Two independent chains, the multiplications overlap
+            quint64 even = pBlocks[bx];
+            quint64 odd = SEED;
+            int x = bx * BLOCK;
+            for (; x + 3 < end; x += 4)
+            {
+                quint64 pixels[2];
+                std::memcpy(pixels, pRow + (x << 2), sizeof(pixels));
+                even = (even ^ (pixels[0] & NOISE_MASK)) * PRIME;
+                odd = (odd ^ (pixels[1] & NOISE_MASK)) * PRIME;
+            }
+            for (; x < end; x++)
+            {
+                quint32 pixel;
+                std::memcpy(&pixel, pRow + (x << 2), sizeof(pixel));
+                even = (even ^ (pixel & NOISE_MASK)) * PRIME;
+            }
+            pBlocks[bx] = (even ^ (odd >> 7) ^ (odd << 23)) * PRIME;
+        }
+    }
+    return grid;
+}
+
+
+quint64 CMatchCache::regionHash(const QImage& rFrame, const QRect& rRegion)
+{
+    const QRect region = rRegion & rFrame.rect();
+    if (region.isEmpty() || (rFrame.depth() != 32))
+        return 0;
+
+    QMutexLocker guard(mpLock);
+    const grid_t* pGrid = acquireGrid(rFrame);
+
+    // Every block touching the region, the position and size belong to the key
+    quint64 hash = fmix(SEED ^ (static_cast<quint64>(region.x()) << 48) ^ (static_cast<quint64>(region.y()) << 32)
+        ^ (static_cast<quint64>(region.width()) << 16) ^ static_cast<quint64>(region.height()));
+    for (int by = region.top() / BLOCK; by <= region.bottom() / BLOCK; by++)
+    {
+        const quint64* pBlocks = pGrid->blocks.data() + by * pGrid->cols;
+        for (int bx = region.left() / BLOCK; bx <= region.right() / BLOCK; bx++)
+            hash = fmix(hash ^ pBlocks[bx]);
+    }
+    return hash ? hash : 1;  // 0 is invalid
+}
+
+
+CMatchCache::grid_t* CMatchCache::findGrid(const QImage& rFrame)
+{// Lock held
+    for (grid_t& rGrid : mGrids)
+    {
+        if ((rGrid.frameKey == rFrame.cacheKey()) && (rGrid.size == rFrame.size()))
+            return &rGrid;
+    }
+    return nullptr;
+}
+
+
+CMatchCache::grid_t* CMatchCache::acquireGrid(const QImage& rFrame)
+{// Lock held
+    grid_t* pGrid = findGrid(rFrame);
+    if (pGrid)
+        return pGrid;
+    // Hashed without the lock, all searches of the frame use it
+    mpLock->unlock();
+    grid_t grid = hashBlocks(rFrame);
+    mpLock->lock();
+    pGrid = findGrid(rFrame);  // another search may have been faster
+    if (pGrid)
+        return pGrid;
+    mGrids.push_front(std::move(grid));
+    dropGrids();
+    return &mGrids.front();
+}
+
+
+void CMatchCache::dropGrids()
+{// Lock held, the oldest grids beyond FRAME_GRIDS that nobody holds
+    int kept = 0;
+    for (auto it = mGrids.begin(); it != mGrids.end();)
+    {
+        if (!it->holds && (++kept > FRAME_GRIDS))
+            it = mGrids.erase(it);
+        else
+            ++it;
+    }
+}
+
+
+void CMatchCache::holdFrame(const QImage& rFrame)
+{
+    if (rFrame.isNull() || (rFrame.depth() != 32))
+        return;
+    QMutexLocker guard(mpLock);
+    acquireGrid(rFrame)->holds++;
+}
+
+
+void CMatchCache::releaseFrame(const QImage& rFrame)
+{
+    QMutexLocker guard(mpLock);
+    grid_t* pGrid = findGrid(rFrame);
+    if (pGrid && (pGrid->holds > 0))
+    {
+        pGrid->holds--;
+        dropGrids();
+    }
+}
+
+
+bool CMatchCache::lookup(qint64 patternKey, int variant, quint64 region, result_t* pOutResult)
+{
+    QMutexLocker guard(mpLock);
+    auto found = mIndex.find(key_t{ patternKey, variant, region });
+    if (found == mIndex.end())
+    {
+        mStats.misses++;
+        Metrics::add(Metrics::C_CACHE_MISSES);
+        return false;
+    }
+    mLru.splice(mLru.begin(), mLru, found->second);  // most recent
+    if (pOutResult)
+        *pOutResult = found->second->result;
+    mStats.hits++;
+    Metrics::add(Metrics::C_CACHE_HITS);
+    return true;
+}
+
+
+void CMatchCache::store(qint64 patternKey, int variant, quint64 region, const result_t& rResult)
+{
+    const key_t key{ patternKey, variant, region };
+    QMutexLocker guard(mpLock);
+    auto found = mIndex.find(key);
+    if (found != mIndex.end())
+    {
+        found->second->result = rResult;
+        mLru.splice(mLru.begin(), mLru, found->second);
+        return;
+    }
+    mLru.push_front(entry_t{ key, rResult });
+    mIndex.emplace(key, mLru.begin());
+    evict();
+}
+
+
+void CMatchCache::evict()
+{// Lock held
+    qint64 gridBytes = 0;
+    for (const grid_t& rGrid : mGrids)
+        gridBytes += rGrid.blocks.capacity() * sizeof(quint64);
+    const qint64 entryBytes = sizeof(entry_t) + NODE_BYTES;
+    while (!mLru.empty() && (gridBytes + static_cast<qint64>(mLru.size()) * entryBytes > mMaxBytes))
+    {
+        mIndex.erase(mLru.back().key);
+        mLru.pop_back();
+        mStats.evictions++;
+    }
+}
+
+
+void CMatchCache::clear()
+{
+    QMutexLocker guard(mpLock);
+    mIndex.clear();
+    mLru.clear();
+    mGrids.clear();
+}
+
+
+CMatchCache::stats_t CMatchCache::getStats()
+{
+    QMutexLocker guard(mpLock);
+    stats_t stats = mStats;
+    stats.entries = static_cast<int>(mLru.size());
+    stats.bytes = static_cast<qint64>(mLru.size()) * (sizeof(entry_t) + NODE_BYTES);
+    for (const grid_t& rGrid : mGrids)
+        stats.bytes += rGrid.blocks.capacity() * sizeof(quint64);
+    return stats;
+}
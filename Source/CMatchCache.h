@@ -0,0 +1,92 @@
+#pragma once
+
+class QMutex;
+class QImage;
+class QRect;
+
+
+#include <QPoint>
+#include <QSize>
+#include <QtGlobal>
+
+#include <deque>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+
+// Search results by pattern and content of the searched region.
+// The region is hashed from 32x32 pixel blocks, the low bits of the color
+// channels are ignored so that slight noise still hits. The block hashes
+// of a frame are computed once and reused by all searches in it. Those of the
+// latest frames are kept, a held frame keeps them until it is released.
+// Least recently used results are dropped beyond the memory cap.
+class CMatchCache
+{
+public:
+    struct stats_t {
+        quint64 hits;
+        quint64 misses;
+        quint64 evictions;
+        int entries;
+        qint64 bytes;
+    };
+
+    struct result_t {
+        bool found;
+        QPoint pos;
+        float scale;
+    };
+
+private:
+    struct key_t {
+        qint64 patternKey;  // QImage::cacheKey of the pattern, changes with its pixels
+        int variant;        // search mode
+        quint64 region;
+
+        bool operator==(const key_t& rOther) const {
+            return (patternKey == rOther.patternKey) && (variant == rOther.variant) && (region == rOther.region);
+        }
+    };
+    struct keyHash_t {
+        size_t operator()(const key_t& rKey) const;
+    };
+    struct entry_t {
+        key_t key;
+        result_t result;
+    };
+    struct grid_t {
+        qint64 frameKey;    // QImage::cacheKey of the frame
+        QSize size;
+        int cols;
+        std::vector<quint64> blocks;
+        int holds;          // callers still searching the frame
+    };
+
+    QMutex* mpLock;
+    std::list<entry_t> mLru;  // most recent first
+    std::unordered_map<key_t, std::list<entry_t>::iterator, keyHash_t> mIndex;
+    std::deque<grid_t> mGrids;  // of the latest and the held frames
+    stats_t mStats;
+    qint64 mMaxBytes;
+
+    static grid_t hashBlocks(const QImage& rFrame);
+    grid_t* findGrid(const QImage& rFrame);
+    grid_t* acquireGrid(const QImage& rFrame);
+    void dropGrids();
+    void evict();
+
+public:
+    explicit CMatchCache(qint64 maxBytes);
+    ~CMatchCache();
+
+    // Hash of the frame content in rRegion, 0 if the frame is not 32bit/pxl
+    quint64 regionHash(const QImage& rFrame, const QRect& rRegion);
+    // A frame searched for several patterns, with searches of other frames in between
+    void holdFrame(const QImage& rFrame);
+    void releaseFrame(const QImage& rFrame);
+    bool lookup(qint64 patternKey, int variant, quint64 region, result_t* pOutResult);
+    void store(qint64 patternKey, int variant, quint64 region, const result_t& rResult);
+    void clear();
+    stats_t getStats();
+};
@@ -0,0 +1,71 @@
+#include "CMatchTracker.h"
+
+#include <QImage>
+
+#include <utility>
+
+
+CMatchTracker::CMatchTracker() :
+    mShift(0, 0),
+    mOrigin(0, 0),
+    mMoved(false)
+{
+}
+
+
+void CMatchTracker::beginFrame(const QImage& rFrame)
+{
+    std::swap(mPrev, mCur);
+    mShift = QPoint(0, 0);
+    mMoved = false;
+
+    ImProcU8::imgArr2I_t frmSz = { rFrame.width(), rFrame.height() };
+    ImProcU8::Image frame{
+        rFrame.constBits(),
+        rFrame.bytesPerLine(),
+        static_cast<unsigned char>(rFrame.depth() >> 3),
+        frmSz
+    };
+    if (rFrame.isNull() || !ImProcU8::prepareMotionFrame(frame, mCur))
+    {
+        mCur.data.clear();  // the next frame has nothing to compare to
+        return;
+    }
+
+    ImProcU8::imgArr2I_t shift = { 0, 0 };
+    if (ImProcU8::estimateShift(mPrev, mCur, shift))
+    {
+        mShift = QPoint(shift[ImProcU8::COOR_LEFT], shift[ImProcU8::COOR_TOP]);
+        mMoved = !mShift.isNull();
+    }
+    // Without a reliable shift the locations are expected where they were
+    mOrigin += mShift;
+}
+
+
+bool CMatchTracker::predict(patternId_t id, QPoint* pOutPos) const
+{
+    auto found = mLocations.find(id);
+    if (found == mLocations.cend())
+        return false;
+    if (pOutPos)
+        *pOutPos = found->second + mOrigin;
+    return true;
+}
+
+
+void CMatchTracker::update(patternId_t id, bool found, const QPoint& rPos)
+{
+    if (found)
+        mLocations[id] = rPos - mOrigin;  // also right after frames it was not searched in
+    else
+        mLocations.erase(id);
+}
+
+
+void CMatchTracker::clear()
+{
+    mLocations.clear();
+    mPrev.data.clear();
+    mCur.data.clear();
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+class QImage;
+
+
+#include <QPoint>
+
+#include <unordered_map>
+
+#include "CPatternRegistry.h"  // patternId_t
+#include "Util/imgproc.h"      // MotionFrame
+
+
+// Follows the found patterns of one monitor from frame to frame.
+// When the window content scrolls or pans, all locations move by the same
+// offset. It is estimated once per frame, the expected locations then only
+// need a local match to verify them instead of a search in the whole frame.
+// Used by the detection lane of its monitor, one frame at a time, no lock.
+class CMatchTracker
+{
+    ImProcU8::MotionFrame mPrev;
+    ImProcU8::MotionFrame mCur;
+    QPoint mShift;      // of the current frame to the previous one
+    QPoint mOrigin;     // sum of all shifts, locations are stored relative to it
+    std::unordered_map<patternId_t, QPoint> mLocations;
+    bool mMoved;
+
+public:
+    CMatchTracker();
+
+    // Before the searches of a frame
+    void beginFrame(const QImage& rFrame);
+    // Where the pattern should be now, false if it was not found last time
+    bool predict(patternId_t id, QPoint* pOutPos) const;
+    void update(patternId_t id, bool found, const QPoint& rPos);
+    void clear();
+
+    QPoint getShift() const { return mShift; }
+    bool getMoved() const { return mMoved; }  // a shift was detected, not just assumed zero
+};
@@ -0,0 +1,184 @@
+#include "CPatternIndex.h"
+
+#include <QSize>
+
+#include <algorithm>
+#include <map>
+#include <utility>
+
+#include "Util/imgproc.h"
+#include "Util/trace.h"
+
+
+namespace {
+    const float GROUP_SIMILARITY = 0.8f;  // to the first pattern of a group
+    const float THRESHOLD_MARGIN = 0.8f;  // noise and blending lower the prototype score
+    const float MIN_THRESHOLD = 0.3f;     // below it the prototype matches about anything
+    const int EXTRA_CANDIDATES = 2;       // places beyond one per member
+
+    // Image refers to its sizes, rOutSize has to outlive it
+    ImProcU8::Image asImage(const QImage& rImg, ImProcU8::imgArr2I_t& rOutSize)
+    {
+        rOutSize[ImProcU8::D_WIDTH] = rImg.width();
+        rOutSize[ImProcU8::D_HEIGHT] = rImg.height();
+        return ImProcU8::Image{
+            rImg.constBits(),
+            rImg.bytesPerLine(),
+            static_cast<unsigned char>(rImg.depth() >> 3),
+            rOutSize
+        };
+    }
+
+    QImage meanOf(const std::vector<QImage>& rImages)
+    {// Same size, RGB32
+        const int w = rImages.front().width();
+        const int h = rImages.front().height();
+        std::vector<unsigned> sums(static_cast<size_t>(w) * h * 3, 0);
+        for (const QImage& rImg : rImages)
+        {
+            unsigned* pSum = sums.data();
+            for (int y = 0; y < h; y++)
+            {
+                const QRgb* pRow = reinterpret_cast<const QRgb*>(rImg.constScanLine(y));
+                for (int x = 0; x < w; x++, pSum += 3)
+                {
+                    pSum[0] += qRed(pRow[x]);
+                    pSum[1] += qGreen(pRow[x]);
+                    pSum[2] += qBlue(pRow[x]);
+                }
+            }
+        }
+        QImage mean(w, h, QImage::Format_RGB32);
+        const unsigned n = static_cast<unsigned>(rImages.size());
+        const unsigned* pSum = sums.data();
+        for (int y = 0; y < h; y++)
+        {
+            QRgb* pRow = reinterpret_cast<QRgb*>(mean.scanLine(y));
+            for (int x = 0; x < w; x++, pSum += 3)
+                pRow[x] = qRgb((pSum[0] + n / 2) / n, (pSum[1] + n / 2) / n, (pSum[2] + n / 2) / n);
+        }
+        return mean;
+    }
+}
+
+
+std::shared_ptr<const CPatternIndex> CPatternIndex::build(const CPatternRegistry::snapshot_t& rPatterns)
+{
+    TRACE_("buildIndex");
+    struct cluster_t {
+        std::vector<patternId_t> ids;
+        std::vector<QImage> images;
+    };
+    // Only equally sized patterns are compared, a search runs at one size
+    auto sizeOrder = [](const QSize& rA, const QSize& rB) {
+        return (rA.width() != rB.width()) ? (rA.width() < rB.width()) : (rA.height() < rB.height());
+    };
+    std::map<QSize, std::vector<cluster_t>, decltype(sizeOrder)> buckets(sizeOrder);
+
+    for (size_t id = 0; id < rPatterns.patches.size(); id++)
+    {
+        const patch_t* pPatch = rPatterns.patches[id].get();
+        if (!pPatch || pPatch->img.isNull())
+            continue;
+        QImage img = pPatch->img;
+        if (img.format() != QImage::Format_RGB32)
+            img.convertToFormat(QImage::Format_RGB32).swap(img);
+
+        std::vector<cluster_t>& rClusters = buckets[img.size()];
+        cluster_t* pBest = nullptr;
+        float bestScore = GROUP_SIMILARITY;
+        ImProcU8::imgArr2I_t imgSz;
+        ImProcU8::imgArr2I_t leaderSz;
+        for (cluster_t& rCluster : rClusters)
+        {// Leader clustering, single colored patterns stay alone
+            const float score = ImProcU8::patternSimilarity(asImage(rCluster.images.front(), leaderSz), asImage(img, imgSz));
+            if (score >= bestScore)
+            {
+                bestScore = score;
+                pBest = &rCluster;
+            }
+        }
+        if (!pBest)
+        {
+            rClusters.emplace_back();
+            pBest = &rClusters.back();
+        }
+        pBest->ids.push_back(static_cast<patternId_t>(id));
+        pBest->images.push_back(img);
+    }
+
+    std::shared_ptr<CPatternIndex> index(new CPatternIndex());
+    index->mVersion = rPatterns.version;
+    for (auto& rBucket : buckets)
+    {
+        for (cluster_t& rCluster : rBucket.second)
+        {
+            if (rCluster.ids.size() < 2)
+                continue;  // nothing to save
+
+            group_t group{ meanOf(rCluster.images), std::move(rCluster.ids), 1.f };
+            ImProcU8::imgArr2I_t protoSz;
+            ImProcU8::imgArr2I_t imgSz;
+            for (const QImage& rImg : rCluster.images)
+                group.threshold = std::min(group.threshold, ImProcU8::patternSimilarity(asImage(group.prototype, protoSz), asImage(rImg, imgSz)));
+            group.threshold *= THRESHOLD_MARGIN;
+            if (group.threshold < MIN_THRESHOLD)
+                continue;  // too different to share a prototype
+
+            const int idx = static_cast<int>(index->mGroups.size());
+            for (patternId_t id : group.members)
+                index->mGroupOf[id] = idx;
+            index->mGroups.push_back(std::move(group));
+        }
+    }
+    return index;
+}
+
+
+int CPatternIndex::groupOf(patternId_t id) const
+{
+    auto found = mGroupOf.find(id);
+    return (found == mGroupOf.cend()) ? -1 : found->second;
+}
+
+
+std::vector<QPoint> CPatternIndex::candidates(int group, const QImage& rFrame, frameMemo_t& rMemo, const QRect* pRoi,
+    ImProcU8::SearchCtrl* pCtrl) const
+{
+    auto found = rMemo.candidates.find(group);
+    if (found != rMemo.candidates.end())
+        return found->second;  // covers every region
+    const QRect area = pRoi ? (*pRoi & rFrame.rect()) : rFrame.rect();
+    std::vector<std::pair<QRect, std::vector<QPoint>>>& rSearched = rMemo.inRegion[group];
+    for (const auto& rDone : rSearched)
+    {
+        if (rDone.first.contains(area))
+            return rDone.second;
+    }
+
+    QImage whole = rFrame;
+    if (whole.format() != QImage::Format_RGB32)
+        whole.convertToFormat(QImage::Format_RGB32).swap(whole);
+    QImage frame = whole;
+    if (area != whole.rect())
+    {// The view shares the frame pixels
+        frame = QImage(whole.constScanLine(area.top()) + area.left() * 4, area.width(), area.height(), whole.bytesPerLine(), whole.format());
+    }
+    const group_t& rGroup = mGroups[group];
+    std::vector<int> xy;
+    ImProcU8::imgArr2I_t frmSz;
+    ImProcU8::imgArr2I_t protoSz;
+    ImProcU8::locateCandidatesIn(asImage(frame, frmSz), asImage(rGroup.prototype, protoSz), rGroup.threshold,
+        static_cast<int>(rGroup.members.size()) + EXTRA_CANDIDATES, xy, pCtrl);
+    std::vector<QPoint> places;
+    for (size_t i = 0; i + 1 < xy.size(); i += 2)
+        places.push_back(QPoint(xy[i], xy[i + 1]) + area.topLeft());
+    if (pCtrl && pCtrl->interrupted)
+        return places;  // a member without deadline searches again
+
+    if (area == rFrame.rect())
+        rMemo.candidates[group] = places;
+    else
+        rSearched.emplace_back(area, places);
+    return places;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+class QImage;
+namespace ImProcU8 { struct SearchCtrl; }
+
+
+#include <QImage>
+#include <QPoint>
+#include <QRect>
+
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "CPatternRegistry.h"  // snapshot_t, patternId_t
+
+
+// Groups similar patterns of the same size under a prototype, the mean of
+// their pixels. A frame is searched once for the prototype, the members are
+// only verified around the places where it scored above the group threshold.
+// With many related patterns (icon families, states of a button) the full
+// searches grow with the number of groups instead of the number of patterns.
+// Built from one registry version and immutable afterwards.
+class CPatternIndex
+{
+public:
+    struct group_t {
+        QImage prototype;                 // RGB32
+        std::vector<patternId_t> members;
+        float threshold;                  // prototype score a present member reaches
+    };
+
+    // Prototype places of one frame, each group is searched on first use
+    struct frameMemo_t {
+        std::unordered_map<int, std::vector<QPoint>> candidates;  // of the whole frame
+        std::unordered_map<int, std::vector<std::pair<QRect, std::vector<QPoint>>>> inRegion;  // few per group
+    };
+
+private:
+    std::vector<group_t> mGroups;
+    std::unordered_map<patternId_t, int> mGroupOf;  // grouped patterns only
+    unsigned long long mVersion;
+
+    CPatternIndex() : mVersion(0) {}
+
+public:
+    static std::shared_ptr<const CPatternIndex> build(const CPatternRegistry::snapshot_t& rPatterns);
+
+    unsigned long long getVersion() const { return mVersion; }  // of the registry
+    int groupCount() const { return static_cast<int>(mGroups.size()); }
+    // -1 for a pattern without similar ones, it is searched on its own
+    int groupOf(patternId_t id) const;
+    const group_t& group(int idx) const { return mGroups[idx]; }
+
+    // Pattern centers where a member may be, best first. Frame shall be RGB32.
+    // With a roi only that part is searched, places outside it may still be returned.
+    // An interrupted search returns no places and is not memorized.
+    std::vector<QPoint> candidates(int group, const QImage& rFrame, frameMemo_t& rMemo, const QRect* pRoi=nullptr,
+        ImProcU8::SearchCtrl* pCtrl=nullptr) const;
+};
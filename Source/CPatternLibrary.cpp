@@ -0,0 +1,416 @@
+#include "CPatternLibrary.h"
+
+#include <QFile>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QByteArray>
+#include <QImage>
+
+#include <cstring>
+
+#include "Util/imgproc.h"
+#include "Util/util.h"
+
+
+namespace {
+    const char MAGIC[8] = { 'S', 'M', 'P', 'L', 'I', 'B', '\0', '\0' };
+    const quint32 VERSION = 2;
+    const int ALIGN = 64;       // of every blob, cache line and SIMD friendly
+    const int ROW_ALIGN = 16;   // of image rows within a blob
+    const int KEY_BYTES = 128;  // utf8, zero terminated
+
+    enum {
+        BLOB_PIXELS = 0,
+        BLOB_GRAY,
+        BLOB_MASK,
+        BLOB_PYRAMID,
+        BLOB_KEYPTS = BLOB_PYRAMID + CPatternLibrary::PYR_LEVELS,
+        BLOB_DESCR,
+        BLOB_COUNT
+    };
+
+    struct blob_t {
+        quint64 offset;  // from file start, 0 if absent
+        quint32 bytes;
+        quint32 stride;  // bytes per row
+        quint32 width;
+        quint32 height;
+    };
+
+    struct entry_t {
+        char key[KEY_BYTES];
+        float fillPerc;
+        qint32 descrBytes;
+        quint64 hash;
+        quint32 pixelFormat;  // QImage::Format
+        quint16 featWidth;    // of the prepared gray pattern
+        quint16 featHeight;
+        qint16 offsetX;       // patch_t::centerOffset
+        qint16 offsetY;
+        quint16 cutWidth;     // patch_t::cutSize
+        quint16 cutHeight;
+        blob_t blobs[BLOB_COUNT];
+    };
+
+    struct header_t {
+        char magic[8];
+        quint32 version;
+        quint32 count;
+        quint64 entries;    // offset of the entry table
+        quint64 fileBytes;
+        char reserved[32];
+    };
+
+    static_assert(sizeof(blob_t) == 24, "Library layout changed");
+    static_assert(sizeof(header_t) == ALIGN, "Library layout changed");
+    static_assert(sizeof(entry_t) % 8 == 0, "Library layout changed");
+
+    // Shared by all images of a loaded library, unmapped with the last one
+    struct mapping_t {
+        QFile file;
+        uchar* pData;
+        qint64 bytes;
+
+        mapping_t(const QString& rPath) : file(rPath), pData(nullptr), bytes(0) {}
+        ~mapping_t() { if (pData) file.unmap(pData); }
+    };
+    using mappingPtr_t = std::shared_ptr<mapping_t>;
+
+    qint64 alignUp(qint64 val, qint64 align) {
+        return (val + align - 1) & ~(align - 1);
+    }
+
+    void padTo(QByteArray* pBuf, qint64 align) {
+        pBuf->append(QByteArray(alignUp(pBuf->size(), align) - pBuf->size(), '\0'));
+    }
+
+    // Appends at an aligned position, offsets are relative to base
+    blob_t appendImage(QByteArray* pBuf, qint64 base, const QImage& rImg)
+    {
+        blob_t blob = {};
+        if (rImg.isNull())
+            return blob;
+
+        int rowBytes = rImg.width() * (rImg.depth() >> 3);
+        padTo(pBuf, ALIGN);
+        blob.offset = base + pBuf->size();
+        blob.stride = alignUp(rowBytes, ROW_ALIGN);
+        blob.width = rImg.width();
+        blob.height = rImg.height();
+        blob.bytes = blob.stride * blob.height;
+        for (int y = 0; y < rImg.height(); y++)
+        {
+            pBuf->append(reinterpret_cast<const char*>(rImg.constScanLine(y)), rowBytes);
+            pBuf->append(QByteArray(blob.stride - rowBytes, '\0'));
+        }
+        return blob;
+    }
+
+    blob_t appendBytes(QByteArray* pBuf, qint64 base, const QByteArray& rBytes, int rowBytes)
+    {
+        blob_t blob = {};
+        if (rBytes.isEmpty() || rowBytes < 1)
+            return blob;
+
+        padTo(pBuf, ALIGN);
+        blob.offset = base + pBuf->size();
+        blob.bytes = rBytes.size();
+        blob.stride = rowBytes;
+        blob.width = rowBytes;
+        blob.height = rBytes.size() / rowBytes;
+        pBuf->append(rBytes);
+        return blob;
+    }
+
+    bool isValid(const blob_t& rBlob, qint64 fileBytes)
+    {
+        return !rBlob.offset || (
+            (rBlob.offset % ALIGN == 0)
+            && (rBlob.offset <= static_cast<quint64>(fileBytes))
+            && (rBlob.bytes <= static_cast<quint64>(fileBytes) - rBlob.offset)
+            && (static_cast<quint64>(rBlob.stride) * rBlob.height <= rBlob.bytes)
+        );
+    }
+
+    // Key points and descriptors describe the same features
+    bool isValidFeatures(const entry_t& rEntry)
+    {
+        const blob_t& rPts = rEntry.blobs[BLOB_KEYPTS];
+        const blob_t& rDescr = rEntry.blobs[BLOB_DESCR];
+        if (!rPts.offset && !rDescr.offset)
+            return true;
+        if (!rPts.offset || !rDescr.offset || (rEntry.descrBytes <= 0) || (rDescr.bytes % rEntry.descrBytes))
+            return false;
+        const quint64 count = rDescr.bytes / static_cast<quint32>(rEntry.descrBytes);
+        return rPts.bytes == 2 * sizeof(float) * count;
+    }
+
+    void releaseMapping(void* pInfo)
+    {
+        delete static_cast<mappingPtr_t*>(pInfo);
+    }
+
+    // Rows of an image blob fit its stride
+    bool isValidImage(const blob_t& rBlob, QImage::Format format)
+    {
+        if (!rBlob.offset)
+            return true;
+        if ((format <= QImage::Format_Invalid) || (format >= QImage::NImageFormats))
+            return false;
+        const quint64 rowBytes = (static_cast<quint64>(rBlob.width) * QImage::toPixelFormat(format).bitsPerPixel() + 7) / 8;
+        return rBlob.width && rBlob.height && (rowBytes <= rBlob.stride);
+    }
+
+    // No copy, the image keeps the mapping alive. The view is read only,
+    // the const data ctor makes every write access copy the pixels first.
+    QImage mappedImage(const mappingPtr_t& rMap, const blob_t& rBlob, QImage::Format format)
+    {
+        if (!rBlob.offset)
+            return QImage();
+        return QImage(
+            static_cast<const uchar*>(rMap->pData + rBlob.offset),
+            rBlob.width,
+            rBlob.height,
+            rBlob.stride,
+            format,
+            releaseMapping,
+            new mappingPtr_t(rMap)
+        );
+    }
+
+    QByteArray mappedBytes(const mappingPtr_t& rMap, const blob_t& rBlob)
+    {// Raw data reference, the patch backing keeps the mapping alive
+        if (!rBlob.offset)
+            return QByteArray();
+        return QByteArray::fromRawData(reinterpret_cast<const char*>(rMap->pData + rBlob.offset), rBlob.bytes);
+    }
+}
+
+
+void CPatternLibrary::prepare(patch_t* pInOutPatch)
+{
+    if (!pInOutPatch || pInOutPatch->img.isNull())
+        return;
+
+    patch_t& rPatch = *pInOutPatch;
+    if (!rPatch.cutSize.isValid())
+        rPatch.cutSize = rPatch.img.size();  // searched as a whole
+    QImage argb = rPatch.img.convertToFormat(QImage::Format_ARGB32);
+    bool opaque = true;
+    for (int y = 0; opaque && y < argb.height(); y++)
+    {
+        const QRgb* pRow = reinterpret_cast<const QRgb*>(argb.constScanLine(y));
+        for (int x = 0; x < argb.width(); x++)
+        {
+            if (qAlpha(pRow[x]) != 0xFF)
+            {
+                opaque = false;
+                break;
+            }
+        }
+    }
+    // Matching works on RGB32, the alpha is kept as separate mask
+    rPatch.img = argb.convertToFormat(QImage::Format_RGB32);
+    rPatch.mask = opaque ? QImage() : argb.convertToFormat(QImage::Format_Alpha8);
+    rPatch.gray = rPatch.img.convertToFormat(QImage::Format_Grayscale8);
+
+    rPatch.pyramid.clear();
+    QImage level = rPatch.img;
+    for (int i = 0; i < PYR_LEVELS && level.width() > 1 && level.height() > 1; i++)
+    {
+        level = level.scaled(
+            level.width() >> 1,
+            level.height() >> 1,
+            Qt::IgnoreAspectRatio,
+            Qt::SmoothTransformation
+        );
+        rPatch.pyramid.append(level);
+    }
+
+    ImProcU8::imgArr2I_t graySz = { rPatch.gray.width(), rPatch.gray.height() };
+    ImProcU8::Image gray{
+        rPatch.gray.constBits(),
+        rPatch.gray.bytesPerLine(),
+        1,
+        graySz
+    };
+    std::vector<float> pts;
+    std::vector<ImProcU8::imgPxl_t> descr;
+    ImProcU8::Features feat;
+    rPatch.keyPts.clear();
+    rPatch.descriptors.clear();
+    rPatch.descrBytes = 0;
+    rPatch.featSize = QSize();
+    if (ImProcU8::describePattern(gray, pts, descr, feat) && feat.count > 0)
+    {
+        rPatch.keyPts = QByteArray(reinterpret_cast<const char*>(pts.data()), int(pts.size() * sizeof(float)));
+        rPatch.descriptors = QByteArray(reinterpret_cast<const char*>(descr.data()), int(descr.size()));
+        rPatch.descrBytes = feat.descrBytes;
+        rPatch.featSize = QSize(feat.width, feat.height);
+    }
+    rPatch.hash = ImProcU8::differenceHash(gray);
+    rPatch.backing.reset();  // all artifacts are owned now
+}
+
+
+bool CPatternLibrary::save(const QString& rPath, const QStringList& rKeys, const QVector<const patch_t*>& rPatches)
+{
+    if (rPath.isEmpty() || rKeys.count() != rPatches.count())
+        return false;
+
+    const qint64 tableBytes = alignUp(rKeys.count() * sizeof(entry_t), ALIGN);
+    const qint64 blobBase = sizeof(header_t) + tableBytes;
+    QVector<entry_t> entries;
+    QByteArray blobs;
+
+    for (int i = 0; i < rKeys.count(); i++)
+    {
+        if (!rPatches[i] || rPatches[i]->img.isNull())
+            continue;
+
+        patch_t patch = *rPatches[i];  // shallow
+        if (patch.gray.isNull())
+            prepare(&patch);
+
+        entry_t entry = {};
+        QByteArray key = rKeys[i].toUtf8();
+        if (key.size() >= KEY_BYTES)
+        {
+            qWarning("Pattern key too long, not saved.");
+            continue;
+        }
+        std::memcpy(entry.key, key.constData(), key.size());
+        entry.fillPerc = patch.fillPerc;
+        entry.descrBytes = patch.descrBytes;
+        entry.hash = patch.hash;
+        entry.pixelFormat = patch.img.format();
+        entry.featWidth = patch.featSize.width();
+        entry.featHeight = patch.featSize.height();
+        entry.offsetX = patch.centerOffset.x();
+        entry.offsetY = patch.centerOffset.y();
+        entry.cutWidth = patch.cutSize.width();
+        entry.cutHeight = patch.cutSize.height();
+        entry.blobs[BLOB_PIXELS] = appendImage(&blobs, blobBase, patch.img);
+        entry.blobs[BLOB_GRAY] = appendImage(&blobs, blobBase, patch.gray);
+        entry.blobs[BLOB_MASK] = appendImage(&blobs, blobBase, patch.mask);
+        for (int lvl = 0; lvl < PYR_LEVELS && lvl < patch.pyramid.count(); lvl++)
+            entry.blobs[BLOB_PYRAMID + lvl] = appendImage(&blobs, blobBase, patch.pyramid[lvl]);
+        entry.blobs[BLOB_KEYPTS] = appendBytes(&blobs, blobBase, patch.keyPts, 2 * sizeof(float));
+        entry.blobs[BLOB_DESCR] = appendBytes(&blobs, blobBase, patch.descriptors, patch.descrBytes);
+        entries.append(entry);
+    }
+
+    header_t header = {};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.count = entries.count();
+    header.entries = sizeof(header_t);
+    header.fileBytes = blobBase + blobs.size();
+
+    QByteArray table(reinterpret_cast<const char*>(entries.constData()), entries.count() * sizeof(entry_t));
+    padTo(&table, ALIGN);
+    table.append(QByteArray(tableBytes - table.size(), '\0'));  // skipped entries
+
+    QString tmpPath = rPath + ".new";
+    QFile out(tmpPath);
+    if (!out.open(QIODevice::WriteOnly | QIODevice::Truncate)
+        || out.write(reinterpret_cast<const char*>(&header), sizeof(header)) != sizeof(header)
+        || out.write(table) != table.size()
+        || out.write(blobs) != blobs.size())
+    {
+        qWarning("Pattern library could not be written.");
+        out.remove();
+        return false;
+    }
+    out.close();
+
+    // Fails while mapped on Windows, load() picks up the new file then
+    if ((!QFile::exists(rPath) || QFile::remove(rPath)) && QFile::rename(tmpPath, rPath))
+        return true;
+    DBG_("Pattern library in use, replaced on next load:" << tmpPath);
+    return true;
+}
+
+
+bool CPatternLibrary::load(const QString& rPath, QStringList* pOutKeys, QVector<patch_t>* pOutPatches)
+{
+    if (!pOutKeys || !pOutPatches)
+        return false;
+
+    QString path = rPath;
+    QString pending = rPath + ".new";
+    if (QFile::exists(pending)
+        && !((!QFile::exists(rPath) || QFile::remove(rPath)) && QFile::rename(pending, rPath)))
+    {
+        path = pending;  // still can not replace, use the newer one
+    }
+
+    mappingPtr_t map = std::make_shared<mapping_t>(path);
+    if (!map->file.open(QIODevice::ReadOnly))
+        return false;
+    map->bytes = map->file.size();
+    if (map->bytes < static_cast<qint64>(sizeof(header_t)))
+        return false;
+    map->pData = map->file.map(0, map->bytes);
+    if (!map->pData)
+        return false;
+
+    header_t header;
+    std::memcpy(&header, map->pData, sizeof(header));
+    if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC))
+        || header.version != VERSION
+        || header.fileBytes != static_cast<quint64>(map->bytes)
+        || header.entries > header.fileBytes
+        || static_cast<quint64>(header.count) * sizeof(entry_t) > header.fileBytes - header.entries)
+    {
+        qWarning("Invalid pattern library.");
+        return false;
+    }
+
+    for (quint32 i = 0; i < header.count; i++)
+    {
+        entry_t entry;
+        std::memcpy(&entry, map->pData + header.entries + i * sizeof(entry_t), sizeof(entry));
+        entry.key[KEY_BYTES - 1] = '\0';
+
+        bool valid = true;
+        for (const blob_t& rBlob : entry.blobs)
+            valid = valid && isValid(rBlob, map->bytes);
+        const QImage::Format format = static_cast<QImage::Format>(entry.pixelFormat);
+        valid = valid && isValidImage(entry.blobs[BLOB_PIXELS], format)
+            && isValidImage(entry.blobs[BLOB_GRAY], QImage::Format_Grayscale8)
+            && isValidImage(entry.blobs[BLOB_MASK], QImage::Format_Alpha8);
+        for (int lvl = 0; lvl < PYR_LEVELS; lvl++)
+            valid = valid && isValidImage(entry.blobs[BLOB_PYRAMID + lvl], format);
+        valid = valid && isValidFeatures(entry);
+        if (!valid || !entry.blobs[BLOB_PIXELS].offset)
+        {
+            qWarning("Corrupt pattern library entry skipped.");
+            continue;
+        }
+
+        patch_t patch = {};
+        patch.img = mappedImage(map, entry.blobs[BLOB_PIXELS], format);
+        patch.fillPerc = entry.fillPerc;
+        patch.centerOffset = QPoint(entry.offsetX, entry.offsetY);
+        patch.cutSize = QSize(entry.cutWidth, entry.cutHeight);
+        patch.gray = mappedImage(map, entry.blobs[BLOB_GRAY], QImage::Format_Grayscale8);
+        patch.mask = mappedImage(map, entry.blobs[BLOB_MASK], QImage::Format_Alpha8);
+        for (int lvl = 0; lvl < PYR_LEVELS; lvl++)
+        {
+            if (entry.blobs[BLOB_PYRAMID + lvl].offset)
+                patch.pyramid.append(mappedImage(map, entry.blobs[BLOB_PYRAMID + lvl], patch.img.format()));
+        }
+        patch.keyPts = mappedBytes(map, entry.blobs[BLOB_KEYPTS]);
+        patch.descriptors = mappedBytes(map, entry.blobs[BLOB_DESCR]);
+        patch.descrBytes = entry.descrBytes;
+        patch.featSize = QSize(entry.featWidth, entry.featHeight);
+        patch.hash = entry.hash;
+        patch.backing = map;
+
+        pOutKeys->append(QString::fromUtf8(entry.key));
+        pOutPatches->append(patch);
+    }
+    return true;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+template <typename T> class QVector;
+class QString;
+class QStringList;
+
+
+#include "CPatternRegistry.h"  // patch_t
+
+
+// Persistent pattern sets in an aligned binary file.
+// Pixels and all artifacts of prepare() are stored ready to use, a loaded
+// library is memory mapped read-only and its patches refer to the mapping.
+// Processes loading the same file share its pages.
+class CPatternLibrary
+{
+public:
+    static const int PYR_LEVELS = 2;
+
+    // Computes gray, pyramid, mask, features and hash from pInOutPatch->img
+    static void prepare(patch_t* pInOutPatch);
+
+    // Writes to rPath + ".new", then replaces rPath. A file that is still mapped
+    // can not be replaced on Windows, then the next load applies the new one.
+    static bool save(const QString& rPath, const QStringList& rKeys, const QVector<const patch_t*>& rPatches);
+
+    static bool load(const QString& rPath, QStringList* pOutKeys, QVector<patch_t>* pOutPatches);
+};
@@ -0,0 +1,106 @@
+#include "CPatternRegistry.h"
+
+#include <QMutex>
+#include <QMutexLocker>
+#include <QHash>
+
+#include "Util/util.h"
+
+
+CPatternRegistry::CPatternRegistry() :
+    mpWriteLock(nullptr),
+    mpIds(nullptr),
+    mpKeys(nullptr)
+{
+    mpWriteLock = new QMutex();
+    mpIds = new QHash<QString, patternId_t>();
+    mpKeys = new QStringList();
+    std::atomic_store(&mSnapshot, snapshotPtr_t(new snapshot_t{ {}, 0 }));
+}
+
+
+CPatternRegistry::~CPatternRegistry()
+{
+    DEL_PTR_(mpKeys);
+    DEL_PTR_(mpIds);
+    DEL_PTR_(mpWriteLock);
+}
+
+
+patternId_t CPatternRegistry::intern(const QString& rKey)
+{
+    if (rKey.isEmpty())
+        return NO_PATTERN;
+
+    QMutexLocker guard(mpWriteLock);
+    auto it = mpIds->constFind(rKey);
+    if (it != mpIds->constEnd())
+        return it.value();
+
+    patternId_t id = mpKeys->count();
+    mpKeys->append(rKey);
+    mpIds->insert(rKey, id);
+    return id;
+}
+
+
+patternId_t CPatternRegistry::idOf(const QString& rKey) const
+{
+    QMutexLocker guard(mpWriteLock);
+    return mpIds->value(rKey, NO_PATTERN);
+}
+
+
+QString CPatternRegistry::keyOf(patternId_t id) const
+{
+    QMutexLocker guard(mpWriteLock);
+    return mpKeys->value(id);
+}
+
+
+void CPatternRegistry::set(patternId_t id, const patch_t& rPatch)
+{
+    if (id < 0 || rPatch.img.isNull())
+        return;
+
+    publish({ { id, std::make_shared<const patch_t>(rPatch) } });
+}
+
+
+void CPatternRegistry::set(const std::vector<patternId_t>& rIds, const std::vector<patch_t>& rPatches)
+{
+    std::vector<std::pair<patternId_t, std::shared_ptr<const patch_t>>> changes;
+    for (size_t i = 0; i < rIds.size() && i < rPatches.size(); i++)
+    {
+        if (rIds[i] >= 0 && !rPatches[i].img.isNull())
+            changes.emplace_back(rIds[i], std::make_shared<const patch_t>(rPatches[i]));
+    }
+    if (!changes.empty())
+        publish(changes);
+}
+
+
+void CPatternRegistry::remove(patternId_t id)
+{
+    if (id >= 0)
+        publish({ { id, nullptr } });
+}
+
+
+void CPatternRegistry::publish(const std::vector<std::pair<patternId_t, std::shared_ptr<const patch_t>>>& rChanges)
+{
+    QMutexLocker guard(mpWriteLock);
+    snapshotPtr_t current = std::atomic_load(&mSnapshot);
+
+    // Only the pointers are copied, untouched patches are shared between versions.
+    // Readers of the old version keep it alive until they drop it.
+    auto next = std::make_shared<snapshot_t>(*current);
+    for (const auto& rChange : rChanges)
+    {
+        if (next->patches.size() <= static_cast<size_t>(rChange.first))
+            next->patches.resize(rChange.first + 1);
+        next->patches[rChange.first] = rChange.second;
+    }
+    next->version = current->version + 1;
+    std::atomic_store(&mSnapshot, snapshotPtr_t(std::move(next)));
+}
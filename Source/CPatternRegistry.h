@@ -0,0 +1,82 @@
+#pragma once
+
+class QMutex;
+template <typename K, typename V> class QHash;
+
+
+#include <QImage>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <QByteArray>
+#include <QPoint>
+#include <QSize>
+
+#include <memory>
+#include <vector>
+
+
+struct patch_t {
+    QImage img;                 // searched, may be a distinct region of the pattern as cut
+    float fillPerc;             // of img
+    QPoint centerOffset;        // from the center of img to the center of the pattern as cut
+    QSize cutSize;              // of the pattern as cut
+    // Artifacts precomputed by CPatternLibrary::prepare, empty if not available
+    QImage gray;
+    QVector<QImage> pyramid;    // level n has 1/2^(n+1) of the resolution
+    QImage mask;                // 8bit alpha, null if fully opaque
+    QByteArray keyPts;          // float x,y pairs in the prepared gray pattern
+    QByteArray descriptors;     // one ORB row per key point
+    int descrBytes;
+    QSize featSize;             // of the prepared gray pattern
+    unsigned long long hash;    // difference hash of the gray pattern
+    std::shared_ptr<const void> backing;  // keeps mapped library memory alive
+};
+
+
+using patternId_t = int;  // interned pattern key, stable for the registry lifetime
+const patternId_t NO_PATTERN = -1;
+
+
+// Copy-on-write store of the patterns.
+// Readers take an immutable snapshot with a single atomic load and keep it
+// for a whole frame, writers publish a new version and never block them.
+class CPatternRegistry
+{
+public:
+    struct snapshot_t {
+        std::vector<std::shared_ptr<const patch_t>> patches;  // by id, null if unset
+        unsigned long long version;
+
+        const patch_t* find(patternId_t id) const {
+            return (id >= 0 && static_cast<size_t>(id) < patches.size()) ?
+                patches[id].get() : nullptr;
+        }
+    };
+    using snapshotPtr_t = std::shared_ptr<const snapshot_t>;
+
+private:
+    snapshotPtr_t mSnapshot;  // only accessed through atomic_load/store
+    QMutex* mpWriteLock;      // serializes writers and interning
+    QHash<QString, patternId_t>* mpIds;
+    QStringList* mpKeys;      // by id
+
+    void publish(const std::vector<std::pair<patternId_t, std::shared_ptr<const patch_t>>>& rChanges);
+
+public:
+    CPatternRegistry();
+    ~CPatternRegistry();
+
+    snapshotPtr_t snapshot() const { return std::atomic_load(&mSnapshot); }
+
+    // Creates an id for an unknown key
+    patternId_t intern(const QString& rKey);
+    // NO_PATTERN if the key was never interned
+    patternId_t idOf(const QString& rKey) const;
+    QString keyOf(patternId_t id) const;
+
+    void set(patternId_t id, const patch_t& rPatch);
+    // Publishes all in a single version
+    void set(const std::vector<patternId_t>& rIds, const std::vector<patch_t>& rPatches);
+    void remove(patternId_t id);
+};
@@ -0,0 +1,97 @@
+#include "CPreviewRenderer.h"
+
+#include <QColor>
+#include <QPainter>
+#include <QPen>
+#include <QThreadPool>
+#include <QtConcurrent>
+
+#include <algorithm>
+#include <cmath>
+
+#include "Util/util.h"
+#include "Util/metrics.h"
+#include "Util/trace.h"
+
+
+namespace {
+    const int OVERLAY_PEN = 2;  // display pixels, stays visible on a scaled down 4K frame
+}
+
+
+QPoint CPreviewRenderer::preview_t::toFrame(const QPoint& rPt) const
+{
+    if (scale <= 0.f)
+        return rPt;
+    return QPoint(static_cast<int>(rPt.x() / scale), static_cast<int>(rPt.y() / scale));
+}
+
+
+QRect CPreviewRenderer::preview_t::toFrame(const QRect& rRect) const
+{
+    if (scale <= 0.f)
+        return rRect & frame.rect();
+    // Outward, a preview pixel covers 1/scale frame pixels
+    const int left = static_cast<int>(std::floor(rRect.left() / scale));
+    const int top = static_cast<int>(std::floor(rRect.top() / scale));
+    const int right = static_cast<int>(std::ceil((rRect.right() + 1) / scale));
+    const int bottom = static_cast<int>(std::ceil((rRect.bottom() + 1) / scale));
+    return QRect(left, top, right - left, bottom - top) & frame.rect();
+}
+
+
+CPreviewRenderer::CPreviewRenderer(frameSource_t source) :
+    mpPool(nullptr),
+    mSource(source),
+    mGeneration(0)
+{
+    mpPool = new QThreadPool();
+    mpPool->setMaxThreadCount(1);  // previews are shown in request order
+}
+
+
+CPreviewRenderer::~CPreviewRenderer()
+{
+    mGeneration++;  // queued requests return at once
+    mpPool->waitForDone();
+    DEL_PTR_(mpPool);
+}
+
+
+QFuture<CPreviewRenderer::preview_t> CPreviewRenderer::render(const QSize& rMaxSize, const std::vector<overlay_t>& rOverlays)
+{
+    const unsigned generation = ++mGeneration;
+    return QtConcurrent::run(
+        mpPool,
+        [this, generation, rMaxSize, rOverlays]() {
+            preview_t preview{ QImage(), QImage(), 1.f };
+            if ((generation != mGeneration.load()) || !mSource(&preview.frame) || preview.frame.isNull())
+                return preview;  // superseded or nothing captured yet
+
+            TRACE_("renderPreview");
+            Metrics::ScopeTimer timer(Metrics::H_CONVERT);
+            const QSize full = preview.frame.size();
+            if (rMaxSize.isEmpty() || ((full.width() <= rMaxSize.width()) && (full.height() <= rMaxSize.height())))
+            {
+                preview.image = preview.frame.convertToFormat(QImage::Format_RGB32);  // copy, overlays are drawn in
+            } else {
+                preview.image = preview.frame.scaled(rMaxSize, Qt::KeepAspectRatio, Qt::SmoothTransformation)
+                    .convertToFormat(QImage::Format_RGB32);
+                preview.scale = static_cast<float>(preview.image.width()) / full.width();
+            }
+
+            if (!rOverlays.empty())
+            {// QPainter on an image is safe outside the UI thread
+                QPainter painter(&preview.image);
+                for (const overlay_t& rOverlay : rOverlays)
+                {
+                    painter.setPen(QPen(rOverlay.found ? QColor(Qt::green) : QColor(Qt::red), OVERLAY_PEN));
+                    const QRectF rect(rOverlay.rect.x() * preview.scale, rOverlay.rect.y() * preview.scale,
+                        rOverlay.rect.width() * preview.scale, rOverlay.rect.height() * preview.scale);
+                    painter.drawRect(rect);
+                }
+            }
+            return preview;
+        }
+    );
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+class QThreadPool;
+template <typename T> class QFuture;
+
+
+#include <QImage>
+#include <QPoint>
+#include <QRect>
+#include <QSize>
+
+#include <atomic>
+#include <functional>
+#include <vector>
+
+
+// Renders the capture for display on a worker thread. The frame is converted,
+// scaled down to the view and the match overlays are drawn there, the UI
+// thread only shows the result. A preview keeps its full resolution frame,
+// selections on the preview map back to frame pixels for pattern creation.
+class CPreviewRenderer
+{
+public:
+    // Provides the latest frame, called on the worker
+    using frameSource_t = std::function<bool(QImage* pOutFrame)>;
+
+    struct overlay_t {
+        QRect rect;       // in frame pixels
+        bool found;       // found is drawn green, a miss or a partial result red
+    };
+
+    struct preview_t {
+        QImage image;     // display resolution, overlays drawn in. Null if superseded or no frame.
+        QImage frame;     // full resolution, shared with the capture copy, not copied again
+        float scale;      // preview pixels per frame pixel, at most 1
+
+        QPoint toFrame(const QPoint& rPt) const;
+        // Covers all frame pixels under the preview rectangle, clipped to the frame
+        QRect toFrame(const QRect& rRect) const;
+    };
+
+private:
+    QThreadPool* mpPool;
+    frameSource_t mSource;
+    std::atomic<unsigned> mGeneration;  // of the latest request
+
+public:
+    explicit CPreviewRenderer(frameSource_t source);
+    ~CPreviewRenderer();  // waits for the render in flight
+
+    // A newer request supersedes one that has not started yet.
+    // Never scales up, a frame smaller than maxSize is shown 1:1.
+    QFuture<preview_t> render(const QSize& rMaxSize, const std::vector<overlay_t>& rOverlays);
+};
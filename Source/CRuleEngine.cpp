@@ -0,0 +1,237 @@
+#include "CRuleEngine.h"
+#include "CScreenMacroTools.h"  // match_t
+
+#include <QMutex>
+#include <QMutexLocker>
+#include <QImage>
+#include <QVector>
+#include <QHash>
+
+#include <algorithm>
+
+#include "Util/util.h"
+
+
+namespace {
+    const double COST_STATE = 0.;
+    const double COST_PROBE = 1.;
+    const double COST_SEARCH = 1000.;  // plus the pattern area
+
+    bool isProbeMatch(const QImage& rFrame, const CRuleEngine::condition_t& rCond)
+    {
+        if (!rFrame.rect().contains(rCond.pos))
+            return false;
+        QRgb px = rFrame.pixel(rCond.pos);
+        return (qAbs(qRed(px) - qRed(rCond.color)) <= rCond.tolerance)
+            && (qAbs(qGreen(px) - qGreen(rCond.color)) <= rCond.tolerance)
+            && (qAbs(qBlue(px) - qBlue(rCond.color)) <= rCond.tolerance);
+    }
+
+    inline void bump(std::atomic<unsigned long long>& rVal)
+    {
+        rVal.store(rVal.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+}
+
+
+CRuleEngine::CRuleEngine() :
+    mFrames(0),
+    mRulesVisited(0),
+    mSearches(0),
+    mpLock(nullptr)
+{
+    mpLock = new QMutex();
+}
+
+
+CRuleEngine::~CRuleEngine()
+{
+    DEL_PTR_(mpLock);
+}
+
+
+int CRuleEngine::stateId(const QString& rName)
+{
+    QMutexLocker guard(mpLock);
+    auto it = std::find(mStateNames.cbegin(), mStateNames.cend(), rName);
+    if (it != mStateNames.cend())
+        return static_cast<int>(it - mStateNames.cbegin());
+    mStateNames.push_back(rName);
+    return static_cast<int>(mStateNames.size()) - 1;
+}
+
+
+std::shared_ptr<const CRuleEngine::plan_t> CRuleEngine::build(const std::vector<rule_t>& rRules, const CPatternRegistry::snapshot_t& rPatterns)
+{
+    auto costOf = [&rPatterns](const condition_t& rCond) -> double {
+        switch (rCond.kind)
+        {
+        case condition_t::STATE:
+            return COST_STATE;
+        case condition_t::PROBE:
+            return COST_PROBE;
+        default:
+            const patch_t* pPatch = rPatterns.find(rCond.pattern);
+            if (!pPatch)
+                return COST_PROBE;  // not searched, decides at once
+            return COST_SEARCH + double(pPatch->img.width()) * pPatch->img.height();
+        }
+    };
+
+    auto plan = std::make_shared<plan_t>();
+    plan->source = rRules;
+    plan->version = rPatterns.version;
+    for (const rule_t& rRule : rRules)
+    {
+        bool canFire = true;
+        for (const condition_t& rCond : rRule.conditions)
+        {
+            if (rCond.kind == condition_t::STATE && rCond.state < 0)
+                canFire = false;  // never interned, patterns may still come
+        }
+        if (!canFire)
+            continue;
+
+        rule_t compiled = rRule;
+        std::stable_sort(
+            compiled.conditions.begin(), compiled.conditions.end(),
+            [&costOf](const condition_t& a, const condition_t& b) { return costOf(a) < costOf(b); }
+        );
+        int idx = static_cast<int>(plan->rules.size());
+        plan->rules.push_back(compiled);
+
+        // Cheapest first, a state condition leads if there is one
+        if (compiled.conditions.empty() || compiled.conditions.front().kind != condition_t::STATE)
+        {
+            plan->unconditional.push_back(idx);
+        } else {
+            const condition_t& rTrigger = compiled.conditions.front();
+            auto& rBucket = plan->onState[rTrigger.value ? 1 : 0];
+            if (rBucket.size() <= static_cast<size_t>(rTrigger.state))
+                rBucket.resize(rTrigger.state + 1);
+            rBucket[rTrigger.state].push_back(idx);
+        }
+    }
+    return plan;
+}
+
+
+void CRuleEngine::compile(const std::vector<rule_t>& rRules, const CPatternRegistry::snapshot_t& rPatterns)
+{
+    std::atomic_store(&mPlan, build(rRules, rPatterns));
+}
+
+
+bool CRuleEngine::isEmpty() const
+{
+    std::shared_ptr<const plan_t> plan = std::atomic_load(&mPlan);
+    return !plan || plan->source.empty();
+}
+
+
+CRuleEngine::stats_t CRuleEngine::getStats() const
+{
+    return stats_t{
+        mFrames.load(std::memory_order_relaxed),
+        mRulesVisited.load(std::memory_order_relaxed),
+        mSearches.load(std::memory_order_relaxed)
+    };
+}
+
+
+void CRuleEngine::evaluate(const QImage& rFrame, const CPatternRegistry::snapshot_t& rPatterns, search_fn_t search, QVector<QPoint>* pOutClicks)
+{
+    std::shared_ptr<const plan_t> plan = std::atomic_load(&mPlan);
+    if (!plan || !search)
+        return;
+    if (plan->version != rPatterns.version)
+    {// A compile in between wins, plan then holds its rules
+        std::shared_ptr<const plan_t> rebuilt = build(plan->source, rPatterns);
+        if (std::atomic_compare_exchange_strong(&mPlan, &plan, rebuilt))
+            plan = rebuilt;
+    }
+    bump(mFrames);
+
+    // Visit only rules whose leading state condition holds
+    std::vector<int> candidates = plan->unconditional;
+    for (int val = 0; val < 2; val++)
+    {
+        const auto& rBuckets = plan->onState[val];
+        for (size_t state = 0; state < rBuckets.size(); state++)
+        {
+            bool current = (state < mState.size()) && mState[state];
+            if (current == (val != 0))
+                candidates.insert(candidates.end(), rBuckets[state].cbegin(), rBuckets[state].cend());
+        }
+    }
+    std::sort(candidates.begin(), candidates.end());  // declaration order
+
+    QHash<patternId_t, match_t> hits;  // each pattern searched once per frame
+    auto hitOf = [&](patternId_t id) -> match_t {
+        auto it = hits.constFind(id);
+        if (it != hits.constEnd())
+            return it.value();
+        bump(mSearches);
+        return hits.insert(id, search(id)).value();
+    };
+
+    // Applied after the frame, all rules see the same prior state
+    std::vector<std::pair<int, bool>> stateChanges;
+    for (int idx : candidates)
+    {
+        const rule_t& rRule = plan->rules[idx];
+        bump(mRulesVisited);
+        bool fires = true;
+        for (const condition_t& rCond : rRule.conditions)
+        {
+            switch (rCond.kind)
+            {
+            case condition_t::STATE:
+                fires = (((rCond.state < static_cast<int>(mState.size())) && mState[rCond.state]) == rCond.value);
+                break;
+            case condition_t::PROBE:
+                fires = isProbeMatch(rFrame, rCond);
+                break;
+            case condition_t::HIT:
+                fires = hitOf(rCond.pattern).found;
+                break;
+            case condition_t::MISS:
+                fires = !hitOf(rCond.pattern).found;
+                break;
+            }
+            if (!fires)
+                break;
+        }
+        if (!fires)
+            continue;
+
+        for (const action_t& rAct : rRule.actions)
+        {
+            switch (rAct.kind)
+            {
+            case action_t::CLICK_HIT:
+            {
+                match_t hit = hitOf(rAct.pattern);
+                if (hit.found && pOutClicks)
+                    pOutClicks->append(hit.pos + rAct.pos);
+                break;
+            }
+            case action_t::CLICK_AT:
+                if (pOutClicks)
+                    pOutClicks->append(rAct.pos);
+                break;
+            case action_t::SET_STATE:
+                if (rAct.state >= 0)
+                    stateChanges.emplace_back(rAct.state, rAct.value);
+                break;
+            }
+        }
+    }
+
+    for (const auto& rChange : stateChanges)
+    {
+        if (mState.size() <= static_cast<size_t>(rChange.first))
+            mState.resize(rChange.first + 1, false);
+        mState[rChange.first] = rChange.second;
+    }
+}
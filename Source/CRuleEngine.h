@@ -0,0 +1,99 @@
+#pragma once
+
+class QMutex;
+class QImage;
+template <typename T> class QVector;
+
+
+#include <QPoint>
+#include <QRgb>
+#include <QString>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "CPatternRegistry.h"  // patternId_t
+
+struct match_t;
+
+
+// Macro rules: if all conditions hold, the actions run.
+// Rules compile into a plan that is evaluated once per frame:
+//  - only rules whose state precondition matches the current state are visited,
+//  - conditions run cheapest first and stop at the first failing one,
+//  - every pattern is searched at most once per frame, shared by all rules.
+// The plan is rebuilt when the patterns change, costs follow the current patterns.
+class CRuleEngine
+{
+public:
+    struct condition_t {
+        enum kind_t { HIT, MISS, PROBE, STATE } kind;
+        patternId_t pattern;  // HIT, MISS
+        QPoint pos;           // PROBE pixel in the frame
+        QRgb color;           // PROBE expected color
+        int tolerance;        // PROBE max difference per color component
+        int state;            // STATE id from stateId()
+        bool value;           // STATE expected value
+    };
+
+    struct action_t {
+        enum kind_t { CLICK_HIT, CLICK_AT, SET_STATE } kind;
+        patternId_t pattern;  // CLICK_HIT, clicks at its location plus pos
+        QPoint pos;           // CLICK_HIT offset, CLICK_AT window position
+        int state;            // SET_STATE id, applied after the frame
+        bool value;
+    };
+
+    struct rule_t {
+        std::vector<condition_t> conditions;  // all must hold, empty always fires
+        std::vector<action_t> actions;
+    };
+
+    struct stats_t {
+        unsigned long long frames;
+        unsigned long long rulesVisited;
+        unsigned long long searches;
+    };
+
+    using search_fn_t = std::function<match_t(patternId_t)>;
+
+private:
+    struct plan_t {
+        std::vector<rule_t> source;                // as given to compile
+        unsigned long long version;                // of the patterns the costs are from
+        std::vector<rule_t> rules;                 // conditions sorted by cost
+        std::vector<int> unconditional;            // rules without state precondition
+        std::vector<std::vector<int>> onState[2];  // by expected value and state id
+    };
+
+    std::shared_ptr<const plan_t> mPlan;  // only accessed through atomic_load/store
+    std::vector<bool> mState;             // touched by evaluate only
+    // Written by evaluate only, relaxed load+store like Metrics
+    std::atomic<unsigned long long> mFrames;
+    std::atomic<unsigned long long> mRulesVisited;
+    std::atomic<unsigned long long> mSearches;
+    QMutex* mpLock;                       // guards interning
+    std::vector<QString> mStateNames;
+
+    static std::shared_ptr<const plan_t> build(const std::vector<rule_t>& rRules, const CPatternRegistry::snapshot_t& rPatterns);
+
+public:
+    CRuleEngine();
+    ~CRuleEngine();
+
+    int stateId(const QString& rName);
+
+    // Replaces the rule set. Pattern areas from rPatterns estimate the search cost,
+    // a pattern not set yet costs like a probe and is never found.
+    void compile(const std::vector<rule_t>& rRules, const CPatternRegistry::snapshot_t& rPatterns);
+    // No rules compiled, or an empty rule set
+    bool isEmpty() const;
+
+    // Not reentrant, call from one thread at a time (one detection lane).
+    // rPatterns is the version search uses, the plan is recompiled if it is another one.
+    void evaluate(const QImage& rFrame, const CPatternRegistry::snapshot_t& rPatterns, search_fn_t search, QVector<QPoint>* pOutClicks);
+
+    stats_t getStats() const;
+};
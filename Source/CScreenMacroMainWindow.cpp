@@ -1,238 +1,351 @@
-#include "CScreenMacroMainWindow.h"
-#include "ui_ScreenMacroForm.h"
-#include "CScreenMacroTools.h"
-
-#include <QString>
-#include <QVector>
-#include <QMouseEvent>
-#include <QRubberBand>
-#include <QRect>
-#include <QPoint>
-
-#include "Util/util.h"
-
-
-using namespace Ui;
-
-
-CScreenMacroMainWindow::CScreenMacroMainWindow() :
-    mpUi(nullptr),
-    mpSelectionRect(nullptr),
-    mpTools(nullptr),
-    mpMseClickPos(nullptr)
-{
-    mpUi = new Ui::ScreenMacroForm();
-    mpUi->setupUi(this);
-    mpSelectionRect = new QRubberBand(QRubberBand::Rectangle, mpUi->lblCaptureView);
-    mpTools = new CScreenMacroTools();
-    mpMseClickPos = new QPoint();
-
-    // This is a QMainWindow, therefore it has a instance of QObject
-    // We call connect of our QObject
-
-    /*this->connect(
-        mpUi->cmbWindows,
-        QOverload<int>::of(&QComboBox::currentIndexChanged),
-        [this](int idx) { this->mpTools->setTargetWindow(idx); }
-    );*/
-    this->connect(
-        mpUi->btnStartCapture,
-        &QPushButton::pressed,
-        this,
-        &CScreenMacroMainWindow::toggleMacro
-    );
-    this->connect(
-        mpUi->btnRefreshWindows,
-        &QPushButton::pressed,
-        this,
-        &CScreenMacroMainWindow::updateWindowNames
-    );
-    this->connect(
-        mpUi->btnMakeScreenshot,
-        &QPushButton::pressed,
-        this,
-        &CScreenMacroMainWindow::updateCapture
-    );
-    this->connect(
-        mpUi->btnStorePattern,
-        &QPushButton::pressed,
-        this,
-        &CScreenMacroMainWindow::addPattern
-    );
-    this->connect(
-        mpUi->btnFindPattern,
-        &QPushButton::pressed,
-        this,
-        &CScreenMacroMainWindow::onBtnFindPattern_pressed
-    );
-
-    updateWindowNames();
-}
-
-
-CScreenMacroMainWindow::~CScreenMacroMainWindow()
-{
-    DEL_PTR_(mpUi);
-    DEL_PTR_(mpSelectionRect);
-    DEL_PTR_(mpTools);
-    DEL_PTR_(mpMseClickPos);
-}
-
-
-void CScreenMacroMainWindow::updateCapture()
-{
-    QLabel* pLbl = mpUi->lblCaptureView;
-    pLbl->move(0, 0);
-    pLbl->setPixmap(mpTools->getWndCapture());
-    pLbl->adjustSize();
-    //mWndWidth = pLbl->width();
-    mpUi->scrollAreaWidgetContents->adjustSize();
-}
-
-
-void CScreenMacroMainWindow::updateWindowNames()
-{
-    QVector<QString> wndNams;
-    mpTools->getWindowNames(&wndNams);
-    mpUi->cmbWindows->clear();
-    QString name;
-    foreach (name, wndNams)
-    {
-        mpUi->cmbWindows->addItem(name);
-    }
-    
-    if (mpUi->cmbWindows->count() > 0)
-    {
-        mpUi->cmbWindows->setCurrentIndex(0);
-    }
-}
-
-
-void CScreenMacroMainWindow::toggleMacro()
-{
-    static bool running;
-    if (running)
-    {
-        mpTools->stop();
-        mpUi->btnStartCapture->setText("start");
-        running = false;
-    } else {
-        mpTools->start(mpUi->cmbWindows->currentIndex());
-        mpUi->btnStartCapture->setText("stop");
-        running = true;
-    }
-}
-
-
-//debug
-void CScreenMacroMainWindow::addPattern()
-{
-    const QPixmap* pPattern = nullptr;
-    if (pPattern= mpUi->lblCaptureView->pixmap())
-    {
-        mpUi->lblPattern->setPixmap(*pPattern);
-        int w = mpUi->scrollAreaWidgetContents->width();
-        if (w < 1)  // div zero guard
-            w = 1;
-        mpTools->setPattern(
-            "test",  // remember to care about uppercase and whitespace
-            *pPattern,
-            (float)(pPattern->width()) / w
-        );
-    }
-}
-
-#pragma region Events
-
-void CScreenMacroMainWindow::mousePressEvent(QMouseEvent* pEvent)
-{
-    if (!pEvent)
-        return;
-
-    if (mpUi->lblCaptureView->underMouse() &&
-        pEvent->button() == Qt::RightButton)
-    {
-        *mpMseClickPos = mpUi->lblCaptureView->mapFrom(this, pEvent->pos());
-        mpSelectionRect->setGeometry(QRect(*mpMseClickPos, QSize()));
-        mpSelectionRect->show();
-    }
-}
-
-
-void CScreenMacroMainWindow::mouseMoveEvent(QMouseEvent* pEvent)
-{
-    if (!pEvent)
-        return;
-
-    if (mpSelectionRect->isVisible() && mpUi->lblCaptureView->underMouse())
-    {
-        QPoint pt = mpUi->lblCaptureView->mapFrom(
-            this, pEvent->pos()
-        );
-        mpSelectionRect->setGeometry(
-            QRect(
-                qMin(mpMseClickPos->x(), pt.x()),
-                qMin(mpMseClickPos->y(), pt.y()),
-                qAbs(mpMseClickPos->x() - pt.x()),
-                qAbs(mpMseClickPos->y() - pt.y())
-            )
-        );
-    }
-}
-
-
-// Overrides QWidget event handler.
-void CScreenMacroMainWindow::mouseReleaseEvent(QMouseEvent* pEvent)
-{
-    if (!pEvent)
-        return;
-
-    if (mpUi->lblCaptureView->underMouse())
-    {
-        if (pEvent->button() == Qt::LeftButton)
-        {// Can run in another thread because it blocks UI for the click duration
-            mpTools->simulateClickAt(
-                mpUi->cmbWindows->currentIndex(),
-                mpUi->lblCaptureView->mapFrom(this, pEvent->pos())
-            );
-        }
-        if (pEvent->button() == Qt::RightButton && mpSelectionRect->isVisible()) {
-            QLabel* pLbl = mpUi->lblCaptureView;
-            QRect rec = mpSelectionRect->geometry();
-            pLbl->setPixmap(pLbl->pixmap()->copy(rec));
-            pLbl->setGeometry(rec);
-            mpSelectionRect->hide();
-        }
-    }
-}
-
-
-void CScreenMacroMainWindow::onCmbWindows_currentIndexChanged(int idx)
-{
-    mpTools->setTargetWindow(idx);
-}
-
-void CScreenMacroMainWindow::onBtnFindPattern_pressed()
-{
-    CScreenMacroTools::scaling_t method;
-    switch (mpUi->cmbScalingMethod->currentIndex())
-    {
-        case 1:
-            method = CScreenMacroTools::SCL_WINDOW;
-            break;
-        case 2:
-            method = CScreenMacroTools::SCL_ZOOM;
-            break;
-        default:
-            method = CScreenMacroTools::SCL_OFF;
-            break;
-    }
-    // TODO: create seperate task with qfuture
-    QPoint loc;
-    if (mpTools->windowHasPattern("test", method, &loc))
-    {
-        mpTools->simulateClickAt(mpUi->cmbWindows->currentIndex(), loc);
-    }
-}
-
-#pragma endregion
+#include "CScreenMacroMainWindow.h"
+#include "ui_ScreenMacroForm.h"
+#include "CScreenMacroTools.h"
+
+#include <QString>
+#include <QVector>
+#include <QMouseEvent>
+#include <QRubberBand>
+#include <QRect>
+#include <QPoint>
+#include <QFutureWatcher>
+#include <QCoreApplication>
+#include <QShortcut>
+#include <QStatusBar>
+#include <QImage>
+#include <QPixmap>
+
+#include "Util/util.h"
+#include "Util/metrics.h"
+#include "Util/trace.h"
+
+
+using namespace Ui;
+
+namespace {
+    const int SEARCH_TIMEOUT_MS = 2000;  // best match so far is taken after
+    const char* PATTERN_LIBRARY = "/patterns.smpl";  // next to the executable
+    const char* METRICS_FILE = "/metrics.prom";      // next to the executable
+    const int METRICS_PERIOD_MS = 10000;
+    const char* TRACE_FILE = "/trace.json";           // next to the executable, open in chrome://tracing
+}
+
+
+CScreenMacroMainWindow::CScreenMacroMainWindow() :
+    mpUi(nullptr),
+    mpSelectionRect(nullptr),
+    mpTools(nullptr),
+    mpMseClickPos(nullptr),
+    mpSearchWatcher(nullptr),
+    mpPreview(nullptr),
+    mpPreviewWatcher(nullptr),
+    mpShown(nullptr),
+    mpOverlays(nullptr),
+    mpPatternCrop(nullptr),
+    mpCropFrame(nullptr),
+    mpCropAt(nullptr)
+{
+    mpUi = new Ui::ScreenMacroForm();
+    mpUi->setupUi(this);
+    mpSelectionRect = new QRubberBand(QRubberBand::Rectangle, mpUi->lblCaptureView);
+    mpTools = new CScreenMacroTools();
+    mpMseClickPos = new QPoint();
+    mpSearchWatcher = new QFutureWatcher<match_t>(this);
+    // Frames are converted and scaled on the renderer thread, not here
+    mpPreview = new CPreviewRenderer([this](QImage* pOutFrame) { return mpTools->getWndFrame(pOutFrame); });
+    mpPreviewWatcher = new QFutureWatcher<CPreviewRenderer::preview_t>(this);
+    mpShown = new CPreviewRenderer::preview_t{ QImage(), QImage(), 1.f };
+    mpOverlays = new std::vector<CPreviewRenderer::overlay_t>();
+    mpPatternCrop = new QImage();
+    mpCropFrame = new QImage();
+    mpCropAt = new QPoint();
+
+    // This is a QMainWindow, therefore it has a instance of QObject
+    // We call connect of our QObject
+
+    /*this->connect(
+        mpUi->cmbWindows,
+        QOverload<int>::of(&QComboBox::currentIndexChanged),
+        [this](int idx) { this->mpTools->setTargetWindow(idx); }
+    );*/
+    this->connect(
+        mpUi->btnStartCapture,
+        &QPushButton::pressed,
+        this,
+        &CScreenMacroMainWindow::toggleMacro
+    );
+    this->connect(
+        mpUi->btnRefreshWindows,
+        &QPushButton::pressed,
+        this,
+        &CScreenMacroMainWindow::updateWindowNames
+    );
+    this->connect(
+        mpUi->btnMakeScreenshot,
+        &QPushButton::pressed,
+        this,
+        &CScreenMacroMainWindow::updateCapture
+    );
+    this->connect(
+        mpUi->btnStorePattern,
+        &QPushButton::pressed,
+        this,
+        &CScreenMacroMainWindow::addPattern
+    );
+    this->connect(
+        mpUi->btnFindPattern,
+        &QPushButton::pressed,
+        this,
+        &CScreenMacroMainWindow::onBtnFindPattern_pressed
+    );
+    this->connect(
+        mpSearchWatcher,
+        &QFutureWatcherBase::finished,
+        this,
+        &CScreenMacroMainWindow::onPatternSearchFinished
+    );
+    this->connect(
+        mpPreviewWatcher,
+        &QFutureWatcherBase::finished,
+        this,
+        &CScreenMacroMainWindow::onPreviewReady
+    );
+
+    // F12 starts tracing, pressed again it exports the recorded spans
+    this->connect(
+        new QShortcut(QKeySequence(Qt::Key_F12), this),
+        &QShortcut::activated,
+        [this]() {
+            if (Trace::isEnabled())
+            {
+                Trace::disable();
+                QString path = QCoreApplication::applicationDirPath() + TRACE_FILE;
+                bool saved = Trace::exportChrome(path.toStdString());
+                statusBar()->showMessage(saved ? "Trace saved to " + path : "Trace export failed", 5000);
+            } else {
+                Trace::enable();
+                statusBar()->showMessage("Tracing, F12 to export", 5000);
+            }
+        }
+    );
+
+    updateWindowNames();
+    mpTools->loadLibrary(QCoreApplication::applicationDirPath() + PATTERN_LIBRARY);
+    Metrics::startDump((QCoreApplication::applicationDirPath() + METRICS_FILE).toStdString(), METRICS_PERIOD_MS);
+}
+
+
+CScreenMacroMainWindow::~CScreenMacroMainWindow()
+{
+    mpSearchWatcher->disconnect();  // owned by this, tools cancel and wait for the search
+    mpPreviewWatcher->disconnect();
+    DEL_PTR_(mpPreview);  // waits for the render, it reads from the tools
+    DEL_PTR_(mpUi);
+    DEL_PTR_(mpSelectionRect);
+    DEL_PTR_(mpTools);
+    DEL_PTR_(mpMseClickPos);
+    DEL_PTR_(mpShown);
+    DEL_PTR_(mpOverlays);
+    DEL_PTR_(mpPatternCrop);
+    DEL_PTR_(mpCropFrame);
+    DEL_PTR_(mpCropAt);
+    Metrics::stopDump();
+}
+
+
+void CScreenMacroMainWindow::updateCapture()
+{// A 4K capture would stall the UI thread, it only gets the scaled preview in onPreviewReady
+    mpPreviewWatcher->setFuture(
+        mpPreview->render(mpUi->scrollArea->viewport()->size(), *mpOverlays)
+    );
+}
+
+
+void CScreenMacroMainWindow::onPreviewReady()
+{
+    CPreviewRenderer::preview_t preview = mpPreviewWatcher->result();
+    if (preview.image.isNull())
+        return;  // no capture yet
+
+    QLabel* pLbl = mpUi->lblCaptureView;
+    pLbl->move(0, 0);
+    pLbl->setPixmap(QPixmap::fromImage(preview.image));
+    pLbl->adjustSize();
+    //mWndWidth = pLbl->width();
+    mpUi->scrollAreaWidgetContents->adjustSize();
+    *mpShown = preview;
+}
+
+
+void CScreenMacroMainWindow::updateWindowNames()
+{
+    QVector<QString> wndNams;
+    mpTools->getWindowNames(&wndNams);
+    mpUi->cmbWindows->clear();
+    QString name;
+    foreach (name, wndNams)
+    {
+        mpUi->cmbWindows->addItem(name);
+    }
+    
+    if (mpUi->cmbWindows->count() > 0)
+    {
+        mpUi->cmbWindows->setCurrentIndex(0);
+    }
+}
+
+
+void CScreenMacroMainWindow::toggleMacro()
+{
+    static bool running;
+    if (running)
+    {
+        mpTools->cancelSearch();
+        mpTools->stop();
+        mpUi->btnStartCapture->setText("start");
+        running = false;
+    } else {
+        mpTools->start(mpUi->cmbWindows->currentIndex());
+        mpUi->btnStartCapture->setText("stop");
+        running = true;
+    }
+}
+
+
+//debug
+void CScreenMacroMainWindow::addPattern()
+{
+    if (!mpPatternCrop->isNull())
+    {// The selection in frame pixels, the preview may be scaled down
+        const QPixmap pattern = QPixmap::fromImage(*mpPatternCrop);
+        mpUi->lblPattern->setPixmap(pattern);
+        int w = mpCropFrame->width();
+        if (w < 1)  // div zero guard
+            w = 1;
+        mpTools->setPattern(
+            "test",  // remember to care about uppercase and whitespace
+            pattern,
+            (float)(pattern.width()) / w,
+            *mpCropFrame,
+            *mpCropAt
+        );
+        mpTools->saveLibrary(QCoreApplication::applicationDirPath() + PATTERN_LIBRARY);
+    }
+}
+
+#pragma region Events
+
+void CScreenMacroMainWindow::mousePressEvent(QMouseEvent* pEvent)
+{
+    if (!pEvent)
+        return;
+
+    if (mpUi->lblCaptureView->underMouse() &&
+        pEvent->button() == Qt::RightButton)
+    {
+        *mpMseClickPos = mpUi->lblCaptureView->mapFrom(this, pEvent->pos());
+        mpSelectionRect->setGeometry(QRect(*mpMseClickPos, QSize()));
+        mpSelectionRect->show();
+    }
+}
+
+
+void CScreenMacroMainWindow::mouseMoveEvent(QMouseEvent* pEvent)
+{
+    if (!pEvent)
+        return;
+
+    if (mpSelectionRect->isVisible() && mpUi->lblCaptureView->underMouse())
+    {
+        QPoint pt = mpUi->lblCaptureView->mapFrom(
+            this, pEvent->pos()
+        );
+        mpSelectionRect->setGeometry(
+            QRect(
+                qMin(mpMseClickPos->x(), pt.x()),
+                qMin(mpMseClickPos->y(), pt.y()),
+                qAbs(mpMseClickPos->x() - pt.x()),
+                qAbs(mpMseClickPos->y() - pt.y())
+            )
+        );
+    }
+}
+
+
+// Overrides QWidget event handler.
+void CScreenMacroMainWindow::mouseReleaseEvent(QMouseEvent* pEvent)
+{
+    if (!pEvent)
+        return;
+
+    if (mpUi->lblCaptureView->underMouse())
+    {
+        if (pEvent->button() == Qt::LeftButton)
+        {// Can run in another thread because it blocks UI for the click duration
+            mpTools->simulateClickAt(
+                mpUi->cmbWindows->currentIndex(),
+                mpShown->toFrame(mpUi->lblCaptureView->mapFrom(this, pEvent->pos()))
+            );
+        }
+        if (pEvent->button() == Qt::RightButton && mpSelectionRect->isVisible()) {
+            QLabel* pLbl = mpUi->lblCaptureView;
+            QRect rec = mpSelectionRect->geometry();
+            const QRect frameRec = mpShown->toFrame(rec);
+            if (!frameRec.isEmpty() && pLbl->pixmap())
+            {
+                *mpPatternCrop = mpShown->frame.copy(frameRec);
+                *mpCropFrame = mpShown->frame;  // shared, the next preview brings a new frame
+                *mpCropAt = frameRec.topLeft();
+                pLbl->setPixmap(pLbl->pixmap()->copy(rec));
+                pLbl->setGeometry(rec);
+            }
+            mpSelectionRect->hide();
+        }
+    }
+}
+
+
+void CScreenMacroMainWindow::onCmbWindows_currentIndexChanged(int idx)
+{
+    mpTools->setTargetWindow(idx);
+}
+
+void CScreenMacroMainWindow::onBtnFindPattern_pressed()
+{
+    CScreenMacroTools::scaling_t method;
+    switch (mpUi->cmbScalingMethod->currentIndex())
+    {
+        case 1:
+            method = CScreenMacroTools::SCL_WINDOW;
+            break;
+        case 2:
+            method = CScreenMacroTools::SCL_ZOOM;
+            break;
+        default:
+            method = CScreenMacroTools::SCL_OFF;
+            break;
+    }
+    // Repeated presses supersede the search in flight
+    mpSearchWatcher->setFuture(
+        mpTools->windowHasPatternAsync("test", method, SEARCH_TIMEOUT_MS)
+    );
+}
+
+
+void CScreenMacroMainWindow::onPatternSearchFinished()
+{
+    const match_t result = mpSearchWatcher->result();
+    mpOverlays->clear();
+    if (result.found)
+    {
+        mpTools->simulateClickAt(mpUi->cmbWindows->currentIndex(), result.pos);
+        // Marked in the next preview, a partial result in red
+        QSize size = mpTools->getPatternSize("test");
+        size = QSize(qRound(size.width() * result.scale), qRound(size.height() * result.scale));
+        QRect rect(QPoint(), size);
+        rect.moveCenter(result.pos);
+        mpOverlays->push_back(CPreviewRenderer::overlay_t{ rect, !result.partial });
+    }
+}
+
+#pragma endregion
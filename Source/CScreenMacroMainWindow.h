@@ -1,51 +1,68 @@
-#pragma once
-
-class QMouseEvent;
-class QRubberBand;
-class CScreenMacroTools;
-class QPixmap;
-class QPoint;
-
-#include <QtWidgets/QMainWindow>
-
-
-
-namespace Ui {
-class ScreenMacroForm;
-
-class CScreenMacroMainWindow : public QMainWindow
-{
-    Q_OBJECT
-
-    ScreenMacroForm* mpUi;
-    CScreenMacroTools* mpTools;
-    QRubberBand* mpSelectionRect;
-    QPoint* mpMseClickPos;
-    //int mWndWidth;
-
-    void addPattern();
-    void updateWindowNames();
-    void updateCapture();
-    void toggleMacro();
-    //void showCapture(const QPixmap& rInCapt);
-
-
-protected:
-    virtual void mouseReleaseEvent(QMouseEvent* pEvent) override;
-    virtual void mousePressEvent(QMouseEvent* pEvent) override;
-    virtual void mouseMoveEvent(QMouseEvent* pEvent) override;
-
-
-public:
-    CScreenMacroMainWindow();
-    ~CScreenMacroMainWindow();
-
-
-public slots:
-    void onCmbWindows_currentIndexChanged(int idx);
-    void onBtnFindPattern_pressed();
-    //void onUpdateCapture(const QPixmap& rInCpt);
-    
-};
-
-}// namespace Ui
+#pragma once
+
+class QMouseEvent;
+class QRubberBand;
+class CScreenMacroTools;
+class QPixmap;
+class QPoint;
+class QImage;
+template <typename T> class QFutureWatcher;
+struct match_t;
+
+#include <QtWidgets/QMainWindow>
+
+#include <vector>
+
+#include "CPreviewRenderer.h"
+
+
+
+namespace Ui {
+class ScreenMacroForm;
+
+class CScreenMacroMainWindow : public QMainWindow
+{
+    Q_OBJECT
+
+    ScreenMacroForm* mpUi;
+    CScreenMacroTools* mpTools;
+    QRubberBand* mpSelectionRect;
+    QPoint* mpMseClickPos;
+    QFutureWatcher<match_t>* mpSearchWatcher;
+    CPreviewRenderer* mpPreview;
+    QFutureWatcher<CPreviewRenderer::preview_t>* mpPreviewWatcher;
+    CPreviewRenderer::preview_t* mpShown;  // preview in lblCaptureView, maps its pixels to the frame
+    std::vector<CPreviewRenderer::overlay_t>* mpOverlays;  // of the last search
+    QImage* mpPatternCrop;  // full resolution selection
+    QImage* mpCropFrame;    // the selection was cut from, picks the distinct part of the pattern
+    QPoint* mpCropAt;       // top left of the selection in mpCropFrame
+    //int mWndWidth;
+
+    void addPattern();
+    void updateWindowNames();
+    void updateCapture();
+    void toggleMacro();
+    //void showCapture(const QPixmap& rInCapt);
+
+
+protected:
+    virtual void mouseReleaseEvent(QMouseEvent* pEvent) override;
+    virtual void mousePressEvent(QMouseEvent* pEvent) override;
+    virtual void mouseMoveEvent(QMouseEvent* pEvent) override;
+
+
+public:
+    CScreenMacroMainWindow();
+    ~CScreenMacroMainWindow();
+
+
+public slots:
+    void onCmbWindows_currentIndexChanged(int idx);
+    void onBtnFindPattern_pressed();
+    void onPatternSearchFinished();
+    void onPreviewReady();
+    //void onUpdateCapture(const QPixmap& rInCpt);
+    
+};
+
+}// namespace Ui
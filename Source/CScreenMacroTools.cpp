@@ -1,269 +1,1105 @@
-#include "CScreenMacroTools.h"
-#include "Util/winapi.h"  // adds map, wstring
-#include "CCaptureEngine.h"
-#include "Util/imgproc.h"
-
-#include <QGuiApplication>
-#include <QObject>
-#include <QThread>
-#include <QtConcurrent>
-#include <QMap>
-#include <QPoint>
-#include <qwindowdefs.h>  // WId
-
-#include "Util/util.h"
-
-
-CScreenMacroTools::CScreenMacroTools() :
-    mpHandles(nullptr),
-    mpGrabber(nullptr),
-    mpCaptureLoop(nullptr),
-    mpPatterns(nullptr)
-{
-    mpHandles = new QVector<const void*>();
-    mpPatterns = new QMap<QString, patch_t>();
-
-    createCaptureTask();
-}
-
-
-CScreenMacroTools::~CScreenMacroTools()
-{
-    killCaptureTask();  // handles capture loop & grabber
-
-    DEL_PTR_(mpHandles);
-    DEL_PTR_(mpPatterns);
-}
-
-
-#pragma region Windows
-
-bool CScreenMacroTools::setTargetWindow(int idx)
-{
-    if (idx >= 0
-        && mpHandles->count() > idx
-        && mpGrabber
-        && WinOS::checkIsValidWindow(mpHandles->at(idx)))
-    {
-        mpGrabber->onSetWindow(mpHandles->at(idx));  // [FIXME] asynchronous!
-        return true;
-    } else
-        return false;
-}
-
-
-const void* CScreenMacroTools::getMappedHdl(int idx)
-{
-    return (idx >= 0 && mpHandles->count() > idx) ?
-        mpHandles->at(idx) : nullptr;
-}
-
-
-void CScreenMacroTools::getWindowNames(QVector<QString>* pOutNames)
-{
-    if (!pOutNames)
-        return;
-
-    std::map<const void*, std::wstring> HandleMap;
-    WinOS::listDsktParentWindows(&HandleMap);
-    if (!HandleMap.size())
-        return;
-
-    mpHandles->clear();
-    for (auto pair : std::as_const(HandleMap)) // it = HandleMap.cbegin(); it != HandleMap.cend(); it++)
-    {
-        if (!(pair.second.empty()))
-        {
-            mpHandles->append(pair.first);
-            pOutNames->append(QString::fromStdWString(pair.second));
-        }
-    }
-}
-
-
-void CScreenMacroTools::simulateClickAt(int wndIdx, const QPoint& rInWndPos)
-{
-    QtConcurrent::run(
-        WinOS::clickWindowHere,
-        getMappedHdl(wndIdx),
-        rInWndPos.x(),
-        rInWndPos.y(),
-        true,  // return to initial cursor pos
-        0uL    // unspecified click duration
-    );
-}
-
-# pragma endregion
-
-
-#pragma region Capture
-
-
-void CScreenMacroTools::createCaptureTask()
-{
-    if (!mpCaptureLoop)
-        mpCaptureLoop = new QThread();
-
-    if (!mpGrabber)
-        mpGrabber = new CCaptureEngine(1000);  // 1 fps sampling
-
-    QObject::connect(
-        mpCaptureLoop, &QThread::finished, mpCaptureLoop, &QObject::deleteLater
-    );
-    QObject::connect(
-        mpCaptureLoop, &QThread::started, mpGrabber, &CCaptureEngine::startCapture
-    );
-
-    mpGrabber->moveToThread(mpCaptureLoop);
-}
-
-
-void CScreenMacroTools::killCaptureTask()
-{
-    if (mpCaptureLoop)
-    {
-        if (mpCaptureLoop->isRunning())
-        {
-            mpCaptureLoop->quit();
-            mpCaptureLoop->wait();  // blocks till thread finishes
-        }
-        delete mpCaptureLoop;
-        mpCaptureLoop = nullptr;
-
-        //do not delete mpGrabber (handled by thread)
-        mpGrabber = nullptr;
-    }
-}
-
-
-QPixmap CScreenMacroTools::getWndCapture()
-{
-    const QPixmap* pPix = nullptr;
-    if (mpGrabber)
-        pPix = mpGrabber->getCapture();
-
-    // Returns a copy referencing same data
-    // Origin gets detached on write
-    if (pPix)
-        return *pPix;
-    else
-        return QPixmap();
-}
-
-
-void CScreenMacroTools::startCapture(const void* wndPtr)
-{
-    if (!mpCaptureLoop || !mpCaptureLoop->isRunning())
-    {
-        createCaptureTask();
-        mpCaptureLoop->start();
-    }
-
-    if (mpGrabber && wndPtr)
-        mpGrabber->onSetWindow(wndPtr);
-}
-
-
-void CScreenMacroTools::stopCapture()
-{
-    if (mpCaptureLoop && mpCaptureLoop->isRunning())
-        killCaptureTask();
-    // this leaves a instance of qthread if it wasnt running before
-}
-
-
-void CScreenMacroTools::setPattern(QString patternKey, const QPixmap& rInPattern, float fillFact)
-{
-    // adds new or overwrites existing key
-    // format should be RGB32
-    if (!patternKey.isEmpty() && !rInPattern.isNull())
-        mpPatterns->insert(patternKey, patch_t{ rInPattern.toImage(), fillFact });  // creates qimage
-}
-
-#pragma endregion
-
-#pragma region imgproc
-
-bool CScreenMacroTools::windowHasPattern(QString patternKey, scaling_t scaling, QPoint* pOutPos)
-{
-    QImage frame;
-
-    if (!mpGrabber || !mpGrabber->tryGetImage(&frame))
-        return false;
-
-    auto* patch = &(mpPatterns->value(patternKey));
-    if (frame.isNull()
-        || !patch
-        || patch->img.isNull())
-    {
-        return false;
-    }
-    if (frame.format() != QImage::Format_RGB32)
-    {
-        frame.convertToFormat(QImage::Format_RGB32).swap(frame);
-        qWarning("Unsupported screenshot color format, converted to RGB32!");
-    }
-    float wF = patch->fillPerc * frame.width();
-    if ((~0u>>1) < wF)            // Does not fit into int
-    {
-        qWarning("(Pattern) Scaling too big, request dropped.");
-        return false;             //throw std::range_error;
-    }
-    int wI = patch->img.width();
-    QImage pattern;
-    if ((scaling == SCL_WINDOW)
-        && (wF > 16)
-        && (wF * ImProcU8::IMG_MATCH_SZ_TOL < abs(wF - wI)))
-    {// Rescale pattern to fit its parent origin.
-     // Repeated rescales may gradually reduce image quality!
-        wI = wF;
-        patch->img.scaledToWidth(wI).swap(pattern);
-    } else
-        pattern = patch->img;  // Shallow copy
-
-    if (pattern.format() != QImage::Format_RGB32)
-        pattern.convertToFormat(QImage::Format_RGB32).swap(pattern);
-
-    ImProcU8::imgArr2I_t frmSz = {
-        frame.width(),
-        frame.height()
-    };
-    ImProcU8::imgArr2I_t patSz = {
-        wI,
-        pattern.height()
-    };
-    ImProcU8::imgArr2I_t location = { 0, 0 };
-    int chan = 4;  // rgb qimage always has 4 channels (32bit align)
-    if (scaling == SCL_ZOOM)
-    {
-        frame.convertToFormat(QImage::Format_Grayscale8).swap(frame);
-        pattern.convertToFormat(QImage::Format_Grayscale8).swap(pattern);
-        chan = 1;
-    }
-    ImProcU8::Image parent{
-        frame.constBits(),
-        frame.bytesPerLine(),
-        chan,
-        frmSz
-    };
-    ImProcU8::Image target{
-        pattern.constBits(),
-        pattern.bytesPerLine(),
-        chan,
-        patSz
-    };
-    if ((scaling == SCL_ZOOM) ?
-        ImProcU8::locateFeaturesIn(parent,target,location) : 
-        ImProcU8::locatePatternIn(parent,target,location))
-    {
-        if (pOutPos)
-        {
-            pOutPos->setX(location[ImProcU8::COOR_LEFT]);
-            pOutPos->setY(location[ImProcU8::COOR_TOP]);
-        }
-        return true;
-    } else {
-        return false;
-    }
-}
-#pragma endregion
+#include "CScreenMacroTools.h"
+#include "Util/winapi.h"  // adds map, wstring
+#include "CCaptureEngine.h"
+#include "CDetectionPool.h"
+#include "CActionDispatcher.h"
+#include "CFrameHistory.h"
+#include "CFrameRing.h"
+#include "CMatchTracker.h"
+#include "CMatchCache.h"
+#include "CPatternLibrary.h"
+#include "CRuleEngine.h"
+#include "Util/imgproc.h"
+
+#include <QGuiApplication>
+#include <QObject>
+#include <QThread>
+#include <QThreadPool>
+#include <QtConcurrent>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QMap>
+#include <QHash>
+#include <QPoint>
+#include <QRect>
+#include <QRectF>
+#include <QDateTime>
+#include <qwindowdefs.h>  // WId
+
+#include <algorithm>
+#include <chrono>
+#include <unordered_map>
+
+#include "Util/util.h"
+#include "Util/metrics.h"
+#include "Util/trace.h"
+
+
+namespace {
+    const qint64 HISTORY_BYTES = 256ll << 20;  // per monitor, hours of a mostly static window
+    const qint64 CACHE_BYTES = 4ll << 20;      // tens of thousands of results
+    const int MIN_COARSE_SIZE = 12;            // pattern side at half resolution, smaller ones match anywhere
+    const float PATTERN_CERTAINTY = 0.55f;     // of the SCL_OFF searches, distinct regions are judged by it too
+}
+
+
+struct CScreenMacroTools::monitor_t {
+    int id;
+    const void* hWnd;
+    CCaptureEngine* pGrabber;
+    QThread* pLoop;
+    QMutex lock;           // guards the pattern ids and the budget
+    std::vector<patternId_t> patterns;
+    std::chrono::milliseconds budget;  // per frame from capture, 0 unlimited
+    std::unordered_map<patternId_t, int> deferred;  // frames in a row without search, detection lane only
+    CRuleEngine* pRules;   // replaces the plain pattern list if set
+    CFrameHistory* pHistory;  // recent frames for post-mortem analysis
+    QThreadPool* pHistoryPool;  // one low priority thread, appends off the capture path
+    std::atomic<bool> historyBusy;  // a frame is being appended, newer ones are skipped meanwhile
+    CMatchTracker* pTracker;  // found locations, detection lane only
+    std::unordered_map<patternId_t, float> scales;  // last SCL_WINDOW scales, detection lane only
+    scaling_t scaling;
+    int lane;              // in the detection pool
+};
+
+
+struct CScreenMacroTools::region_t {
+    QRectF area;           // frame fractions, or pixels around the anchor hit
+    patternId_t anchor;    // NO_PATTERN for frame fractions
+};
+
+
+CScreenMacroTools::CScreenMacroTools() :
+    mpHandles(nullptr),
+    mpGrabber(nullptr),
+    mpCaptureLoop(nullptr),
+    mpPatterns(nullptr),
+    mpSearchPool(nullptr),
+    mpSearchLock(nullptr),
+    mClosing(false),
+    mpMonitors(nullptr),
+    mpDetector(nullptr),
+    mpDispatcher(nullptr),
+    mpCache(nullptr),
+    mSearchGen(0),
+    mpScales(nullptr),
+    mpPriorities(nullptr),
+    mpRegions(nullptr),
+    mNextMonitor(0)
+{
+    mpHandles = new QVector<const void*>();
+    mpPatterns = new CPatternRegistry();
+    mpMonitors = new QMap<int, monitor_t*>();
+    mpDetector = new CDetectionPool();  // sized to the cores
+    mpDispatcher = new CActionDispatcher(new CWinInputBackend());
+    mpCache = new CMatchCache(CACHE_BYTES);
+    mScaleRange = std::make_shared<const ImProcU8::ScaleRange>(ImProcU8::DEFAULT_SCALES);
+    mpScales = new QHash<patternId_t, float>();
+    mpPriorities = new QHash<patternId_t, int>();
+    mpRegions = new QHash<patternId_t, region_t>();
+    mpSearchLock = new QMutex();
+    mpSearchPool = new QThreadPool();
+    // A superseded search may still finish its current tile
+    mpSearchPool->setMaxThreadCount(2);
+
+    createCaptureTask();
+}
+
+
+CScreenMacroTools::~CScreenMacroTools()
+{
+    cancelSearch();
+    mClosing.store(true);  // region selections in the pool
+    mpSearchPool->waitForDone();
+    killCaptureTask();  // handles capture loop & grabber
+    for (int id : mpMonitors->keys())
+        removeMonitor(id);
+
+    DEL_PTR_(mpDetector);  // after monitors, they submit to it
+    DEL_PTR_(mpDispatcher);  // after detection, it clicks; releases held buttons
+    DEL_PTR_(mpMonitors);
+    DEL_PTR_(mpSearchPool);
+    DEL_PTR_(mpSearchLock);
+    DEL_PTR_(mpHandles);
+    DEL_PTR_(mpPatterns);
+    DEL_PTR_(mpCache);
+    DEL_PTR_(mpScales);
+    DEL_PTR_(mpPriorities);
+    DEL_PTR_(mpRegions);
+}
+
+
+#pragma region Windows
+
+bool CScreenMacroTools::setTargetWindow(int idx)
+{
+    if (idx >= 0
+        && mpHandles->count() > idx
+        && mpGrabber
+        && WinOS::checkIsValidWindow(mpHandles->at(idx)))
+    {
+        mpGrabber->onSetWindow(mpHandles->at(idx));  // [FIXME] asynchronous!
+        QMutexLocker guard(mpSearchLock);
+        mpScales->clear();  // pattern sizes belong to the window
+        return true;
+    } else
+        return false;
+}
+
+
+const void* CScreenMacroTools::getMappedHdl(int idx)
+{
+    return (idx >= 0 && mpHandles->count() > idx) ?
+        mpHandles->at(idx) : nullptr;
+}
+
+
+void CScreenMacroTools::getWindowNames(QVector<QString>* pOutNames)
+{
+    if (!pOutNames)
+        return;
+
+    std::map<const void*, std::wstring> HandleMap;
+    WinOS::listDsktParentWindows(&HandleMap);
+    if (!HandleMap.size())
+        return;
+
+    mpHandles->clear();
+    for (auto pair : std::as_const(HandleMap)) // it = HandleMap.cbegin(); it != HandleMap.cend(); it++)
+    {
+        if (!(pair.second.empty()))
+        {
+            mpHandles->append(pair.first);
+            pOutNames->append(QString::fromStdWString(pair.second));
+        }
+    }
+}
+
+
+void CScreenMacroTools::simulateClickAt(int wndIdx, const QPoint& rInWndPos)
+{
+    clickAt(getMappedHdl(wndIdx), rInWndPos);
+}
+
+
+void CScreenMacroTools::clickAt(const void* hWnd, const QPoint& rInWndPos)
+{
+    Metrics::add(Metrics::C_CLICKS);
+    // Ordered with every other click, the cursor returns after
+    mpDispatcher->click(hWnd, rInWndPos, true);
+}
+
+# pragma endregion
+
+
+#pragma region Capture
+
+
+void CScreenMacroTools::createCaptureTask()
+{
+    if (!mpCaptureLoop)
+        mpCaptureLoop = new QThread();
+
+    if (!mpGrabber)
+    {
+        mpGrabber = new CCaptureEngine(1000);  // 1 fps sampling
+        if (!mRingName.isEmpty())
+            mpGrabber->publishFrames(mRingName, CFrameRing::DEFAULT_SLOTS);  // still in this thread
+    }
+
+    QObject::connect(
+        mpCaptureLoop, &QThread::finished, mpCaptureLoop, &QObject::deleteLater
+    );
+    QObject::connect(
+        mpCaptureLoop, &QThread::started, mpGrabber, &CCaptureEngine::startCapture
+    );
+
+    mpGrabber->moveToThread(mpCaptureLoop);
+}
+
+
+void CScreenMacroTools::killCaptureTask()
+{
+    if (mpCaptureLoop)
+    {
+        if (mpCaptureLoop->isRunning())
+        {
+            mpCaptureLoop->quit();
+            mpCaptureLoop->wait();  // blocks till thread finishes
+        }
+        delete mpCaptureLoop;
+        mpCaptureLoop = nullptr;
+
+        //do not delete mpGrabber (handled by thread)
+        mpGrabber = nullptr;
+    }
+}
+
+
+QPixmap CScreenMacroTools::getWndCapture()
+{
+    const QPixmap* pPix = nullptr;
+    if (mpGrabber)
+        pPix = mpGrabber->getCapture();
+
+    // Returns a copy referencing same data
+    // Origin gets detached on write
+    if (pPix)
+        return *pPix;
+    else
+        return QPixmap();
+}
+
+
+bool CScreenMacroTools::getWndFrame(QImage* pOutFrame)
+{
+    return mpGrabber && mpGrabber->tryGetImage(pOutFrame);
+}
+
+
+void CScreenMacroTools::startCapture(const void* wndPtr)
+{
+    if (!mpCaptureLoop || !mpCaptureLoop->isRunning())
+    {
+        createCaptureTask();
+        mpCaptureLoop->start();
+    }
+
+    if (mpGrabber && wndPtr)
+        mpGrabber->onSetWindow(wndPtr);
+}
+
+
+void CScreenMacroTools::setFrameRing(const QString& rName)
+{
+    mRingName = rName;
+    if (mpGrabber)
+    {// The grabber lives in the capture thread, the ring is only touched there
+        CCaptureEngine* pGrabber = mpGrabber;
+        QMetaObject::invokeMethod(pGrabber, [pGrabber, rName]() {
+            pGrabber->publishFrames(rName, CFrameRing::DEFAULT_SLOTS);
+        }, Qt::QueuedConnection);
+    }
+}
+
+
+void CScreenMacroTools::stopCapture()
+{
+    if (mpCaptureLoop && mpCaptureLoop->isRunning())
+        killCaptureTask();
+    // this leaves a instance of qthread if it wasnt running before
+}
+
+
+void CScreenMacroTools::setPattern(QString patternKey, const QPixmap& rInPattern, float fillFact, const QImage& rSourceFrame,
+    const QPoint& rCutAt)
+{
+    // adds new or overwrites existing key
+    // format should be RGB32
+    // publishes a new registry version, running detections keep the old one
+    if (!patternKey.isEmpty() && !rInPattern.isNull())
+    {
+        patch_t patch = {};
+        patch.img = rInPattern.toImage();  // creates qimage
+        patch.fillPerc = fillFact;
+        patch.cutSize = patch.img.size();
+        CPatternLibrary::prepare(&patch);  // artifacts reused by every search
+        const patternId_t id = mpPatterns->intern(patternKey);
+        {
+            QMutexLocker guard(mpSearchLock);
+            mpPatterns->set(id, patch);
+        }
+        if (!rSourceFrame.isNull())
+        {// The whole pattern is searched until its region is selected
+            const QImage frame = rSourceFrame;
+            QtConcurrent::run(mpSearchPool, [this, id, patch, frame, rCutAt]() {
+                selectRegion(id, patch, frame, rCutAt);
+            });
+        }
+    }
+}
+
+
+void CScreenMacroTools::selectRegion(patternId_t id, patch_t patch, const QImage& rSourceFrame, const QPoint& rCutAt)
+{// The smallest part that is still unique in its frame is searched instead
+    TRACE_("selectRegion");
+    const qint64 cutKey = patch.img.cacheKey();
+    const QImage frame = rSourceFrame.convertToFormat(QImage::Format_RGB32);
+    const QImage pattern = patch.img.convertToFormat(QImage::Format_RGB32);
+    ImProcU8::imgArr2I_t frmSz = { frame.width(), frame.height() };
+    ImProcU8::imgArr2I_t patSz = { pattern.width(), pattern.height() };
+    ImProcU8::imgArr2I_t cutAt = { rCutAt.x(), rCutAt.y() };
+    ImProcU8::imgArr2I_t regionXy;
+    ImProcU8::imgArr2I_t regionSz;
+    ImProcU8::SearchCtrl ctrl{ &mClosing, std::chrono::steady_clock::time_point(), false };
+    if (!ImProcU8::selectDistinctRegion(
+        ImProcU8::Image{ frame.constBits(), frame.bytesPerLine(), 4, frmSz },
+        ImProcU8::Image{ pattern.constBits(), pattern.bytesPerLine(), 4, patSz },
+        cutAt, PATTERN_CERTAINTY, regionXy, regionSz, &ctrl))
+    {
+        return;
+    }
+    const QRect region(regionXy[ImProcU8::COOR_LEFT], regionXy[ImProcU8::COOR_TOP],
+        regionSz[ImProcU8::D_WIDTH], regionSz[ImProcU8::D_HEIGHT]);
+    patch.centerOffset = QPoint(patch.cutSize.width() >> 1, patch.cutSize.height() >> 1)
+        - (region.topLeft() + QPoint(region.width() >> 1, region.height() >> 1));
+    patch.fillPerc = patch.fillPerc * region.width() / patch.cutSize.width();
+    patch.img = patch.img.copy(region);
+    CPatternLibrary::prepare(&patch);
+
+    QMutexLocker guard(mpSearchLock);
+    const patch_t* pCurrent = mpPatterns->snapshot()->find(id);
+    if (!pCurrent || (pCurrent->img.cacheKey() != cutKey))
+        return;  // replaced or removed meanwhile
+    mpPatterns->set(id, patch);
+    DBG_("Pattern" << mpPatterns->keyOf(id) << "searched by" << region);
+}
+
+
+bool CScreenMacroTools::loadLibrary(const QString& rPath)
+{
+    QStringList keys;
+    QVector<patch_t> patches;
+    if (!CPatternLibrary::load(rPath, &keys, &patches))
+        return false;
+
+    std::vector<patternId_t> ids;
+    for (const QString& rKey : keys)
+        ids.push_back(mpPatterns->intern(rKey));
+    mpPatterns->set(ids, std::vector<patch_t>(patches.cbegin(), patches.cend()));
+    return true;
+}
+
+
+bool CScreenMacroTools::saveLibrary(const QString& rPath)
+{
+    CPatternRegistry::snapshotPtr_t patterns = mpPatterns->snapshot();
+    QStringList keys;
+    QVector<const patch_t*> patches;
+    for (patternId_t id = 0; id < static_cast<patternId_t>(patterns->patches.size()); id++)
+    {
+        if (patterns->find(id))
+        {
+            keys.append(mpPatterns->keyOf(id));
+            patches.append(patterns->find(id));
+        }
+    }
+    return CPatternLibrary::save(rPath, keys, patches);
+}
+
+
+patternId_t CScreenMacroTools::getPatternId(const QString& rKey) const
+{
+    return mpPatterns->idOf(rKey);
+}
+
+
+QString CScreenMacroTools::getPatternKey(patternId_t id) const
+{
+    return mpPatterns->keyOf(id);
+}
+
+
+QSize CScreenMacroTools::getPatternSize(const QString& rKey) const
+{
+    CPatternRegistry::snapshotPtr_t patterns = mpPatterns->snapshot();
+    const patch_t* pPatch = patterns->find(mpPatterns->idOf(rKey));
+    return pPatch ? pPatch->cutSize : QSize();
+}
+
+#pragma endregion
+
+#pragma region Monitors
+
+int CScreenMacroTools::addMonitor(int wndIdx, int periodMs, const QStringList& rPatternKeys, scaling_t scaling)
+{
+    const void* hWnd = getMappedHdl(wndIdx);
+    if (!hWnd || !WinOS::checkIsValidWindow(hWnd) || (periodMs < 1))
+        return -1;
+
+    int id = mNextMonitor++;
+    monitor_t* pMon = new monitor_t();
+    pMon->id = id;
+    pMon->hWnd = hWnd;
+    pMon->pRules = nullptr;
+    pMon->pHistory = new CFrameHistory(HISTORY_BYTES);
+    pMon->pHistoryPool = new QThreadPool();
+    pMon->pHistoryPool->setMaxThreadCount(1);  // CFrameHistory::append from one thread at a time
+    pMon->historyBusy.store(false);
+    pMon->pTracker = new CMatchTracker();
+    for (const QString& rKey : rPatternKeys)
+        pMon->patterns.push_back(mpPatterns->intern(rKey));
+    pMon->scaling = scaling;
+    pMon->budget = std::chrono::milliseconds(0);
+    pMon->lane = mpDetector->addLane();
+    pMon->pLoop = new QThread();
+    pMon->pGrabber = new CCaptureEngine(periodMs);
+    pMon->pGrabber->onSetWindow(hWnd);  // before the thread runs
+
+    CCaptureEngine* pGrabber = pMon->pGrabber;
+    QObject::connect(
+        pMon->pLoop, &QThread::started, pGrabber, &CCaptureEngine::startCapture
+    );
+    QObject::connect(
+        pMon->pLoop, &QThread::finished, pGrabber, &QObject::deleteLater
+    );
+    QObject::connect(
+        pGrabber,
+        &CCaptureEngine::captured,
+        [this, pMon, pGrabber]() {
+            // Capture thread, the pool drops this frame if a newer one arrives first
+            auto capturedAt = std::chrono::steady_clock::now();
+            QImage frame;
+            if (!pGrabber->tryGetImage(&frame))
+                return;
+            const qint64 timeMs = QDateTime::currentMSecsSinceEpoch();
+            bool queued = mpDetector->submit(pMon->lane, [this, pMon, frame, capturedAt]() {
+                auto startedAt = std::chrono::steady_clock::now();
+                Metrics::observe(Metrics::H_QUEUE_WAIT, startedAt - capturedAt);
+                Trace::record("queued", capturedAt, startedAt, pMon->id);
+                detectIn(pMon, frame, capturedAt);  // the lane is removed before pMon
+            });
+            if (!queued)
+                Metrics::add(Metrics::C_SUPERSEDED);
+            // Tile compares and compression stay out of detection, a slow append skips frames
+            if (!pMon->historyBusy.exchange(true))
+            {
+                QtConcurrent::run(pMon->pHistoryPool, [pMon, frame, timeMs]() {
+                    QThread::currentThread()->setPriority(QThread::LowestPriority);
+                    pMon->pHistory->append(frame, timeMs);
+                    pMon->historyBusy.store(false);
+                });
+            }
+        }
+    );
+    pGrabber->moveToThread(pMon->pLoop);
+    mpMonitors->insert(id, pMon);
+    pMon->pLoop->start();
+    return id;
+}
+
+
+void CScreenMacroTools::setMonitorPatterns(int monitorId, const QStringList& rPatternKeys)
+{
+    monitor_t* pMon = mpMonitors->value(monitorId, nullptr);
+    if (pMon)
+    {
+        std::vector<patternId_t> ids;
+        for (const QString& rKey : rPatternKeys)
+            ids.push_back(mpPatterns->intern(rKey));
+        QMutexLocker guard(&pMon->lock);
+        pMon->patterns.swap(ids);  // from the next frame on
+    }
+}
+
+
+void CScreenMacroTools::setPatternPriority(const QString& rKey, priority_t priority)
+{
+    const patternId_t id = mpPatterns->intern(rKey);
+    QMutexLocker guard(mpSearchLock);
+    if (priority == PRIO_NORMAL)
+        mpPriorities->remove(id);
+    else
+        mpPriorities->insert(id, priority);
+}
+
+
+void CScreenMacroTools::setPatternRegion(const QString& rKey, const QRectF& rArea, const QString& rAnchorKey)
+{
+    const patternId_t id = mpPatterns->intern(rKey);
+    const patternId_t anchor = rAnchorKey.isEmpty() ? NO_PATTERN : mpPatterns->intern(rAnchorKey);
+    QMutexLocker guard(mpSearchLock);
+    if (rArea.isNull())
+    {
+        mpRegions->remove(id);
+        return;
+    }
+    // The anchors of a frame are searched in order, they must not depend on this pattern
+    for (patternId_t at = anchor; at != NO_PATTERN; at = mpRegions->value(at, region_t{ QRectF(), NO_PATTERN }).anchor)
+    {
+        if (at == id)
+        {
+            qWarning("Pattern region anchors form a cycle, region not set.");
+            return;
+        }
+    }
+    mpRegions->insert(id, region_t{ rArea, anchor });
+}
+
+
+void CScreenMacroTools::setMonitorBudget(int monitorId, int budgetMs)
+{
+    monitor_t* pMon = mpMonitors->value(monitorId, nullptr);
+    if (pMon)
+    {
+        QMutexLocker guard(&pMon->lock);
+        pMon->budget = std::chrono::milliseconds(std::max(0, budgetMs));
+    }
+}
+
+
+void CScreenMacroTools::removeMonitor(int monitorId)
+{
+    monitor_t* pMon = mpMonitors->take(monitorId);
+    if (!pMon)
+        return;
+
+    pMon->pLoop->quit();
+    pMon->pLoop->wait();  // no more frames, grabber is deleted later
+    mpDetector->removeLane(pMon->lane);  // blocks till its running job is done
+    pMon->pHistoryPool->waitForDone();
+    delete pMon->pLoop;
+    DEL_PTR_(pMon->pHistoryPool);
+    DEL_PTR_(pMon->pRules);
+    DEL_PTR_(pMon->pHistory);
+    DEL_PTR_(pMon->pTracker);
+    delete pMon;
+}
+
+
+bool CScreenMacroTools::setMonitorRules(int monitorId, const std::vector<CRuleEngine::rule_t>& rRules)
+{
+    monitor_t* pMon = mpMonitors->value(monitorId, nullptr);
+    if (!pMon)
+        return false;
+
+    QMutexLocker guard(&pMon->lock);
+    if (!pMon->pRules)
+        pMon->pRules = new CRuleEngine();
+    pMon->pRules->compile(rRules, *mpPatterns->snapshot());  // detection picks the plan up atomically
+    return true;
+}
+
+
+void CScreenMacroTools::setMonitorHistory(int monitorId, qint64 maxBytes)
+{
+    monitor_t* pMon = mpMonitors->value(monitorId, nullptr);
+    if (pMon)
+        pMon->pHistory->setMaxBytes(maxBytes);  // oldest frames are dropped at once
+}
+
+
+bool CScreenMacroTools::saveMonitorHistory(int monitorId, const QString& rPath)
+{
+    monitor_t* pMon = mpMonitors->value(monitorId, nullptr);
+    return pMon && pMon->pHistory->save(rPath);
+}
+
+
+int CScreenMacroTools::getMonitorStateId(int monitorId, const QString& rName)
+{
+    monitor_t* pMon = mpMonitors->value(monitorId, nullptr);
+    if (!pMon)
+        return -1;
+
+    QMutexLocker guard(&pMon->lock);
+    if (!pMon->pRules)
+        pMon->pRules = new CRuleEngine();
+    return pMon->pRules->stateId(rName);
+}
+
+
+void CScreenMacroTools::detectIn(monitor_t* pMon, QImage frame, std::chrono::steady_clock::time_point capturedAt)
+{
+    Trace::Span span("detect", pMon->id);
+    pMon->lock.lock();
+    std::vector<patternId_t> ids = pMon->patterns;
+    CRuleEngine* pRules = pMon->pRules;  // never deleted while the lane runs
+    if (pRules && pRules->isEmpty())
+        pRules = nullptr;  // only state ids so far
+    scaling_t scaling = pMon->scaling;
+    const std::chrono::milliseconds budget = pMon->budget;
+    pMon->lock.unlock();
+    QHash<patternId_t, int> priorities;
+    QHash<patternId_t, region_t> regions;
+    {
+        QMutexLocker guard(mpSearchLock);
+        priorities = *mpPriorities;  // shared, not copied
+        regions = *mpRegions;
+    }
+    auto priorityOf = [&priorities](patternId_t id) {
+        return priorities.value(id, PRIO_NORMAL);
+    };
+    // Includes the wait for a worker, the budget is a latency target
+    const std::chrono::steady_clock::time_point deadline = (budget.count() > 0) ?
+        capturedAt + budget : std::chrono::steady_clock::time_point();
+    auto isOverBudget = [&deadline]() {
+        return (deadline != std::chrono::steady_clock::time_point()) && (std::chrono::steady_clock::now() >= deadline);
+    };
+    QImage halfFrame;  // coarse level of the anytime searches, made on first use
+
+    // One version for the whole frame, edits apply from the next one
+    CPatternRegistry::snapshotPtr_t patterns = mpPatterns->snapshot();
+    CMatchTracker* pTracker = pMon->pTracker;
+    pTracker->beginFrame(frame);
+    // Similar patterns share a prototype search, template matching only
+    std::shared_ptr<const CPatternIndex> index;
+    if (scaling == SCL_OFF)
+        index = patternIndex(*patterns);
+    CPatternIndex::frameMemo_t prototypes;
+    // Each pattern is searched once per frame. An anchor is searched before the first
+    // pattern placed by it, the anchors resolve in topological order. Cycles are refused by setPatternRegion.
+    QHash<patternId_t, match_t> frameHits;
+    std::function<match_t(patternId_t)> search;
+    search = [&](patternId_t id) -> match_t {
+        auto done = frameHits.constFind(id);
+        if (done != frameHits.constEnd())
+            return done.value();
+        const patch_t* pPatch = patterns->find(id);
+        QRect roi;
+        auto region = regions.constFind(id);
+        if (pPatch && (region != regions.constEnd()))
+        {// A pattern without its anchor in this frame is not searched
+            match_t anchorHit{ QPoint(), false, false, 1.f };
+            if (region->anchor != NO_PATTERN)
+                anchorHit = search(region->anchor);
+            if (!regionRoi(*region, *pPatch, frame.size(), anchorHit.found ? &anchorHit.pos : nullptr, &roi))
+                pPatch = nullptr;
+        }
+        const QRect* pRoi = roi.isEmpty() ? nullptr : &roi;
+
+        Trace::Span span("search", id);
+        match_t result{ QPoint(), false, false, 1.f };
+        if (pPatch)
+        {
+            float* pScale = (scaling == SCL_WINDOW) ? &pMon->scales[id] : nullptr;  // starts at 0, unknown
+            // Critical patterns run to the end, the others stop at the deadline with their best result
+            ImProcU8::SearchCtrl ctrl{ nullptr, (priorityOf(id) == PRIO_CRITICAL) ? std::chrono::steady_clock::time_point() : deadline, false };
+            ImProcU8::SearchCtrl* pCtrl = (ctrl.deadline != std::chrono::steady_clock::time_point()) ? &ctrl : nullptr;
+            QPoint expected;
+            if (pTracker->predict(id, &expected))
+            {// Moved with the window content, a local match verifies it
+                result = matchFrame(frame, *pPatch, scaling, pCtrl, &expected, pScale, pRoi);
+                if (result.found)
+                    Metrics::add(Metrics::C_TRACKED);
+            }
+            const int group = index ? index->groupOf(id) : -1;
+            if (!result.found && !ctrl.interrupted && (group < 0))
+            {
+                result = pCtrl ? anytimeMatch(frame, &halfFrame, *pPatch, scaling, pCtrl, pScale, pRoi) :
+                    matchFrame(frame, *pPatch, scaling, nullptr, nullptr, pScale, pRoi);
+            } else if (!result.found && !ctrl.interrupted) {
+             // Only where the prototype of its group scored, the prototype search keeps the deadline
+                const std::vector<QPoint> places = index->candidates(group, frame, prototypes, pRoi, pCtrl);
+                if (ctrl.interrupted)
+                    result.partial = true;  // deferred past the budget, not a miss
+                else if (places.empty())
+                    Metrics::add(Metrics::C_PRUNED);
+                for (const QPoint& rPlace : places)
+                {
+                    const QPoint hint = rPlace + pPatch->centerOffset;  // places are centers of the searched region
+                    if (pRoi && !pRoi->contains(hint))
+                        continue;
+                    result = matchFrame(frame, *pPatch, scaling, pCtrl, &hint, nullptr, pRoi);
+                    if (result.found || ctrl.interrupted)
+                        break;
+                }
+            }
+            // A partial miss says nothing, the location is kept for the next frame
+            if (result.found || !result.partial)
+                pTracker->update(id, result.found, result.pos);
+        }
+        if (mOnDetected)
+            mOnDetected(pMon->id, id, result);
+        frameHits.insert(id, result);
+        return result;
+    };
+
+    if (pRules)
+    {// The plan decides which patterns are searched
+        QVector<QPoint> clicks;
+        pRules->evaluate(frame, *patterns, search, &clicks);
+        for (const QPoint& rPos : clicks)
+        {
+            clickAt(pMon->hWnd, rPos);
+            Metrics::observe(Metrics::H_DETECT_TO_CLICK, std::chrono::steady_clock::now() - capturedAt);
+        }
+    } else {
+        // Critical first, background last. Within a priority the longest deferred go first, then list order.
+        std::stable_sort(ids.begin(), ids.end(), [&](patternId_t a, patternId_t b) {
+            const int prioA = priorityOf(a);
+            const int prioB = priorityOf(b);
+            if (prioA != prioB)
+                return prioA < prioB;
+            auto deferredA = pMon->deferred.find(a);
+            auto deferredB = pMon->deferred.find(b);
+            return ((deferredA != pMon->deferred.end()) ? deferredA->second : 0)
+                > ((deferredB != pMon->deferred.end()) ? deferredB->second : 0);
+        });
+        for (patternId_t id : ids)
+        {
+            if (!patterns->find(id) || frameHits.contains(id))
+                continue;  // gone, or searched as anchor already
+            if ((priorityOf(id) != PRIO_CRITICAL) && isOverBudget())
+            {// Comes first among its priority next frame
+                pMon->deferred[id]++;
+                Metrics::add(Metrics::C_DEFERRED);
+                continue;
+            }
+            pMon->deferred.erase(id);
+            search(id);
+        }
+    }
+    if (isOverBudget())
+        Metrics::add(Metrics::C_DEADLINE_MISSES);
+}
+
+#pragma endregion
+
+#pragma region imgproc
+
+bool CScreenMacroTools::windowHasPattern(QString patternKey, scaling_t scaling, QPoint* pOutPos)
+{
+    QImage frame;
+
+    if (!mpGrabber || !mpGrabber->tryGetImage(&frame))
+        return false;
+
+    match_t result = frameHasPattern(frame, patternKey, scaling);
+    if (result.found && pOutPos)
+        *pOutPos = result.pos;
+    return result.found;
+}
+
+
+match_t CScreenMacroTools::frameHasPattern(const QImage& rFrame, const QString& rPatternKey, scaling_t scaling)
+{
+    CPatternRegistry::snapshotPtr_t patterns = mpPatterns->snapshot();
+    return scaledMatch(rFrame, *patterns, mpPatterns->idOf(rPatternKey), scaling);
+}
+
+
+std::shared_ptr<const CPatternIndex> CScreenMacroTools::patternIndex(const CPatternRegistry::snapshot_t& rPatterns)
+{
+    std::shared_ptr<const CPatternIndex> index = std::atomic_load(&mIndex);
+    if (!index || (index->getVersion() != rPatterns.version))
+    {// Lanes may build the same version at once, either result is right
+        index = CPatternIndex::build(rPatterns);
+        std::atomic_store(&mIndex, index);
+    }
+    return index;
+}
+
+
+void CScreenMacroTools::setCascade(const ImProcU8::Cascade* pCascade)
+{
+    std::shared_ptr<const ImProcU8::Cascade> cascade;
+    if (pCascade)
+        cascade = std::make_shared<const ImProcU8::Cascade>(*pCascade);
+    std::atomic_store(&mCascade, cascade);
+    mSearchGen++;  // after the store, a search of the new generation sees the new cascade
+    mpCache->clear();  // results may differ, frees the old ones
+}
+
+
+void CScreenMacroTools::setScaleRange(const ImProcU8::ScaleRange& rRange)
+{
+    std::atomic_store(&mScaleRange, std::make_shared<const ImProcU8::ScaleRange>(rRange));
+    mSearchGen++;  // like setCascade
+    mpCache->clear();  // results may differ, frees the old ones
+}
+
+
+match_t CScreenMacroTools::scaledMatch(const QImage& rFrame, const CPatternRegistry::snapshot_t& rPatterns, patternId_t id, scaling_t scaling,
+    ImProcU8::SearchCtrl* pCtrl)
+{
+    const match_t missing{ QPoint(), false, false, 1.f };
+    const patch_t* pPatch = rPatterns.find(id);
+    if (!pPatch)
+        return missing;
+    float scale;
+    bool hasRegion;
+    region_t region{ QRectF(), NO_PATTERN };
+    {
+        QMutexLocker guard(mpSearchLock);
+        scale = mpScales->value(id, 0.f);
+        auto found = mpRegions->constFind(id);
+        hasRegion = (found != mpRegions->constEnd());
+        if (hasRegion)
+            region = found.value();
+    }
+    QRect roi;
+    if (hasRegion)
+    {// The anchor is searched in this frame too, the result cache makes repeats cheap.
+     // Anchors never form a cycle, setPatternRegion refuses them.
+        match_t anchorHit = missing;
+        if (region.anchor != NO_PATTERN)
+            anchorHit = scaledMatch(rFrame, rPatterns, region.anchor, scaling, pCtrl);
+        if (!regionRoi(region, *pPatch, rFrame.size(), anchorHit.found ? &anchorHit.pos : nullptr, &roi))
+            return missing;  // its anchor is not in this frame
+    }
+
+    match_t result = cachedMatch(rFrame, *pPatch, scaling, pCtrl, (scaling == SCL_WINDOW) ? &scale : nullptr,
+        roi.isNull() ? nullptr : &roi);
+    if ((scaling == SCL_WINDOW) && result.found && !result.partial)
+    {
+        QMutexLocker guard(mpSearchLock);
+        mpScales->insert(id, result.scale);
+    }
+    return result;
+}
+
+
+bool CScreenMacroTools::regionRoi(const region_t& rRegion, const patch_t& rInPatch, const QSize& rFrameSize, const QPoint* pAnchorHit,
+    QRect* pOutRoi)
+{
+    QRectF area = rRegion.area;
+    if (rRegion.anchor != NO_PATTERN)
+    {
+        if (!pAnchorHit)
+            return false;
+        area.translate(*pAnchorHit);
+    } else {
+        area = QRectF(area.x() * rFrameSize.width(), area.y() * rFrameSize.height(),
+            area.width() * rFrameSize.width(), area.height() * rFrameSize.height());
+    }
+    QRect roi = area.toAlignedRect();
+    // A region smaller than the pattern holds it around its center
+    const QSize patSize = rInPatch.cutSize.isValid() ? rInPatch.cutSize : rInPatch.img.size();
+    if (roi.width() < patSize.width())
+    {
+        roi.setLeft(roi.center().x() - (patSize.width() >> 1));
+        roi.setWidth(patSize.width());
+    }
+    if (roi.height() < patSize.height())
+    {
+        roi.setTop(roi.center().y() - (patSize.height() >> 1));
+        roi.setHeight(patSize.height());
+    }
+    *pOutRoi = roi & QRect(QPoint(), rFrameSize);
+    return !pOutRoi->isEmpty();
+}
+
+
+match_t CScreenMacroTools::cachedMatch(const QImage& rFrame, const patch_t& rInPatch, scaling_t scaling, ImProcU8::SearchCtrl* pCtrl, float* pInOutScale,
+    const QRect* pRoi)
+{
+    // The same pattern on the same content has the same result
+    const quint64 region = mpCache->regionHash(rFrame, pRoi ? *pRoi : rFrame.rect());
+    const qint64 patternKey = rInPatch.img.cacheKey();  // changes with the pattern pixels
+    // Read before the search loads the settings, a result stored during a change is never looked up
+    const int variant = (mSearchGen.load() << 2) | scaling;
+    CMatchCache::result_t cached;
+    if (region && mpCache->lookup(patternKey, variant, region, &cached))
+        return match_t{ cached.pos, cached.found, false, cached.scale };
+
+    match_t result = matchFrame(rFrame, rInPatch, scaling, pCtrl, nullptr, pInOutScale, pRoi);
+    if (region && !result.partial && !(pCtrl && pCtrl->interrupted))
+        mpCache->store(patternKey, variant, region, CMatchCache::result_t{ result.found, result.pos, result.scale });
+    return result;
+}
+
+
+QFuture<match_t> CScreenMacroTools::windowHasPatternAsync(QString patternKey, scaling_t scaling, int timeoutMs)
+{
+    auto cancelFlag = std::make_shared<std::atomic<bool>>(false);
+    {
+        QMutexLocker guard(mpSearchLock);
+        if (mCancelFlag)
+            mCancelFlag->store(true);  // superseded by this request
+        mCancelFlag = cancelFlag;
+    }
+    std::chrono::steady_clock::time_point deadline;
+    if (timeoutMs > 0)
+        deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+
+    // Frame and pattern are taken now, a null frame yields no match
+    QImage frame;
+    if (mpGrabber)
+        mpGrabber->tryGetImage(&frame);
+    CPatternRegistry::snapshotPtr_t patterns = mpPatterns->snapshot();
+    patternId_t id = mpPatterns->idOf(patternKey);
+    auto requestedAt = std::chrono::steady_clock::now();
+
+    return QtConcurrent::run(
+        mpSearchPool,
+        [this, frame, patterns, id, scaling, cancelFlag, deadline, requestedAt]() {
+            auto startedAt = std::chrono::steady_clock::now();
+            Metrics::observe(Metrics::H_QUEUE_WAIT, startedAt - requestedAt);
+            Trace::record("searchQueued", requestedAt, startedAt);
+            ImProcU8::SearchCtrl ctrl{ cancelFlag.get(), deadline, false };
+            return scaledMatch(frame, *patterns, id, scaling, &ctrl);
+        }
+    );
+}
+
+
+void CScreenMacroTools::cancelSearch()
+{
+    QMutexLocker guard(mpSearchLock);
+    if (mCancelFlag)
+        mCancelFlag->store(true);
+}
+
+
+match_t CScreenMacroTools::anytimeMatch(const QImage& rFrame, QImage* pInOutHalfFrame, const patch_t& rInPatch, scaling_t scaling,
+    ImProcU8::SearchCtrl* pCtrl, float* pInOutScale, const QRect* pRoi)
+{
+    if ((scaling != SCL_OFF) || rInPatch.pyramid.isEmpty()
+        || (std::min(rInPatch.pyramid[0].width(), rInPatch.pyramid[0].height()) < MIN_COARSE_SIZE))
+    {// No coarse level, the deadline cuts the search short instead
+        return matchFrame(rFrame, rInPatch, scaling, pCtrl, nullptr, pInOutScale, pRoi);
+    }
+    if (pInOutHalfFrame->isNull())
+    {// Reduced like the pattern pyramid, shared by the searches of the frame
+        TRACE_("halfFrame");
+        *pInOutHalfFrame = rFrame.scaled(rFrame.width() >> 1, rFrame.height() >> 1, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+    }
+    patch_t coarse = rInPatch;  // shallow
+    coarse.img = rInPatch.pyramid[0];
+    coarse.centerOffset = rInPatch.centerOffset / 2;
+    const QRect coarseRoi = pRoi ? QRect(pRoi->x() >> 1, pRoi->y() >> 1, (pRoi->width() + 1) >> 1, (pRoi->height() + 1) >> 1) : QRect();
+    match_t result = matchFrame(*pInOutHalfFrame, coarse, SCL_OFF, pCtrl, nullptr, nullptr, pRoi ? &coarseRoi : nullptr);
+    result.pos *= 2;
+    if (!result.found)
+        return result;  // absent, or out of time already
+
+    if (!pCtrl->isExpired())
+    {
+        const QPoint hint = result.pos;
+        match_t refined = matchFrame(rFrame, rInPatch, SCL_OFF, pCtrl, &hint, nullptr, pRoi);
+        if (refined.found || !refined.partial)
+            return refined;  // exact, or the coarse hit was wrong
+    }
+    Metrics::add(Metrics::C_COARSE_RESULTS);
+    result.partial = true;  // within a pixel or two
+    return result;
+}
+
+
+match_t CScreenMacroTools::matchFrame(QImage frame, const patch_t& rInPatch, scaling_t scaling, ImProcU8::SearchCtrl* pCtrl, const QPoint* pHint,
+    float* pInOutScale, const QRect* pRoi)
+{
+    match_t result{ QPoint(), false, false, 1.f };
+    const patch_t* patch = &rInPatch;
+    if (frame.isNull()
+        || patch->img.isNull())
+    {
+        return result;
+    }
+    Metrics::add(Metrics::C_SEARCHES);
+    auto convertStart = std::chrono::steady_clock::now();
+    if (frame.format() != QImage::Format_RGB32)
+    {
+        frame.convertToFormat(QImage::Format_RGB32).swap(frame);
+        qWarning("Unsupported screenshot color format, converted to RGB32!");
+    }
+    const QImage whole = frame;  // keeps the pixels of a roi view
+    QPoint roiAt;
+    if (pRoi)
+    {// The view shares the frame pixels, only the roi is searched
+        const QRect roi = *pRoi & whole.rect();
+        if (roi.isEmpty())
+            return result;
+        frame = QImage(whole.constScanLine(roi.top()) + roi.left() * 4, roi.width(), roi.height(), whole.bytesPerLine(), whole.format());
+        roiAt = roi.topLeft();
+        Metrics::add(Metrics::C_ROI_SEARCHES);
+    }
+    float wF = patch->fillPerc * whole.width();  // of the window, not the roi
+    if ((~0u>>1) < wF)            // Does not fit into int
+    {
+        qWarning("(Pattern) Scaling too big, request dropped.");
+        return result;            //throw std::range_error;
+    }
+    int wI = patch->img.width();
+    QImage pattern = patch->img;  // Shallow copy, SCL_WINDOW scales it per search
+
+    if (pattern.format() != QImage::Format_RGB32)
+        pattern.convertToFormat(QImage::Format_RGB32).swap(pattern);
+
+    ImProcU8::imgArr2I_t frmSz = {
+        frame.width(),
+        frame.height()
+    };
+    ImProcU8::imgArr2I_t patSz = {
+        wI,
+        pattern.height()
+    };
+    ImProcU8::imgArr2I_t location = { 0, 0 };
+    // Results are of the pattern as cut, the searched region is off its center
+    const float hintScale = (pInOutScale && (*pInOutScale > 0.f)) ? *pInOutScale : 1.f;
+    if (pHint)
+    {// Only the surrounding of the hint is searched
+        const QPoint regionHint = *pHint - patch->centerOffset * hintScale - roiAt;
+        location[ImProcU8::COOR_LEFT] = regionHint.x();
+        location[ImProcU8::COOR_TOP] = regionHint.y();
+    }
+    int chan = 4;  // rgb qimage always has 4 channels (32bit align)
+    if (scaling == SCL_ZOOM)
+    {
+        frame.convertToFormat(QImage::Format_Grayscale8).swap(frame);
+        if (patch->gray.isNull())
+            pattern.convertToFormat(QImage::Format_Grayscale8).swap(pattern);
+        else
+            pattern = patch->gray;  // precomputed
+        chan = 1;
+    }
+    Metrics::observe(Metrics::H_CONVERT, std::chrono::steady_clock::now() - convertStart);
+    Trace::record("convert", convertStart, std::chrono::steady_clock::now());
+    TRACE_("match");
+    Metrics::ScopeTimer timer((scaling == SCL_ZOOM) ? Metrics::H_MATCH_FEATURES : Metrics::H_MATCH_TEMPLATE);
+    ImProcU8::Image parent{
+        frame.constBits(),
+        frame.bytesPerLine(),
+        chan,
+        frmSz
+    };
+    ImProcU8::Image target{
+        pattern.constBits(),
+        pattern.bytesPerLine(),
+        chan,
+        patSz
+    };
+    if ((scaling == SCL_ZOOM) && (patch->descrBytes > 0) && !patch->descriptors.isEmpty())
+    {// Pattern features are precomputed
+        ImProcU8::Features feat{
+            reinterpret_cast<const float*>(patch->keyPts.constData()),
+            reinterpret_cast<const ImProcU8::imgPxl_t*>(patch->descriptors.constData()),
+            patch->descriptors.size() / patch->descrBytes,
+            patch->descrBytes,
+            patch->featSize.width(),
+            patch->featSize.height(),
+            (pattern.width() > 0) ? static_cast<float>(patch->featSize.width()) / pattern.width() : 0.f  // pattern is the described gray one
+        };
+        result.found = ImProcU8::locateFeaturesIn(parent, feat, location, true, 0.75f, pCtrl, &result.scale);
+    } else if (scaling == SCL_WINDOW) {
+        // Around the size the pattern had in its window, the window may have been resized since
+        const float guess = (wF > 16) ? wF / wI : 1.f;
+        ImProcU8::ScaleRange range = *std::atomic_load(&mScaleRange);
+        range.minScale *= guess;
+        range.maxScale *= guess;
+        float scale = pInOutScale ? *pInOutScale : 0.f;
+        result.found = ImProcU8::locatePatternScaled(parent, target, range, location, &scale, 0.7f, pCtrl);
+        if (result.found)
+        {
+            result.scale = scale;
+            if (pInOutScale)
+                *pInOutScale = scale;
+        }
+    } else {
+        const std::shared_ptr<const ImProcU8::Cascade> cascade = std::atomic_load(&mCascade);
+        ImProcU8::CascadeStats stats = {};
+        result.found = (scaling == SCL_ZOOM) ?
+            ImProcU8::locateFeaturesIn(parent, target, location, true, 0.75f, pCtrl, &result.scale) :
+            ImProcU8::locatePatternIn(parent, target, location, PATTERN_CERTAINTY, pCtrl, cascade.get(), &stats);
+        Metrics::add(Metrics::C_CASCADE_WINDOWS, stats.windows);
+        Metrics::add(Metrics::C_REJECTED_STATS, stats.rejectedStats);
+        Metrics::add(Metrics::C_REJECTED_SIGNATURE, stats.rejectedSignature);
+    }
+    if (pCtrl && pCtrl->interrupted)
+    {// A cancelled search is stale, its result is discarded
+        if (pCtrl->isCancelled())
+            result.found = false;
+        else
+            result.partial = true;
+    }
+    if (result.found)
+    {
+        Metrics::add(Metrics::C_FOUND);
+        result.pos.setX(location[ImProcU8::COOR_LEFT]);
+        result.pos.setY(location[ImProcU8::COOR_TOP]);
+        result.pos += patch->centerOffset * result.scale + roiAt;
+    }
+    return result;
+}
+#pragma endregion
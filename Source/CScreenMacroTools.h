@@ -1,55 +1,192 @@
-#pragma once
-
-template <typename T> class QVector;
-template <typename T1, typename T2> class QMap;
-class QThread;
-class QSize;
-class CCaptureEngine;
-
-
-#include <QPixmap>
-#include <QString>
-#include <QImage>
-
-
-struct patch_t {
-    QImage img;
-    float fillPerc;
-};
-
-
-class CScreenMacroTools
-{
-    QMap<QString, patch_t>* mpPatterns;
-    CCaptureEngine* mpGrabber;
-    QThread* mpCaptureLoop;
-    QVector<const void*>* mpHandles;
-    //QImage mFrame;
-
-    const void* getMappedHdl(int idx);
-
-    void startCapture(const void* wndPtr=nullptr);
-    void stopCapture();
-    void createCaptureTask();
-    void killCaptureTask();
-
-protected:
-    
-
-public:
-    enum scaling_t{ SCL_OFF, SCL_WINDOW, SCL_ZOOM };
-
-    CScreenMacroTools();
-    ~CScreenMacroTools();
-
-    QPixmap getWndCapture();
-    void getWindowNames(QVector<QString>* pOutNames);
-
-    bool setTargetWindow(int idx);
-    void setPattern(QString patternKey, const QPixmap& rInPattern, float fillFact);
-
-    void start(int idx) { startCapture(getMappedHdl(idx)); }  // temporary
-    void stop() { stopCapture(); }  // temporary
-    void simulateClickAt(int wndIdx, const QPoint& rInWndPos=QPoint(0,0));
-    bool windowHasPattern(QString patternKey, scaling_t scaling, QPoint* pOutPos=nullptr);
+#pragma once
+
+template <typename T> class QVector;
+template <typename T1, typename T2> class QMap;
+template <typename K, typename V> class QHash;
+class QThread;
+class QThreadPool;
+class QMutex;
+class QSize;
+class QRect;
+class QRectF;
+class CCaptureEngine;
+class CDetectionPool;
+class CActionDispatcher;
+namespace ImProcU8 { struct SearchCtrl; struct Cascade; struct ScaleRange; }
+
+
+#include <QPixmap>
+#include <QString>
+#include <QImage>
+#include <QPoint>
+#include <QFuture>
+#include <QStringList>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <functional>
+#include <vector>
+
+#include "CPatternRegistry.h"  // patch_t, patternId_t
+#include "CRuleEngine.h"
+#include "CMatchCache.h"
+#include "CPatternIndex.h"
+
+
+struct match_t {
+    QPoint pos;
+    bool found;
+    bool partial;  // search ran into its deadline, pos is the best so far
+    float scale;   // of the pattern where found, 1 unless searched with SCL_WINDOW or SCL_ZOOM
+};
+
+// Receives the result of every pattern in a monitored frame, called from a pool worker
+using detect_fn_t = std::function<void(int monitorId, patternId_t patternId, const match_t& rResult)>;
+
+
+class CScreenMacroTools
+{
+    struct monitor_t;
+    struct region_t;
+
+    CPatternRegistry* mpPatterns;
+    CCaptureEngine* mpGrabber;
+    QThread* mpCaptureLoop;
+    QVector<const void*>* mpHandles;
+    QThreadPool* mpSearchPool;
+    QMutex* mpSearchLock;
+    std::shared_ptr<std::atomic<bool>> mCancelFlag;  // of the latest async search
+    std::atomic<bool> mClosing;  // stops the background work of the pool
+    QMap<int, monitor_t*>* mpMonitors;
+    CDetectionPool* mpDetector;
+    CActionDispatcher* mpDispatcher;
+    CMatchCache* mpCache;
+    std::shared_ptr<const ImProcU8::Cascade> mCascade;  // only accessed through atomic_load/store, null (default) correlates every window
+    std::atomic<int> mSearchGen;  // of the search settings, cached results of older ones are not used
+    std::shared_ptr<const ImProcU8::ScaleRange> mScaleRange;  // of SCL_WINDOW relative to the fillPerc guess, atomic_load/store only
+    QHash<patternId_t, float>* mpScales;  // last SCL_WINDOW scales in the target window
+    QHash<patternId_t, int>* mpPriorities;  // priority_t, only set ones
+    QHash<patternId_t, region_t>* mpRegions;  // only set ones
+    std::shared_ptr<const CPatternIndex> mIndex;  // only accessed through atomic_load/store
+    detect_fn_t mOnDetected;
+    QString mRingName;  // frames are published under it when not empty
+    int mNextMonitor;
+    //QImage mFrame;
+
+    const void* getMappedHdl(int idx);
+
+    // Runs in the search pool, replaces the pattern unless it was set again meanwhile
+    void selectRegion(patternId_t id, patch_t patch, const QImage& rSourceFrame, const QPoint& rCutAt);
+    void startCapture(const void* wndPtr=nullptr);
+    void stopCapture();
+    void createCaptureTask();
+    void killCaptureTask();
+
+protected:
+    
+
+public:
+    enum scaling_t{ SCL_OFF, SCL_WINDOW, SCL_ZOOM };
+    // Order of the searches in a monitored frame. Critical ones are never deferred.
+    enum priority_t{ PRIO_CRITICAL, PRIO_NORMAL, PRIO_BACKGROUND };
+
+    CScreenMacroTools();
+    ~CScreenMacroTools();
+
+    QPixmap getWndCapture();
+    // Latest capture as a deep copy, converted in the calling thread
+    bool getWndFrame(QImage* pOutFrame);
+    void getWindowNames(QVector<QString>* pOutNames);
+
+    bool setTargetWindow(int idx);
+    // With the frame it was cut from, only the smallest distinct region of the pattern
+    // is searched, once it is selected in the background. Results still are the center of the pattern as cut.
+    void setPattern(QString patternKey, const QPixmap& rInPattern, float fillFact, const QImage& rSourceFrame=QImage(),
+        const QPoint& rCutAt=QPoint());
+    patternId_t getPatternId(const QString& rKey) const;
+    QString getPatternKey(patternId_t id) const;
+    QSize getPatternSize(const QString& rKey) const;  // as captured, invalid if unknown
+    // Patterns persist in a memory mapped CPatternLibrary file
+    bool loadLibrary(const QString& rPath);
+    bool saveLibrary(const QString& rPath);
+
+    void start(int idx) { startCapture(getMappedHdl(idx)); }  // temporary
+    // Captured frames also go to a shared memory CFrameRing for analyzers in
+    // other processes. Applies from the next capture, empty turns it off.
+    void setFrameRing(const QString& rName);
+    void stop() { stopCapture(); }  // temporary
+    void simulateClickAt(int wndIdx, const QPoint& rInWndPos=QPoint(0,0));
+    bool windowHasPattern(QString patternKey, scaling_t scaling, QPoint* pOutPos=nullptr);
+    // Same search on a frame from elsewhere (recording, synthetic screen)
+    match_t frameHasPattern(const QImage& rFrame, const QString& rPatternKey, scaling_t scaling);
+    // Searches in the thread pool, a newer request cancels the one in flight.
+    // With timeoutMs > 0 the search returns its best result when time runs out.
+    QFuture<match_t> windowHasPatternAsync(QString patternKey, scaling_t scaling, int timeoutMs=0);
+    void cancelSearch();
+    // Results of windowHasPattern and frameHasPattern by region content
+    CMatchCache::stats_t getCacheStats() { return mpCache->getStats(); }
+    // Keeps the block hashes of a frame searched for several patterns by frameHasPattern
+    // while other frames are searched meanwhile, until released
+    void holdFrame(const QImage& rFrame) { mpCache->holdFrame(rFrame); }
+    void releaseFrame(const QImage& rFrame) { mpCache->releaseFrame(rFrame); }
+    // Prefilter of the template engines, off by default. With it a pattern is found by its
+    // correlation score alone, not by the score range of the frame. Null turns it off.
+    // Searches running meanwhile finish with the one they started with.
+    void setCascade(const ImProcU8::Cascade* pCascade);
+    // Scales SCL_WINDOW tries, as factors of the size the pattern had in its window.
+    // Searches running meanwhile finish with the range they started with.
+    void setScaleRange(const ImProcU8::ScaleRange& rRange);
+    // With a hint (pattern center) only its surrounding is searched, with a roi only that part of the frame.
+    // SCL_WINDOW tries the scale in pInOutScale first and updates it.
+    match_t matchFrame(QImage frame, const patch_t& rInPatch, scaling_t scaling, ImProcU8::SearchCtrl* pCtrl=nullptr, const QPoint* pHint=nullptr,
+        float* pInOutScale=nullptr, const QRect* pRoi=nullptr);
+
+    // Monitors capture their window at their own period and search their
+    // pattern set on a detection pool shared by all windows.
+    void setDetectionHandler(detect_fn_t handler) { mOnDetected = handler; }  // before adding monitors
+    int addMonitor(int wndIdx, int periodMs, const QStringList& rPatternKeys, scaling_t scaling);
+    void setMonitorPatterns(int monitorId, const QStringList& rPatternKeys);
+    // PRIO_NORMAL unless set, applies from the next frame
+    void setPatternPriority(const QString& rKey, priority_t priority);
+    // Where a pattern can appear, the whole frame unless set. Without anchor rArea is in
+    // fractions of the frame, (0.75, 0.9, 0.25, 0.1) is a bottom right toolbar. With an
+    // anchor it is in pixels around the center of the anchor pattern in the same frame.
+    // Anchors are searched first in every searched frame, a pattern whose anchor is missing
+    // is not searched. A null area removes the region.
+    void setPatternRegion(const QString& rKey, const QRectF& rArea, const QString& rAnchorKey=QString());
+    // Time from capture till the searches of a frame shall be done, 0 is unlimited.
+    // Critical patterns always run to the end. Past the budget the others return
+    // their coarse result, and those not started yet are deferred to the next frames.
+    // With rules nothing is deferred, a rule needs every result it asks for.
+    void setMonitorBudget(int monitorId, int budgetMs);
+    void removeMonitor(int monitorId);
+    // Rules replace the pattern list of the monitor, their clicks go to its window.
+    // An empty rule set searches the pattern list again.
+    bool setMonitorRules(int monitorId, const std::vector<CRuleEngine::rule_t>& rRules);
+    // Ids stay valid across setMonitorRules, they may be taken before the rules are set
+    int getMonitorStateId(int monitorId, const QString& rName);
+    // Every monitor keeps its recent frames, maxBytes 0 turns the history off.
+    // A saved history replays through CFrameHistoryReader.
+    void setMonitorHistory(int monitorId, qint64 maxBytes);
+    bool saveMonitorHistory(int monitorId, const QString& rPath);
+
+private:
+    // Of the current registry version, rebuilt on first use after a change
+    std::shared_ptr<const CPatternIndex> patternIndex(const CPatternRegistry::snapshot_t& rPatterns);
+    match_t cachedMatch(const QImage& rFrame, const patch_t& rInPatch, scaling_t scaling, ImProcU8::SearchCtrl* pCtrl=nullptr,
+        float* pInOutScale=nullptr, const QRect* pRoi=nullptr);
+    // Patterns tend to keep their size in a window, the next search starts with it.
+    // Searches the region of the pattern, relative to its anchor found in the same frame.
+    match_t scaledMatch(const QImage& rFrame, const CPatternRegistry::snapshot_t& rPatterns, patternId_t id, scaling_t scaling,
+        ImProcU8::SearchCtrl* pCtrl=nullptr);
+    // Anytime search for a frame budget: the half resolution pyramid level first,
+    // refined at full resolution around its hit while time remains
+    match_t anytimeMatch(const QImage& rFrame, QImage* pInOutHalfFrame, const patch_t& rInPatch, scaling_t scaling,
+        ImProcU8::SearchCtrl* pCtrl, float* pInOutScale=nullptr, const QRect* pRoi=nullptr);
+    // Part of the frame a region covers, grown to hold the pattern.
+    // False if the region has an anchor and pAnchorHit is null.
+    static bool regionRoi(const region_t& rRegion, const patch_t& rInPatch, const QSize& rFrameSize, const QPoint* pAnchorHit, QRect* pOutRoi);
+    void detectIn(monitor_t* pMon, QImage frame, std::chrono::steady_clock::time_point capturedAt);
+    void clickAt(const void* hWnd, const QPoint& rInWndPos);
 };
\ No newline at end of file
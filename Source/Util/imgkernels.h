@@ -0,0 +1,291 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define KERNELS_SSE2_
+#include <emmintrin.h>
+#endif
+
+// Inner loops of imgproc specialized at compile time.
+// The pixel format fixes the channel step and the pattern width the trip count,
+// so the loops unroll and vectorize. imgproc picks the instantiation once per
+// search, nothing branches per pixel.
+namespace ImProcU8 {
+namespace Kernels {
+
+enum pixelFormat_t { PF_BGRA8 = 4, PF_GRAY8 = 1 };  // value is the channel count
+
+// Pixel sums of a pattern, computed once per search
+struct patternMoments_t {
+    long long sums[4];  // per channel, gray uses the first
+    double norm;        // root of the summed squared deviations from the channel means
+};
+
+template <pixelFormat_t F>
+struct format_t {
+    static const int CHANNELS = F;  // interleaved, alpha included like matchTemplate does
+};
+
+
+// Sums of a window of width W (0: the runtime width w) in integers, exact and free of
+// float reductions the compiler could not reorder. Cross products and squares are
+// summed over all channels, only the plain sums are needed per channel.
+template <pixelFormat_t F, int W>
+inline void windowSums(const unsigned char* pWnd, size_t step, const unsigned char* pPat, size_t patStep,
+    int w, int h, long long* pOutSums, long long& rOutCross, long long& rOutSq)
+{
+    const int CH = format_t<F>::CHANNELS;
+    const int width = W ? W : w;
+    for (int y = 0; y < h; y++)
+    {
+        const unsigned char* pRow = pWnd + y * step;
+        const unsigned char* pPatRow = pPat + y * patStep;
+        int sums[CH] = {};
+        int cross = 0;  // a row of MAX_PATTERN_SIZE pixels fits 32 bits
+        int sq = 0;
+        for (int x = 0; x < width; x++)
+        {
+            for (int c = 0; c < CH; c++)
+                sums[c] += pRow[x * CH + c];
+        }
+        for (int i = 0; i < width * CH; i++)
+        {
+            const int val = pRow[i];
+            cross += val * pPatRow[i];
+            sq += val * val;
+        }
+        for (int c = 0; c < CH; c++)
+            pOutSums[c] += sums[c];
+        rOutCross += cross;
+        rOutSq += sq;
+    }
+}
+
+/**
+ TM_CCOEFF_NORMED of a single window, for scattered windows where matchTemplate
+ would correlate the whole area. Equal to it up to rounding.
+ @param pWnd, step     top left pixel of the window in the searched image.
+ @param pPat, patStep  top left pixel of the pattern, same format.
+ @param rPat           moments of the pattern, see patternMoments.
+ */
+template <pixelFormat_t F, int W>
+float windowScore(const unsigned char* pWnd, size_t step, const unsigned char* pPat, size_t patStep,
+    const patternMoments_t& rPat, int w, int h)
+{
+    const int CH = format_t<F>::CHANNELS;
+    long long sums[CH] = {};
+    long long cross = 0;
+    long long sq = 0;
+    windowSums<F, W>(pWnd, step, pPat, patStep, w, h, sums, cross, sq);
+
+    // Deviation products, the means only enter once per window
+    const double pixels = static_cast<double>(W ? W : w) * h;
+    double dot = static_cast<double>(cross);
+    double var = static_cast<double>(sq);
+    for (int c = 0; c < CH; c++)
+    {
+        dot -= static_cast<double>(sums[c]) * rPat.sums[c] / pixels;
+        var -= static_cast<double>(sums[c]) * sums[c] / pixels;
+    }
+    if ((var <= 0.) || (rPat.norm <= 0.))
+        return 0.f;
+    return static_cast<float>(dot / (rPat.norm * std::sqrt(var)));
+}
+
+template <pixelFormat_t F>
+patternMoments_t patternMoments(const unsigned char* pPat, size_t patStep, int w, int h)
+{
+    const int CH = format_t<F>::CHANNELS;
+    long long sums[CH] = {};
+    long long cross = 0;
+    long long sq = 0;
+    windowSums<F, 0>(pPat, patStep, pPat, patStep, w, h, sums, cross, sq);
+    patternMoments_t moments = { { 0, 0, 0, 0 }, 0. };
+    double var = static_cast<double>(sq);
+    for (int c = 0; c < CH; c++)
+    {
+        moments.sums[c] = sums[c];
+        var -= static_cast<double>(sums[c]) * sums[c] / (static_cast<double>(w) * h);
+    }
+    moments.norm = (var > 0.) ? std::sqrt(var) : 0.;
+    return moments;
+}
+
+
+using scoreFn_t = float (*)(const unsigned char*, size_t, const unsigned char*, size_t, const patternMoments_t&, int, int);
+
+// Common icon widths get their own code, other widths the generic loop
+template <pixelFormat_t F>
+scoreFn_t scoreKernel(int width)
+{
+    switch (width)
+    {
+    case 16: return &windowScore<F, 16>;
+    case 24: return &windowScore<F, 24>;
+    case 32: return &windowScore<F, 32>;
+    case 48: return &windowScore<F, 48>;
+    default: return &windowScore<F, 0>;
+    }
+}
+
+inline scoreFn_t scoreKernel(pixelFormat_t format, int width)
+{
+    return (format == PF_GRAY8) ? scoreKernel<PF_GRAY8>(width) : scoreKernel<PF_BGRA8>(width);
+}
+
+inline patternMoments_t patternMoments(pixelFormat_t format, const unsigned char* pPat, size_t patStep, int w, int h)
+{
+    return (format == PF_GRAY8) ? patternMoments<PF_GRAY8>(pPat, patStep, w, h) : patternMoments<PF_BGRA8>(pPat, patStep, w, h);
+}
+
+
+// Pattern of the integer correlation, rows widened to 16 bit once per search
+struct fixedPattern_t {
+    std::vector<short> pixels;  // rowLen values per row
+    int rowLen;                 // width * channels
+    int width;
+    int height;
+    patternMoments_t moments;
+};
+
+// Integral images of a band of pixel rows, rebuilt per band: window sums per channel
+// in 32 bit, they wrap but a window sum fits, and squares summed over the channels in 64 bit
+struct areaIntegrals_t {
+    std::vector<unsigned> sums;     // (rows + 1) lines of (cols + 1) * channels
+    std::vector<long long> squares; // (rows + 1) lines of (cols + 1)
+    int cols;
+    int rows;
+};
+
+/**
+ Sum of the products of n bytes and n 16bit pattern values.
+ SSE2 widens 16 bytes per step and multiplies and adds pairs to 32bit lanes (pmaddwd).
+ The pattern is not packed to signed bytes for pmaddubsw, its pair sums saturate.
+ A row of MAX_PATTERN_SIZE pixels fits 32 bits.
+ */
+inline int rowCross(const unsigned char* pRow, const short* pPat, int n)
+{
+    int i = 0;
+    int cross = 0;
+#ifdef KERNELS_SSE2_
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (; i + 16 <= n; i += 16)
+    {
+        const __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pRow + i));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(px, zero), _mm_loadu_si128(reinterpret_cast<const __m128i*>(pPat + i))));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpackhi_epi8(px, zero), _mm_loadu_si128(reinterpret_cast<const __m128i*>(pPat + i + 8))));
+    }
+    for (; i + 8 <= n; i += 8)
+    {
+        const __m128i px = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(pRow + i));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(px, zero), _mm_loadu_si128(reinterpret_cast<const __m128i*>(pPat + i))));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    cross = _mm_cvtsi128_si32(acc);
+#endif
+    for (; i < n; i++)
+        cross += pRow[i] * pPat[i];
+    return cross;
+}
+
+template <pixelFormat_t F>
+fixedPattern_t fixedPattern(const unsigned char* pPat, size_t patStep, int w, int h)
+{
+    const int CH = format_t<F>::CHANNELS;
+    fixedPattern_t pattern = { std::vector<short>(static_cast<size_t>(w) * CH * h), w * CH, w, h, patternMoments<F>(pPat, patStep, w, h) };
+    for (int y = 0; y < h; y++)
+    {
+        for (int i = 0; i < pattern.rowLen; i++)
+            pattern.pixels[y * pattern.rowLen + i] = pPat[y * patStep + i];
+    }
+    return pattern;
+}
+
+template <pixelFormat_t F>
+void areaIntegrals(const unsigned char* pArea, size_t step, int w, int h, areaIntegrals_t& rOut)
+{
+    const int CH = format_t<F>::CHANNELS;
+    const int line = (w + 1) * CH;
+    rOut.cols = w + 1;
+    rOut.rows = h + 1;
+    rOut.sums.assign(static_cast<size_t>(line) * (h + 1), 0u);
+    rOut.squares.assign(static_cast<size_t>(w + 1) * (h + 1), 0ll);
+    for (int y = 0; y < h; y++)
+    {
+        const unsigned char* pRow = pArea + y * step;
+        const unsigned* pSumAbove = rOut.sums.data() + y * line;
+        unsigned* pSum = rOut.sums.data() + (y + 1) * line;
+        const long long* pSqAbove = rOut.squares.data() + y * rOut.cols;
+        long long* pSq = rOut.squares.data() + (y + 1) * rOut.cols;
+        unsigned rowSums[CH] = {};
+        long long rowSq = 0;
+        for (int x = 0; x < w; x++)
+        {
+            for (int c = 0; c < CH; c++)
+            {
+                const unsigned val = pRow[x * CH + c];
+                rowSums[c] += val;
+                rowSq += val * val;
+                pSum[(x + 1) * CH + c] = pSumAbove[(x + 1) * CH + c] + rowSums[c];
+            }
+            pSq[x + 1] = pSqAbove[x + 1] + rowSq;
+        }
+    }
+}
+
+/**
+ TM_CCOEFF_NORMED of all windows of result row y, like windowScore, but the window
+ sums come from the integrals and only the extrema of the row are kept.
+ @param pArea, step  top left pixel of the band, the integrals are of it. y is relative to it.
+ @param resCols      windows in the row.
+ */
+template <pixelFormat_t F>
+void rowScores(const unsigned char* pArea, size_t step, const areaIntegrals_t& rInt, const fixedPattern_t& rPat, int y, int resCols,
+    float& rOutMax, int& rOutMaxX, float& rOutMin)
+{
+    const int CH = format_t<F>::CHANNELS;
+    const int line = rInt.cols * CH;
+    const double pixels = static_cast<double>(rPat.width) * rPat.height;
+    const unsigned* pTop = rInt.sums.data() + y * line;
+    const unsigned* pBot = rInt.sums.data() + (y + rPat.height) * line;
+    const long long* pSqTop = rInt.squares.data() + y * rInt.cols;
+    const long long* pSqBot = rInt.squares.data() + (y + rPat.height) * rInt.cols;
+    rOutMax = -2.f;
+    rOutMaxX = 0;
+    rOutMin = 2.f;
+    for (int x = 0; x < resCols; x++)
+    {
+        const int x0 = x * CH;
+        const int x1 = (x + rPat.width) * CH;
+        double dot = 0.;
+        double var = static_cast<double>(pSqBot[x + rPat.width] - pSqBot[x] - pSqTop[x + rPat.width] + pSqTop[x]);
+        for (int c = 0; c < CH; c++)
+        {
+            const double sum = static_cast<double>(pBot[x1 + c] - pBot[x0 + c] - pTop[x1 + c] + pTop[x0 + c]);
+            dot -= sum * rPat.moments.sums[c] / pixels;
+            var -= sum * sum / pixels;
+        }
+        float score = 0.f;  // single color, like matchTemplate
+        if ((var > 0.5) && (rPat.moments.norm > 0.))
+        {
+            long long cross = 0;
+            for (int py = 0; py < rPat.height; py++)
+                cross += rowCross(pArea + (y + py) * step + x0, rPat.pixels.data() + py * rPat.rowLen, rPat.rowLen);
+            score = static_cast<float>((dot + static_cast<double>(cross)) / (rPat.moments.norm * std::sqrt(var)));
+        }
+        if (score > rOutMax)
+        {
+            rOutMax = score;
+            rOutMaxX = x;
+        }
+        rOutMin = (score < rOutMin) ? score : rOutMin;
+    }
+}
+
+} // namespace Kernels
+} // namespace ImProcU8
@@ -1,319 +1,1296 @@
-#include "imgproc.h"
-
-#include <vector>
-#include <opencv2/core/version.hpp>
-#if CV_VERSION_MAJOR >= 3 && CV_VERSION_MINOR > 3
-  // Bugfix: Missing channel_type in Mat_ due to deprecated cv::DataType
-  #define OPENCV_TRAITS_ENABLE_DEPRECATED
-#endif
-
-//#include <opencv2/core/hal/interface.h>  // basic types
-//#include <opencv2/core/mat.hpp>
-//#include <opencv2/core/types.hpp>  // cv structs
-//#include <opencv2/core/cvstd.hpp>  // math, algorythm, ptr...
-#include <opencv2/core.hpp>
-#include <opencv2/imgproc.hpp>       // template match
-#include <opencv2/features2d.hpp>    // feature detection & descriptor
-#include <opencv2/calib3d.hpp>       // camera estimation
-
-
-#ifndef NDEBUG
-#include <iostream>
-#define MSG_(msg) std::cout << msg << std::endl
-#else
-#define MSG_(msg)
-#endif
-
-inline bool evalLimits(double x, double y, int xLim, int yLim)
-{// false == failed Limit test
-    return !(cv::min(x, y) < 0 ||
-        x > xLim ||
-        y > yLim ||
-        cv::max(x, y) > std::numeric_limits<int>::max()
-        );
-}
-
-
-namespace ImProcU8 {
-using namespace cv;
-
-// Maximum number of points used for estimation of location
-const int MAX_FOR_PT_ESTIM = 32;
-
-// Feature detector: pixel value difference of 20, filter duplicates, feature window with diameter of 9pxl, circumference 16pxl
-// ORB filters out too much features in a sample parent image (pyramid?), we use FAST instead.
-Ptr<FastFeatureDetector> gDetPtr = FastFeatureDetector::create(20, true);//, FastFeatureDetector::TYPE_7_12);
-
-// FastFeatureDetector::compute() crashes, we use ORB instead
-Ptr<ORB> gDescrPtr = ORB::create();
-
-// Feature matcher: Use hamming distance (NORM_HAMMING==6)
-// Crosscheck (Im1ToIm2/Im2ToIm1) crashes with knnMatch().
-// Faster FlannBasedMatcher crashes, maybe it does not understand ORB descriptors
-Ptr<BFMatcher> gCoplPtr = BFMatcher::create(NORM_HAMMING);
-// Note: cv::Ptr is a shared pointer with automatic garbage collection
-
-bool locatePatternIn(const Image& rInSrc, const Image& rInTar, imgArr2I_t aInOutXyLoc, float certaintyPerc)
-{
-    if (certaintyPerc < 0.02)
-    {
-        certaintyPerc = 0.02f;
-    }
-    int w1, w2, h1, h2;
-    w1 = rInSrc.aSizes[D_WIDTH];
-    h1 = rInSrc.aSizes[D_HEIGHT];
-    w2 = rInTar.aSizes[D_WIDTH];
-    h2 = rInTar.aSizes[D_HEIGHT];
-
-    int l1, l2, s1, s2;
-    l1 = max(w1, h1);
-    l2 = max(w2, h2);
-    s1 = min(w1, h1);
-    s2 = min(w2, h2);
-
-    if (rInSrc.channels != 4 || rInTar.channels != 4)
-        return false;  //throw std::invalid_argument;
-    // TODO: handle overlapping pattern (can be cut out in several ways)
-    if ((w2 > w1) || (h2 > h1))
-        return false;
-    if ((1 > min(s1, s2)) ||
-        (MAX_PATTERN_SIZE < l2)
-       )
-    {
-        return false;  //throw std::invalid_argument;
-    }
-    // There is no const data ctor for mat, but we use the pointer only for reading
-    const Mat csrc(h1, w1, CV_8UC4, const_cast<uchar*>(rInSrc.pDat), rInSrc.lneLenByte);
-    const Mat cpat(h2, w2, CV_8UC4, const_cast<uchar*>(rInTar.pDat), rInTar.lneLenByte);
-    Mat result(h1 - h2 + 1, w1 - w2 + 1, CV_32FC1);
-
-#ifndef NDEBUG
-    int64 ts = getTickCount();
-#endif
-
-    /*
-        matching methods:
-        SQDIFF: pixel difference (substract)
-        CCORR:  pixel correlation (product)
-        CCOEFF: feature pixel correlation (deviation product)
-    */
-    if (aInOutXyLoc && ((aInOutXyLoc[COOR_LEFT] & aInOutXyLoc[COOR_TOP]) != 0))
-    {// Create a 3x3 subset for less amounts of pixel
-        const Mat subs(
-            csrc,
-            Rect(
-                aInOutXyLoc[COOR_LEFT]-(w2>>1)-w2,
-                aInOutXyLoc[COOR_TOP]-(h2>>1)-h2,
-                (w2<<1)+w2,
-                (h2<<1)+h2)
-        );
-        matchTemplate(subs, cpat, result, TM_CCOEFF_NORMED);
-    } else {
-        matchTemplate(csrc, cpat, result, TM_CCOEFF_NORMED);
-    }
-    double minVal, maxVal, range;
-    Point exLoc;
-    minMaxLoc(result, &minVal, &maxVal, NULL, &exLoc);  // location of extrema
-
-#ifndef NDEBUG
-    MSG_("Locate by pattern, time: " << (1000 * (getTickCount() - ts) / getTickFrequency()) << " msec");
-#endif
-
-    range = maxVal - minVal;
-    // extrema must be high enough and discrete from noise
-    if (range > certaintyPerc)
-    {
-        if (aInOutXyLoc)
-        {
-            aInOutXyLoc[COOR_LEFT] = exLoc.x + (w2 >> 1);
-            aInOutXyLoc[COOR_TOP] = exLoc.y + (h2 >> 1);
-        }
-        return (abs(maxVal) / range) > certaintyPerc;
-    } else
-        return false;
-}
-
-
-bool locateFeaturesIn(const Image& rInSrc, const Image& rInTar, imgArr2I_t aInOutXyLoc, bool ratioTest, float maxDistRatio)
-{
-    int w1, w2, h1, h2;
-    w1 = rInSrc.aSizes[D_WIDTH];
-    h1 = rInSrc.aSizes[D_HEIGHT];
-    w2 = rInTar.aSizes[D_WIDTH];
-    h2 = rInTar.aSizes[D_HEIGHT];
-
-    if (rInSrc.channels != 1 || rInTar.channels != 1)
-        return false;
-
-    // There is no const data ctor for mat, but we use the pointer only for reading
-    const Mat csrc(h1, w1, CV_8U, const_cast<uchar*>(rInSrc.pDat), rInSrc.lneLenByte);
-    const Mat cpat(h2, w2, CV_8U, const_cast<uchar*>(rInTar.pDat), rInTar.lneLenByte);
-
-    std::vector<KeyPoint> srcKp, tarKp;
-    std::vector<DMatch> matches;
-    std::vector<std::vector<DMatch>> matchResults;
-    std::vector<Point2f> srcPts, tarPts;
-    Mat srcScr, tarScr, transf, src, tar, inlierMap;
-
-#ifndef NDEBUG
-    Mat result;
-    int64 ts = getTickCount();
-    double elapsed = 0;
-#endif
-    // Resize pattern to find it better within downscaled content.
-    resize(cpat, tar, Size(), 0.9, 0.9, INTER_LINEAR_EXACT);
-    w2 = tar.cols;
-    h2 = tar.rows;
-
-    // Edge detector is vulnerable to image noise
-    medianBlur(csrc, src, 3);
-    medianBlur(tar, tar, 3);
-    //tar = cpat;
-    //src = csrc;
-    if (aInOutXyLoc && ((aInOutXyLoc[COOR_LEFT] & aInOutXyLoc[COOR_TOP]) != 0))
-    {// Create a 3x3 subset for less amounts of pixel
-        const Mat subs(
-            src,
-            Rect(
-                aInOutXyLoc[COOR_LEFT] - (w2 >> 1) - w2,
-                aInOutXyLoc[COOR_TOP] - (h2 >> 1) - h2,
-                (w2 << 1) + w2,
-                (h2 << 1) + h2)
-        );
-        // The max amount of found features is still same
-        gDetPtr->detect(subs, srcKp);
-        gDescrPtr->compute(subs, srcKp, srcScr);
-    } else
-    {
-        gDetPtr->detect(src, srcKp);
-        gDescrPtr->compute(src, srcKp, srcScr);
-    }
-    gDetPtr->detect(tar, tarKp);
-    gDescrPtr->compute(tar, tarKp, tarScr);
-    //todo: limit queries to 2k
-    if (ratioTest)
-    {// For each src descriptor, search the best 2 matches (Crashes with too many queries)
-        gCoplPtr->knnMatch(srcScr, tarScr, matchResults, 2);  // tarScr is temporarily trained, not stored in instance
-        for (auto it = matchResults.cbegin(); it != matchResults.cend(); it++)
-        {
-            switch (it->size())
-            {
-            case 2:  // Skip ambiguous results
-                if ((it->at(0).distance / it->at(1).distance) > maxDistRatio)
-                {
-                    break;
-                }
-                //[fallthrough]
-            case 1:
-                // idx0 has always the smallest distance
-                matches.emplace_back((*it)[0]);
-                break;
-            default:  // 0 or more than 2 results
-                break;
-            }
-        }// for all matchResults
-    } else {
-     // For each src descriptor, search the best match
-        gCoplPtr->match(srcScr, tarScr, matches);
-    }
-
-    if (matches.size() < 4)
-    {// Not enough matches
-        return false;
-    } else if (matches.size() > MAX_FOR_PT_ESTIM) {
-        // Sorting by ascending hamming distance to select the best among
-        std::sort(matches.begin(), matches.end(), [&](DMatch a, DMatch b) {return a.distance < b.distance; });
-    }
-    for (size_t i = 0, upper = min<size_t>(MAX_FOR_PT_ESTIM, matches.size()); i < upper; i++)
-    {// Collect coordinates of image features
-        srcPts.emplace_back(srcKp[matches[i].queryIdx].pt);
-        tarPts.emplace_back(tarKp[matches[i].trainIdx].pt);
-    }
-
-    // Calculate 2x3 transformation of pattern to parent coordinate
-    // The supplied feature points are filtered using RANSAC==8 method (Removing outliners, error allowance of 1-3.0).
-    transf = estimateAffine2D(tarPts, srcPts, inlierMap, RANSAC, 1.5);  // scaled, but no perspective transform
-
-#ifndef NDEBUG
-    elapsed = (getTickCount() - ts) / getTickFrequency();
-    MSG_("Locate by features, time: " << elapsed*1000 << " msec");
-    //drawKeypoints(csrc, srcKp, result);
-    drawMatches(
-        src, srcKp,
-        tar, tarKp,
-        std::vector<DMatch>(  // First 10, may not be sorted!
-            matches.cbegin(), matches.cbegin()+min<size_t>(10,matches.size())
-        ),
-        result
-    );
-#endif
-
-    Scalar_<double> xyLoc(Scalar::all(0));
-    if (!transf.empty())
-    {
-        // Test Transformation
-        assert((transf.cols == 3) && (transf.type() == CV_64F));
-        xyLoc[0] = transf.at<double>(0, 0);
-        xyLoc[1] = transf.at<double>(1, 1);
-    }
-    if (transf.empty() ||
-           (min(xyLoc[0], xyLoc[1]) / max(xyLoc[0], xyLoc[1]) < 0.65)
-       )
-    {// Transformation not available
-        assert((inlierMap.cols == 1) && (inlierMap.type() == CV_8U));
-        // Build the average of inliners
-        tarPts.clear();
-        uchar* pEle = inlierMap.data;
-        for (size_t i = 0; i < inlierMap.total(); i++, pEle++)
-        {
-            if (*pEle)
-            {
-                tarPts.emplace_back(srcPts[i]);
-            }
-        }
-        if (tarPts.size() < 3)
-        {// Result not certain enough
-            return false;
-        }
-        auto xX = std::minmax_element(
-            tarPts.cbegin(), tarPts.cend(),
-            [&](Point2f a, Point2f b) {return a.x < b.x; }
-        );
-        auto yY = std::minmax_element(
-            tarPts.cbegin(), tarPts.cend(),
-            [&](Point2f a, Point2f b) {return a.y < b.y; }
-        );
-        if (((xX.second->x - xX.first->x) > w2) ||
-               ((yY.second->y - yY.first->y) > h2)
-           )
-        {// Points too far apart
-            return false;
-        }
-        xyLoc = mean(tarPts);
-        xyLoc[0] = round(xyLoc[0]);
-        xyLoc[1] = round(xyLoc[1]);
-    } else {
-     // Transformation seems valid
-        Mat_<double> loc = transf * (Mat_<double>(3, 1) <<
-            (w2 >> 1),
-            (h2 >> 1),
-            1
-        );
-        xyLoc[0] = round(loc(0));
-        xyLoc[1] = round(loc(1));
-    }
-
-    if (!evalLimits(xyLoc[0], xyLoc[1], w1, h1))
-    {// Exceed parent borders
-        return false;
-    }
-
-    if (aInOutXyLoc)
-    {
-        aInOutXyLoc[COOR_LEFT] = static_cast<int>(xyLoc[0]);
-        aInOutXyLoc[COOR_TOP] = static_cast<int>(xyLoc[1]);
-    }
-    return true;
-}
-
+#include "imgproc.h"
+#include "imgkernels.h"
+#include "trace.h"
+
+#include <cmath>
+#include <vector>
+#include <opencv2/core/version.hpp>
+#if CV_VERSION_MAJOR >= 3 && CV_VERSION_MINOR > 3
+  // Bugfix: Missing channel_type in Mat_ due to deprecated cv::DataType
+  #define OPENCV_TRAITS_ENABLE_DEPRECATED
+#endif
+
+//#include <opencv2/core/hal/interface.h>  // basic types
+//#include <opencv2/core/mat.hpp>
+//#include <opencv2/core/types.hpp>  // cv structs
+//#include <opencv2/core/cvstd.hpp>  // math, algorythm, ptr...
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>       // template match
+#include <opencv2/features2d.hpp>    // feature detection & descriptor
+#include <opencv2/calib3d.hpp>       // camera estimation
+
+
+#ifndef NDEBUG
+#include <iostream>
+#define MSG_(msg) std::cout << msg << std::endl
+#else
+#define MSG_(msg)
+#endif
+
+inline bool evalLimits(double x, double y, int xLim, int yLim)
+{// false == failed Limit test
+    return !(cv::min(x, y) < 0 ||
+        x > xLim ||
+        y > yLim ||
+        cv::max(x, y) > std::numeric_limits<int>::max()
+        );
+}
+
+
+namespace ImProcU8 {
+using namespace cv;
+
+// Maximum number of points used for estimation of location
+const int MAX_FOR_PT_ESTIM = 32;
+
+// Minimum result rows correlated between two polls of a stop request
+const int TILE_ROWS = 128;
+
+// Feature detector: pixel value difference of 20, filter duplicates, feature window with diameter of 9pxl, circumference 16pxl
+// ORB filters out too much features in a sample parent image (pyramid?), we use FAST instead.
+Ptr<FastFeatureDetector> gDetPtr = FastFeatureDetector::create(20, true);//, FastFeatureDetector::TYPE_7_12);
+
+// FastFeatureDetector::compute() crashes, we use ORB instead
+Ptr<ORB> gDescrPtr = ORB::create();
+
+// Feature matcher: Use hamming distance (NORM_HAMMING==6)
+// Crosscheck (Im1ToIm2/Im2ToIm1) crashes with knnMatch().
+// Faster FlannBasedMatcher crashes, maybe it does not understand ORB descriptors
+Ptr<BFMatcher> gCoplPtr = BFMatcher::create(NORM_HAMMING);
+// Note: cv::Ptr is a shared pointer with automatic garbage collection
+
+namespace {
+// Pattern deviation tolerance in gray levels, on top of Cascade::devRatio
+const double DEV_SLACK = 2.;
+// Block means of the pattern varying less are no signature
+const double MIN_SIG_NORM = 4.;
+
+// Windows of a result row that passed the cascade, x1 exclusive
+struct run_t {
+    int y, x0, x1;
+};
+
+// Sum of a rectangle in a 32bit integral image. The integral may wrap on large
+// images, the difference is right as long as the rectangle sum fits 32 bits.
+inline unsigned rectSum(const int* pTop, const int* pBot, int x0, int x1)
+{
+    return static_cast<unsigned>(pBot[x1]) - static_cast<unsigned>(pBot[x0])
+        - static_cast<unsigned>(pTop[x1]) + static_cast<unsigned>(pTop[x0]);
+}
+
+/**
+ Windows of rArea surviving the cheap cascade stages, as runs per result row.
+ Both images shall be 4x8bit or 1x8bit/pxl, the stages look at gray values.
+ Polls the stop request every TILE_ROWS rows, when expired the rows done are kept.
+ @return  false if more windows survive than Cascade::maxSurvivors allows.
+          Scored one by one, the survivors cost with the pattern area.
+ */
+bool prefilter(const Mat& rArea, const Mat& rPat, const Cascade& rCfg, std::vector<run_t>& rOutRuns, CascadeStats& rStats, SearchCtrl* pCtrl)
+{
+    const int w2 = rPat.cols;
+    const int h2 = rPat.rows;
+    const int resRows = rArea.rows - h2 + 1;
+    const int resCols = rArea.cols - w2 + 1;
+    const double pixels = static_cast<double>(w2) * h2;
+
+    Mat gray = rArea;  // header only
+    Mat patGray = rPat;
+    Mat sum, sqsum, patSum;
+    {
+        TRACE_("integral");
+        if (rArea.channels() == 4)
+            cvtColor(rArea, gray, COLOR_BGRA2GRAY);
+        integral(gray, sum, sqsum, CV_32S, CV_64F);
+    }
+    if (rPat.channels() == 4)
+        cvtColor(rPat, patGray, COLOR_BGRA2GRAY);
+    integral(patGray, patSum, CV_32S);
+    Scalar patMean, patDev;
+    meanStdDev(patGray, patMean, patDev);
+    const double loDev = max(0., patDev[0] / rCfg.devRatio - DEV_SLACK);
+    const double hiDev = patDev[0] * rCfg.devRatio + DEV_SLACK;
+    const double loVar = loDev * loDev;
+    const double hiVar = hiDev * hiDev;
+
+    // Signature: zero mean block means of a window, bounds relative to it
+    const int blocks = max(1, min(rCfg.sigBlocks, min(w2, h2)));  // a single block has no layout
+    std::vector<int> xs(blocks + 1), ys(blocks + 1);
+    for (int i = 0; i <= blocks; i++)
+    {
+        xs[i] = i * w2 / blocks;
+        ys[i] = i * h2 / blocks;
+    }
+    std::vector<double> patSig(blocks * blocks), sig(patSig.size());
+    auto signature = [&](const Mat& rSum, int x, int y, std::vector<double>& rOut) -> double {
+        double total = 0.;
+        for (int by = 0; by < blocks; by++)
+        {
+            const int* pTop = rSum.ptr<int>(y + ys[by]);
+            const int* pBot = rSum.ptr<int>(y + ys[by + 1]);
+            for (int bx = 0; bx < blocks; bx++)
+            {
+                const double mean = rectSum(pTop, pBot, x + xs[bx], x + xs[bx + 1])
+                    / static_cast<double>((xs[bx + 1] - xs[bx]) * (ys[by + 1] - ys[by]));
+                rOut[by * blocks + bx] = mean;
+                total += mean;
+            }
+        }
+        const double mean = total / rOut.size();
+        double norm = 0.;
+        for (double& rVal : rOut)
+        {
+            rVal -= mean;
+            norm += rVal * rVal;
+        }
+        return std::sqrt(norm);
+    };
+    const double patNorm = (blocks > 1) ? signature(patSum, 0, 0, patSig) : 0.;
+    const bool useSig = patNorm > MIN_SIG_NORM;
+
+    const long long maxSurvivors = static_cast<long long>(rCfg.maxSurvivors * (1024. / pixels) * resRows * resCols);
+    long long survivors = 0;
+    int y = 0;
+    for (; y < resRows; y++)
+    {
+        if (pCtrl && !(y % TILE_ROWS))
+        {
+            if (pCtrl->isCancelled() || (y && pCtrl->isExpired()))
+            {
+                pCtrl->interrupted = true;
+                break;
+            }
+        }
+        const int* pTop = sum.ptr<int>(y);
+        const int* pBot = sum.ptr<int>(y + h2);
+        const double* pSqTop = sqsum.ptr<double>(y);
+        const double* pSqBot = sqsum.ptr<double>(y + h2);
+        int runStart = -1;
+        for (int x = 0; x <= resCols; x++)
+        {
+            bool pass = false;
+            if (x < resCols)
+            {// Stage 1: mean and deviation
+                const double mean = rectSum(pTop, pBot, x, x + w2) / pixels;
+                pass = std::abs(mean - patMean[0]) <= rCfg.meanTol;
+                if (pass)
+                {
+                    const double var = (pSqBot[x + w2] - pSqBot[x] - pSqTop[x + w2] + pSqTop[x]) / pixels - mean * mean;
+                    pass = (var >= loVar) && (var <= hiVar);
+                }
+                if (!pass)
+                    rStats.rejectedStats++;
+                else if (useSig)
+                {// Stage 2: coarse layout
+                    const double norm = signature(sum, x, y, sig);
+                    double dot = 0.;
+                    for (size_t i = 0; i < sig.size(); i++)
+                        dot += sig[i] * patSig[i];
+                    pass = (norm > 0.) && (dot >= rCfg.minSigCorr * norm * patNorm);
+                    if (!pass)
+                        rStats.rejectedSignature++;
+                }
+            }
+            if (pass)
+            {
+                survivors++;
+                if (runStart < 0)
+                    runStart = x;
+            } else if (runStart >= 0) {
+                rOutRuns.push_back(run_t{ y, runStart, x });
+                runStart = -1;
+            }
+        }
+        if (survivors > maxSurvivors)
+            return false;
+    }
+    rStats.windows += static_cast<long long>(y) * resCols;
+    rStats.correlated += survivors;
+    return true;
+}
+}  // namespace
+
+
+bool locatePatternIn(const Image& rInSrc, const Image& rInTar, imgArr2I_t aInOutXyLoc, float certaintyPerc, SearchCtrl* pCtrl,
+    const Cascade* pCascade, CascadeStats* pOutStats)
+{
+    if (certaintyPerc < 0.02)
+    {
+        certaintyPerc = 0.02f;
+    }
+    int w1, w2, h1, h2;
+    w1 = rInSrc.aSizes[D_WIDTH];
+    h1 = rInSrc.aSizes[D_HEIGHT];
+    w2 = rInTar.aSizes[D_WIDTH];
+    h2 = rInTar.aSizes[D_HEIGHT];
+
+    int l1, l2, s1, s2;
+    l1 = max(w1, h1);
+    l2 = max(w2, h2);
+    s1 = min(w1, h1);
+    s2 = min(w2, h2);
+
+    const int channels = rInSrc.channels;
+    if ((channels != rInTar.channels) || ((channels != 4) && (channels != 1)))
+        return false;  //throw std::invalid_argument;
+    // TODO: handle overlapping pattern (can be cut out in several ways)
+    if ((w2 > w1) || (h2 > h1))
+        return false;
+    if ((1 > min(s1, s2)) ||
+        (MAX_PATTERN_SIZE < l2)
+       )
+    {
+        return false;  //throw std::invalid_argument;
+    }
+    // There is no const data ctor for mat, but we use the pointer only for reading
+    const int type = (channels == 4) ? CV_8UC4 : CV_8UC1;
+    const Mat csrc(h1, w1, type, const_cast<uchar*>(rInSrc.pDat), rInSrc.lneLenByte);
+    const Mat cpat(h2, w2, type, const_cast<uchar*>(rInTar.pDat), rInTar.lneLenByte);
+    Mat result;
+
+#ifndef NDEBUG
+    int64 ts = getTickCount();
+#endif
+
+    /*
+        matching methods:
+        SQDIFF: pixel difference (substract)
+        CCORR:  pixel correlation (product)
+        CCOEFF: feature pixel correlation (deviation product)
+    */
+    Mat area = csrc;  // Header only
+    Point origin(0, 0);
+    if (aInOutXyLoc && ((aInOutXyLoc[COOR_LEFT] | aInOutXyLoc[COOR_TOP]) != 0))
+    {// Create a 3x3 subset for less amounts of pixel
+        Rect subRect = Rect(
+            aInOutXyLoc[COOR_LEFT]-(w2>>1)-w2,
+            aInOutXyLoc[COOR_TOP]-(h2>>1)-h2,
+            (w2<<1)+w2,
+            (h2<<1)+h2) & Rect(0, 0, w1, h1);
+        if ((subRect.width >= w2) && (subRect.height >= h2))
+        {
+            area = Mat(csrc, subRect);
+            origin = subRect.tl();
+        }
+    }
+    const int resRows = area.rows - h2 + 1;
+    if (pCascade)
+    {
+        std::vector<run_t> runs;
+        CascadeStats stats = {};
+        bool filtered;
+        {
+            TRACE_("cascade");
+            filtered = prefilter(area, cpat, *pCascade, runs, stats, pCtrl);
+        }
+        if (pCtrl && pCtrl->isCancelled())
+            return false;
+        if (filtered)
+        {// Correlate the survivors only
+            if (pOutStats)
+            {
+                pOutStats->windows += stats.windows;
+                pOutStats->rejectedStats += stats.rejectedStats;
+                pOutStats->rejectedSignature += stats.rejectedSignature;
+                pOutStats->correlated += stats.correlated;
+            }
+            TRACE_("matchSurvivors");
+            const Kernels::pixelFormat_t format = static_cast<Kernels::pixelFormat_t>(channels);
+            const Kernels::scoreFn_t scoreFn = Kernels::scoreKernel(format, w2);  // once per search
+            const Kernels::patternMoments_t moments = Kernels::patternMoments(format, cpat.data, cpat.step, w2, h2);
+            float maxVal = -1.f;
+            Point exLoc;
+            for (const run_t& rRun : runs)
+            {
+                const uchar* pRow = area.ptr<uchar>(rRun.y);
+                for (int x = rRun.x0; x < rRun.x1; x++)
+                {
+                    const float score = scoreFn(pRow + x * channels, area.step, cpat.data, cpat.step, moments, w2, h2);
+                    if (score > maxVal)
+                    {
+                        maxVal = score;
+                        exLoc = origin + Point(x, rRun.y);
+                    }
+                }
+            }
+            if (maxVal <= certaintyPerc)
+                return false;
+            if (aInOutXyLoc)
+            {
+                aInOutXyLoc[COOR_LEFT] = exLoc.x + (w2 >> 1);
+                aInOutXyLoc[COOR_TOP] = exLoc.y + (h2 >> 1);
+            }
+            return true;
+        }
+    }
+    if (pOutStats)
+    {
+        const long long windows = static_cast<long long>(resRows) * (area.cols - w2 + 1);
+        pOutStats->windows += windows;
+        pOutStats->correlated += windows;
+    }
+
+    // Correlate in bands of result rows, each overlapping the pattern height.
+    // Without stop request the whole area is a single band.
+    const int bandRows = pCtrl ? max(TILE_ROWS, h2 << 1) : resRows;
+    double minVal = std::numeric_limits<double>::max();
+    double maxVal = -minVal;
+    double range;
+    Point exLoc;
+    int row = 0;
+    for (; row < resRows; row += bandRows)
+    {
+        if (pCtrl)
+        {
+            if (pCtrl->isCancelled())
+            {
+                pCtrl->interrupted = true;
+                return false;
+            }
+            if (row && pCtrl->isExpired())
+            {// Evaluate what we have so far
+                pCtrl->interrupted = true;
+                break;
+            }
+        }
+        const Mat band(area, Rect(0, row, area.cols, min(bandRows, resRows - row) + h2 - 1));
+        double bandMin, bandMax;
+        Point bandLoc;
+        TRACE_("matchTemplate");
+        matchTemplate(band, cpat, result, TM_CCOEFF_NORMED);
+        minMaxLoc(result, &bandMin, &bandMax, NULL, &bandLoc);  // location of extrema
+        minVal = min(minVal, bandMin);
+        if (bandMax > maxVal)
+        {
+            maxVal = bandMax;
+            exLoc = bandLoc + origin + Point(0, row);
+        }
+    }
+
+#ifndef NDEBUG
+    MSG_("Locate by pattern, time: " << (1000 * (getTickCount() - ts) / getTickFrequency()) << " msec");
+#endif
+
+    range = maxVal - minVal;
+    // extrema must be high enough and discrete from noise
+    if (range > certaintyPerc)
+    {
+        if (aInOutXyLoc)
+        {
+            aInOutXyLoc[COOR_LEFT] = exLoc.x + (w2 >> 1);
+            aInOutXyLoc[COOR_TOP] = exLoc.y + (h2 >> 1);
+        }
+        return (abs(maxVal) / range) > certaintyPerc;
+    } else
+        return false;
+}
+
+
+namespace {
+// Extrema per result row of rArea, rows in bands of TILE_ROWS, in parallel within a band.
+// The integrals cover the pixel rows of one band only, they are reused by the next.
+// Returns the rows done, -1 if cancelled.
+template <Kernels::pixelFormat_t F>
+int fixedRows(const Mat& rArea, const Mat& rPat, RowExtrema& rOut, SearchCtrl* pCtrl)
+{
+    const Kernels::fixedPattern_t pattern = Kernels::fixedPattern<F>(rPat.data, rPat.step, rPat.cols, rPat.rows);
+    Kernels::areaIntegrals_t integrals;
+    const int resRows = rArea.rows - rPat.rows + 1;
+    const int resCols = rArea.cols - rPat.cols + 1;
+    rOut.maxVal.resize(resRows);
+    rOut.maxX.resize(resRows);
+    rOut.minVal.resize(resRows);
+
+    int row = 0;
+    for (; row < resRows; row += TILE_ROWS)
+    {
+        if (pCtrl)
+        {
+            if (pCtrl->isCancelled())
+            {
+                pCtrl->interrupted = true;
+                return -1;
+            }
+            if (row && pCtrl->isExpired())
+            {
+                pCtrl->interrupted = true;
+                break;
+            }
+        }
+        TRACE_("correlateRows");
+        const int bandRows = min(TILE_ROWS, resRows - row);
+        const uchar* pBand = rArea.ptr<uchar>(row);
+        Kernels::areaIntegrals<F>(pBand, rArea.step, rArea.cols, bandRows + rPat.rows - 1, integrals);
+        parallel_for_(Range(0, bandRows), [&](const Range& rPart) {
+            for (int y = rPart.start; y < rPart.end; y++)
+            {
+                Kernels::rowScores<F>(pBand, rArea.step, integrals, pattern, y, resCols,
+                    rOut.maxVal[row + y], rOut.maxX[row + y], rOut.minVal[row + y]);
+            }
+        });
+    }
+    row = min(row, resRows);
+    rOut.maxVal.resize(row);
+    rOut.maxX.resize(row);
+    rOut.minVal.resize(row);
+    return row;
+}
+
+int fixedRows(const Mat& rArea, const Mat& rPat, RowExtrema& rOut, SearchCtrl* pCtrl)
+{
+    return (rArea.channels() == 1) ? fixedRows<Kernels::PF_GRAY8>(rArea, rPat, rOut, pCtrl)
+        : fixedRows<Kernels::PF_BGRA8>(rArea, rPat, rOut, pCtrl);
+}
+
+bool validPair(const Image& rInSrc, const Image& rInTar)
+{
+    const int channels = rInSrc.channels;
+    return (channels == rInTar.channels) && ((channels == 4) || (channels == 1))
+        && (rInTar.aSizes[D_WIDTH] <= rInSrc.aSizes[D_WIDTH]) && (rInTar.aSizes[D_HEIGHT] <= rInSrc.aSizes[D_HEIGHT])
+        && (min(rInTar.aSizes[D_WIDTH], rInTar.aSizes[D_HEIGHT]) >= 1)
+        && (max(rInTar.aSizes[D_WIDTH], rInTar.aSizes[D_HEIGHT]) <= MAX_PATTERN_SIZE);
+}
+}  // namespace
+
+
+bool correlateRows(const Image& rInSrc, const Image& rInTar, RowExtrema& rOut, SearchCtrl* pCtrl)
+{
+    if (!validPair(rInSrc, rInTar))
+        return false;
+    const int type = (rInSrc.channels == 4) ? CV_8UC4 : CV_8UC1;
+    const Mat csrc(rInSrc.aSizes[D_HEIGHT], rInSrc.aSizes[D_WIDTH], type, const_cast<uchar*>(rInSrc.pDat), rInSrc.lneLenByte);
+    const Mat cpat(rInTar.aSizes[D_HEIGHT], rInTar.aSizes[D_WIDTH], type, const_cast<uchar*>(rInTar.pDat), rInTar.lneLenByte);
+    return fixedRows(csrc, cpat, rOut, pCtrl) >= 0;
+}
+
+
+bool locatePatternFixed(const Image& rInSrc, const Image& rInTar, imgArr2I_t aInOutXyLoc, float certaintyPerc, SearchCtrl* pCtrl)
+{
+    if (certaintyPerc < 0.02)
+    {
+        certaintyPerc = 0.02f;
+    }
+    if (!validPair(rInSrc, rInTar))
+        return false;
+    const int w1 = rInSrc.aSizes[D_WIDTH];
+    const int h1 = rInSrc.aSizes[D_HEIGHT];
+    const int w2 = rInTar.aSizes[D_WIDTH];
+    const int h2 = rInTar.aSizes[D_HEIGHT];
+    const int type = (rInSrc.channels == 4) ? CV_8UC4 : CV_8UC1;
+    const Mat csrc(h1, w1, type, const_cast<uchar*>(rInSrc.pDat), rInSrc.lneLenByte);
+    const Mat cpat(h2, w2, type, const_cast<uchar*>(rInTar.pDat), rInTar.lneLenByte);
+
+    Mat area = csrc;
+    Point origin(0, 0);
+    if (aInOutXyLoc && ((aInOutXyLoc[COOR_LEFT] | aInOutXyLoc[COOR_TOP]) != 0))
+    {// 3x3 pattern sizes around the hint, like locatePatternIn
+        Rect subRect = Rect(
+            aInOutXyLoc[COOR_LEFT]-(w2>>1)-w2,
+            aInOutXyLoc[COOR_TOP]-(h2>>1)-h2,
+            (w2<<1)+w2,
+            (h2<<1)+h2) & Rect(0, 0, w1, h1);
+        if ((subRect.width >= w2) && (subRect.height >= h2))
+        {
+            area = Mat(csrc, subRect);
+            origin = subRect.tl();
+        }
+    }
+
+    RowExtrema rows;
+    const int rowsDone = fixedRows(area, cpat, rows, pCtrl);
+    if (rowsDone <= 0)
+        return false;
+    float minVal = rows.minVal[0];
+    float maxVal = rows.maxVal[0];
+    Point exLoc = origin + Point(rows.maxX[0], 0);
+    for (int y = 1; y < rowsDone; y++)
+    {
+        minVal = min(minVal, rows.minVal[y]);
+        if (rows.maxVal[y] > maxVal)
+        {
+            maxVal = rows.maxVal[y];
+            exLoc = origin + Point(rows.maxX[y], y);
+        }
+    }
+
+    const float range = maxVal - minVal;
+    if (range > certaintyPerc)
+    {
+        if (aInOutXyLoc)
+        {
+            aInOutXyLoc[COOR_LEFT] = exLoc.x + (w2 >> 1);
+            aInOutXyLoc[COOR_TOP] = exLoc.y + (h2 >> 1);
+        }
+        return (std::abs(maxVal) / range) > certaintyPerc;
+    } else
+        return false;
+}
+
+
+namespace {
+// Smallest scaled pattern side correlated, smaller ones match about anything
+const int MIN_SCALED_SIZE = 8;
+// Scales refined per side of the coarse winner, they split one coarse step.
+// Neighboring scales score alike at coarse resolution, the winner may be one off.
+const int REFINE_STEPS = 3;
+
+struct scaleHit_t {
+    float scale;    // on its source
+    int source;     // index of the searched image
+    float score;    // -2 if the scaled pattern does not fit
+    Point loc;      // top left
+    Size size;      // of the scaled pattern
+};
+
+// Best correlation of the pattern resized by the scale of rHit
+void matchScaled(const Mat& rSrc, const Mat& rPat, scaleHit_t& rHit)
+{
+    rHit.score = -2.f;
+    rHit.size = Size(cvRound(rPat.cols * rHit.scale), cvRound(rPat.rows * rHit.scale));
+    if ((min(rHit.size.width, rHit.size.height) < MIN_SCALED_SIZE)
+        || (rHit.size.width > rSrc.cols) || (rHit.size.height > rSrc.rows))
+    {
+        return;
+    }
+    Mat pat, result;
+    resize(rPat, pat, rHit.size, 0, 0, (rHit.scale < 1.f) ? INTER_AREA : INTER_LINEAR);
+    matchTemplate(rSrc, pat, result, TM_CCOEFF_NORMED);
+    double maxVal;
+    minMaxLoc(result, NULL, &maxVal, NULL, &rHit.loc);
+    rHit.score = static_cast<float>(maxVal);
+}
+
+// All scales at once, one per core, returns the best
+scaleHit_t matchScales(const std::vector<Mat>& rSources, const Mat& rPat, std::vector<scaleHit_t>& rHits)
+{
+    parallel_for_(Range(0, static_cast<int>(rHits.size())), [&](const Range& rPart) {
+        for (int i = rPart.start; i < rPart.end; i++)
+            matchScaled(rSources[rHits[i].source], rPat, rHits[i]);
+    });
+    scaleHit_t best{ 0.f, 0, -2.f, Point(), Size() };
+    for (const scaleHit_t& rHit : rHits)
+    {
+        if (rHit.score > best.score)
+            best = rHit;
+    }
+    return best;
+}
+}  // namespace
+
+
+bool locatePatternScaled(const Image& rInSrc, const Image& rInTar, const ScaleRange& rRange, imgArr2I_t aInOutXyLoc,
+    float* pInOutScale, float certaintyPerc, SearchCtrl* pCtrl)
+{
+    const int w1 = rInSrc.aSizes[D_WIDTH];
+    const int h1 = rInSrc.aSizes[D_HEIGHT];
+    const int w2 = rInTar.aSizes[D_WIDTH];
+    const int h2 = rInTar.aSizes[D_HEIGHT];
+    const int channels = rInSrc.channels;
+    if ((channels != rInTar.channels) || ((channels != 4) && (channels != 1))
+        || (min(w2, h2) < 1) || (MAX_PATTERN_SIZE < max(w2, h2))
+        || (rRange.minScale <= 0.f) || (rRange.maxScale < rRange.minScale) || (rRange.step <= 1.f))
+    {
+        return false;
+    }
+    const int type = (channels == 4) ? CV_8UC4 : CV_8UC1;
+    const Mat csrc(h1, w1, type, const_cast<uchar*>(rInSrc.pDat), rInSrc.lneLenByte);
+    const Mat cpat(h2, w2, type, const_cast<uchar*>(rInTar.pDat), rInTar.lneLenByte);
+
+    Mat area = csrc;  // Header only
+    Point origin(0, 0);
+    if (aInOutXyLoc && ((aInOutXyLoc[COOR_LEFT] | aInOutXyLoc[COOR_TOP]) != 0))
+    {// 3x3 of the largest scaled pattern
+        const int w = cvRound(w2 * rRange.maxScale);
+        const int h = cvRound(h2 * rRange.maxScale);
+        const Rect subRect = Rect(aInOutXyLoc[COOR_LEFT] - (w >> 1) - w, aInOutXyLoc[COOR_TOP] - (h >> 1) - h, 3 * w, 3 * h)
+            & Rect(0, 0, w1, h1);
+        if (!subRect.empty())
+        {
+            area = Mat(csrc, subRect);
+            origin = subRect.tl();
+        }
+    }
+    auto accept = [&](const scaleHit_t& rHit) {
+        if (rHit.score <= certaintyPerc)
+            return false;
+        if (aInOutXyLoc)
+        {
+            aInOutXyLoc[COOR_LEFT] = origin.x + rHit.loc.x + (rHit.size.width >> 1);
+            aInOutXyLoc[COOR_TOP] = origin.y + rHit.loc.y + (rHit.size.height >> 1);
+        }
+        if (pInOutScale)
+            *pInOutScale = rHit.scale;
+        return true;
+    };
+
+    std::vector<Mat> sources(1, area);
+    if (pInOutScale && (*pInOutScale > 0.f))
+    {// Sizes rarely change, the last scale usually matches
+        TRACE_("matchLastScale");
+        scaleHit_t hit{ *pInOutScale, 0, -2.f, Point(), Size() };
+        matchScaled(area, cpat, hit);
+        if (accept(hit))
+            return true;
+    }
+    if (pCtrl && pCtrl->isCancelled())
+    {
+        pCtrl->interrupted = true;
+        return false;
+    }
+
+    // Coarse pass, each scale on the frame reduced as far as its pattern stays correlatable
+    std::vector<scaleHit_t> hits;
+    sources.resize(max(1, rRange.coarse) + 1);  // by reduction, 1 is the area itself
+    sources[1] = area;
+    for (float scale = rRange.minScale; scale <= rRange.maxScale * 1.0001f; scale *= rRange.step)
+    {
+        const int reduction = max(1, min(rRange.coarse, cvFloor(min(w2, h2) * scale / MIN_SCALED_SIZE)));
+        if (sources[reduction].empty())
+            resize(area, sources[reduction], Size(), 1. / reduction, 1. / reduction, INTER_AREA);
+        hits.push_back(scaleHit_t{ scale / reduction, reduction, -2.f, Point(), Size() });
+    }
+    scaleHit_t best;
+    {
+        TRACE_("scaleSweep");
+        best = matchScales(sources, cpat, hits);
+    }
+    if (best.score < -1.f)
+        return false;  // no scale fits
+    best.scale *= best.source;
+    best.loc *= best.source;
+    best.size = Size(cvRound(w2 * best.scale), cvRound(h2 * best.scale));
+    if (pCtrl && (pCtrl->isCancelled() || pCtrl->isExpired()))
+    {// The coarse winner is the best so far
+        pCtrl->interrupted = true;
+        return !pCtrl->isCancelled() && accept(best);
+    }
+
+    // Refine around the winner at full resolution, a coarse step to each side
+    TRACE_("scaleRefine");
+    const int margin = 2 * best.source + cvCeil(max(w2, h2) * best.scale * (rRange.step - 1.f));
+    const Rect around = Rect(best.loc.x - margin, best.loc.y - margin, best.size.width + 2 * margin, best.size.height + 2 * margin)
+        & Rect(0, 0, area.cols, area.rows);
+    sources.assign(1, Mat(area, around));
+    const float fine = std::pow(rRange.step, 1.f / REFINE_STEPS);
+    hits.clear();
+    for (int i = -REFINE_STEPS; i <= REFINE_STEPS; i++)
+        hits.push_back(scaleHit_t{ best.scale * std::pow(fine, static_cast<float>(i)), 0, -2.f, Point(), Size() });
+    const scaleHit_t refined = matchScales(sources, cpat, hits);
+    if (refined.score < -1.f)
+        return false;  // the frame edge cuts all of them off
+    best = refined;  // the full resolution score decides
+    best.loc += around.tl();
+    return accept(best);
+}
+
+
+int locateCandidatesIn(const Image& rInSrc, const Image& rInTar, float minScore, int maxCount, std::vector<int>& rOutXy, SearchCtrl* pCtrl)
+{
+    rOutXy.clear();
+    const int w1 = rInSrc.aSizes[D_WIDTH];
+    const int h1 = rInSrc.aSizes[D_HEIGHT];
+    const int w2 = rInTar.aSizes[D_WIDTH];
+    const int h2 = rInTar.aSizes[D_HEIGHT];
+    if ((rInSrc.channels != 4) || (rInTar.channels != 4)
+        || (w2 > w1) || (h2 > h1) || (min(w2, h2) < 1) || (maxCount < 1)
+        || (MAX_PATTERN_SIZE < max(w2, h2)))
+    {
+        return 0;
+    }
+    if (pCtrl && (pCtrl->isCancelled() || pCtrl->isExpired()))
+    {// One correlation of the whole source, it cannot stop midway
+        pCtrl->interrupted = true;
+        return 0;
+    }
+
+    const Mat csrc(h1, w1, CV_8UC4, const_cast<uchar*>(rInSrc.pDat), rInSrc.lneLenByte);
+    const Mat cpat(h2, w2, CV_8UC4, const_cast<uchar*>(rInTar.pDat), rInTar.lneLenByte);
+    Mat result;
+    {
+        TRACE_("matchPrototype");
+        matchTemplate(csrc, cpat, result, TM_CCOEFF_NORMED);
+    }
+    for (int i = 0; i < maxCount; i++)
+    {
+        double maxVal;
+        Point loc;
+        minMaxLoc(result, NULL, &maxVal, NULL, &loc);
+        if (maxVal < minScore)
+            break;
+        rOutXy.push_back(loc.x + (w2 >> 1));
+        rOutXy.push_back(loc.y + (h2 >> 1));
+        // Overlapping places show the same instance
+        rectangle(result, Rect(loc.x - w2 + 1, loc.y - h2 + 1, (w2 << 1) - 1, (h2 << 1) - 1), Scalar::all(-1.), FILLED);
+    }
+    return static_cast<int>(rOutXy.size() >> 1);
+}
+
+
+float patternSimilarity(const Image& rInA, const Image& rInB)
+{
+    const int w = rInA.aSizes[D_WIDTH];
+    const int h = rInA.aSizes[D_HEIGHT];
+    if ((rInA.channels != 4) || (rInB.channels != 4) || (min(w, h) < 1)
+        || (w != rInB.aSizes[D_WIDTH]) || (h != rInB.aSizes[D_HEIGHT]))
+    {
+        return 0.f;
+    }
+    const Mat ca(h, w, CV_8UC4, const_cast<uchar*>(rInA.pDat), rInA.lneLenByte);
+    const Mat cb(h, w, CV_8UC4, const_cast<uchar*>(rInB.pDat), rInB.lneLenByte);
+    Scalar mean, devA, devB;
+    meanStdDev(ca, mean, devA);
+    meanStdDev(cb, mean, devB);
+    if ((max(max(devA[0], devA[1]), devA[2]) < 1.) || (max(max(devB[0], devB[1]), devB[2]) < 1.))
+        return 0.f;  // single color
+    Mat result;
+    matchTemplate(ca, cb, result, TM_CCOEFF_NORMED);  // same size, a single score
+    return result.at<float>(0, 0);
+}
+
+
+namespace {
+// Smallest region side tried, smaller regions match about anything
+const int MIN_REGION_SIDE = 12;
+// Region sides tried, in eighths of the pattern side
+const int REGION_EIGHTHS[] = { 2, 3, 4, 5, 6 };
+// Places most like the whole pattern, a region has to tell itself apart from them
+const int MAX_RIVALS = 8;
+// Region placements of a size correlated with the whole frame, best ranked first
+const int REGION_TRIES = 3;
+// A look-alike scoring this has the same region, the placement cannot tell them apart
+const float SAME_SCORE = 0.98f;
+
+// Decision rule of locatePatternIn: the best score high enough and distinct from the score range
+bool isMatch(double maxVal, double minVal, float certaintyPerc)
+{
+    const double range = maxVal - minVal;
+    return (range > certaintyPerc) && ((std::abs(maxVal) / range) > certaintyPerc);
+}
+
+// Windows closer than half the pattern size show the same place shifted, no other instance
+void suppressAround(Mat& rResult, const Point& rAt, const Size& rSize)
+{
+    rectangle(rResult, Rect(rAt.x - (rSize.width >> 1), rAt.y - (rSize.height >> 1), rSize.width | 1, rSize.height | 1),
+        Scalar::all(-1.), FILLED);
+}
+}
+
+
+bool selectDistinctRegion(const Image& rInSrc, const Image& rInTar, const imgArr2I_t aInXyLoc, float certaintyPerc,
+    imgArr2I_t aOutXy, imgArr2I_t aOutSize, SearchCtrl* pCtrl)
+{
+    certaintyPerc = max(certaintyPerc, 0.02f);  // like locatePatternIn
+    const int w1 = rInSrc.aSizes[D_WIDTH];
+    const int h1 = rInSrc.aSizes[D_HEIGHT];
+    const int w2 = rInTar.aSizes[D_WIDTH];
+    const int h2 = rInTar.aSizes[D_HEIGHT];
+    aOutXy[COOR_LEFT] = 0;
+    aOutXy[COOR_TOP] = 0;
+    aOutSize[D_WIDTH] = w2;
+    aOutSize[D_HEIGHT] = h2;
+    const Rect cut(aInXyLoc[COOR_LEFT], aInXyLoc[COOR_TOP], w2, h2);
+    if ((rInSrc.channels != 4) || (rInTar.channels != 4)
+        || (min(w2, h2) < MIN_REGION_SIDE) || (MAX_PATTERN_SIZE < max(w2, h2))
+        || ((cut & Rect(0, 0, w1, h1)) != cut))
+    {
+        return false;
+    }
+
+    const Mat csrc(h1, w1, CV_8UC4, const_cast<uchar*>(rInSrc.pDat), rInSrc.lneLenByte);
+    const Mat cpat(h2, w2, CV_8UC4, const_cast<uchar*>(rInTar.pDat), rInTar.lneLenByte);
+    Mat result;
+    if (pCtrl && pCtrl->isCancelled())
+        return false;
+    {
+        TRACE_("matchWhole");
+        matchTemplate(csrc, cpat, result, TM_CCOEFF_NORMED);
+    }
+    // Look-alikes of the whole pattern, like a row of buttons with the same frame
+    std::vector<Point> rivals;
+    suppressAround(result, cut.tl(), cut.size());
+    for (int i = 0; i < MAX_RIVALS; i++)
+    {
+        double maxVal;
+        Point loc;
+        minMaxLoc(result, NULL, &maxVal, NULL, &loc);
+        if (maxVal < 0.)
+            break;
+        rivals.push_back(loc);
+        suppressAround(result, loc, cut.size());
+    }
+
+    // The part where the pattern differs from its look-alikes may be more distinct than the whole
+    for (int eighths : REGION_EIGHTHS)
+    {
+        const Size size(min(w2, max(MIN_REGION_SIDE, w2 * eighths / 8)), min(h2, max(MIN_REGION_SIDE, h2 * eighths / 8)));
+        if ((size.width == w2) && (size.height == h2))
+            break;
+        // Placements at half region steps, ranked by their best score on a look-alike
+        std::vector<std::pair<float, Point>> places;
+        for (int y = 0; y + size.height <= h2; y += max(1, size.height >> 1))
+        {
+            for (int x = 0; x + size.width <= w2; x += max(1, size.width >> 1))
+            {
+                const Rect rect(Point(x, y), size);
+                const Mat region(cpat, rect);
+                Scalar mean, dev;
+                meanStdDev(region, mean, dev);
+                if (max(max(dev[0], dev[1]), dev[2]) < 1.)
+                    continue;  // single color, matches any plain area
+                float rivalScore = -1.f;
+                for (const Point& rRival : rivals)
+                {
+                    matchTemplate(Mat(csrc, rect + rRival), region, result, TM_CCOEFF_NORMED);  // same size, a single score
+                    rivalScore = max(rivalScore, result.at<float>(0, 0));
+                }
+                if (rivalScore < SAME_SCORE)
+                    places.emplace_back(rivalScore, Point(x, y));
+            }
+        }
+        std::sort(places.begin(), places.end(),
+            [](const std::pair<float, Point>& a, const std::pair<float, Point>& b) { return a.first < b.first; });
+        // Other parts of the frame may still look like the region
+        for (size_t i = 0; (i < places.size()) && (i < REGION_TRIES); i++)
+        {
+            if (pCtrl && pCtrl->isCancelled())
+            {
+                pCtrl->interrupted = true;
+                return false;
+            }
+            const Point& rPlace = places[i].second;
+            {
+                TRACE_("matchRegion");
+                matchTemplate(csrc, Mat(cpat, Rect(rPlace, size)), result, TM_CCOEFF_NORMED);
+            }
+            // The search judges the best score against the range of the whole map
+            double minVal, bestVal;
+            Point bestLoc;
+            minMaxLoc(result, &minVal, &bestVal, NULL, &bestLoc);
+            const Point own = cut.tl() + rPlace;
+            suppressAround(result, own, size);
+            double otherVal;
+            minMaxLoc(result, NULL, &otherVal);
+            const bool ownFound = (max(std::abs(bestLoc.x - own.x), std::abs(bestLoc.y - own.y)) <= 1) && isMatch(bestVal, minVal, certaintyPerc);
+            if (ownFound && !isMatch(otherVal, minVal, certaintyPerc))
+            {
+                aOutXy[COOR_LEFT] = rPlace.x;
+                aOutXy[COOR_TOP] = rPlace.y;
+                aOutSize[D_WIDTH] = size.width;
+                aOutSize[D_HEIGHT] = size.height;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+
+bool describePattern(const Image& rInTar, std::vector<float>& rOutPts, std::vector<imgPxl_t>& rOutDescr, Features& rOutFeat)
+{
+    int w2, h2;
+    w2 = rInTar.aSizes[D_WIDTH];
+    h2 = rInTar.aSizes[D_HEIGHT];
+
+    if (rInTar.channels != 1 || min(w2, h2) < 1)
+        return false;
+
+    const Mat cpat(h2, w2, CV_8U, const_cast<uchar*>(rInTar.pDat), rInTar.lneLenByte);
+    std::vector<KeyPoint> tarKp;
+    Mat tar, tarScr;
+
+    // Resize pattern to find it better within downscaled content.
+    resize(cpat, tar, Size(), 0.9, 0.9, INTER_LINEAR_EXACT);
+    // Edge detector is vulnerable to image noise
+    medianBlur(tar, tar, 3);
+    gDetPtr->detect(tar, tarKp);
+    gDescrPtr->compute(tar, tarKp, tarScr);  // drops points too close to the border
+
+    rOutPts.clear();
+    for (const KeyPoint& rKp : tarKp)
+    {
+        rOutPts.push_back(rKp.pt.x);
+        rOutPts.push_back(rKp.pt.y);
+    }
+    tarScr = tarScr.isContinuous() ? tarScr : tarScr.clone();
+    rOutDescr.assign(tarScr.datastart, tarScr.dataend);
+
+    rOutFeat.pPts = rOutPts.data();
+    rOutFeat.pDescr = rOutDescr.data();
+    rOutFeat.count = tarScr.rows;
+    rOutFeat.descrBytes = tarScr.cols;
+    rOutFeat.width = tar.cols;
+    rOutFeat.height = tar.rows;
+    rOutFeat.scale = static_cast<float>(tar.cols) / w2;
+    return true;
+}
+
+
+namespace {
+// Distance in pixels a point may deviate from the model and still support it
+const float INLIER_TOL = 1.5f;
+// Pattern points of a sample closer than this give no usable scale
+const float MIN_SAMPLE_DIST = 4.f;
+// UI elements are not zoomed beyond it, other scales are mismatches
+const float MAX_FEATURE_SCALE = 4.f;
+// Probability that a better model was not missed when sampling stops
+const double PROSAC_CONFIDENCE = 0.99;
+
+// Pattern to parent mapping of UI elements: uniform scale and translation
+struct similarity_t {
+    float scale;
+    Point2f shift;
+    Point2f map(const Point2f& rPt) const { return rPt * scale + shift; }
+};
+
+int countInliers(const std::vector<Point2f>& rTar, const std::vector<Point2f>& rSrc, const similarity_t& rModel,
+    std::vector<uchar>* pOutMask = nullptr)
+{
+    const float tol2 = INLIER_TOL * INLIER_TOL;
+    int count = 0;
+    for (size_t i = 0; i < rTar.size(); i++)
+    {
+        const Point2f d = rModel.map(rTar[i]) - rSrc[i];
+        const bool inlier = (d.dot(d) <= tol2);
+        count += inlier;
+        if (pOutMask)
+            (*pOutMask)[i] = inlier;
+    }
+    return count;
+}
+
+// Least squares scale and shift of the inliers
+bool refineSimilarity(const std::vector<Point2f>& rTar, const std::vector<Point2f>& rSrc, const std::vector<uchar>& rMask,
+    similarity_t& rInOutModel)
+{
+    Point2f tarMean(0.f, 0.f), srcMean(0.f, 0.f);
+    int n = 0;
+    for (size_t i = 0; i < rTar.size(); i++)
+    {
+        if (!rMask[i])
+            continue;
+        tarMean += rTar[i];
+        srcMean += rSrc[i];
+        n++;
+    }
+    tarMean *= 1.f / n;
+    srcMean *= 1.f / n;
+    double cross = 0., sq = 0.;
+    for (size_t i = 0; i < rTar.size(); i++)
+    {
+        if (!rMask[i])
+            continue;
+        const Point2f t = rTar[i] - tarMean;
+        cross += t.dot(rSrc[i] - srcMean);
+        sq += t.dot(t);
+    }
+    if (sq <= 0.)
+        return false;  // all inliers on one pattern point, keep the sampled scale
+    rInOutModel.scale = static_cast<float>(cross / sq);
+    rInOutModel.shift = srcMean - tarMean * rInOutModel.scale;
+    return true;
+}
+
+/**
+ PROSAC: the matches are sorted by descriptor distance, the samples are drawn from
+ a growing head of the list. Each new match is paired with all better ones before
+ the next is added, so the good matches are tried first and deterministically.
+ Sampling stops once the best model makes missing a better one improbable,
+ usually after a few pairs. Two points determine scale and shift.
+ @param rTar, rSrc  pattern and parent coordinates of the matches, best first.
+ @param rOutMask    inliers of the returned model.
+ @return            false if no model is supported by 3 or more matches.
+ */
+bool verifySimilarity(const std::vector<Point2f>& rTar, const std::vector<Point2f>& rSrc, similarity_t& rOutModel,
+    std::vector<uchar>& rOutMask)
+{
+    const int count = static_cast<int>(rTar.size());
+    int bestInliers = 0;
+    long long trials = 0;
+    long long maxTrials = static_cast<long long>(count) * (count - 1) / 2;
+    for (int n = 1; (n < count) && (trials < maxTrials); n++)
+    {
+        for (int j = 0; (j < n) && (trials < maxTrials); j++, trials++)
+        {
+            const Point2f tarD = rTar[n] - rTar[j];
+            const float tarLen = static_cast<float>(norm(tarD));
+            if (tarLen < MIN_SAMPLE_DIST)
+                continue;
+            const similarity_t model = {
+                static_cast<float>(norm(rSrc[n] - rSrc[j])) / tarLen,
+                Point2f(0.f, 0.f)
+            };
+            if ((model.scale < 1.f / MAX_FEATURE_SCALE) || (model.scale > MAX_FEATURE_SCALE))
+                continue;
+            // Both points map with the same scale, the shift is their mean
+            similarity_t hypo = model;
+            hypo.shift = ((rSrc[n] + rSrc[j]) - (rTar[n] + rTar[j]) * model.scale) * 0.5f;
+            const int inliers = countInliers(rTar, rSrc, hypo);
+            if (inliers <= bestInliers)
+                continue;
+            bestInliers = inliers;
+            rOutModel = hypo;
+            if (inliers == count)
+                break;
+            // Pairs needed to draw two inliers at least once with the confidence
+            const double w = static_cast<double>(inliers) / count;
+            maxTrials = min(maxTrials,
+                static_cast<long long>(std::ceil(std::log(1. - PROSAC_CONFIDENCE) / std::log(1. - w * w))));
+        }
+        if (bestInliers == count)
+            break;
+    }
+    if (bestInliers < 3)
+        return false;
+
+    rOutMask.assign(count, 0);
+    countInliers(rTar, rSrc, rOutModel, &rOutMask);
+    similarity_t refined = rOutModel;
+    if (refineSimilarity(rTar, rSrc, rOutMask, refined)
+        && (refined.scale >= 1.f / MAX_FEATURE_SCALE) && (refined.scale <= MAX_FEATURE_SCALE)
+        && (countInliers(rTar, rSrc, refined) >= bestInliers))
+    {// Otherwise the refit was pulled by a near outlier, the sampled model explains more
+        rOutModel = refined;
+        countInliers(rTar, rSrc, rOutModel, &rOutMask);
+    }
+    return true;
+}
+}  // namespace
+
+
+bool locateFeaturesIn(const Image& rInSrc, const Image& rInTar, imgArr2I_t aInOutXyLoc, bool ratioTest, float maxDistRatio, SearchCtrl* pCtrl,
+    float* pOutScale)
+{
+    std::vector<float> pts;
+    std::vector<imgPxl_t> descr;
+    Features feat;
+
+    if (rInSrc.channels != 1 || !describePattern(rInTar, pts, descr, feat))
+        return false;
+    return locateFeaturesIn(rInSrc, feat, aInOutXyLoc, ratioTest, maxDistRatio, pCtrl, pOutScale);
+}
+
+
+bool locateFeaturesIn(const Image& rInSrc, const Features& rInTar, imgArr2I_t aInOutXyLoc, bool ratioTest, float maxDistRatio, SearchCtrl* pCtrl,
+    float* pOutScale)
+{
+    int w1, w2, h1, h2;
+    w1 = rInSrc.aSizes[D_WIDTH];
+    h1 = rInSrc.aSizes[D_HEIGHT];
+    w2 = rInTar.width;
+    h2 = rInTar.height;
+
+    if (rInSrc.channels != 1 || rInTar.count < 4)
+        return false;
+
+    // Polled between the stages, a partial feature set has no usable result
+    auto isStopRequested = [pCtrl]() -> bool {
+        if (pCtrl && (pCtrl->isCancelled() || pCtrl->isExpired()))
+        {
+            pCtrl->interrupted = true;
+            return true;
+        }
+        return false;
+    };
+
+    // There is no const data ctor for mat, but we use the pointer only for reading
+    const Mat csrc(h1, w1, CV_8U, const_cast<uchar*>(rInSrc.pDat), rInSrc.lneLenByte);
+    const Mat tarScr(rInTar.count, rInTar.descrBytes, CV_8U, const_cast<uchar*>(rInTar.pDescr));
+
+    std::vector<KeyPoint> srcKp;
+    std::vector<DMatch> matches;
+    std::vector<std::vector<DMatch>> matchResults;
+    std::vector<Point2f> srcPts, tarPts;
+    std::vector<uchar> inlierMap;
+    Mat srcScr, src;
+    Point2f origin(0.f, 0.f);
+
+#ifndef NDEBUG
+    Mat result;
+    int64 ts = getTickCount();
+    double elapsed = 0;
+#endif
+
+    // Edge detector is vulnerable to image noise
+    {
+        TRACE_("medianBlur");
+        medianBlur(csrc, src, 3);
+    }
+    //src = csrc;
+    if (isStopRequested())
+        return false;
+    Mat area = src;  // Header only
+    if (aInOutXyLoc && ((aInOutXyLoc[COOR_LEFT] | aInOutXyLoc[COOR_TOP]) != 0))
+    {// Create a 3x3 subset for less amounts of pixel
+        Rect subRect = Rect(
+            aInOutXyLoc[COOR_LEFT] - (w2 >> 1) - w2,
+            aInOutXyLoc[COOR_TOP] - (h2 >> 1) - h2,
+            (w2 << 1) + w2,
+            (h2 << 1) + h2) & Rect(0, 0, w1, h1);
+        if (!subRect.empty())
+        {
+            area = Mat(src, subRect);
+            origin = subRect.tl();
+        }
+    }
+    // The max amount of found features is still same
+    {
+        TRACE_("detectFeatures");
+        gDetPtr->detect(area, srcKp);
+        gDescrPtr->compute(area, srcKp, srcScr);
+    }
+    if (isStopRequested())
+        return false;
+    //todo: limit queries to 2k
+    Trace::Span matchSpan("matchFeatures");
+    if (ratioTest)
+    {// For each src descriptor, search the best 2 matches (Crashes with too many queries)
+        gCoplPtr->knnMatch(srcScr, tarScr, matchResults, 2);  // tarScr is temporarily trained, not stored in instance
+        for (auto it = matchResults.cbegin(); it != matchResults.cend(); it++)
+        {
+            switch (it->size())
+            {
+            case 2:  // Skip ambiguous results
+                if ((it->at(0).distance / it->at(1).distance) > maxDistRatio)
+                {
+                    break;
+                }
+                //[fallthrough]
+            case 1:
+                // idx0 has always the smallest distance
+                matches.emplace_back((*it)[0]);
+                break;
+            default:  // 0 or more than 2 results
+                break;
+            }
+        }// for all matchResults
+    } else {
+     // For each src descriptor, search the best match
+        gCoplPtr->match(srcScr, tarScr, matches);
+    }
+
+    if (matches.size() < 4 || isStopRequested())
+    {// Not enough matches
+        return false;
+    }
+    // Best first, the verifier samples in this order
+    std::sort(matches.begin(), matches.end(), [&](DMatch a, DMatch b) {return a.distance < b.distance; });
+    for (size_t i = 0, upper = min<size_t>(MAX_FOR_PT_ESTIM, matches.size()); i < upper; i++)
+    {// Collect coordinates of image features
+        const float* pTarPt = rInTar.pPts + (matches[i].trainIdx << 1);
+        srcPts.emplace_back(srcKp[matches[i].queryIdx].pt + origin);
+        tarPts.emplace_back(pTarPt[0], pTarPt[1]);
+    }
+
+    matchSpan.end();
+    TRACE_("estimateLocation");
+    // UI elements are only moved and zoomed, a scale and a shift map the pattern to the parent.
+    // Fewer parameters than an affine transform need fewer matches and cannot shear or mirror.
+    similarity_t model = { 1.f, Point2f(0.f, 0.f) };
+    const bool verified = verifySimilarity(tarPts, srcPts, model, inlierMap);
+
+#ifndef NDEBUG
+    elapsed = (getTickCount() - ts) / getTickFrequency();
+    MSG_("Locate by features, time: " << elapsed*1000 << " msec");
+    drawKeypoints(area, srcKp, result);
+#endif
+
+    if (!verified)
+    {// Result not certain enough
+        return false;
+    }
+    const Point2f center = model.map(Point2f(static_cast<float>(w2 >> 1), static_cast<float>(h2 >> 1)));
+    const Scalar_<double> xyLoc(round(center.x), round(center.y));
+
+    if (!evalLimits(xyLoc[0], xyLoc[1], w1, h1))
+    {// Exceed parent borders
+        return false;
+    }
+
+    if (aInOutXyLoc)
+    {
+        aInOutXyLoc[COOR_LEFT] = static_cast<int>(xyLoc[0]);
+        aInOutXyLoc[COOR_TOP] = static_cast<int>(xyLoc[1]);
+    }
+    if (pOutScale)
+    {// The model maps the prepared pattern, which is smaller than the described one
+        *pOutScale = (rInTar.scale > 0.f) ? model.scale * rInTar.scale : model.scale;
+    }
+    return true;
+}
+
+
+unsigned long long differenceHash(const Image& rInGray)
+{
+    if (rInGray.channels != 1 || min(rInGray.aSizes[D_WIDTH], rInGray.aSizes[D_HEIGHT]) < 1)
+        return 0;
+
+    const Mat cimg(rInGray.aSizes[D_HEIGHT], rInGray.aSizes[D_WIDTH], CV_8U, const_cast<uchar*>(rInGray.pDat), rInGray.lneLenByte);
+    Mat thumb;
+    resize(cimg, thumb, Size(9, 8), 0, 0, INTER_AREA);
+    unsigned long long hash = 0;
+    for (int y = 0; y < 8; y++)
+    {// One bit per horizontal gradient sign
+        const uchar* pRow = thumb.ptr<uchar>(y);
+        for (int x = 0; x < 8; x++)
+            hash = (hash << 1) | (pRow[x] < pRow[x + 1] ? 1u : 0u);
+    }
+    return hash;
+}
+
+
+bool prepareMotionFrame(const Image& rInFrame, MotionFrame& rOutFrame, int scale)
+{
+    const int w = rInFrame.aSizes[D_WIDTH];
+    const int h = rInFrame.aSizes[D_HEIGHT];
+    scale = max(scale, 1);
+    if (((rInFrame.channels != 1) && (rInFrame.channels != 4)) || (min(w, h) < (scale << 3)))
+        return false;
+
+    TRACE_("motionFrame");
+    const Mat cimg(h, w, (rInFrame.channels == 4) ? CV_8UC4 : CV_8U, const_cast<uchar*>(rInFrame.pDat), rInFrame.lneLenByte);
+    Mat small, gray;
+    resize(cimg, small, Size(w / scale, h / scale), 0, 0, INTER_AREA);
+    if (small.channels() == 4)
+        cvtColor(small, gray, COLOR_BGRA2GRAY);
+    else
+        gray = small;
+
+    rOutFrame.width = gray.cols;
+    rOutFrame.height = gray.rows;
+    rOutFrame.scale = scale;
+    rOutFrame.data.resize(gray.total());
+    Mat out(gray.rows, gray.cols, CV_32F, rOutFrame.data.data());
+    gray.convertTo(out, CV_32F);  // into the vector, sizes match
+    // Fades out the frame borders, they would correlate as a strong edge
+    thread_local Mat window;
+    if (window.size() != out.size())
+        createHanningWindow(window, out.size(), CV_32F);
+    multiply(out, window, out);
+    return true;
+}
+
+
+bool estimateShift(const MotionFrame& rInPrev, const MotionFrame& rInCur, imgArr2I_t aOutShift, float minResponse)
+{
+    if (!aOutShift
+        || rInPrev.data.empty()
+        || (rInPrev.width != rInCur.width)
+        || (rInPrev.height != rInCur.height)
+        || (rInPrev.scale != rInCur.scale)
+        || (rInPrev.data.size() != rInCur.data.size()))
+    {
+        return false;
+    }
+
+    TRACE_("phaseCorrelate");
+    const Mat prev(rInPrev.height, rInPrev.width, CV_32F, const_cast<float*>(rInPrev.data.data()));
+    const Mat cur(rInCur.height, rInCur.width, CV_32F, const_cast<float*>(rInCur.data.data()));
+    double response = 0.;
+    Point2d shift = phaseCorrelate(prev, cur, noArray(), &response);  // sub-sample, windowed already
+    if (response < minResponse)
+        return false;
+    aOutShift[COOR_LEFT] = cvRound(shift.x * rInCur.scale);
+    aOutShift[COOR_TOP] = cvRound(shift.y * rInCur.scale);
+    return true;
+}
+
 } // namespace ImProcU8
\ No newline at end of file
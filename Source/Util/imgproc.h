@@ -1,40 +1,251 @@
-#pragma once
-
-
-namespace ImProcU8 {
-
-enum { D_WIDTH = 0, D_HEIGHT, D_2AXES};
-enum { COOR_LEFT = 0, COOR_TOP, COOR_2DIM };
-
-using imgArr2I_t = int[D_2AXES];    // plain fixed 2dim array of shorts (16B)
-using imgPxl_t = unsigned char;     // dept of one color component in a pixel
-
-const int MAX_PATTERN_SIZE = 2048;  // A sane size for lookup pattern (also limits parallelization)
-const float IMG_MATCH_SZ_TOL = 0.1f;// Allows 10% image resultion difference for matching alg.
-
-struct Image {
-    const imgPxl_t* pDat;    // const data, variable pointer!
-    int lneLenByte;          // bytes per row (aligment)
-    unsigned char channels;  // Number of color components in one pixel
-    imgArr2I_t& aSizes;      // Alternative: int (&aSizes)[2];
-    bool volatileData;
-};
-
-/**
- Find location of a pixel pattern within another image.
- Pattern size must be smaller than parent image. Both images shall be 4x8bit/pxl.
- If a rough location is given with aInOutXyLoc != {0,0}
- the parent image will be reduced to a smaller search window.
- @param rInSrc         pointer to first pixel (topleft) in the parent image.
- @param rInTar         pointer to first pixel (topleft) in the pattern.
- @param aInOutXyLoc    int[2] estimate location of the pattern within parent image. Can be NULL.
- @param certaintyPerc  percentage of how certain the result should be. Affects scaling tolerance. (0.2-1.0, default .55).
- @return               Result whether the pattern was found.
- */
-bool locatePatternIn(const Image& rInSrc, const Image& rInTar, imgArr2I_t aInOutXyLoc=nullptr, float certaintyPerc=0.55f);
-
-bool locateFeaturesIn(const Image& rInSrc, const Image& rInTar, imgArr2I_t aInOutXyLoc = nullptr, bool ratioTest = true, float maxDistRatio = 0.75f);
-
-//void findCropRectIn(const imgPxl_t* pSrcData, imgSize_t& rInOutSrcSz, imgPoint_t& rInOutRectPos);
-
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+namespace ImProcU8 {
+
+enum { D_WIDTH = 0, D_HEIGHT, D_2AXES};
+enum { COOR_LEFT = 0, COOR_TOP, COOR_2DIM };
+
+using imgArr2I_t = int[D_2AXES];    // plain fixed 2dim array of shorts (16B)
+using imgPxl_t = unsigned char;     // dept of one color component in a pixel
+
+const int MAX_PATTERN_SIZE = 2048;  // A sane size for lookup pattern (also limits parallelization)
+
+struct Image {
+    const imgPxl_t* pDat;    // const data, variable pointer!
+    int lneLenByte;          // bytes per row (aligment)
+    unsigned char channels;  // Number of color components in one pixel
+    imgArr2I_t& aSizes;      // Alternative: int (&aSizes)[2];
+    bool volatileData;
+};
+
+/**
+ Key points and ORB descriptors of a pattern, prepared the way locateFeaturesIn needs them.
+ Like Image it only refers to data owned elsewhere.
+ */
+struct Features {
+    const float* pPts;          // x,y pair per key point
+    const imgPxl_t* pDescr;     // one row of descrBytes per key point
+    int count;
+    int descrBytes;
+    int width;                  // of the prepared pattern
+    int height;
+    float scale;                // prepared pattern size relative to the given one
+};
+
+/**
+ Cooperative stop request for long running searches.
+ The search polls it between tiles and pipeline stages.
+ @var pCancel      set by the owner to abort, result is discarded. Can be NULL.
+ @var deadline     time limit, the best result so far is evaluated. Ignored if default constructed.
+ @var interrupted  output, true if the search stopped early.
+ */
+struct SearchCtrl {
+    const std::atomic<bool>* pCancel;
+    std::chrono::steady_clock::time_point deadline;
+    bool interrupted;
+
+    bool isCancelled() const {
+        return pCancel && pCancel->load(std::memory_order_relaxed);
+    }
+    bool isExpired() const {
+        return (deadline != std::chrono::steady_clock::time_point())
+            && (std::chrono::steady_clock::now() >= deadline);
+    }
+};
+
+/**
+ Cheap tests in front of the normalized correlation, done on gray values from integral images.
+ Stage 1 compares mean and deviation of every pattern sized window with the pattern,
+ stage 2 a grid of block means (signature), only survivors are correlated.
+ With a cascade a pattern is found by the correlation score alone, the score
+ of rejected windows is not known.
+ @var meanTol       allowed difference of the window mean, gray levels.
+ @var devRatio      allowed factor between window and pattern deviation (>= 1).
+ @var sigBlocks     signature blocks per side, 0 skips stage 2.
+ @var minSigCorr    correlation of the block means required (-1 to 1).
+ @var maxSurvivors  fraction of windows above which the full correlation is faster,
+                    for a 32x32 pattern. Scaled by the pattern area, survivors are scored one by one.
+ */
+struct Cascade {
+    float meanTol;
+    float devRatio;
+    int sigBlocks;
+    float minSigCorr;
+    float maxSurvivors;
+};
+const Cascade DEFAULT_CASCADE = { 24.f, 2.f, 4, 0.5f, 0.1f };
+
+/**
+ Windows tested and rejected per cascade stage, accumulated over calls.
+ Without a cascade, or when it fell back, all windows count as correlated.
+ */
+struct CascadeStats {
+    long long windows;
+    long long rejectedStats;      // stage 1
+    long long rejectedSignature;  // stage 2
+    long long correlated;
+};
+
+/**
+ Find location of a pixel pattern within another image.
+ Pattern size must be smaller than parent image. Both images shall be 4x8bit/pxl or both 1x8bit/pxl.
+ If a rough location is given with aInOutXyLoc != {0,0}
+ the parent image will be reduced to a smaller search window.
+ @param rInSrc         pointer to first pixel (topleft) in the parent image.
+ @param rInTar         pointer to first pixel (topleft) in the pattern.
+ @param aInOutXyLoc    int[2] estimate location of the pattern within parent image. Can be NULL.
+ @param certaintyPerc  percentage of how certain the result should be. Affects scaling tolerance. (0.2-1.0, default .55).
+ @param pCtrl          optional stop request, polled between row tiles of the parent image.
+ @param pCascade       optional prefilter, NULL correlates every window.
+ @param pOutStats      optional, windows per cascade stage are added.
+ @return               Result whether the pattern was found.
+ */
+bool locatePatternIn(const Image& rInSrc, const Image& rInTar, imgArr2I_t aInOutXyLoc=nullptr, float certaintyPerc=0.55f, SearchCtrl* pCtrl=nullptr,
+    const Cascade* pCascade=nullptr, CascadeStats* pOutStats=nullptr);
+
+/**
+ Extrema of each row of the TM_CCOEFF_NORMED result map, the map itself is not kept.
+ Rows are indexed like the result map, from the top of the searched area.
+ */
+struct RowExtrema {
+    std::vector<float> maxVal;
+    std::vector<int> maxX;
+    std::vector<float> minVal;
+};
+
+/**
+ TM_CCOEFF_NORMED of every window like matchTemplate, in integer sums: the cross products
+ of 8bit pixels and the 16bit pattern in SIMD, the window sums from integral images and the
+ pattern moments computed once. Scores agree with matchTemplate within float rounding.
+ Direct correlation pays off on hint sized areas and small patterns, on whole frames with
+ large patterns the DFT of matchTemplate is faster.
+ Both images shall be 4x8bit/pxl or both 1x8bit/pxl.
+ @param rOut   extrema per result row. When pCtrl expired, the rows done so far.
+ @param pCtrl  optional stop request, polled every TILE_ROWS rows.
+ @return       false on invalid input or cancel.
+ */
+bool correlateRows(const Image& rInSrc, const Image& rInTar, RowExtrema& rOut, SearchCtrl* pCtrl=nullptr);
+
+/**
+ locatePatternIn on correlateRows instead of matchTemplate, same hint and decision.
+ */
+bool locatePatternFixed(const Image& rInSrc, const Image& rInTar, imgArr2I_t aInOutXyLoc=nullptr, float certaintyPerc=0.55f, SearchCtrl* pCtrl=nullptr);
+
+/**
+ Pattern scales searched by locatePatternScaled.
+ @var minScale, maxScale  range of the pattern size, 1 = as given.
+ @var step                factor between neighboring scales of the coarse pass (> 1).
+ @var coarse              the coarse pass runs on the frame reduced by it, 1 runs it at full size.
+ */
+struct ScaleRange {
+    float minScale;
+    float maxScale;
+    float step;
+    int coarse;
+};
+const ScaleRange DEFAULT_SCALES = { 0.5f, 2.f, 1.1f, 4 };
+
+/**
+ Find a pattern of unknown size. All scales of the range are correlated in parallel on
+ a reduced frame, the best is refined around its location at full resolution.
+ Both images shall be 4x8bit/pxl or both 1x8bit/pxl.
+ @param aInOutXyLoc    like locatePatternIn, a hint limits all passes to its surrounding.
+ @param pInOutScale    scale of the match. A scale > 0 is tried first at full resolution,
+                       a match skips the other passes. Can be NULL.
+ @param certaintyPerc  correlation score (0-1) the best scale has to reach.
+ @param pCtrl          optional stop request, polled between the passes.
+ @return               Result whether the pattern was found.
+ */
+bool locatePatternScaled(const Image& rInSrc, const Image& rInTar, const ScaleRange& rRange, imgArr2I_t aInOutXyLoc=nullptr,
+    float* pInOutScale=nullptr, float certaintyPerc=0.7f, SearchCtrl* pCtrl=nullptr);
+
+/**
+ Places where a pattern correlates best, for patterns standing in for a group of similar ones.
+ Places closer than the pattern size to a better one are suppressed. Both images shall be 4x8bit/pxl.
+ @param minScore  normalized correlation (0-1) required.
+ @param rOutXy    x,y pairs of the pattern centers, best first.
+ @param pCtrl     optional stop request, polled before the correlation. An interrupted search finds nothing.
+ @return          number of places found.
+ */
+int locateCandidatesIn(const Image& rInSrc, const Image& rInTar, float minScore, int maxCount, std::vector<int>& rOutXy, SearchCtrl* pCtrl=nullptr);
+
+/**
+ Normalized correlation coefficient (-1 to 1) of two equally sized 4x8bit/pxl images.
+ An image without any structure (single color) has no similarity to anything, 0.
+ */
+float patternSimilarity(const Image& rInA, const Image& rInB);
+
+/**
+ Smallest region of a pattern that identifies it in the frame it was cut from. Sizes are
+ tried from small to large, per size the placements that differ most from the places where
+ the whole pattern scores high come first. A region qualifies if locatePatternIn finds it at
+ its own place, and would find nothing elsewhere if that place were gone. It may qualify where
+ the whole pattern does not, a row of buttons differs in the labels only.
+ Correlates the whole frame several times, run it off the UI thread. Both images shall be 4x8bit/pxl.
+ @param aInXyLoc       top left of the pattern in the frame.
+ @param certaintyPerc  of the locatePatternIn searches the region is meant for.
+ @param aOutXy         top left of the region in the pattern.
+ @param aOutSize       of the region, the whole pattern if no smaller one qualifies.
+ @param pCtrl          optional, a cancel is polled between the correlations. The deadline is ignored.
+ @return               whether a region smaller than the pattern qualified.
+ */
+bool selectDistinctRegion(const Image& rInSrc, const Image& rInTar, const imgArr2I_t aInXyLoc, float certaintyPerc,
+    imgArr2I_t aOutXy, imgArr2I_t aOutSize, SearchCtrl* pCtrl=nullptr);
+
+/**
+ Find location of a pattern by matching FAST/ORB features. Both images shall be 1x8bit/pxl.
+ @param pCtrl  optional stop request, polled between pipeline stages.
+               There is no partial result, an interrupted search reports not found.
+ @param pOutScale  optional, size of the found pattern relative to the given one.
+                   With Features it is relative to the pattern they were described from.
+ */
+bool locateFeaturesIn(const Image& rInSrc, const Image& rInTar, imgArr2I_t aInOutXyLoc = nullptr, bool ratioTest = true, float maxDistRatio = 0.75f, SearchCtrl* pCtrl = nullptr,
+    float* pOutScale = nullptr);
+
+// Same with pattern features from describePattern, skips their extraction.
+bool locateFeaturesIn(const Image& rInSrc, const Features& rInTar, imgArr2I_t aInOutXyLoc = nullptr, bool ratioTest = true, float maxDistRatio = 0.75f, SearchCtrl* pCtrl = nullptr,
+    float* pOutScale = nullptr);
+
+/**
+ Extract the pattern features used by locateFeaturesIn. Pattern shall be 1x8bit/pxl.
+ @param rOutPts    storage of the key points, rOutFeat refers to it.
+ @param rOutDescr  storage of the descriptors, rOutFeat refers to it.
+ */
+bool describePattern(const Image& rInTar, std::vector<float>& rOutPts, std::vector<imgPxl_t>& rOutDescr, Features& rOutFeat);
+
+// 64bit difference hash of a 1x8bit/pxl image, 0 on invalid input.
+unsigned long long differenceHash(const Image& rInGray);
+
+/**
+ Downsampled and windowed gray copy of a frame, the input of estimateShift.
+ Computed once per frame and kept for the comparison with the next one.
+ */
+struct MotionFrame {
+    std::vector<float> data;
+    int width;
+    int height;
+    int scale;   // frame pixels per sample
+};
+
+/**
+ Prepare a frame of 4x8bit/pxl or 1x8bit/pxl for estimateShift.
+ @param scale  downsampling factor, larger is faster but less exact.
+ */
+bool prepareMotionFrame(const Image& rInFrame, MotionFrame& rOutFrame, int scale = 4);
+
+/**
+ Global translation of the content between two frames by phase correlation.
+ Suits scrolling and panning, not zoom or rotation.
+ @param aOutShift    int[2] offset of the content of rInCur relative to rInPrev in frame pixels.
+ @param minResponse  required peak strength (0-1), frames without common texture stay below.
+ @return             whether a shift was found. An unchanged frame has shift {0,0}.
+ */
+bool estimateShift(const MotionFrame& rInPrev, const MotionFrame& rInCur, imgArr2I_t aOutShift, float minResponse = 0.2f);
+
+//void findCropRectIn(const imgPxl_t* pSrcData, imgSize_t& rInOutSrcSz, imgPoint_t& rInOutRectPos);
+
 } // namespace ImProc
\ No newline at end of file
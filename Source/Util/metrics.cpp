@@ -0,0 +1,225 @@
+#include "metrics.h"
+
+#include <QSaveFile>
+#include <QString>
+
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace {
+    using namespace Metrics;
+
+    const char* HIST_NAMES[H_COUNT] = {
+        "capture", "convert", "match_template", "match_features", "queue_wait", "detect_to_click", "input_delay"
+    };
+    const char* COUNTER_NAMES[C_COUNT] = {
+        "frames", "dropped_frames", "superseded_frames", "searches", "found", "clicks", "coalesced_moves", "tracked", "cache_hits", "cache_misses",
+        "pruned", "cascade_windows", "rejected_stats", "rejected_signature",
+        "published_frames", "deferred_searches", "deadline_misses", "coarse_results", "roi_searches"
+    };
+
+    // Written by its thread only, relaxed load+store is enough and avoids locked adds.
+    // Each shard is an allocation of its own, padded so two never share a cache line.
+    struct shard_t {
+        char padFront[64];
+        std::atomic<unsigned long long> counters[C_COUNT];
+        std::atomic<unsigned long long> buckets[H_COUNT][BUCKETS];
+        std::atomic<unsigned long long> sumNs[H_COUNT];
+        char padBack[64];
+    };
+
+    inline void bump(std::atomic<unsigned long long>& rVal, unsigned long long n)
+    {
+        rVal.store(rVal.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    // Shards outlive their threads, counts of finished workers stay in the sums
+    std::mutex gShardLock;
+    std::vector<std::unique_ptr<shard_t>> gShards;
+
+    shard_t& localShard()
+    {
+        thread_local shard_t* pShard = nullptr;
+        if (!pShard)
+        {
+            std::unique_ptr<shard_t> shard(new shard_t());
+            for (auto& rCounter : shard->counters)
+                rCounter.store(0, std::memory_order_relaxed);
+            for (int h = 0; h < H_COUNT; h++)
+            {
+                for (auto& rBucket : shard->buckets[h])
+                    rBucket.store(0, std::memory_order_relaxed);
+                shard->sumNs[h].store(0, std::memory_order_relaxed);
+            }
+            pShard = shard.get();
+            std::lock_guard<std::mutex> guard(gShardLock);
+            gShards.push_back(std::move(shard));
+        }
+        return *pShard;
+    }
+
+    struct dumper_t {
+        std::thread thread;
+        std::mutex lock;
+        std::condition_variable wake;
+        bool stop;
+    };
+    std::mutex gDumpLock;  // serializes start and stop
+    std::unique_ptr<dumper_t> gDumper;
+
+    void endDumper()
+    {// Caller holds gDumpLock
+        if (!gDumper)
+            return;
+        {
+            std::lock_guard<std::mutex> guard(gDumper->lock);
+            gDumper->stop = true;
+        }
+        gDumper->wake.notify_all();
+        gDumper->thread.join();
+        gDumper.reset();
+    }
+
+    bool writeDump(const QString& rPath)
+    {
+        std::string text = toText(collect());
+        QSaveFile file(rPath);  // replaced on commit, readers never see half a dump
+        if (!file.open(QIODevice::WriteOnly))
+            return false;
+        file.write(text.data(), static_cast<qint64>(text.size()));
+        return file.commit();
+    }
+}
+
+
+namespace Metrics {
+
+void observe(histogram_t hist, std::chrono::nanoseconds duration)
+{
+    unsigned long long ns = duration.count() > 0 ? static_cast<unsigned long long>(duration.count()) : 0;
+    unsigned long long us = (ns + 999) / 1000;
+    int bucket = 0;
+    while ((us > 1) && (bucket < BUCKETS - 1))
+    {// Rounds up to the next power of two
+        us = (us + 1) >> 1;
+        bucket++;
+    }
+    shard_t& rShard = localShard();
+    bump(rShard.buckets[hist][bucket], 1);
+    bump(rShard.sumNs[hist], ns);
+}
+
+
+void add(counter_t counter, unsigned long long n)
+{
+    bump(localShard().counters[counter], n);
+}
+
+
+snapshot_t collect()
+{
+    snapshot_t data = {};
+    std::lock_guard<std::mutex> guard(gShardLock);
+    for (const auto& rShard : gShards)
+    {
+        for (int c = 0; c < C_COUNT; c++)
+            data.counters[c] += rShard->counters[c].load(std::memory_order_relaxed);
+        for (int h = 0; h < H_COUNT; h++)
+        {
+            histogramData_t& rHist = data.histograms[h];
+            for (int b = 0; b < BUCKETS; b++)
+            {
+                unsigned long long n = rShard->buckets[h][b].load(std::memory_order_relaxed);
+                rHist.buckets[b] += n;
+                rHist.count += n;
+            }
+            rHist.sumNs += rShard->sumNs[h].load(std::memory_order_relaxed);
+        }
+    }
+    return data;
+}
+
+
+double percentileMs(const histogramData_t& rHist, double perc)
+{
+    if (!rHist.count)
+        return 0.;
+    unsigned long long rank = static_cast<unsigned long long>(perc * rHist.count);
+    unsigned long long seen = 0;
+    for (int b = 0; b < BUCKETS; b++)
+    {
+        seen += rHist.buckets[b];
+        if (seen > rank)
+            return static_cast<double>(1ull << b) / 1000.;
+    }
+    return static_cast<double>(1ull << (BUCKETS - 1)) / 1000.;
+}
+
+
+std::string toText(const snapshot_t& rData)
+{
+    std::string text;
+    char line[160];
+    for (int c = 0; c < C_COUNT; c++)
+    {
+        std::snprintf(line, sizeof(line), "# TYPE screenmacro_%s_total counter\nscreenmacro_%s_total %llu\n",
+            COUNTER_NAMES[c], COUNTER_NAMES[c], rData.counters[c]);
+        text += line;
+    }
+    for (int h = 0; h < H_COUNT; h++)
+    {
+        const histogramData_t& rHist = rData.histograms[h];
+        std::snprintf(line, sizeof(line), "# TYPE screenmacro_%s_seconds histogram\n", HIST_NAMES[h]);
+        text += line;
+        unsigned long long cumulated = 0;
+        for (int b = 0; b < BUCKETS - 1; b++)
+        {
+            cumulated += rHist.buckets[b];
+            std::snprintf(line, sizeof(line), "screenmacro_%s_seconds_bucket{le=\"%g\"} %llu\n",
+                HIST_NAMES[h], static_cast<double>(1ull << b) * 1e-6, cumulated);
+            text += line;
+        }
+        std::snprintf(line, sizeof(line),
+            "screenmacro_%s_seconds_bucket{le=\"+Inf\"} %llu\nscreenmacro_%s_seconds_sum %.9f\nscreenmacro_%s_seconds_count %llu\n",
+            HIST_NAMES[h], rHist.count, HIST_NAMES[h], rHist.sumNs * 1e-9, HIST_NAMES[h], rHist.count);
+        text += line;
+    }
+    return text;
+}
+
+
+bool startDump(const std::string& rPath, int periodMs)
+{
+    if (rPath.empty() || (periodMs < 1))
+        return false;
+
+    std::lock_guard<std::mutex> guard(gDumpLock);
+    endDumper();
+    gDumper.reset(new dumper_t());
+    gDumper->stop = false;
+    dumper_t* pDumper = gDumper.get();
+    QString path = QString::fromStdString(rPath);
+    pDumper->thread = std::thread([pDumper, path, periodMs]() {
+        std::unique_lock<std::mutex> lock(pDumper->lock);
+        while (!pDumper->stop)
+        {
+            pDumper->wake.wait_for(lock, std::chrono::milliseconds(periodMs));
+            writeDump(path);  // last dump on stop
+        }
+    });
+    return true;
+}
+
+
+void stopDump()
+{
+    std::lock_guard<std::mutex> guard(gDumpLock);
+    endDumper();
+}
+
+} // namespace Metrics
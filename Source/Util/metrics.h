@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+namespace Metrics {
+
+// Fixed set, an enum indexes the shard arrays without lookup
+enum histogram_t {
+    H_CAPTURE = 0,      // screen grab of a window
+    H_CONVERT,          // pixmap to image, color and scale conversion
+    H_MATCH_TEMPLATE,   // one pattern search, locatePatternIn
+    H_MATCH_FEATURES,   // one pattern search, locateFeaturesIn
+    H_QUEUE_WAIT,       // frame or request waiting for a worker
+    H_DETECT_TO_CLICK,  // frame captured till click dispatched
+    H_INPUT_DELAY,      // click queued till its button down was sent
+    H_COUNT
+};
+
+enum counter_t {
+    C_FRAMES = 0,       // captured
+    C_DROPPED,          // capture skipped, frame buffer busy
+    C_SUPERSEDED,       // frame replaced in the queue before a worker took it
+    C_SEARCHES,
+    C_FOUND,
+    C_CLICKS,
+    C_COALESCED_MOVES,  // cursor moves superseded before they were sent
+    C_TRACKED,          // found again at the location expected from the frame shift
+    C_CACHE_HITS,       // search result taken from the cache, region content unchanged
+    C_CACHE_MISSES,
+    C_PRUNED,           // searches skipped, the prototype of the pattern group did not match
+    C_CASCADE_WINDOWS,  // pattern positions tested by the template engines
+    C_REJECTED_STATS,   // by mean and deviation, before correlation
+    C_REJECTED_SIGNATURE,  // by block means, before correlation
+    C_PUBLISHED,        // frames written to the shared memory ring
+    C_DEFERRED,         // searches moved to a later frame, the frame budget was used up
+    C_DEADLINE_MISSES,  // frames whose searches ended after their budget
+    C_COARSE_RESULTS,   // anytime searches cut short after the coarse level
+    C_ROI_SEARCHES,     // searches limited to the region of their pattern
+    C_COUNT
+};
+
+// Bucket i counts durations up to 2^i microseconds, the last one the rest
+const int BUCKETS = 24;
+
+struct histogramData_t {
+    unsigned long long buckets[BUCKETS];
+    unsigned long long count;
+    unsigned long long sumNs;
+};
+
+struct snapshot_t {
+    unsigned long long counters[C_COUNT];
+    histogramData_t histograms[H_COUNT];
+};
+
+/**
+ Record a duration. Each thread writes its own shard, no lock and no shared cache line.
+ The first call of a thread registers its shard once.
+ */
+void observe(histogram_t hist, std::chrono::nanoseconds duration);
+
+void add(counter_t counter, unsigned long long n=1);
+
+// Sum of all shards, threads may write meanwhile
+snapshot_t collect();
+
+// Upper bound in ms of the bucket holding the percentile (0-1)
+double percentileMs(const histogramData_t& rHist, double perc);
+
+// Prometheus text exposition format
+std::string toText(const snapshot_t& rData);
+
+/**
+ Write toText(collect()) to a file every periodMs, replaced atomically.
+ Suits the textfile collector of a node exporter. A new call replaces the running dump.
+ */
+bool startDump(const std::string& rPath, int periodMs);
+void stopDump();
+
+// Records the lifetime of the scope
+class ScopeTimer
+{
+    std::chrono::steady_clock::time_point mStart;
+    histogram_t mHist;
+
+public:
+    explicit ScopeTimer(histogram_t hist) : mStart(std::chrono::steady_clock::now()), mHist(hist) {}
+    ~ScopeTimer() { observe(mHist, std::chrono::steady_clock::now() - mStart); }
+};
+
+} // namespace Metrics
@@ -0,0 +1,199 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <vector>
+
+
+namespace {
+    using traceClock_t = std::chrono::steady_clock;
+
+    // Fields are atomics so a concurrent export is no data race,
+    // seq is odd while the slot is written.
+    struct slot_t {
+        std::atomic<unsigned long long> seq;
+        std::atomic<const char*> pName;
+        std::atomic<long long> startNs;
+        std::atomic<long long> durNs;
+        std::atomic<long long> arg;
+        std::atomic<int> tid;
+    };
+
+    struct event_t {
+        const char* pName;
+        long long startNs;
+        long long durNs;
+        long long arg;
+        int tid;
+    };
+
+    std::atomic<bool> gEnabled(false);
+    std::atomic<slot_t*> gRing(nullptr);
+    unsigned gMask = 0;                          // written once with gRing
+    std::atomic<unsigned long long> gNext(0);
+    const traceClock_t::time_point gEpoch = traceClock_t::now();
+
+    std::mutex gLock;                            // ring allocation and thread names
+    std::map<int, const char*> gThreadNames;
+    std::atomic<int> gNextTid(1);
+
+    int threadId()
+    {
+        thread_local int tid = gNextTid.fetch_add(1, std::memory_order_relaxed);
+        return tid;
+    }
+
+    long long sinceEpoch(traceClock_t::time_point t)
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(t - gEpoch).count();
+    }
+
+    void appendEscaped(std::string& rOut, const char* pText)
+    {
+        for (; *pText; pText++)
+        {
+            if ((*pText == '"') || (*pText == '\\'))
+                rOut += '\\';
+            rOut += *pText;
+        }
+    }
+}
+
+
+namespace Trace {
+
+void enable(unsigned capacity)
+{
+    {
+        std::lock_guard<std::mutex> guard(gLock);
+        if (!gRing.load())
+        {
+            unsigned size = 1;
+            while (size < std::max(capacity, 2u))
+                size <<= 1;
+            slot_t* pRing = new slot_t[size];
+            for (unsigned i = 0; i < size; i++)
+                pRing[i].seq.store(0, std::memory_order_relaxed);  // empty
+            gMask = size - 1;
+            gRing.store(pRing, std::memory_order_release);
+        }
+    }
+    gEnabled.store(true, std::memory_order_release);
+}
+
+
+void disable()
+{
+    gEnabled.store(false, std::memory_order_release);
+}
+
+
+bool isEnabled()
+{
+    return gEnabled.load(std::memory_order_relaxed);
+}
+
+
+void setThreadName(const char* pName)
+{
+    std::lock_guard<std::mutex> guard(gLock);
+    gThreadNames[threadId()] = pName;
+}
+
+
+void record(const char* pName, traceClock_t::time_point start, traceClock_t::time_point end, long long arg)
+{
+    slot_t* pRing = gRing.load(std::memory_order_acquire);
+    if (!pRing || !isEnabled())
+        return;
+
+    unsigned long long idx = gNext.fetch_add(1, std::memory_order_relaxed);
+    slot_t& rSlot = pRing[idx & gMask];
+    rSlot.seq.store(2 * idx + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    rSlot.pName.store(pName, std::memory_order_relaxed);
+    rSlot.startNs.store(sinceEpoch(start), std::memory_order_relaxed);
+    rSlot.durNs.store(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(), std::memory_order_relaxed);
+    rSlot.arg.store(arg, std::memory_order_relaxed);
+    rSlot.tid.store(threadId(), std::memory_order_relaxed);
+    rSlot.seq.store(2 * idx + 2, std::memory_order_release);
+}
+
+
+std::string toChromeJson()
+{
+    std::vector<event_t> events;
+    slot_t* pRing = gRing.load(std::memory_order_acquire);
+    if (pRing)
+    {
+        events.reserve(gMask + 1);
+        for (unsigned i = 0; i <= gMask; i++)
+        {
+            const slot_t& rSlot = pRing[i];
+            unsigned long long seq = rSlot.seq.load(std::memory_order_acquire);
+            if (!seq || (seq & 1))
+                continue;  // empty or being written
+            event_t event{
+                rSlot.pName.load(std::memory_order_relaxed),
+                rSlot.startNs.load(std::memory_order_relaxed),
+                rSlot.durNs.load(std::memory_order_relaxed),
+                rSlot.arg.load(std::memory_order_relaxed),
+                rSlot.tid.load(std::memory_order_relaxed)
+            };
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (rSlot.seq.load(std::memory_order_relaxed) == seq)
+                events.push_back(event);  // not overwritten meanwhile
+        }
+    }
+    std::sort(events.begin(), events.end(),
+        [](const event_t& a, const event_t& b) { return a.startNs < b.startNs; });
+
+    std::string json = "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    char buf[192];
+    bool first = true;
+    for (const event_t& rEvent : events)
+    {
+        json += first ? "\n{\"name\": \"" : ",\n{\"name\": \"";
+        appendEscaped(json, rEvent.pName ? rEvent.pName : "?");
+        std::snprintf(buf, sizeof(buf), "\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+            rEvent.tid, rEvent.startNs * 1e-3, rEvent.durNs * 1e-3);
+        json += buf;
+        if (rEvent.arg >= 0)
+        {
+            std::snprintf(buf, sizeof(buf), ", \"args\": {\"id\": %lld}", rEvent.arg);
+            json += buf;
+        }
+        json += "}";
+        first = false;
+    }
+    {
+        std::lock_guard<std::mutex> guard(gLock);
+        for (const auto& rName : gThreadNames)
+        {
+            std::snprintf(buf, sizeof(buf), "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"",
+                first ? "" : ",", rName.first);
+            json += buf;
+            appendEscaped(json, rName.second);
+            json += "\"}}";
+            first = false;
+        }
+    }
+    json += "\n]}\n";
+    return json;
+}
+
+
+bool exportChrome(const std::string& rPath)
+{
+    std::string json = toChromeJson();
+    FILE* pFile = std::fopen(rPath.c_str(), "wb");
+    if (!pFile)
+        return false;
+    bool written = std::fwrite(json.data(), 1, json.size(), pFile) == json.size();
+    return (std::fclose(pFile) == 0) && written;
+}
+
+} // namespace Trace
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+
+#define TRACE_CAT_(a, b) a##b
+#define TRACE_VAR_(line) TRACE_CAT_(traceSpan, line)
+// Span of the enclosing scope, name must be a string literal
+#define TRACE_(name) Trace::Span TRACE_VAR_(__LINE__)(name)
+
+namespace Trace {
+
+/**
+ Start recording spans into a ring buffer, the oldest ones are overwritten.
+ The buffer is allocated by the first call and kept, its capacity is rounded up to a power of two.
+ */
+void enable(unsigned capacity = 1u << 16);
+void disable();
+bool isEnabled();
+
+// Shown instead of the thread number, pName must outlive the trace
+void setThreadName(const char* pName);
+
+/**
+ Add a finished span. Writers only claim a slot with an atomic increment,
+ a slot being rewritten while exporting is skipped.
+ @param pName  static string, only the pointer is stored.
+ @param arg    shown in the span details, e.g. a frame or monitor id. Negative for none.
+ */
+void record(const char* pName, std::chrono::steady_clock::time_point start,
+    std::chrono::steady_clock::time_point end, long long arg = -1);
+
+// Chrome trace JSON (chrome://tracing, Perfetto) of the spans in the buffer
+std::string toChromeJson();
+bool exportChrome(const std::string& rPath);
+
+class Span
+{
+    const char* mpName;
+    long long mArg;
+    std::chrono::steady_clock::time_point mStart;
+    bool mActive;
+
+public:
+    explicit Span(const char* pName, long long arg = -1) :
+        mpName(pName), mArg(arg), mActive(isEnabled())
+    {
+        if (mActive)
+            mStart = std::chrono::steady_clock::now();
+    }
+    ~Span() { end(); }
+
+    // Ends the span before the scope does
+    void end()
+    {
+        if (mActive)
+            record(mpName, mStart, std::chrono::steady_clock::now(), mArg);
+        mActive = false;
+    }
+};
+
+} // namespace Trace
@@ -1,144 +1,337 @@
-#include <Windows.h>
-#include <vector>
-#include "winapi.h"
-
-
-// Anonymous namespace
-namespace {
-    const int WND_TXT_SZ = 50;
-    const unsigned long CLICK_TIME(GetDoubleClickTime() + 5);
-    template<typename T> T limToPos(T val) {
-        return val < 0 ? 0 : val;
-    }
-}
-
-namespace WinOS {
-using namespace std;
-
-BOOL CALLBACK EnumWindowsProc(_In_ HWND hWnd, _In_ LPARAM lParam)
-{
-    if (!lParam)
-        return false;
-    if (!hWnd)
-        return true;
-    
-    reinterpret_cast<vector<HWND>*>(lParam)->push_back(hWnd);
-
-    return true;
-}
-
-
-void listDsktParentWindows(map<const void*, wstring>* rOutHwnd_TitleMap)
-{
-    if (!rOutHwnd_TitleMap)
-        return;
-
-    vector<HWND> handles;
-    int srcSz, dstSz;
-    wchar_t* wcharBuff = new wchar_t[WND_TXT_SZ];
-
-    dstSz = WND_TXT_SZ;
-    EnumWindows(EnumWindowsProc, LONG_PTR(&handles));
-    for(auto hdl : handles)  // auto it = Handles.cbegin(); it != Handles.cend(); it++)
-    {
-        if (IsWindowVisible(hdl) && (!GetWindow(hdl, GW_OWNER)))
-        {
-            srcSz = GetWindowTextLength(hdl);
-            if (srcSz >= dstSz)
-            {
-                wcharBuff = new wchar_t[++srcSz];
-                dstSz = srcSz;
-            }
-            if (0 < GetWindowTextW(hdl, wcharBuff, dstSz))
-            {
-                rOutHwnd_TitleMap->emplace(hdl, wstring(wcharBuff));
-            }
-        }
-    }
-    delete[] wcharBuff;
-}
-
-
-bool checkIsValidWindow(const void* hWnd)
-{
-    return hWnd ? IsWindow(HWND(hWnd)) : false;
-}
-
-
-void clickWindowHere(
-    const void* hWnd,
-    int xPos,
-    int yPos,
-    bool returnAfter,
-    unsigned long durationMs
-    )
-{
-    if (!hWnd || !checkIsValidWindow(hWnd))
-        return;
-    
-    RECT wndRect;
-    if (GetWindowRect(HWND(hWnd), &wndRect))  // returns virtual desktop coords
-    {
-        // TODO: limit wndRect
-        POINT msePos;
-        GetCursorPos(&msePos);
-        long x, y;
-        x = limToPos(wndRect.left + xPos);
-        y = limToPos(wndRect.top + yPos);
-        if ((x | y) > 0xFFFF)  // x, y < short_max
-            return;  //throw overflow_error("Mouse coordinates too big");
-        // can click on a desktop spread over max 34 FullHD monitors...
-        moveMouseAbsolute(
-            (unsigned short)x,
-            (unsigned short)y
-        );
-        mouseClick(durationMs ? durationMs : CLICK_TIME);
-        if (returnAfter)
-        {
-            x = limToPos(msePos.x);
-            y = limToPos(msePos.y);
-            if ((x | y) > 0xFFFF)  // x, y < short_max
-                return;  //throw overflow_error("Unsupported desktop resolution");;
-            moveMouseAbsolute((unsigned short)x, (unsigned short)y);
-        }
-    }
-}
-
-
-void moveMouseAbsolute(unsigned short xPxl, unsigned short yPxl)
-{
-    // Alternatives:
-    // GetDeviceCaps( hdcPrimaryMonitor, HORZRES)
-    // GetMonitorInfoA( MonitorFromWindow( hwnd, MONITOR_DEFAULTTONEAREST),&MONITORINFO() )
-    INPUT inpt = {
-        (DWORD)INPUT_MOUSE,  // type
-        MOUSEINPUT {         // DUMMYUNIONNAME.mi
-            // dx, dy, mouseData, dwFlags, time, dwExtraInfo
-            (long)((float)xPxl * (65535.f / (GetSystemMetrics(SM_CXVIRTUALSCREEN)-1))),  //SM_CXSCREEN
-            (long)((float)yPxl * (65535.f / (GetSystemMetrics(SM_CYVIRTUALSCREEN)-1))),  //SM_CYSCREEN
-            0,
-            MOUSEEVENTF_ABSOLUTE | MOUSEEVENTF_MOVE| MOUSEEVENTF_VIRTUALDESK,
-            0,
-            0
-        }
-    };
-    SendInput(1, &inpt, sizeof(inpt));
-}
-
-
-void mouseClick(unsigned long durationMs)
-{
-    INPUT inpt = {
-        (DWORD)INPUT_MOUSE,  // type
-        MOUSEINPUT {         // DUMMYUNIONNAME.mi
-            // dx, dy, mouseData, dwFlags, time, dwExtraInfo
-            0, 0, 0, MOUSEEVENTF_LEFTDOWN, 0, 0
-        }
-    };
-    SendInput(1, &inpt, sizeof(inpt));
-    Sleep(durationMs);
-    inpt.mi.dwFlags = MOUSEEVENTF_LEFTUP;
-    SendInput(1, &inpt, sizeof(inpt));
-}
-
-}// Namespace WinOS
\ No newline at end of file
+#ifdef _WIN32
+#include <Windows.h>
+#include <vector>
+#include "winapi.h"
+
+
+// Anonymous namespace
+namespace {
+    const int WND_TXT_SZ = 50;
+    const unsigned long CLICK_TIME(GetDoubleClickTime() + 5);
+    template<typename T> T limToPos(T val) {
+        return val < 0 ? 0 : val;
+    }
+}
+
+namespace WinOS {
+using namespace std;
+
+BOOL CALLBACK EnumWindowsProc(_In_ HWND hWnd, _In_ LPARAM lParam)
+{
+    if (!lParam)
+        return false;
+    if (!hWnd)
+        return true;
+    
+    reinterpret_cast<vector<HWND>*>(lParam)->push_back(hWnd);
+
+    return true;
+}
+
+
+void listDsktParentWindows(map<const void*, wstring>* rOutHwnd_TitleMap)
+{
+    if (!rOutHwnd_TitleMap)
+        return;
+
+    vector<HWND> handles;
+    int srcSz, dstSz;
+    wchar_t* wcharBuff = new wchar_t[WND_TXT_SZ];
+
+    dstSz = WND_TXT_SZ;
+    EnumWindows(EnumWindowsProc, LONG_PTR(&handles));
+    for(auto hdl : handles)  // auto it = Handles.cbegin(); it != Handles.cend(); it++)
+    {
+        if (IsWindowVisible(hdl) && (!GetWindow(hdl, GW_OWNER)))
+        {
+            srcSz = GetWindowTextLength(hdl);
+            if (srcSz >= dstSz)
+            {
+                wcharBuff = new wchar_t[++srcSz];
+                dstSz = srcSz;
+            }
+            if (0 < GetWindowTextW(hdl, wcharBuff, dstSz))
+            {
+                rOutHwnd_TitleMap->emplace(hdl, wstring(wcharBuff));
+            }
+        }
+    }
+    delete[] wcharBuff;
+}
+
+
+bool checkIsValidWindow(const void* hWnd)
+{
+    return hWnd ? IsWindow(HWND(hWnd)) : false;
+}
+
+
+void clickWindowHere(
+    const void* hWnd,
+    int xPos,
+    int yPos,
+    bool returnAfter,
+    unsigned long durationMs
+    )
+{
+    if (!hWnd || !checkIsValidWindow(hWnd))
+        return;
+    
+    RECT wndRect;
+    if (GetWindowRect(HWND(hWnd), &wndRect))  // returns virtual desktop coords
+    {
+        // TODO: limit wndRect
+        POINT msePos;
+        GetCursorPos(&msePos);
+        long x, y;
+        x = limToPos(wndRect.left + xPos);
+        y = limToPos(wndRect.top + yPos);
+        if ((x | y) > 0xFFFF)  // x, y < short_max
+            return;  //throw overflow_error("Mouse coordinates too big");
+        // can click on a desktop spread over max 34 FullHD monitors...
+        moveMouseAbsolute(
+            (unsigned short)x,
+            (unsigned short)y
+        );
+        mouseClick(durationMs ? durationMs : CLICK_TIME);
+        if (returnAfter)
+        {
+            x = limToPos(msePos.x);
+            y = limToPos(msePos.y);
+            if ((x | y) > 0xFFFF)  // x, y < short_max
+                return;  //throw overflow_error("Unsupported desktop resolution");;
+            moveMouseAbsolute((unsigned short)x, (unsigned short)y);
+        }
+    }
+}
+
+
+void moveMouseAbsolute(unsigned short xPxl, unsigned short yPxl)
+{
+    // Alternatives:
+    // GetDeviceCaps( hdcPrimaryMonitor, HORZRES)
+    // GetMonitorInfoA( MonitorFromWindow( hwnd, MONITOR_DEFAULTTONEAREST),&MONITORINFO() )
+    INPUT inpt = {
+        (DWORD)INPUT_MOUSE,  // type
+        MOUSEINPUT {         // DUMMYUNIONNAME.mi
+            // dx, dy, mouseData, dwFlags, time, dwExtraInfo
+            (long)((float)xPxl * (65535.f / (GetSystemMetrics(SM_CXVIRTUALSCREEN)-1))),  //SM_CXSCREEN
+            (long)((float)yPxl * (65535.f / (GetSystemMetrics(SM_CYVIRTUALSCREEN)-1))),  //SM_CYSCREEN
+            0,
+            MOUSEEVENTF_ABSOLUTE | MOUSEEVENTF_MOVE| MOUSEEVENTF_VIRTUALDESK,
+            0,
+            0
+        }
+    };
+    SendInput(1, &inpt, sizeof(inpt));
+}
+
+
+void mouseClick(unsigned long durationMs)
+{
+    INPUT inpt = {
+        (DWORD)INPUT_MOUSE,  // type
+        MOUSEINPUT {         // DUMMYUNIONNAME.mi
+            // dx, dy, mouseData, dwFlags, time, dwExtraInfo
+            0, 0, 0, MOUSEEVENTF_LEFTDOWN, 0, 0
+        }
+    };
+    SendInput(1, &inpt, sizeof(inpt));
+    Sleep(durationMs);
+    inpt.mi.dwFlags = MOUSEEVENTF_LEFTUP;
+    SendInput(1, &inpt, sizeof(inpt));
+}
+
+
+bool getWindowOrigin(const void* hWnd, int* pOutX, int* pOutY)
+{
+    RECT wndRect;
+    if (!hWnd || !pOutX || !pOutY || !checkIsValidWindow(hWnd) || !GetWindowRect(HWND(hWnd), &wndRect))
+        return false;
+    *pOutX = wndRect.left;
+    *pOutY = wndRect.top;
+    return true;
+}
+
+
+void getCursorPos(int* pOutX, int* pOutY)
+{
+    POINT msePos = { 0, 0 };
+    GetCursorPos(&msePos);
+    if (pOutX)
+        *pOutX = msePos.x;
+    if (pOutY)
+        *pOutY = msePos.y;
+}
+
+
+unsigned sendMouseInputs(const mouseInput_t* pInputs, unsigned count)
+{
+    if (!pInputs || !count)
+        return 0;
+
+    // Normalized absolute coordinates of the virtual desktop
+    const float xScale = 65535.f / (GetSystemMetrics(SM_CXVIRTUALSCREEN) - 1);
+    const float yScale = 65535.f / (GetSystemMetrics(SM_CYVIRTUALSCREEN) - 1);
+    vector<INPUT> inputs(count);
+    for (unsigned i = 0; i < count; i++)
+    {
+        INPUT& rInpt = inputs[i];
+        rInpt.type = INPUT_MOUSE;
+        rInpt.mi = MOUSEINPUT{ 0, 0, 0, 0, 0, 0 };
+        switch (pInputs[i].kind)
+        {
+        case mouseInput_t::MSE_MOVE:
+            rInpt.mi.dx = (long)((float)limToPos(pInputs[i].x) * xScale);
+            rInpt.mi.dy = (long)((float)limToPos(pInputs[i].y) * yScale);
+            rInpt.mi.dwFlags = MOUSEEVENTF_ABSOLUTE | MOUSEEVENTF_MOVE | MOUSEEVENTF_VIRTUALDESK;
+            break;
+        case mouseInput_t::MSE_LEFT_DOWN:
+            rInpt.mi.dwFlags = MOUSEEVENTF_LEFTDOWN;
+            break;
+        case mouseInput_t::MSE_LEFT_UP:
+            rInpt.mi.dwFlags = MOUSEEVENTF_LEFTUP;
+            break;
+        }
+    }
+    return SendInput(count, inputs.data(), sizeof(INPUT));
+}
+
+
+unsigned long getDoubleClickTime()
+{
+    return GetDoubleClickTime();
+}
+
+bool openSharedMemory(const char* pName, size_t bytes, bool create, sharedMemory_t* pOutMem)
+{
+    if (!pName || !pOutMem || (create && !bytes))
+        return false;
+    *pOutMem = sharedMemory_t{ nullptr, 0, nullptr };
+    const string name = string("Local\\") + pName;  // session namespace, no privilege needed
+    HANDLE hMap = create ?
+        CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+            static_cast<DWORD>(static_cast<unsigned long long>(bytes) >> 32), static_cast<DWORD>(bytes), name.c_str()) :
+        OpenFileMappingA(FILE_MAP_READ, FALSE, name.c_str());
+    if (!hMap)
+        return false;
+    void* pView = MapViewOfFile(hMap, create ? FILE_MAP_ALL_ACCESS : FILE_MAP_READ, 0, 0, bytes);
+    if (!pView)
+    {
+        CloseHandle(hMap);
+        return false;
+    }
+    if (!bytes)
+    {// Size of the existing mapping, rounded to pages
+        MEMORY_BASIC_INFORMATION info;
+        bytes = VirtualQuery(pView, &info, sizeof(info)) ? info.RegionSize : 0;
+    }
+    *pOutMem = sharedMemory_t{ pView, bytes, hMap };
+    return true;
+}
+
+void closeSharedMemory(sharedMemory_t* pInOutMem, const char* pUnlinkName)
+{
+    (void)pUnlinkName;  // the mapping is gone with its last handle
+    if (!pInOutMem)
+        return;
+    if (pInOutMem->pView)
+        UnmapViewOfFile(pInOutMem->pView);
+    if (pInOutMem->handle)
+        CloseHandle(pInOutMem->handle);
+    *pInOutMem = sharedMemory_t{ nullptr, 0, nullptr };
+}
+
+}// Namespace WinOS
+
+#else  // Not Windows: no window system access, keeps the detection path usable by the tools
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "winapi.h"
+
+namespace WinOS {
+
+void listDsktParentWindows(std::map<const void*, std::wstring>* rOutHwnd_TitleMap)
+{
+    (void)rOutHwnd_TitleMap;
+}
+
+bool checkIsValidWindow(const void* hWnd)
+{
+    (void)hWnd;
+    return false;
+}
+
+void clickWindowHere(const void*, int, int, bool, unsigned long) {}
+
+void moveMouseAbsolute(unsigned short, unsigned short) {}
+
+void mouseClick(unsigned long) {}
+
+bool getWindowOrigin(const void*, int*, int*)
+{
+    return false;
+}
+
+void getCursorPos(int* pOutX, int* pOutY)
+{
+    if (pOutX)
+        *pOutX = 0;
+    if (pOutY)
+        *pOutY = 0;
+}
+
+unsigned sendMouseInputs(const mouseInput_t*, unsigned)
+{
+    return 0;
+}
+
+unsigned long getDoubleClickTime()
+{
+    return 500;  // Windows default
+}
+
+bool openSharedMemory(const char* pName, size_t bytes, bool create, sharedMemory_t* pOutMem)
+{
+    if (!pName || !pOutMem || (create && !bytes))
+        return false;
+    *pOutMem = sharedMemory_t{ nullptr, 0, nullptr };
+    const std::string name = std::string("/") + pName;
+    if (create)
+        shm_unlink(name.c_str());  // of a crashed writer, its readers keep their pages
+    const int fd = shm_open(name.c_str(), create ? (O_CREAT | O_EXCL | O_RDWR) : O_RDONLY, 0600);
+    if (fd < 0)
+        return false;
+    struct stat info;
+    bool ok = create ?
+        (ftruncate(fd, static_cast<off_t>(bytes)) == 0) :
+        ((fstat(fd, &info) == 0) && (info.st_size > 0));
+    if (ok && !bytes)
+        bytes = static_cast<size_t>(info.st_size);
+    void* pView = ok ? mmap(nullptr, bytes, create ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);  // the mapping keeps the object
+    if (pView == MAP_FAILED)
+    {
+        if (create)
+            shm_unlink(name.c_str());
+        return false;
+    }
+    *pOutMem = sharedMemory_t{ pView, bytes, nullptr };
+    return true;
+}
+
+void closeSharedMemory(sharedMemory_t* pInOutMem, const char* pUnlinkName)
+{
+    if (!pInOutMem)
+        return;
+    if (pInOutMem->pView)
+        munmap(pInOutMem->pView, pInOutMem->bytes);
+    if (pUnlinkName)
+        shm_unlink((std::string("/") + pUnlinkName).c_str());
+    *pInOutMem = sharedMemory_t{ nullptr, 0, nullptr };
+}
+
+}// Namespace WinOS
+#endif
\ No newline at end of file
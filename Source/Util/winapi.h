@@ -1,19 +1,53 @@
-#pragma once
-
-#include <map>
-#include <string>
-
-
-namespace WinOS {
-
-void listDsktParentWindows(std::map<const void*, std::wstring>* rOutHwnd_TitleMap);
-
-bool checkIsValidWindow(const void* hWnd);
-
-void clickWindowHere(const void* hWnd, int xPos, int yPos, bool returnAfter=false, unsigned long durationMs=0);
-
-void moveMouseAbsolute(unsigned short xPxl, unsigned short yPxl);
-
-void mouseClick(unsigned long durationMs);
-
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <string>
+
+
+namespace WinOS {
+
+struct mouseInput_t {
+    enum kind_t { MSE_MOVE, MSE_LEFT_DOWN, MSE_LEFT_UP } kind;
+    int x;  // virtual desktop pixel, MSE_MOVE only
+    int y;
+};
+
+void listDsktParentWindows(std::map<const void*, std::wstring>* rOutHwnd_TitleMap);
+
+bool checkIsValidWindow(const void* hWnd);
+
+void clickWindowHere(const void* hWnd, int xPos, int yPos, bool returnAfter=false, unsigned long durationMs=0);
+
+void moveMouseAbsolute(unsigned short xPxl, unsigned short yPxl);
+
+void mouseClick(unsigned long durationMs);
+
+// Top left corner of the window in virtual desktop coordinates
+bool getWindowOrigin(const void* hWnd, int* pOutX, int* pOutY);
+
+void getCursorPos(int* pOutX, int* pOutY);
+
+// All inputs in one SendInput call, returns the number injected
+unsigned sendMouseInputs(const mouseInput_t* pInputs, unsigned count);
+
+unsigned long getDoubleClickTime();
+
+struct sharedMemory_t {
+    void* pView;    // null if not mapped
+    size_t bytes;
+    void* handle;   // of the mapping on Windows, unused elsewhere
+};
+
+/**
+ Named memory other processes map by the same name, POSIX shm outside Windows.
+ @param pName   without path or prefix, e.g. "screenmacro-frames".
+ @param bytes   size to create, 0 opens an existing one at its size.
+ @param create  read-write, replaces a stale one of that name. Otherwise read-only.
+ */
+bool openSharedMemory(const char* pName, size_t bytes, bool create, sharedMemory_t* pOutMem);
+
+// Unmaps the view, with pUnlinkName the name is removed too (POSIX, Windows drops it with the last handle)
+void closeSharedMemory(sharedMemory_t* pInOutMem, const char* pUnlinkName=nullptr);
+
 }// Namespace WinOS
\ No newline at end of file